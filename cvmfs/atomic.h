@@ -100,6 +100,25 @@ static int32_t inline __attribute__((used)) atomic_cas32(
   return __sync_bool_compare_and_swap(a, cmp, newval);
 }
 
+
+static int32_t inline __attribute__((used)) atomic_cas64(
+  atomic_int64 *a,
+  int64_t cmp,
+  int64_t newval)
+{
+  return __sync_bool_compare_and_swap(a, cmp, newval);
+}
+
+
+template <typename T>
+static bool inline __attribute__((used)) atomic_casptr(
+  T **a,
+  T *cmp,
+  T *newval)
+{
+  return __sync_bool_compare_and_swap(a, cmp, newval);
+}
+
 #ifdef CVMFS_NAMESPACE_GUARD
 }  // namespace CVMFS_NAMESPACE_GUARD
 #endif
@@ -124,6 +124,16 @@ CacheManager::~CacheManager() {
 }
 
 
+int CacheManager::GetRawFd(int fd) {
+  return -ENOTSUP;
+}
+
+
+void CacheManager::Touch(const shash::Any &id) {
+  quota_mgr_->Touch(id);
+}
+
+
 /**
  * Compresses and checksums the file pointed to by fd.  The hash algorithm needs
  * to be set in id.
@@ -353,6 +363,17 @@ int PosixCacheManager::CommitTxn(void *txn) {
     }
   }
 
+  // Regular and volatile objects can be moved and reported to the quota manager
+  // later by the commit thread
+  if (commit_spawned_ &&
+      ((transaction->type == kTypeRegular) ||
+       (transaction->type == kTypeVolatile)))
+  {
+    QueueCommit(*transaction);
+    transaction->~Transaction();
+    return 0;
+  }
+
   // Move the temporary file into its final location
   if (alien_cache_) {
     int retval = chmod(transaction->tmp_path.c_str(), 0660);
@@ -384,6 +405,46 @@ int PosixCacheManager::CommitTxn(void *txn) {
 }
 
 
+PosixCacheManager::PosixCacheManager(
+  const string &cache_path,
+  const bool alien_cache)
+  : cache_path_(cache_path)
+  , txn_template_path_(cache_path_ + "/txn/fetchXXXXXX")
+  , alien_cache_(alien_cache)
+  , workaround_rename_(false)
+  , cache_mode_(kCacheReadWrite)
+  , reports_correct_filesize_(true)
+  , max_pending_commits_(0)
+  , commit_spawned_(false)
+  , commit_terminate_(false)
+{
+  atomic_init32(&no_inflight_txns_);
+  int retval = pthread_mutex_init(&lock_commit_, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&cond_commit_queued_, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&cond_commit_space_, NULL);
+  assert(retval == 0);
+}
+
+
+/**
+ * Pending commits are processed before the commit thread stops.
+ */
+PosixCacheManager::~PosixCacheManager() {
+  if (commit_spawned_) {
+    pthread_mutex_lock(&lock_commit_);
+    commit_terminate_ = true;
+    pthread_cond_signal(&cond_commit_queued_);
+    pthread_mutex_unlock(&lock_commit_);
+    pthread_join(thread_commit_, NULL);
+  }
+  pthread_cond_destroy(&cond_commit_space_);
+  pthread_cond_destroy(&cond_commit_queued_);
+  pthread_mutex_destroy(&lock_commit_);
+}
+
+
 PosixCacheManager *PosixCacheManager::Create(
   const string &cache_path,
   const bool alien_cache,
@@ -447,7 +508,7 @@ int PosixCacheManager::Flush(Transaction *transaction) {
   if (transaction->buf_pos == 0)
     return 0;
   int written =
-    write(transaction->fd, transaction->buffer, transaction->buf_pos);
+    write(transaction->fd, transaction->buf, transaction->buf_pos);
   if (written < 0)
     return -errno;
   if (static_cast<unsigned>(written) != transaction->buf_pos) {
@@ -459,6 +520,26 @@ int PosixCacheManager::Flush(Transaction *transaction) {
 }
 
 
+/**
+ * Replaces the transaction's buffer by a larger one on the heap.  The buffered
+ * data are preserved.
+ */
+void PosixCacheManager::GrowBuffer(
+  Transaction *transaction,
+  const unsigned new_size)
+{
+  assert(new_size > transaction->buf_size);
+  if (transaction->buf == transaction->buffer) {
+    transaction->buf = static_cast<unsigned char *>(smalloc(new_size));
+    memcpy(transaction->buf, transaction->buffer, transaction->buf_pos);
+  } else {
+    transaction->buf =
+      static_cast<unsigned char *>(srealloc(transaction->buf, new_size));
+  }
+  transaction->buf_size = new_size;
+}
+
+
 inline string PosixCacheManager::GetPathInCache(const shash::Any &id) {
   return cache_path_ + "/" + id.MakePathWithoutSuffix();
 }
@@ -473,9 +554,43 @@ int64_t PosixCacheManager::GetSize(int fd) {
 }
 
 
+/**
+ * Takes the commits queued so far and processes them as one batch.  While the
+ * batch is processed, new commits accumulate for the next round.
+ */
+void *PosixCacheManager::MainCommit(void *data) {
+  PosixCacheManager *cache_mgr = reinterpret_cast<PosixCacheManager *>(data);
+  LogCvmfs(kLogCache, kLogDebug, "starting commit thread");
+
+  vector<PendingCommit> batch;
+  while (true) {
+    pthread_mutex_lock(&cache_mgr->lock_commit_);
+    while (cache_mgr->commit_queue_.empty() && !cache_mgr->commit_terminate_) {
+      pthread_cond_wait(&cache_mgr->cond_commit_queued_,
+                        &cache_mgr->lock_commit_);
+    }
+    if (cache_mgr->commit_queue_.empty()) {
+      pthread_mutex_unlock(&cache_mgr->lock_commit_);
+      break;
+    }
+    batch.swap(cache_mgr->commit_queue_);
+    pthread_cond_broadcast(&cache_mgr->cond_commit_space_);
+    pthread_mutex_unlock(&cache_mgr->lock_commit_);
+
+    cache_mgr->ProcessCommits(batch);
+    batch.clear();
+  }
+
+  LogCvmfs(kLogCache, kLogDebug, "stopping commit thread");
+  return NULL;
+}
+
+
 int PosixCacheManager::Open(const shash::Any &id) {
   const string path = GetPathInCache(id);
   int result = open(path.c_str(), O_RDONLY);
+  if ((result < 0) && (errno == ENOENT) && commit_spawned_)
+    result = OpenPending(id);
 
   if (result >= 0) {
     LogCvmfs(kLogCache, kLogDebug, "hit %s", path.c_str());
@@ -501,6 +616,30 @@ int PosixCacheManager::OpenFromTxn(void *txn) {
 }
 
 
+/**
+ * Objects in the commit queue are still in the txn directory.  If the commit
+ * thread moved the object in the meantime, it is found in its final location.
+ * The commit thread renames the object before it removes it from the pending
+ * paths, so an object that is not pending anymore is already in its final
+ * location.  Returns -1 and sets errno on failure, like open().
+ */
+int PosixCacheManager::OpenPending(const shash::Any &id) {
+  string tmp_path;
+  pthread_mutex_lock(&lock_commit_);
+  map<shash::Any, string>::const_iterator i = pending_paths_.find(id);
+  if (i != pending_paths_.end())
+    tmp_path = i->second;
+  pthread_mutex_unlock(&lock_commit_);
+
+  if (!tmp_path.empty()) {
+    int fd = open(tmp_path.c_str(), O_RDONLY);
+    if ((fd >= 0) || (errno != ENOENT))
+      return fd;
+  }
+  return open(GetPathInCache(id).c_str(), O_RDONLY);
+}
+
+
 int64_t PosixCacheManager::Pread(
   int fd,
   void *buf,
@@ -518,6 +657,75 @@ int64_t PosixCacheManager::Pread(
 }
 
 
+/**
+ * Moves a batch of objects into the cache and only then informs the quota
+ * manager about the new objects.
+ */
+void PosixCacheManager::ProcessCommits(const vector<PendingCommit> &batch) {
+  const unsigned size = batch.size();
+  vector<bool> committed(size, false);
+  for (unsigned i = 0; i < size; ++i) {
+    if (alien_cache_) {
+      int retval = chmod(batch[i].tmp_path.c_str(), 0660);
+      assert(retval == 0);
+    }
+    int retval =
+      Rename(batch[i].tmp_path.c_str(), batch[i].final_path.c_str());
+    if (retval < 0) {
+      LogCvmfs(kLogCache, kLogDebug, "commit of %s failed: %s",
+               batch[i].id.ToString().c_str(), strerror(-retval));
+      unlink(batch[i].tmp_path.c_str());
+    } else {
+      committed[i] = true;
+    }
+  }
+
+  pthread_mutex_lock(&lock_commit_);
+  for (unsigned i = 0; i < size; ++i) {
+    map<shash::Any, string>::iterator iter = pending_paths_.find(batch[i].id);
+    if ((iter != pending_paths_.end()) && (iter->second == batch[i].tmp_path))
+      pending_paths_.erase(iter);
+  }
+  pthread_mutex_unlock(&lock_commit_);
+
+  for (unsigned i = 0; i < size; ++i) {
+    if (!committed[i])
+      continue;
+    if (batch[i].type == kTypeVolatile) {
+      quota_mgr_->InsertVolatile(batch[i].id, batch[i].size,
+                                 batch[i].description);
+    } else {
+      quota_mgr_->Insert(batch[i].id, batch[i].size, batch[i].description);
+    }
+  }
+  LogCvmfs(kLogCache, kLogDebug, "committed batch of %u objects", size);
+  atomic_xadd32(&no_inflight_txns_, -static_cast<int32_t>(size));
+}
+
+
+/**
+ * Hands a flushed and closed transaction over to the commit thread.  The
+ * transaction still counts as inflight until the commit thread processed it.
+ */
+void PosixCacheManager::QueueCommit(const Transaction &transaction) {
+  PendingCommit commit;
+  commit.id = transaction.id;
+  commit.tmp_path = transaction.tmp_path;
+  commit.final_path = transaction.final_path;
+  commit.description = transaction.description;
+  commit.size = transaction.size;
+  commit.type = transaction.type;
+
+  pthread_mutex_lock(&lock_commit_);
+  while (commit_queue_.size() >= max_pending_commits_)
+    pthread_cond_wait(&cond_commit_space_, &lock_commit_);
+  commit_queue_.push_back(commit);
+  pending_paths_[commit.id] = commit.tmp_path;
+  pthread_cond_signal(&cond_commit_queued_);
+  pthread_mutex_unlock(&lock_commit_);
+}
+
+
 int PosixCacheManager::Rename(const char *oldpath, const char *newpath) {
   int result;
   if (workaround_rename_ == false) {
@@ -574,6 +782,25 @@ int PosixCacheManager::Reset(void *txn) {
 }
 
 
+/**
+ * Enables group commit with up to max_pending queued commits.  Takes effect
+ * with Spawn().
+ */
+void PosixCacheManager::SetGroupCommit(const unsigned max_pending) {
+  assert(!commit_spawned_);
+  max_pending_commits_ = max_pending;
+}
+
+
+void PosixCacheManager::Spawn() {
+  if ((max_pending_commits_ == 0) || commit_spawned_)
+    return;
+  int retval = pthread_create(&thread_commit_, NULL, MainCommit, this);
+  assert(retval == 0);
+  commit_spawned_ = true;
+}
+
+
 int PosixCacheManager::StartTxn(
   const shash::Any &id,
   uint64_t size,
@@ -618,11 +845,15 @@ int PosixCacheManager::StartTxn(
            template_path, transaction->fd);
   transaction->tmp_path = template_path;
   transaction->expected_size = size;
+  if ((size != kSizeUnknown) && (size > kTxnBufferSize)) {
+    GrowBuffer(transaction,
+               std::min(static_cast<uint64_t>(kMaxTxnBufferSize), size));
+  }
   return transaction->fd;
 }
 
 
-void PosixCacheManager::TearDown2ReadOnly() {
+bool PosixCacheManager::TearDown2ReadOnly() {
   cache_mode_ = kCacheReadOnly;
   while (atomic_read32(&no_inflight_txns_) != 0)
     SafeSleepMs(50);
@@ -635,6 +866,7 @@ void PosixCacheManager::TearDown2ReadOnly() {
   unlink(("running." + *cvmfs::repository_name_).c_str());
   LogCvmfs(kLogCache, kLogSyslog, "switch to read-only cache mode");
   SetLogMicroSyslog("");
+  return true;
 }
 
 
@@ -653,7 +885,14 @@ int64_t PosixCacheManager::Write(const void *buf, uint64_t size, void *txn) {
   uint64_t written = 0;
   const unsigned char *read_pos = reinterpret_cast<const unsigned char *>(buf);
   while (written < size) {
-    if (transaction->buf_pos == sizeof(transaction->buffer)) {
+    if (transaction->buf_pos == transaction->buf_size) {
+      // Objects of unknown size: the buffer grows with the object
+      if ((transaction->expected_size == kSizeUnknown) &&
+          (transaction->buf_size < kMaxTxnBufferSize))
+      {
+        GrowBuffer(transaction, 2 * transaction->buf_size);
+        continue;
+      }
       int retval = Flush(transaction);
       if (retval != 0) {
         transaction->size += written;
@@ -661,10 +900,9 @@ int64_t PosixCacheManager::Write(const void *buf, uint64_t size, void *txn) {
       }
     }
     uint64_t remaining = size - written;
-    uint64_t space_in_buffer =
-      sizeof(transaction->buffer) - transaction->buf_pos;
+    uint64_t space_in_buffer = transaction->buf_size - transaction->buf_pos;
     uint64_t batch_size = std::min(remaining, space_in_buffer);
-    memcpy(transaction->buffer + transaction->buf_pos, read_pos, batch_size);
+    memcpy(transaction->buf + transaction->buf_pos, read_pos, batch_size);
     transaction->buf_pos += batch_size;
     written += batch_size;
     read_pos += batch_size;
@@ -5,9 +5,11 @@
 #ifndef CVMFS_CACHE_H_
 #define CVMFS_CACHE_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <cstdlib>
 #include <map>
 #include <string>
 #include <vector>
@@ -43,6 +45,8 @@ namespace cache {
 enum CacheManagerIds {
   kUnknownCacheManager = 0,
   kPosixCacheManager,
+  kRamCacheManager,
+  kTieredCacheManager,
 };
 
 enum CacheModes {
@@ -51,6 +55,55 @@ enum CacheModes {
 };
 
 
+/**
+ * The file descriptor table of a cache manager that hands out its own file
+ * descriptors, saved across a reload of the Fuse module.  The open files of
+ * the Fuse module refer to these file descriptors.  File descriptors of the
+ * PosixCacheManager are plain file descriptors that survive the reload.
+ */
+struct SavedFdTable : SingleCopy {
+  /**
+   * For the RamCacheManager, target is the index of the object or -1 for a
+   * file descriptor of the backing cache manager.  For the TieredCacheManager,
+   * target is the index of the tier.  Unused entries have target and fd -1.
+   */
+  struct Entry {
+    Entry() : target(-1), fd(-1) { }
+    Entry(const int target, const int fd) : target(target), fd(fd) { }
+    bool IsUsed() const { return (target >= 0) || (fd >= 0); }
+    int target;
+    int fd;
+  };
+
+  /**
+   * Copy of an object that is open in memory, data is malloc'd
+   */
+  struct Object {
+    Object() : data(NULL), size(0) { }
+    shash::Any id;
+    unsigned char *data;
+    uint64_t size;
+  };
+
+  explicit SavedFdTable(const CacheManagerIds id) : id(id) { }
+  ~SavedFdTable() {
+    for (unsigned i = 0; i < objects.size(); ++i)
+      free(objects[i].data);
+    for (unsigned i = 0; i < backing.size(); ++i)
+      delete backing[i];
+  }
+
+  CacheManagerIds id;
+  std::vector<Entry> fds;
+  std::vector<Object> objects;
+  /**
+   * Saved tables of the cache managers underneath, NULL for cache managers
+   * without a table of their own
+   */
+  std::vector<SavedFdTable *> backing;
+};
+
+
 /**
  * The Cache Manager provides (virtual) file descriptors to content-addressable
  * objects in the cache.  The implementation can use a POSIX file system or
@@ -122,9 +175,48 @@ class CacheManager : SingleCopy {
   virtual int OpenFromTxn(void *txn) = 0;
   virtual int CommitTxn(void *txn) = 0;
 
-  int OpenPinned(const shash::Any &id,
-                 const std::string &description,
-                 bool is_catalog);
+  /**
+   * Cache managers that store objects as plain files can expose the file
+   * descriptor of the underlying file system.  That allows the Fuse module to
+   * splice the data directly from the page cache.  Returns -ENOTSUP if the
+   * cache manager descriptor is not backed by a file.
+   */
+  virtual int GetRawFd(int fd);
+
+  /**
+   * Starts background threads of the cache manager, if any.  Called once the
+   * client has forked into the background.
+   */
+  virtual void Spawn() { }
+
+  /**
+   * Moves the object to the end of the LRU order of the quota manager that
+   * accounts for it, as Open() does.  For cache managers that serve objects
+   * without opening them in the cache manager they are stacked on.
+   */
+  virtual void Touch(const shash::Any &id);
+
+  /**
+   * Stops writing to the cache and detaches from the quota manager.  Quota
+   * listeners need to be unregistered before.  Returns false if the cache
+   * manager has no read-only mode.
+   */
+  virtual bool TearDown2ReadOnly() { return false; }
+  virtual CacheModes GetCacheMode() { return kCacheReadWrite; }
+
+  /**
+   * Called before and after a reload of the Fuse module, while no file system
+   * calls are served.  Cache managers without a file descriptor table of their
+   * own return NULL.  Restoring takes ownership of the object data in the
+   * table; it fails if the table was saved by a different kind of cache
+   * manager, e.g. because the cache configuration changed.
+   */
+  virtual SavedFdTable *SaveFdTable() { return NULL; }
+  virtual bool RestoreFdTable(SavedFdTable *saved) { return saved == NULL; }
+
+  virtual int OpenPinned(const shash::Any &id,
+                         const std::string &description,
+                         bool is_catalog);
   int ChecksumFd(int fd, shash::Any *id);
   bool Open2Mem(const shash::Any &id, unsigned char **buffer, uint64_t *size);
   bool CommitFromMem(const shash::Any &id,
@@ -151,8 +243,11 @@ class CacheManager : SingleCopy {
 class PosixCacheManager : public CacheManager {
   FRIEND_TEST(T_CacheManager, CommitTxnQuotaNotifications);
   FRIEND_TEST(T_CacheManager, CommitTxnRenameFail);
+  FRIEND_TEST(T_CacheManager, GroupCommit);
+  FRIEND_TEST(T_CacheManager, GroupCommitThroughput);
   FRIEND_TEST(T_CacheManager, Open);
   FRIEND_TEST(T_CacheManager, OpenFromTxn);
+  FRIEND_TEST(T_CacheManager, OpenPending);
   FRIEND_TEST(T_CacheManager, OpenPinned);
   FRIEND_TEST(T_CacheManager, Rename);
   FRIEND_TEST(T_CacheManager, StartTxn);
@@ -176,7 +271,7 @@ class PosixCacheManager : public CacheManager {
   static PosixCacheManager *Create(const std::string &cache_path,
                                    const bool alien_cache,
                                    const bool workaround_rename_ = false);
-  virtual ~PosixCacheManager() { }
+  virtual ~PosixCacheManager();
   virtual bool AcquireQuotaManager(QuotaManager *quota_mgr);
 
   virtual int Open(const shash::Any &id);
@@ -198,15 +293,35 @@ class PosixCacheManager : public CacheManager {
   virtual int AbortTxn(void *txn);
   virtual int CommitTxn(void *txn);
 
-  void TearDown2ReadOnly();
+  virtual int GetRawFd(int fd) { return fd; }
+
+  virtual void Spawn();
+  void SetGroupCommit(const unsigned max_pending);
+
+  virtual bool TearDown2ReadOnly();
+  virtual cache::CacheModes GetCacheMode() {
+    return (cache_mode_ == kCacheReadOnly) ? cache::kCacheReadOnly :
+                                             cache::kCacheReadWrite;
+  }
   CacheModes cache_mode() { return cache_mode_; }
   bool alien_cache() { return alien_cache_; }
   std::string cache_path() { return cache_path_; }
 
  private:
+  /**
+   * Tiny objects are written through the buffer that is embedded in the
+   * transaction.  Larger objects get a buffer on the heap of up to
+   * kMaxTxnBufferSize bytes, which is sized according to the expected object
+   * size or, for objects of unknown size, doubled as the object grows.
+   */
+  static const unsigned kTxnBufferSize = 4096;
+  static const unsigned kMaxTxnBufferSize = 256 * 1024;
+
   struct Transaction {
     Transaction(const shash::Any &id, const std::string &final_path)
-      : buf_pos(0)
+      : buf(buffer)
+      , buf_size(sizeof(buffer))
+      , buf_pos(0)
       , size(0)
       , expected_size(kSizeUnknown)
       , fd(-1)
@@ -215,8 +330,17 @@ class PosixCacheManager : public CacheManager {
       , final_path(final_path)
       , id(id)
     { }
-
-    unsigned char buffer[4096];
+    ~Transaction() {
+      if (buf != buffer)
+        free(buf);
+    }
+
+    unsigned char buffer[kTxnBufferSize];
+    /**
+     * Points to either the embedded buffer or to a heap allocated one.
+     */
+    unsigned char *buf;
+    unsigned buf_size;
     unsigned buf_pos;
     uint64_t size;
     uint64_t expected_size;
@@ -228,20 +352,29 @@ class PosixCacheManager : public CacheManager {
     shash::Any id;
   };
 
-  PosixCacheManager(const std::string &cache_path, const bool alien_cache)
-    : cache_path_(cache_path)
-    , txn_template_path_(cache_path_ + "/txn/fetchXXXXXX")
-    , alien_cache_(alien_cache)
-    , workaround_rename_(false)
-    , cache_mode_(kCacheReadWrite)
-    , reports_correct_filesize_(true)
-  {
-    atomic_init32(&no_inflight_txns_);
-  }
+  /**
+   * A committed regular or volatile object whose rename into the cache and
+   * whose quota notification is left to the commit thread.
+   */
+  struct PendingCommit {
+    shash::Any id;
+    std::string tmp_path;
+    std::string final_path;
+    std::string description;
+    uint64_t size;
+    ObjectType type;
+  };
+
+  PosixCacheManager(const std::string &cache_path, const bool alien_cache);
 
+  static void *MainCommit(void *data);
   std::string GetPathInCache(const shash::Any &id);
   int Rename(const char *oldpath, const char *newpath);
   int Flush(Transaction *transaction);
+  void GrowBuffer(Transaction *transaction, const unsigned new_size);
+  void QueueCommit(const Transaction &transaction);
+  void ProcessCommits(const std::vector<PendingCommit> &batch);
+  int OpenPending(const shash::Any &id);
 
   std::string cache_path_;
   std::string txn_template_path_;
@@ -260,6 +393,26 @@ class PosixCacheManager : public CacheManager {
    * Hack for HDFS which writes file sizes asynchronously.
    */
   bool reports_correct_filesize_;
+
+  /**
+   * Group commit: if set, regular and volatile objects are moved into the
+   * cache and reported to the quota manager in batches by a separate thread.
+   * CommitTxn() blocks if max_pending_commits_ commits are queued.  Zero
+   * means synchronous commits.
+   */
+  unsigned max_pending_commits_;
+  bool commit_spawned_;
+  bool commit_terminate_;
+  pthread_t thread_commit_;
+  pthread_mutex_t lock_commit_;
+  pthread_cond_t cond_commit_queued_;
+  pthread_cond_t cond_commit_space_;
+  std::vector<PendingCommit> commit_queue_;
+  /**
+   * Maps the pending objects to their location in the txn directory, so that
+   * they can be opened before the commit thread renamed them.
+   */
+  std::map<shash::Any, std::string> pending_paths_;
 };  // class PosixCacheManager
 
 }  // namespace cache
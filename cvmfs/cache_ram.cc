@@ -0,0 +1,607 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "cache_ram.h"
+
+#include <errno.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+#include "logging.h"
+#include "murmur.h"
+#include "quota.h"
+#include "smalloc.h"
+#include "util.h"
+#include "util_concurrency.h"
+
+using namespace std;  // NOLINT
+
+namespace cache {
+
+static inline uint32_t hasher_any(const shash::Any &key) {
+  return MurmurHash2(key.digest, shash::kDigestSizes[key.algorithm],
+                     0x07387a4f);
+}
+
+
+/**
+ * Takes ownership of the backing cache manager.  The quota manager is the one
+ * of the backing cache manager.
+ */
+RamCacheManager *RamCacheManager::Create(
+  CacheManager *backing,
+  const uint64_t max_size,
+  const uint64_t max_object_size,
+  perf::Statistics *statistics)
+{
+  assert(backing != NULL);
+  assert(max_object_size <= max_size);
+  return new RamCacheManager(backing, max_size, max_object_size, statistics);
+}
+
+
+RamCacheManager::RamCacheManager(
+  CacheManager *backing,
+  const uint64_t max_size,
+  const uint64_t max_object_size,
+  perf::Statistics *statistics)
+  : backing_(backing)
+  , max_size_(max_size)
+  , max_object_size_(max_object_size)
+  , lru_head_(NULL)
+  , lru_tail_(NULL)
+  , size_(0)
+{
+  delete quota_mgr_;
+  quota_mgr_ = backing_->quota_mgr();
+  int retval = pthread_mutex_init(&lock_, NULL);
+  assert(retval == 0);
+  // The empty key has the algorithm kAny, which never appears in the cache
+  index_.Init(1024, shash::Any(), hasher_any);
+
+  n_hit_ram_ = statistics->Register("ram_cache.n_hit_ram",
+    "Number of objects opened from memory");
+  n_hit_backing_ = statistics->Register("ram_cache.n_hit_backing",
+    "Number of objects opened from the backing cache");
+  n_miss_ = statistics->Register("ram_cache.n_miss",
+    "Number of objects neither in memory nor in the backing cache");
+  n_insert_ = statistics->Register("ram_cache.n_insert",
+    "Number of objects copied into memory");
+  n_evict_ = statistics->Register("ram_cache.n_evict",
+    "Number of objects evicted from memory");
+  sz_used_ = statistics->Register("ram_cache.sz_used",
+    "Number of bytes of objects in memory");
+}
+
+
+RamCacheManager::~RamCacheManager() {
+  // Evicted objects that are still open.  A reload of the Fuse module deletes
+  // the cache manager with open files, see SaveFdTable().
+  for (unsigned i = 0; i < fds_.size(); ++i) {
+    Object *object = fds_[i].object;
+    if ((object == NULL) || object->in_index)
+      continue;
+    for (unsigned j = i; j < fds_.size(); ++j) {
+      if (fds_[j].object == object)
+        fds_[j].object = NULL;
+    }
+    free(object->data);
+    delete object;
+  }
+  Object *object = lru_head_;
+  while (object != NULL) {
+    Object *next = object->next;
+    free(object->data);
+    delete object;
+    object = next;
+  }
+  pthread_mutex_destroy(&lock_);
+  // Owned and deleted by the backing cache manager
+  quota_mgr_ = NULL;
+  delete backing_;
+}
+
+
+int RamCacheManager::AbortTxn(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  free(transaction->buffer);
+  transaction->~Transaction();
+  return backing_->AbortTxn(GetBackingTxn(txn));
+}
+
+
+bool RamCacheManager::AcquireQuotaManager(QuotaManager *quota_mgr) {
+  if (!backing_->AcquireQuotaManager(quota_mgr))
+    return false;
+  quota_mgr_ = backing_->quota_mgr();
+  return true;
+}
+
+
+int RamCacheManager::AddFdUnlocked(const FdEntry &entry) {
+  if (free_fds_.empty()) {
+    fds_.push_back(entry);
+    return fds_.size() - 1;
+  }
+  const int fd = free_fds_.back();
+  free_fds_.pop_back();
+  fds_[fd] = entry;
+  return fd;
+}
+
+
+int RamCacheManager::Close(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_);
+    if ((fd < 0) || (static_cast<unsigned>(fd) >= fds_.size()) ||
+        !fds_[fd].IsUsed())
+    {
+      return -EBADF;
+    }
+    entry = fds_[fd];
+    fds_[fd] = FdEntry();
+    free_fds_.push_back(fd);
+    if (entry.object != NULL) {
+      ReleaseUnlocked(entry.object);
+      return 0;
+    }
+  }
+  return backing_->Close(entry.backing_fd);
+}
+
+
+/**
+ * The object stays in memory only if the transaction is small enough.
+ */
+int RamCacheManager::CommitTxn(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  const int result = backing_->CommitTxn(GetBackingTxn(txn));
+  if ((result == 0) && transaction->cached) {
+    MutexLockGuard guard(&lock_);
+    if (InsertUnlocked(transaction->id, transaction->buffer,
+                       transaction->size) != NULL)
+    {
+      transaction->buffer = NULL;
+    }
+  }
+  free(transaction->buffer);
+  transaction->~Transaction();
+  return result;
+}
+
+
+void RamCacheManager::CtrlTxn(
+  const std::string &description,
+  const ObjectType type,
+  const int flags,
+  void *txn)
+{
+  backing_->CtrlTxn(description, type, flags, GetBackingTxn(txn));
+}
+
+
+int RamCacheManager::Dup(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+    if (entry.object != NULL) {
+      entry.object->refcnt++;
+      return AddFdUnlocked(entry);
+    }
+  }
+  const int backing_fd = backing_->Dup(entry.backing_fd);
+  if (backing_fd < 0)
+    return backing_fd;
+  MutexLockGuard guard(&lock_);
+  return AddFdUnlocked(FdEntry(NULL, backing_fd));
+}
+
+
+/**
+ * Removes the object from the index.  Its memory is freed once it is closed.
+ */
+void RamCacheManager::EvictUnlocked(Object *object) {
+  UnlinkUnlocked(object);
+  index_.Erase(object->id);
+  object->in_index = false;
+  size_ -= object->size;
+  perf::Inc(n_evict_);
+  perf::Xadd(sz_used_, -static_cast<int64_t>(object->size));
+  if (object->refcnt == 0) {
+    free(object->data);
+    delete object;
+  }
+}
+
+
+int RamCacheManager::GetRawFd(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  if (entry.object != NULL)
+    return -ENOTSUP;
+  return backing_->GetRawFd(entry.backing_fd);
+}
+
+
+/**
+ * Needs to be called with the lock held.
+ */
+bool RamCacheManager::GetFd(const int fd, FdEntry *entry) {
+  if ((fd < 0) || (static_cast<unsigned>(fd) >= fds_.size()) ||
+      !fds_[fd].IsUsed())
+  {
+    return false;
+  }
+  *entry = fds_[fd];
+  return true;
+}
+
+
+int64_t RamCacheManager::GetSize(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  if (entry.object != NULL)
+    return entry.object->size;
+  return backing_->GetSize(entry.backing_fd);
+}
+
+
+/**
+ * Takes ownership of data.  Returns NULL if the object does not fit.  If the
+ * object is already in memory, data is freed and the existing object is
+ * returned.  The returned object is the most recently used one.
+ */
+RamCacheManager::Object *RamCacheManager::InsertUnlocked(
+  const shash::Any &id,
+  unsigned char *data,
+  const uint64_t size)
+{
+  if (size > max_object_size_)
+    return NULL;
+
+  Object *object;
+  if (index_.Lookup(id, &object)) {
+    free(data);
+  } else {
+    while ((lru_head_ != NULL) && (size_ + size > max_size_))
+      EvictUnlocked(lru_head_);
+    object = new Object();
+    object->id = id;
+    object->data = data;
+    object->size = size;
+    object->in_index = true;
+    index_.Insert(id, object);
+    size_ += size;
+    perf::Inc(n_insert_);
+    perf::Xadd(sz_used_, size);
+    LogCvmfs(kLogCache, kLogDebug, "copied %s into memory (%"PRIu64" bytes)",
+             id.ToString().c_str(), size);
+  }
+  UnlinkUnlocked(object);
+  LinkUnlocked(object);
+  return object;
+}
+
+
+/**
+ * Appends the object to the end of the LRU list.
+ */
+void RamCacheManager::LinkUnlocked(Object *object) {
+  object->prev = lru_tail_;
+  object->next = NULL;
+  if (lru_tail_ != NULL)
+    lru_tail_->next = object;
+  else
+    lru_head_ = object;
+  lru_tail_ = object;
+}
+
+
+/**
+ * Copies a small object from the backing cache into memory.  Returns NULL if
+ * the object is too large or cannot be read.
+ */
+RamCacheManager::Object *RamCacheManager::LoadFromBacking(
+  const shash::Any &id,
+  const int backing_fd)
+{
+  const int64_t size = backing_->GetSize(backing_fd);
+  if ((size < 0) || (static_cast<uint64_t>(size) > max_object_size_))
+    return NULL;
+  unsigned char *data =
+    static_cast<unsigned char *>(smalloc(std::max(size, int64_t(1))));
+  const int64_t nbytes = backing_->Pread(backing_fd, data, size, 0);
+  if (nbytes != size) {
+    free(data);
+    return NULL;
+  }
+  MutexLockGuard guard(&lock_);
+  Object *object = InsertUnlocked(id, data, size);
+  if (object != NULL)
+    object->refcnt++;
+  return object;
+}
+
+
+int RamCacheManager::Open(const shash::Any &id) {
+  {
+    MutexLockGuard guard(&lock_);
+    Object *object;
+    if (index_.Lookup(id, &object)) {
+      object->refcnt++;
+      UnlinkUnlocked(object);
+      LinkUnlocked(object);
+      perf::Inc(n_hit_ram_);
+      // Keep the backing cache's LRU order in sync
+      backing_->Touch(id);
+      return AddFdUnlocked(FdEntry(object, -1));
+    }
+  }
+
+  const int backing_fd = backing_->Open(id);
+  if (backing_fd < 0) {
+    perf::Inc(n_miss_);
+    return backing_fd;
+  }
+  perf::Inc(n_hit_backing_);
+  Object *object = LoadFromBacking(id, backing_fd);
+  if (object != NULL) {
+    backing_->Close(backing_fd);
+    MutexLockGuard guard(&lock_);
+    return AddFdUnlocked(FdEntry(object, -1));
+  }
+  MutexLockGuard guard(&lock_);
+  return AddFdUnlocked(FdEntry(NULL, backing_fd));
+}
+
+
+/**
+ * The object is not yet in memory, it is read through the backing cache
+ * manager's transaction.
+ */
+int RamCacheManager::OpenFromTxn(void *txn) {
+  const int backing_fd = backing_->OpenFromTxn(GetBackingTxn(txn));
+  if (backing_fd < 0)
+    return backing_fd;
+  MutexLockGuard guard(&lock_);
+  return AddFdUnlocked(FdEntry(NULL, backing_fd));
+}
+
+
+int64_t RamCacheManager::Pread(
+  int fd,
+  void *buf,
+  uint64_t size,
+  uint64_t offset)
+{
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  if (entry.object == NULL)
+    return backing_->Pread(entry.backing_fd, buf, size, offset);
+
+  // The data of an open object is immutable and stays valid until it is closed
+  if (offset >= entry.object->size)
+    return 0;
+  const uint64_t nbytes = std::min(size, entry.object->size - offset);
+  memcpy(buf, entry.object->data + offset, nbytes);
+  return nbytes;
+}
+
+
+int RamCacheManager::Readahead(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  if (entry.object != NULL)
+    return 0;
+  return backing_->Readahead(entry.backing_fd);
+}
+
+
+/**
+ * Drops a reference to the object.  Evicted objects are freed with the last
+ * reference.
+ */
+void RamCacheManager::ReleaseUnlocked(Object *object) {
+  assert(object->refcnt > 0);
+  object->refcnt--;
+  if ((object->refcnt == 0) && !object->in_index) {
+    free(object->data);
+    delete object;
+  }
+}
+
+
+int RamCacheManager::Reset(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  transaction->size = 0;
+  return backing_->Reset(GetBackingTxn(txn));
+}
+
+
+/**
+ * Restored objects are not in the index; they are freed when they are closed.
+ * The table of the new cache manager is empty before.
+ */
+bool RamCacheManager::RestoreFdTable(SavedFdTable *saved) {
+  if ((saved == NULL) || (saved->id != kRamCacheManager) ||
+      (saved->backing.size() != 1))
+  {
+    return false;
+  }
+  const unsigned num_objects = saved->objects.size();
+  for (unsigned i = 0; i < saved->fds.size(); ++i) {
+    if (saved->fds[i].target >= static_cast<int>(num_objects))
+      return false;
+  }
+  if (!backing_->RestoreFdTable(saved->backing[0]))
+    return false;
+
+  vector<Object *> objects;
+  for (unsigned i = 0; i < num_objects; ++i) {
+    Object *object = new Object();
+    object->id = saved->objects[i].id;
+    object->data = saved->objects[i].data;
+    object->size = saved->objects[i].size;
+    saved->objects[i].data = NULL;
+    objects.push_back(object);
+  }
+
+  MutexLockGuard guard(&lock_);
+  assert(fds_.empty());
+  for (unsigned i = 0; i < saved->fds.size(); ++i) {
+    const SavedFdTable::Entry &entry = saved->fds[i];
+    if (!entry.IsUsed()) {
+      fds_.push_back(FdEntry());
+      free_fds_.push_back(i);
+    } else if (entry.target >= 0) {
+      objects[entry.target]->refcnt++;
+      fds_.push_back(FdEntry(objects[entry.target], -1));
+    } else {
+      fds_.push_back(FdEntry(NULL, entry.fd));
+    }
+  }
+  LogCvmfs(kLogCache, kLogDebug, "restored %u file descriptors, %u objects",
+           static_cast<unsigned>(fds_.size() - free_fds_.size()), num_objects);
+  return true;
+}
+
+
+/**
+ * Objects in memory are copied because the cache manager is deleted before
+ * the new one takes over.
+ */
+SavedFdTable *RamCacheManager::SaveFdTable() {
+  SavedFdTable *saved = new SavedFdTable(kRamCacheManager);
+  saved->backing.push_back(backing_->SaveFdTable());
+
+  MutexLockGuard guard(&lock_);
+  map<Object *, int> saved_objects;
+  saved->fds.resize(fds_.size());
+  for (unsigned i = 0; i < fds_.size(); ++i) {
+    Object *object = fds_[i].object;
+    if (object == NULL) {
+      saved->fds[i] = SavedFdTable::Entry(-1, fds_[i].backing_fd);
+      continue;
+    }
+    map<Object *, int>::const_iterator iter = saved_objects.find(object);
+    int target;
+    if (iter != saved_objects.end()) {
+      target = iter->second;
+    } else {
+      SavedFdTable::Object saved_object;
+      saved_object.id = object->id;
+      saved_object.size = object->size;
+      saved_object.data = static_cast<unsigned char *>(
+        smalloc(std::max(object->size, uint64_t(1))));
+      memcpy(saved_object.data, object->data, object->size);
+      target = saved->objects.size();
+      saved->objects.push_back(saved_object);
+      saved_objects[object] = target;
+    }
+    saved->fds[i] = SavedFdTable::Entry(target, -1);
+  }
+  return saved;
+}
+
+
+int RamCacheManager::StartTxn(const shash::Any &id, uint64_t size, void *txn) {
+  Transaction *transaction = new (txn) Transaction(id);
+  if ((size != kSizeUnknown) && (size > max_object_size_))
+    transaction->cached = false;
+  const int result = backing_->StartTxn(id, size, GetBackingTxn(txn));
+  if (result < 0) {
+    transaction->~Transaction();
+    return result;
+  }
+  if (transaction->cached && (size != kSizeUnknown)) {
+    transaction->capacity = std::max(size, uint64_t(1));
+    transaction->buffer =
+      static_cast<unsigned char *>(smalloc(transaction->capacity));
+  }
+  return result;
+}
+
+
+/**
+ * The objects in memory remain readable.  New objects are refused by the
+ * backing cache manager.
+ */
+bool RamCacheManager::TearDown2ReadOnly() {
+  if (!backing_->TearDown2ReadOnly())
+    return false;
+  quota_mgr_ = backing_->quota_mgr();
+  return true;
+}
+
+
+void RamCacheManager::UnlinkUnlocked(Object *object) {
+  if (object->prev != NULL)
+    object->prev->next = object->next;
+  else if (lru_head_ == object)
+    lru_head_ = object->next;
+  if (object->next != NULL)
+    object->next->prev = object->prev;
+  else if (lru_tail_ == object)
+    lru_tail_ = object->prev;
+  object->prev = object->next = NULL;
+}
+
+
+/**
+ * Collects the data of small objects in the transaction's buffer.  Once the
+ * object is too large for the memory tier, the buffer is dropped.
+ */
+int64_t RamCacheManager::Write(const void *buf, uint64_t size, void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  const int64_t result = backing_->Write(buf, size, GetBackingTxn(txn));
+  if ((result <= 0) || !transaction->cached)
+    return result;
+
+  const uint64_t new_size = transaction->size + result;
+  if (new_size > max_object_size_) {
+    free(transaction->buffer);
+    transaction->buffer = NULL;
+    transaction->cached = false;
+    return result;
+  }
+  if (new_size > transaction->capacity) {
+    transaction->capacity =
+      std::min(std::max(new_size, 2 * transaction->capacity),
+               max_object_size_);
+    transaction->buffer = static_cast<unsigned char *>(
+      srealloc(transaction->buffer, transaction->capacity));
+  }
+  memcpy(transaction->buffer + transaction->size, buf, result);
+  transaction->size = new_size;
+  return result;
+}
+
+}  // namespace cache
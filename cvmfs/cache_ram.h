@@ -0,0 +1,172 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_CACHE_RAM_H_
+#define CVMFS_CACHE_RAM_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "hash.h"
+#include "smallhash.h"
+#include "statistics.h"
+
+namespace cache {
+
+/**
+ * An in-memory tier in front of another cache manager (usually a
+ * PosixCacheManager).  Objects up to max_object_size bytes are kept in memory
+ * in addition to the backing cache, so that opening and reading hot small
+ * objects does not require system calls.  Larger objects are handled by the
+ * backing cache manager alone.
+ *
+ * Writes go through to the backing cache manager, which remains responsible
+ * for quota management and persistency.  Small objects are copied into memory
+ * when their transaction is committed or when they are opened from the backing
+ * cache.  The memory tier is limited to max_size bytes; the least recently
+ * opened objects are evicted first.  Evicted objects that are still open stay
+ * in memory until they are closed.
+ *
+ * The file descriptors handed out by the RamCacheManager are its own and refer
+ * to either an object in memory or to a file descriptor of the backing cache
+ * manager.
+ */
+class RamCacheManager : public CacheManager {
+ public:
+  static const uint64_t kDefaultMaxObjectSize = 128 * 1024;
+
+  static RamCacheManager *Create(CacheManager *backing,
+                                 const uint64_t max_size,
+                                 const uint64_t max_object_size,
+                                 perf::Statistics *statistics);
+  virtual ~RamCacheManager();
+
+  virtual CacheManagerIds id() { return kRamCacheManager; }
+  virtual bool AcquireQuotaManager(QuotaManager *quota_mgr);
+
+  virtual int Open(const shash::Any &id);
+  virtual int64_t GetSize(int fd);
+  virtual int Close(int fd);
+  virtual int64_t Pread(int fd, void *buf, uint64_t size, uint64_t offset);
+  virtual int Dup(int fd);
+  virtual int Readahead(int fd);
+
+  virtual uint16_t SizeOfTxn() {
+    return sizeof(Transaction) + backing_->SizeOfTxn();
+  }
+  virtual int StartTxn(const shash::Any &id, uint64_t size, void *txn);
+  virtual void CtrlTxn(const std::string &description,
+                       const ObjectType type,
+                       const int flags,
+                       void *txn);
+  virtual int64_t Write(const void *buf, uint64_t size, void *txn);
+  virtual int Reset(void *txn);
+  virtual int OpenFromTxn(void *txn);
+  virtual int AbortTxn(void *txn);
+  virtual int CommitTxn(void *txn);
+
+  virtual int GetRawFd(int fd);
+  virtual void Spawn() { backing_->Spawn(); }
+  virtual void Touch(const shash::Any &id) { backing_->Touch(id); }
+  virtual bool TearDown2ReadOnly();
+  virtual CacheModes GetCacheMode() { return backing_->GetCacheMode(); }
+  virtual SavedFdTable *SaveFdTable();
+  virtual bool RestoreFdTable(SavedFdTable *saved);
+
+  CacheManager *backing() { return backing_; }
+  uint64_t max_size() const { return max_size_; }
+  uint64_t max_object_size() const { return max_object_size_; }
+
+ private:
+  /**
+   * An object in memory.  Objects in the index are linked in LRU order.
+   */
+  struct Object {
+    Object() : data(NULL), size(0), refcnt(0), in_index(false),
+               prev(NULL), next(NULL) { }
+    shash::Any id;
+    unsigned char *data;
+    uint64_t size;
+    /**
+     * Number of open file descriptors
+     */
+    unsigned refcnt;
+    bool in_index;
+    Object *prev;
+    Object *next;
+  };
+
+  /**
+   * Either object or backing_fd is set for a used file descriptor.
+   */
+  struct FdEntry {
+    FdEntry() : object(NULL), backing_fd(-1) { }
+    FdEntry(Object *object, int backing_fd)
+      : object(object), backing_fd(backing_fd) { }
+    bool IsUsed() const { return (object != NULL) || (backing_fd >= 0); }
+    Object *object;
+    int backing_fd;
+  };
+
+  /**
+   * Followed by the transaction of the backing cache manager.  The buffer
+   * collects the object as long as it is small enough for the memory tier.
+   */
+  struct Transaction {
+    explicit Transaction(const shash::Any &id)
+      : id(id), buffer(NULL), size(0), capacity(0), cached(true) { }
+    shash::Any id;
+    unsigned char *buffer;
+    uint64_t size;
+    uint64_t capacity;
+    bool cached;
+  };
+
+  RamCacheManager(CacheManager *backing,
+                  const uint64_t max_size,
+                  const uint64_t max_object_size,
+                  perf::Statistics *statistics);
+  void *GetBackingTxn(void *txn) {
+    return reinterpret_cast<char *>(txn) + sizeof(Transaction);
+  }
+  int AddFdUnlocked(const FdEntry &entry);
+  bool GetFd(const int fd, FdEntry *entry);
+  Object *InsertUnlocked(const shash::Any &id, unsigned char *data,
+                         const uint64_t size);
+  void EvictUnlocked(Object *object);
+  void ReleaseUnlocked(Object *object);
+  void LinkUnlocked(Object *object);
+  void UnlinkUnlocked(Object *object);
+  Object *LoadFromBacking(const shash::Any &id, const int backing_fd);
+
+  CacheManager *backing_;
+  uint64_t max_size_;
+  uint64_t max_object_size_;
+
+  /**
+   * Protects the index, the LRU list, and the file descriptor table
+   */
+  pthread_mutex_t lock_;
+  SmallHashDynamic<shash::Any, Object *> index_;
+  Object *lru_head_;  ///< Least recently used, evicted first
+  Object *lru_tail_;
+  uint64_t size_;  ///< Sum of the sizes of the objects in the index
+  std::vector<FdEntry> fds_;
+  std::vector<int> free_fds_;
+
+  perf::Counter *n_hit_ram_;
+  perf::Counter *n_hit_backing_;
+  perf::Counter *n_miss_;
+  perf::Counter *n_insert_;
+  perf::Counter *n_evict_;
+  perf::Counter *sz_used_;
+};  // class RamCacheManager
+
+}  // namespace cache
+
+#endif  // CVMFS_CACHE_RAM_H_
@@ -0,0 +1,492 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include "cvmfs_config.h"
+#include "cache_tiered.h"
+
+#include <errno.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include "logging.h"
+#include "quota.h"
+#include "util.h"
+#include "util_concurrency.h"
+
+using namespace std;  // NOLINT
+
+namespace cache {
+
+/**
+ * Takes ownership of both tiers.  The quota manager is the one of the local
+ * tier.
+ */
+TieredCacheManager *TieredCacheManager::Create(
+  CacheManager *shared_tier,
+  CacheManager *local_tier,
+  perf::Statistics *statistics)
+{
+  assert(shared_tier != NULL);
+  assert(local_tier != NULL);
+  return new TieredCacheManager(shared_tier, local_tier, statistics);
+}
+
+
+TieredCacheManager::TieredCacheManager(
+  CacheManager *shared_tier,
+  CacheManager *local_tier,
+  perf::Statistics *statistics)
+  : shared_tier_(shared_tier)
+  , local_tier_(local_tier)
+{
+  delete quota_mgr_;
+  quota_mgr_ = local_tier_->quota_mgr();
+  int retval = pthread_mutex_init(&lock_fds_, NULL);
+  assert(retval == 0);
+
+  n_hit_shared_ = statistics->Register("tiered_cache.n_hit_shared",
+    "Number of objects opened from the shared tier");
+  n_hit_local_ = statistics->Register("tiered_cache.n_hit_local",
+    "Number of objects opened from the local tier");
+  n_miss_ = statistics->Register("tiered_cache.n_miss",
+    "Number of objects in neither tier");
+  n_commit_shared_ = statistics->Register("tiered_cache.n_commit_shared",
+    "Number of objects committed to the shared tier");
+  n_commit_local_ = statistics->Register("tiered_cache.n_commit_local",
+    "Number of objects committed to the local tier");
+}
+
+
+TieredCacheManager::~TieredCacheManager() {
+  pthread_mutex_destroy(&lock_fds_);
+  // Owned and deleted by the local tier
+  quota_mgr_ = NULL;
+  delete shared_tier_;
+  delete local_tier_;
+}
+
+
+int TieredCacheManager::AbortTxn(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  CacheManager *tier = transaction->tier;
+  transaction->~Transaction();
+  if (tier == NULL)
+    return 0;
+  return tier->AbortTxn(GetTierTxn(txn));
+}
+
+
+bool TieredCacheManager::AcquireQuotaManager(QuotaManager *quota_mgr) {
+  if (!local_tier_->AcquireQuotaManager(quota_mgr))
+    return false;
+  quota_mgr_ = local_tier_->quota_mgr();
+  return true;
+}
+
+
+int TieredCacheManager::AddFd(const FdEntry &entry) {
+  MutexLockGuard guard(&lock_fds_);
+  if (free_fds_.empty()) {
+    fds_.push_back(entry);
+    return fds_.size() - 1;
+  }
+  const int fd = free_fds_.back();
+  free_fds_.pop_back();
+  fds_[fd] = entry;
+  return fd;
+}
+
+
+int TieredCacheManager::Close(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_fds_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+    fds_[fd] = FdEntry();
+    free_fds_.push_back(fd);
+  }
+  return entry.tier->Close(entry.fd);
+}
+
+
+/**
+ * Copies an object of the shared tier into the local tier as a pinned object.
+ * Returns 0 on success.
+ */
+int TieredCacheManager::CopyToLocal(
+  const shash::Any &id,
+  const std::string &description,
+  bool is_catalog)
+{
+  const int fd = shared_tier_->Open(id);
+  if (fd < 0)
+    return fd;
+  const int64_t size = shared_tier_->GetSize(fd);
+  if (size < 0) {
+    shared_tier_->Close(fd);
+    return size;
+  }
+
+  void *txn = alloca(local_tier_->SizeOfTxn());
+  int retval = local_tier_->StartTxn(id, size, txn);
+  if (retval < 0) {
+    shared_tier_->Close(fd);
+    return retval;
+  }
+  local_tier_->CtrlTxn(description, is_catalog ? kTypeCatalog : kTypePinned,
+                       0, txn);
+  unsigned char buf[4096];
+  uint64_t pos = 0;
+  int64_t nbytes;
+  do {
+    nbytes = shared_tier_->Pread(fd, buf, sizeof(buf), pos);
+    if (nbytes > 0)
+      nbytes = local_tier_->Write(buf, nbytes, txn);
+    if (nbytes < 0) {
+      shared_tier_->Close(fd);
+      local_tier_->AbortTxn(txn);
+      return nbytes;
+    }
+    pos += nbytes;
+  } while (nbytes == static_cast<int64_t>(sizeof(buf)));
+  shared_tier_->Close(fd);
+
+  retval = local_tier_->CommitTxn(txn);
+  if (retval < 0)
+    return retval;
+  perf::Inc(n_commit_local_);
+  LogCvmfs(kLogCache, kLogDebug, "copied pinned object %s to the local tier",
+           id.ToString().c_str());
+  return 0;
+}
+
+
+int TieredCacheManager::CommitTxn(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  CacheManager *tier = transaction->tier;
+  const int error = transaction->error;
+  transaction->~Transaction();
+  if (tier == NULL)
+    return error;
+  const int result = tier->CommitTxn(GetTierTxn(txn));
+  if (result == 0)
+    perf::Inc((tier == shared_tier_) ? n_commit_shared_ : n_commit_local_);
+  return result;
+}
+
+
+/**
+ * Only regular objects are shared between repositories.  Other objects move
+ * to the local tier; nothing has been written to the transaction at this
+ * point.
+ */
+void TieredCacheManager::CtrlTxn(
+  const std::string &description,
+  const ObjectType type,
+  const int flags,
+  void *txn)
+{
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  if ((transaction->tier == shared_tier_) && (type != kTypeRegular)) {
+    shared_tier_->AbortTxn(GetTierTxn(txn));
+    transaction->tier = NULL;
+    const int retval =
+      local_tier_->StartTxn(transaction->id, transaction->size,
+                            GetTierTxn(txn));
+    if (retval < 0) {
+      LogCvmfs(kLogCache, kLogDebug, "failed to move transaction on %s to "
+               "the local tier (%d)", transaction->id.ToString().c_str(),
+               retval);
+      transaction->error = retval;
+      return;
+    }
+    transaction->tier = local_tier_;
+  }
+  if (transaction->tier != NULL)
+    transaction->tier->CtrlTxn(description, type, flags, GetTierTxn(txn));
+}
+
+
+int TieredCacheManager::Dup(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_fds_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  const int tier_fd = entry.tier->Dup(entry.fd);
+  if (tier_fd < 0)
+    return tier_fd;
+  return AddFd(FdEntry(entry.tier, tier_fd));
+}
+
+
+/**
+ * Writes go to the local tier if the shared tier refuses them, so the cache is
+ * only read-only if both tiers are.
+ */
+CacheModes TieredCacheManager::GetCacheMode() {
+  if ((shared_tier_->GetCacheMode() == kCacheReadOnly) &&
+      (local_tier_->GetCacheMode() == kCacheReadOnly))
+  {
+    return kCacheReadOnly;
+  }
+  return kCacheReadWrite;
+}
+
+
+int TieredCacheManager::GetRawFd(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_fds_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  return entry.tier->GetRawFd(entry.fd);
+}
+
+
+/**
+ * Needs to be called with the lock held.
+ */
+bool TieredCacheManager::GetFd(const int fd, FdEntry *entry) {
+  if ((fd < 0) || (static_cast<unsigned>(fd) >= fds_.size()) ||
+      (fds_[fd].tier == NULL))
+  {
+    return false;
+  }
+  *entry = fds_[fd];
+  return true;
+}
+
+
+int64_t TieredCacheManager::GetSize(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_fds_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  return entry.tier->GetSize(entry.fd);
+}
+
+
+int TieredCacheManager::Open(const shash::Any &id) {
+  int tier_fd = shared_tier_->Open(id);
+  if (tier_fd >= 0) {
+    perf::Inc(n_hit_shared_);
+    return AddFd(FdEntry(shared_tier_, tier_fd));
+  }
+  tier_fd = local_tier_->Open(id);
+  if (tier_fd >= 0) {
+    perf::Inc(n_hit_local_);
+    return AddFd(FdEntry(local_tier_, tier_fd));
+  }
+  perf::Inc(n_miss_);
+  return tier_fd;
+}
+
+
+/**
+ * Pins are accounted for by the quota manager of the local tier, so pinned
+ * objects have to be in the local tier.
+ */
+int TieredCacheManager::OpenPinned(
+  const shash::Any &id,
+  const std::string &description,
+  bool is_catalog)
+{
+  int tier_fd = local_tier_->OpenPinned(id, description, is_catalog);
+  if (tier_fd >= 0) {
+    perf::Inc(n_hit_local_);
+    return AddFd(FdEntry(local_tier_, tier_fd));
+  }
+  if (tier_fd != -ENOENT)
+    return tier_fd;
+
+  const int retval = CopyToLocal(id, description, is_catalog);
+  if (retval < 0) {
+    if (retval == -ENOENT)
+      perf::Inc(n_miss_);
+    return retval;
+  }
+  perf::Inc(n_hit_shared_);
+  tier_fd = local_tier_->OpenPinned(id, description, is_catalog);
+  if (tier_fd < 0)
+    return tier_fd;
+  return AddFd(FdEntry(local_tier_, tier_fd));
+}
+
+
+int TieredCacheManager::OpenFromTxn(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  if (transaction->tier == NULL)
+    return transaction->error;
+  const int tier_fd = transaction->tier->OpenFromTxn(GetTierTxn(txn));
+  if (tier_fd < 0)
+    return tier_fd;
+  return AddFd(FdEntry(transaction->tier, tier_fd));
+}
+
+
+int64_t TieredCacheManager::Pread(
+  int fd,
+  void *buf,
+  uint64_t size,
+  uint64_t offset)
+{
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_fds_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  return entry.tier->Pread(entry.fd, buf, size, offset);
+}
+
+
+int TieredCacheManager::Readahead(int fd) {
+  FdEntry entry;
+  {
+    MutexLockGuard guard(&lock_fds_);
+    if (!GetFd(fd, &entry))
+      return -EBADF;
+  }
+  return entry.tier->Readahead(entry.fd);
+}
+
+
+int TieredCacheManager::Reset(void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  if (transaction->tier == NULL)
+    return transaction->error;
+  return transaction->tier->Reset(GetTierTxn(txn));
+}
+
+
+/**
+ * Called on a freshly created cache manager before any file is opened.
+ */
+bool TieredCacheManager::RestoreFdTable(SavedFdTable *saved) {
+  if ((saved == NULL) || (saved->id != kTieredCacheManager) ||
+      (saved->backing.size() != 2))
+  {
+    return false;
+  }
+  for (unsigned i = 0; i < saved->fds.size(); ++i) {
+    if (saved->fds[i].IsUsed() &&
+        (saved->fds[i].target != 0) && (saved->fds[i].target != 1))
+    {
+      return false;
+    }
+  }
+  if (!shared_tier_->RestoreFdTable(saved->backing[0]) ||
+      !local_tier_->RestoreFdTable(saved->backing[1]))
+  {
+    return false;
+  }
+
+  MutexLockGuard guard(&lock_fds_);
+  assert(fds_.empty());
+  for (unsigned i = 0; i < saved->fds.size(); ++i) {
+    const SavedFdTable::Entry &entry = saved->fds[i];
+    if (!entry.IsUsed()) {
+      fds_.push_back(FdEntry());
+      free_fds_.push_back(i);
+      continue;
+    }
+    CacheManager *tier = (entry.target == 0) ? shared_tier_ : local_tier_;
+    fds_.push_back(FdEntry(tier, entry.fd));
+  }
+  return true;
+}
+
+
+/**
+ * The target of a saved file descriptor is 0 for the shared tier and 1 for the
+ * local tier.
+ */
+SavedFdTable *TieredCacheManager::SaveFdTable() {
+  SavedFdTable *saved = new SavedFdTable(kTieredCacheManager);
+  saved->backing.push_back(shared_tier_->SaveFdTable());
+  saved->backing.push_back(local_tier_->SaveFdTable());
+
+  MutexLockGuard guard(&lock_fds_);
+  saved->fds.resize(fds_.size());
+  for (unsigned i = 0; i < fds_.size(); ++i) {
+    if (fds_[i].tier == NULL)
+      continue;
+    saved->fds[i] = SavedFdTable::Entry(
+      (fds_[i].tier == shared_tier_) ? 0 : 1, fds_[i].fd);
+  }
+  return saved;
+}
+
+
+void TieredCacheManager::Spawn() {
+  shared_tier_->Spawn();
+  local_tier_->Spawn();
+}
+
+
+/**
+ * Objects that the shared tier refuses, e.g. because they exceed its quota,
+ * are written to the local tier.
+ */
+int TieredCacheManager::StartTxn(
+  const shash::Any &id,
+  uint64_t size,
+  void *txn)
+{
+  Transaction *transaction = new (txn) Transaction(id, size);
+  int result = shared_tier_->StartTxn(id, size, GetTierTxn(txn));
+  if (result >= 0) {
+    transaction->tier = shared_tier_;
+    return result;
+  }
+
+  LogCvmfs(kLogCache, kLogDebug, "shared tier refused %s (%d), using the "
+           "local tier", id.ToString().c_str(), result);
+  result = local_tier_->StartTxn(id, size, GetTierTxn(txn));
+  if (result < 0) {
+    transaction->~Transaction();
+    return result;
+  }
+  transaction->tier = local_tier_;
+  return result;
+}
+
+
+/**
+ * Both tiers stop writing.  The quota manager of the local tier is replaced in
+ * the process.
+ */
+bool TieredCacheManager::TearDown2ReadOnly() {
+  const bool shared_retval = shared_tier_->TearDown2ReadOnly();
+  const bool local_retval = local_tier_->TearDown2ReadOnly();
+  quota_mgr_ = local_tier_->quota_mgr();
+  return shared_retval && local_retval;
+}
+
+
+/**
+ * The object is in one of the tiers; touching it in the other tier has no
+ * effect.
+ */
+void TieredCacheManager::Touch(const shash::Any &id) {
+  shared_tier_->Touch(id);
+  local_tier_->Touch(id);
+}
+
+
+int64_t TieredCacheManager::Write(const void *buf, uint64_t size, void *txn) {
+  Transaction *transaction = reinterpret_cast<Transaction *>(txn);
+  if (transaction->tier == NULL)
+    return transaction->error;
+  return transaction->tier->Write(buf, size, GetTierTxn(txn));
+}
+
+}  // namespace cache
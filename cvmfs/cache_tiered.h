@@ -0,0 +1,143 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_CACHE_TIERED_H_
+#define CVMFS_CACHE_TIERED_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "hash.h"
+#include "statistics.h"
+
+namespace cache {
+
+/**
+ * Combines a node-wide cache tier that is shared by all repositories with the
+ * cache tier of a single repository.  Since objects are content-addressed, the
+ * shared tier deduplicates files that are used by several repositories.
+ *
+ * Objects are looked up in the shared tier first and then in the local tier.
+ * New regular objects are written to the shared tier; catalogs, pinned and
+ * volatile objects as well as objects that the shared tier does not accept
+ * (e.g. too large for its quota) are written to the local tier.  The object
+ * type is only known after CtrlTxn(), so transactions start in the shared tier
+ * and move to the local tier when CtrlTxn() requests a non-regular object.
+ *
+ * Each tier keeps its own quota manager.  The quota manager of the shared tier
+ * accounts for the usage of the shared tier, usually across all mounted
+ * repositories.  The quota manager of the TieredCacheManager is the one of the
+ * local tier, which takes care of pinned objects.  Hence the cache size and
+ * cleanup commands of cvmfs_talk only act on the local tier.  Pinned objects
+ * that are found in the shared tier are copied to the local tier, so that the
+ * quota manager of the shared tier cannot evict them.
+ *
+ * The file descriptors handed out by the TieredCacheManager are its own and
+ * refer to a file descriptor of one of the tiers.
+ */
+class TieredCacheManager : public CacheManager {
+ public:
+  static TieredCacheManager *Create(CacheManager *shared_tier,
+                                    CacheManager *local_tier,
+                                    perf::Statistics *statistics);
+  virtual ~TieredCacheManager();
+
+  virtual CacheManagerIds id() { return kTieredCacheManager; }
+  virtual bool AcquireQuotaManager(QuotaManager *quota_mgr);
+
+  virtual int Open(const shash::Any &id);
+  virtual int64_t GetSize(int fd);
+  virtual int Close(int fd);
+  virtual int64_t Pread(int fd, void *buf, uint64_t size, uint64_t offset);
+  virtual int Dup(int fd);
+  virtual int Readahead(int fd);
+
+  virtual uint16_t SizeOfTxn() {
+    return sizeof(Transaction) +
+           std::max(shared_tier_->SizeOfTxn(), local_tier_->SizeOfTxn());
+  }
+  virtual int StartTxn(const shash::Any &id, uint64_t size, void *txn);
+  virtual void CtrlTxn(const std::string &description,
+                       const ObjectType type,
+                       const int flags,
+                       void *txn);
+  virtual int64_t Write(const void *buf, uint64_t size, void *txn);
+  virtual int Reset(void *txn);
+  virtual int OpenFromTxn(void *txn);
+  virtual int AbortTxn(void *txn);
+  virtual int CommitTxn(void *txn);
+
+  virtual int GetRawFd(int fd);
+  virtual void Spawn();
+  virtual void Touch(const shash::Any &id);
+  virtual bool TearDown2ReadOnly();
+  virtual CacheModes GetCacheMode();
+  virtual SavedFdTable *SaveFdTable();
+  virtual bool RestoreFdTable(SavedFdTable *saved);
+  virtual int OpenPinned(const shash::Any &id,
+                         const std::string &description,
+                         bool is_catalog);
+
+  CacheManager *shared_tier() { return shared_tier_; }
+  CacheManager *local_tier() { return local_tier_; }
+
+ private:
+  struct FdEntry {
+    FdEntry() : tier(NULL), fd(-1) { }
+    FdEntry(CacheManager *tier, int fd) : tier(tier), fd(fd) { }
+    CacheManager *tier;
+    int fd;
+  };
+
+  /**
+   * Followed by the transaction of the tier.  If the transaction cannot be
+   * moved to the local tier, tier is NULL and error is returned by the
+   * following transaction operations.
+   */
+  struct Transaction {
+    Transaction(const shash::Any &id, const uint64_t size)
+      : id(id), size(size), tier(NULL), error(0) { }
+    shash::Any id;
+    uint64_t size;
+    CacheManager *tier;
+    int error;
+  };
+
+  TieredCacheManager(CacheManager *shared_tier,
+                     CacheManager *local_tier,
+                     perf::Statistics *statistics);
+  void *GetTierTxn(void *txn) {
+    return reinterpret_cast<char *>(txn) + sizeof(Transaction);
+  }
+  int AddFd(const FdEntry &entry);
+  int CopyToLocal(const shash::Any &id,
+                  const std::string &description,
+                  bool is_catalog);
+  bool GetFd(const int fd, FdEntry *entry);
+
+  CacheManager *shared_tier_;
+  CacheManager *local_tier_;
+
+  /**
+   * Protects the file descriptor table
+   */
+  pthread_mutex_t lock_fds_;
+  std::vector<FdEntry> fds_;
+  std::vector<int> free_fds_;
+
+  perf::Counter *n_hit_shared_;
+  perf::Counter *n_hit_local_;
+  perf::Counter *n_miss_;
+  perf::Counter *n_commit_shared_;
+  perf::Counter *n_commit_local_;
+};  // class TieredCacheManager
+
+}  // namespace cache
+
+#endif  // CVMFS_CACHE_TIERED_H_
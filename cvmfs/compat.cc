@@ -168,6 +168,28 @@ void Migrate(InodeTracker *old_tracker, glue::InodeTracker *new_tracker) {
 //------------------------------------------------------------------------------
 
 
+namespace inode_tracker_v4 {
+
+void Migrate(InodeTracker *old_tracker, glue::InodeTracker *new_tracker) {
+  assert(old_tracker->version_ == InodeTracker::kVersion);
+  // Copying the maps rehashes the entries with the new hash functions
+  glue::InodeTracker::Statistics statistics;
+  statistics.num_inserts = old_tracker->statistics_.num_inserts;
+  statistics.num_removes = old_tracker->statistics_.num_removes;
+  statistics.num_references = old_tracker->statistics_.num_references;
+  statistics.num_hits_inode = old_tracker->statistics_.num_hits_inode;
+  statistics.num_hits_path = old_tracker->statistics_.num_hits_path;
+  statistics.num_misses_path = old_tracker->statistics_.num_misses_path;
+  new_tracker->Import(old_tracker->path_map_, old_tracker->inode_map_,
+                      old_tracker->inode_references_, statistics);
+}
+
+}  // namespace inode_tracker_v4
+
+
+//------------------------------------------------------------------------------
+
+
 namespace chunk_tables {
 
 ChunkTables::~ChunkTables() {
@@ -832,6 +832,49 @@ void Migrate(InodeTracker *old_tracker, glue::InodeTracker *new_tracker);
 }  // namespace inode_tracker_v3
 
 
+//------------------------------------------------------------------------------
+
+
+namespace inode_tracker_v4 {
+
+/**
+ * Up to 2.2, the inode tracker was protected by a mutex.  The maps themselves
+ * are unchanged.
+ */
+class InodeTracker {
+ public:
+  struct Statistics {
+    atomic_int64 num_inserts;
+    atomic_int64 num_removes;
+    atomic_int64 num_references;
+    atomic_int64 num_hits_inode;
+    atomic_int64 num_hits_path;
+    atomic_int64 num_misses_path;
+  };
+
+  InodeTracker() { assert(false); }
+  explicit InodeTracker(const InodeTracker &other) { assert(false); }
+  InodeTracker &operator= (const InodeTracker &other) { assert(false); }
+  ~InodeTracker() {
+    pthread_mutex_destroy(lock_);
+    free(lock_);
+  }
+
+  static const unsigned kVersion = 4;
+
+  unsigned version_;
+  pthread_mutex_t *lock_;
+  glue::PathMap path_map_;
+  glue::InodeMap inode_map_;
+  glue::InodeReferences inode_references_;
+  Statistics statistics_;
+};
+
+void Migrate(InodeTracker *old_tracker, glue::InodeTracker *new_tracker);
+
+}  // namespace inode_tracker_v4
+
+
 namespace chunk_tables {
 
 class FileChunk {
@@ -221,17 +221,17 @@ StreamStates DecompressZStream2Sink(
   z_stream *strm,
   cvmfs::Sink *sink)
 {
-  unsigned char out[kZChunk];
+  unsigned char out[kZChunkStream];
   int z_ret;
   int64_t pos = 0;
 
   do {
-    strm->avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
+    strm->avail_in = (kZChunkStream > (size-pos)) ? size-pos : kZChunkStream;
     strm->next_in = ((unsigned char *)buf)+pos;
 
     // Run inflate() on input until output buffer not full
     do {
-      strm->avail_out = kZChunk;
+      strm->avail_out = kZChunkStream;
       strm->next_out = out;
       z_ret = inflate(strm, Z_NO_FLUSH);
       switch (z_ret) {
@@ -243,13 +243,13 @@ StreamStates DecompressZStream2Sink(
         case Z_MEM_ERROR:
           return kStreamIOError;
       }
-      size_t have = kZChunk - strm->avail_out;
+      size_t have = kZChunkStream - strm->avail_out;
       int64_t written = sink->Write(out, have);
       if ((written < 0) || (static_cast<uint64_t>(written) != have))
         return kStreamIOError;
     } while (strm->avail_out == 0);
 
-    pos += kZChunk;
+    pos += kZChunkStream;
   } while (pos < size);
 
   return (z_ret == Z_STREAM_END ? kStreamEnd : kStreamContinue);
@@ -262,17 +262,17 @@ StreamStates DecompressZStream2File(
   z_stream *strm,
   FILE *f)
 {
-  unsigned char out[kZChunk];
+  unsigned char out[kZChunkStream];
   int z_ret;
   int64_t pos = 0;
 
   do {
-    strm->avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
+    strm->avail_in = (kZChunkStream > (size-pos)) ? size-pos : kZChunkStream;
     strm->next_in = ((unsigned char *)buf)+pos;
 
     // Run inflate() on input until output buffer not full
     do {
-      strm->avail_out = kZChunk;
+      strm->avail_out = kZChunkStream;
       strm->next_out = out;
       z_ret = inflate(strm, Z_NO_FLUSH);
       switch (z_ret) {
@@ -284,7 +284,7 @@ StreamStates DecompressZStream2File(
         case Z_MEM_ERROR:
           return kStreamIOError;
       }
-      size_t have = kZChunk - strm->avail_out;
+      size_t have = kZChunkStream - strm->avail_out;
       if (fwrite(out, 1, have, f) != have || ferror(f)) {
         LogCvmfs(kLogCompress, kLogDebug, "Inflate to file failed with %s "
              "(errno=%d)", strerror(errno), errno);
@@ -292,7 +292,7 @@ StreamStates DecompressZStream2File(
       }
     } while (strm->avail_out == 0);
 
-    pos += kZChunk;
+    pos += kZChunkStream;
   } while (pos < size);
 
   return (z_ret == Z_STREAM_END ? kStreamEnd : kStreamContinue);
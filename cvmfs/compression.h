@@ -31,6 +31,12 @@ bool CopyPath2Mem(const std::string &path,
 namespace zlib {
 
 const unsigned kZChunk = 16384;
+/**
+ * Buffer size of the streaming decompression of downloads.  With larger
+ * buffers, inflate() spends more time in its fast path and the sink is called
+ * less often.  The buffer lives on the stack of the calling thread.
+ */
+const unsigned kZChunkStream = 128 * 1024;
 
 enum StreamStates {
   kStreamDataError = 0,
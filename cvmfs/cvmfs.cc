@@ -72,11 +72,14 @@
 #include "auto_umount.h"
 #include "backoff.h"
 #include "cache.h"
+#include "cache_ram.h"
+#include "cache_tiered.h"
 #include "catalog_mgr_client.h"
 #include "clientctx.h"
 #include "compat.h"
 #include "compression.h"
 #include "directory_entry.h"
+#include "dns.h"
 #include "download.h"
 #include "duplex_sqlite3.h"
 #include "fetch.h"
@@ -85,6 +88,7 @@
 #include "glue_buffer.h"
 #include "hash.h"
 #include "history_sqlite.h"
+#include "listing_cache.h"
 #include "loader.h"
 #include "logging.h"
 #include "lru.h"
@@ -93,6 +97,7 @@
 #include "nfs_maps.h"
 #include "options.h"
 #include "platform.h"
+#include "prefetch.h"
 #include "quota.h"
 #include "quota_listener.h"
 #include "shortstring.h"
@@ -128,6 +133,7 @@ const double kDefaultKCacheTimeout = 60.0;
 const unsigned kReloadSafetyMargin = 500;  // in milliseconds
 const unsigned kDefaultNumConnections = 16;
 const uint64_t kDefaultMemcache = 16*1024*1024;  // 16M RAM for meta-data caches
+const uint64_t kDefaultListingCache = 16*1024*1024;  // 16M for dir listings
 const uint64_t kDefaultCacheSizeMb = 1024*1024*1024;  // 1G
 /**
  * If catalog reload fails, try again in 3 minutes
@@ -159,7 +165,6 @@ InodeGenerationInfo inode_generation_info_;
 
 /**
  * For cvmfs_opendir / cvmfs_readdir
- * TODO: use mmap for very large listings
  */
 struct DirectoryListing {
   char *buffer;  /**< Filled by fuse_add_direntry */
@@ -195,12 +200,28 @@ quota::ListenerHandle *unpin_listener_ = NULL;
 signature::SignatureManager *signature_manager_ = NULL;
 download::DownloadManager *download_manager_ = NULL;
 download::DownloadManager *external_download_manager_ = NULL;
+/**
+ * Resolved proxy names, shared by both download managers
+ */
+dns::HostCache *host_cache_ = NULL;
 cache::CacheManager *cache_manager_ = NULL;
 Fetcher *fetcher_ = NULL;
 Fetcher *external_fetcher_ = NULL;
+/**
+ * Reads ahead chunks of sequentially read files, NULL if disabled
+ */
+ChunkPrefetcher *chunk_prefetcher_ = NULL;
 lru::InodeCache *inode_cache_ = NULL;
 lru::PathCache *path_cache_ = NULL;
 lru::Md5PathCache *md5path_cache_ = NULL;
+/**
+ * Names that do not exist in a directory, keyed by the parent inode
+ */
+lru::NegativeCache *negative_cache_ = NULL;
+/**
+ * Serialized directory listings, NULL if disabled
+ */
+ListingCache *listing_cache_ = NULL;
 glue::InodeTracker *inode_tracker_ = NULL;
 OptionsManager *options_manager_ = NULL;
 
@@ -214,6 +235,13 @@ bool volatile_repository_ = false;
  * synthetic attributes should not be copied up.
  */
 bool hide_magic_xattrs_ = false;
+/**
+ * If true, the attributes of directory entries that are collected for a
+ * listing are stored in the inode cache and the path cache.  The kernel
+ * follows up a readdir() by ls -l or find with a lookup() and getattr() for
+ * every entry, which are then served from memory.
+ */
+bool prime_listing_attrs_ = true;
 
 /**
  * in maintenance mode, cache timeout is 0 and catalogs are not reloaded
@@ -249,6 +277,7 @@ perf::Counter *n_fs_lookup_ = NULL;
 perf::Counter *n_fs_lookup_negative_ = NULL;
 perf::Counter *n_fs_stat_ = NULL;
 perf::Counter *n_fs_read_ = NULL;
+perf::Counter *n_fs_read_fd_ = NULL;
 perf::Counter *n_fs_readlink_ = NULL;
 perf::Counter *n_fs_forget_ = NULL;
 perf::Counter *n_io_error_ = NULL;
@@ -429,13 +458,17 @@ static void RemountFinish() {
     inode_cache_->Pause();
     path_cache_->Pause();
     md5path_cache_->Pause();
+    negative_cache_->Pause();
     inode_cache_->Drop();
     path_cache_->Drop();
     md5path_cache_->Drop();
+    negative_cache_->Drop();
 
     // Ensure that all Fuse callbacks left the catalog query code
     remount_fence_->Block();
     catalog::LoadError retval = catalog_manager_->Remount(false);
+    if (listing_cache_ != NULL)
+      listing_cache_->Drop();
     if (inode_annotation_) {
       inode_generation_info_.inode_generation =
         inode_annotation_->GetGeneration();
@@ -447,6 +480,7 @@ static void RemountFinish() {
     inode_cache_->Resume();
     path_cache_->Resume();
     md5path_cache_->Resume();
+    negative_cache_->Resume();
 
     atomic_cas32(&drainout_mode_, 1, 0);
     if ((retval == catalog::kLoadFail) || (retval == catalog::kLoadNoSpace) ||
@@ -718,6 +752,9 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     assert(false);
   }
 
+  if (negative_cache_->Lookup(parent, name))
+    goto lookup_reply_negative;
+
   if (!GetPathForInode(parent, &parent_path)) {
     LogCvmfs(kLogCvmfs, kLogDebug, "no path for parent inode found");
     goto lookup_reply_negative;
@@ -728,10 +765,12 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
   path.Append(name, strlen(name));
   tracer::Trace(tracer::kFuseLookup, path, "lookup()");
   if (!GetDirentForPath(path, &dirent)) {
-    if (dirent.GetSpecial() == catalog::kDirentNegative)
+    if (dirent.GetSpecial() == catalog::kDirentNegative) {
+      negative_cache_->Insert(parent, name);
       goto lookup_reply_negative;
-    else
+    } else {
       goto lookup_reply_error;
+    }
   }
 
  lookup_reply_positive:
@@ -889,6 +928,67 @@ static void AddToDirListing(const fuse_req_t req,
 }
 
 
+/**
+ * Serializes the listing of the directory with the dirent d into fuse_listing.
+ */
+static bool BuildDirListing(const fuse_req_t req,
+                            const PathString &path,
+                            const catalog::DirectoryEntry &d,
+                            BigVector<char> *fuse_listing)
+{
+  // Add current directory link
+  struct stat info;
+  info = d.GetStatStructure();
+  AddToDirListing(req, ".", &info, fuse_listing);
+
+  // Add parent directory link
+  catalog::DirectoryEntry p;
+  if (d.inode() != catalog_manager_->GetRootInode() &&
+      GetDirentForPath(GetParentPath(path), &p))
+  {
+    info = p.GetStatStructure();
+    AddToDirListing(req, "..", &info, fuse_listing);
+  }
+
+  // Add all names
+  catalog::StatEntryList listing_from_catalog;
+  bool retval = catalog_manager_->ListingStat(path, &listing_from_catalog);
+  if (!retval)
+    return false;
+
+  for (unsigned i = 0; i < listing_from_catalog.size(); ++i) {
+    // Fix inodes
+    PathString entry_path;
+    entry_path.Assign(path);
+    entry_path.Append("/", 1);
+    entry_path.Append(listing_from_catalog.AtPtr(i)->name.GetChars(),
+                      listing_from_catalog.AtPtr(i)->name.GetLength());
+
+    catalog::DirectoryEntry entry_dirent;
+    if (!GetDirentForPath(entry_path, &entry_dirent)) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "listing entry %s vanished, skipping",
+               entry_path.c_str());
+      continue;
+    }
+
+    struct stat fixed_info = listing_from_catalog.AtPtr(i)->info;
+    fixed_info.st_ino = entry_dirent.inode();
+    if (prime_listing_attrs_) {
+      // The lookup() of the entry finds the dirent in the md5path cache.  The
+      // inode tracker is not touched: the kernel does not hold a reference to
+      // the inode before the lookup(), so there would be no matching forget().
+      inode_cache_->Insert(entry_dirent.inode(), entry_dirent);
+      // Hardlinks share an inode, the path is ambiguous
+      if (entry_dirent.IsDirectory() || (entry_dirent.linkcount() <= 1))
+        path_cache_->Insert(entry_dirent.inode(), entry_path);
+    }
+    AddToDirListing(req, listing_from_catalog.AtPtr(i)->name.c_str(),
+                    &fixed_info, fuse_listing);
+  }
+  return true;
+}
+
+
 /**
  * Open a directory for listing.
  */
@@ -934,52 +1034,23 @@ static void cvmfs_opendir(fuse_req_t req, fuse_ino_t ino,
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_opendir on inode: %"PRIu64", path %s",
            uint64_t(ino), path.c_str());
 
-  // Build listing
   BigVector<char> fuse_listing(512);
-
-  // Add current directory link
-  struct stat info;
-  info = d.GetStatStructure();
-  AddToDirListing(req, ".", &info, &fuse_listing);
-
-  // Add parent directory link
-  catalog::DirectoryEntry p;
-  if (d.inode() != catalog_manager_->GetRootInode() &&
-      GetDirentForPath(GetParentPath(path), &p))
+  const shash::Md5 md5path(path.GetChars(), path.GetLength());
+  if ((listing_cache_ == NULL) ||
+      !listing_cache_->Lookup(md5path, &fuse_listing))
   {
-    info = p.GetStatStructure();
-    AddToDirListing(req, "..", &info, &fuse_listing);
-  }
-
-  // Add all names
-  catalog::StatEntryList listing_from_catalog;
-  bool retval = catalog_manager_->ListingStat(path, &listing_from_catalog);
-
-  if (!retval) {
-    remount_fence_->Leave();
-    fuse_listing.Clear();  // Buffer is shared, empty manually
-    fuse_reply_err(req, EIO);
-    return;
-  }
-  for (unsigned i = 0; i < listing_from_catalog.size(); ++i) {
-    // Fix inodes
-    PathString entry_path;
-    entry_path.Assign(path);
-    entry_path.Append("/", 1);
-    entry_path.Append(listing_from_catalog.AtPtr(i)->name.GetChars(),
-                      listing_from_catalog.AtPtr(i)->name.GetLength());
-
-    catalog::DirectoryEntry entry_dirent;
-    if (!GetDirentForPath(entry_path, &entry_dirent)) {
-      LogCvmfs(kLogCvmfs, kLogDebug, "listing entry %s vanished, skipping",
-               entry_path.c_str());
-      continue;
+    if (!BuildDirListing(req, path, d, &fuse_listing)) {
+      remount_fence_->Leave();
+      fuse_listing.Clear();  // Buffer is shared, empty manually
+      fuse_reply_err(req, EIO);
+      return;
+    }
+    if (listing_cache_ != NULL) {
+      char *buffer;
+      bool large_alloc;
+      fuse_listing.ShareBuffer(&buffer, &large_alloc);
+      listing_cache_->Insert(md5path, buffer, fuse_listing.size());
     }
-
-    struct stat fixed_info = listing_from_catalog.AtPtr(i)->info;
-    fixed_info.st_ino = entry_dirent.inode();
-    AddToDirListing(req, listing_from_catalog.AtPtr(i)->name.c_str(),
-                    &fixed_info, &fuse_listing);
   }
   remount_fence_->Leave();
 
@@ -1180,10 +1251,16 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
       chunk_tables_->Lock();
       // Check again to avoid race
       if (!chunk_tables_->inode2chunks.Contains(ino)) {
-        chunk_tables_->inode2chunks.Insert(
-          ino, FileChunkReflist(chunks, path, dirent.compression_algorithm(),
-                                dirent.IsExternalFile()));
+        FileChunkReflist chunk_reflist(chunks, path,
+                                       dirent.compression_algorithm(),
+                                       dirent.IsExternalFile());
+        chunk_tables_->inode2chunks.Insert(ino, chunk_reflist);
         chunk_tables_->inode2references.Insert(ino, 1);
+        if (chunk_prefetcher_) {
+          chunk_prefetcher_->OnOpen(chunk_reflist,
+            volatile_repository_ ? cache::CacheManager::kTypeVolatile
+                                 : cache::CacheManager::kTypeRegular);
+        }
       } else {
         uint32_t refctr;
         bool retval = chunk_tables_->inode2references.Lookup(ino, &refctr);
@@ -1262,8 +1339,35 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
 }
 
 
+#if FUSE_VERSION >= 29
 /**
- * Redirected to pread into cache.
+ * Hands the requested range of a cache file to Fuse as file descriptor and
+ * offset.  If the kernel supports splice, the data is moved from the page cache
+ * to the Fuse device without a copy through user space.  Returns false if the
+ * cache manager cannot expose a file descriptor, in which case nothing has
+ * been replied yet.
+ */
+static bool ReplyFd(fuse_req_t req, int fd, size_t size, off_t off) {
+  const int raw_fd = cache_manager_->GetRawFd(fd);
+  if (raw_fd < 0)
+    return false;
+
+  struct fuse_bufvec bufvec = FUSE_BUFVEC_INIT(size);
+  bufvec.buf[0].flags =
+    static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  bufvec.buf[0].fd = raw_fd;
+  bufvec.buf[0].pos = off;
+  // Read errors are replied by fuse itself
+  fuse_reply_data(req, &bufvec, FUSE_BUF_SPLICE_MOVE);
+  perf::Inc(n_fs_read_fd_);
+  return true;
+}
+#endif
+
+
+/**
+ * Redirected to pread into cache.  Requests that can be served from a single
+ * cache file are handed to fuse as a file descriptor (see ReplyFd).
  */
 static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                        struct fuse_file_info *fi)
@@ -1310,6 +1414,11 @@ static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
       // Open file descriptor to chunk
       if ((chunk_fd.fd == -1) || (chunk_fd.chunk_idx != chunk_idx)) {
         if (chunk_fd.fd != -1) cache_manager_->Close(chunk_fd.fd);
+        if (chunk_prefetcher_) {
+          chunk_prefetcher_->OnChunkAccess(chunk_handle, chunks, chunk_idx,
+            volatile_repository_ ? cache::CacheManager::kTypeVolatile
+                                 : cache::CacheManager::kTypeRegular);
+        }
         string verbose_path = "Part of " + chunks.path.ToString();
         if (chunks.external_data) {
           chunk_fd.fd = external_fetcher_->Fetch(
@@ -1350,6 +1459,21 @@ static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
         chunks.list->AtPtr(chunk_idx)->size() - offset_in_chunk;
       size_t bytes_to_read_in_chunk =
         std::min(bytes_to_read, remaining_bytes_in_chunk);
+#if FUSE_VERSION >= 29
+      // The file descriptor must stay valid until fuse_reply_data returns, so
+      // only requests within a single chunk take the fast path
+      if ((overall_bytes_fetched == 0) && (bytes_to_read_in_chunk == size) &&
+          ReplyFd(req, chunk_fd.fd, size, offset_in_chunk))
+      {
+        chunk_tables_->Lock();
+        chunk_tables_->handle2fd.Insert(chunk_handle, chunk_fd);
+        chunk_tables_->Unlock();
+        UnlockMutex(handle_lock);
+        LogCvmfs(kLogCvmfs, kLogDebug, "pushed chunk fd %d to user",
+                 chunk_fd.fd);
+        return;
+      }
+#endif
       const int64_t bytes_fetched = cache_manager_->Pread(
         chunk_fd.fd,
         data + overall_bytes_fetched,
@@ -1383,6 +1507,12 @@ static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
              chunk_fd.fd);
   } else {
     const int64_t fd = fi->fh;
+#if FUSE_VERSION >= 29
+    if (ReplyFd(req, fd, size, off)) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "pushed fd %d to user", fd);
+      return;
+    }
+#endif
     int64_t nbytes = cache_manager_->Pread(fd, data, size, off);
     if (nbytes < 0) {
       fuse_reply_err(req, -nbytes);
@@ -1444,6 +1574,8 @@ static void cvmfs_release(fuse_req_t req, fuse_ino_t ino,
 
     if (chunk_fd.fd != -1)
       cache_manager_->Close(chunk_fd.fd);
+    if (chunk_prefetcher_)
+      chunk_prefetcher_->Forget(chunk_handle);
     perf::Dec(no_open_files_);
   } else {
     if (cache_manager_->Close(fd) == 0) {
@@ -1932,6 +2064,13 @@ static void cvmfs_init(void *userdata, struct fuse_conn_info *conn) {
 #ifdef CVMFS_NFS_SUPPORT
   conn->want |= FUSE_CAP_EXPORT_SUPPORT;
 #endif
+
+#if FUSE_VERSION >= 29
+  // Replies of cvmfs_read are spliced from the cache files if possible.  Can
+  // be turned off by the no_splice_write mount option.
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+#endif
 }
 
 static void cvmfs_destroy(void *unused __attribute__((unused))) {
@@ -2090,6 +2229,24 @@ static int Init(const loader::LoaderExports *loader_exports) {
   cvmfs::Uuid *uuid;
   bool use_geo_api = false;
   bool follow_redirects = false;
+  bool use_http2 = false;
+  bool adaptive_proxies = false;
+  bool prewarm_connections = false;
+  unsigned http2_max_streams =
+    download::DownloadManager::kHttp2DefaultMaxStreams;
+  unsigned parallel_ranges = 0;
+  unsigned parallel_range_size =
+    download::DownloadManager::kDefaultParallelRangeSize;
+  unsigned hedge_percentile = 0;
+  unsigned processing_threads = 0;
+  unsigned prefetch_window = 0;
+  unsigned eager_chunks = 0;
+  uint64_t listing_cache_size = cvmfs::kDefaultListingCache;
+  uint64_t ram_cache_size = 0;
+  unsigned group_commit = 0;
+  uint64_t ram_cache_max_object = cache::RamCacheManager::kDefaultMaxObjectSize;
+  string cache_shared_tier = "";
+  int64_t cache_shared_tier_quota = -1;  // default: same as quota_limit
 
   cvmfs::boot_time_ = loader_exports->boot_time;
   cvmfs::backoff_throttle_ = new BackoffThrottle();
@@ -2180,6 +2337,60 @@ static int Init(const loader::LoaderExports *loader_exports) {
   {
     follow_redirects = true;
   }
+  if (cvmfs::options_manager_->GetValue("CVMFS_HTTP2", &parameter) &&
+      cvmfs::options_manager_->IsOn(parameter))
+  {
+    use_http2 = true;
+  }
+  if (cvmfs::options_manager_->GetValue("CVMFS_ADAPTIVE_PROXIES", &parameter) &&
+      cvmfs::options_manager_->IsOn(parameter))
+  {
+    adaptive_proxies = true;
+  }
+  if (cvmfs::options_manager_->GetValue("CVMFS_PREWARM_CONNECTIONS",
+                                        &parameter) &&
+      cvmfs::options_manager_->IsOn(parameter))
+  {
+    prewarm_connections = true;
+  }
+  if (cvmfs::options_manager_->GetValue("CVMFS_HTTP2_MAX_STREAMS", &parameter))
+    http2_max_streams = String2Uint64(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_PARALLEL_RANGES", &parameter))
+    parallel_ranges = String2Uint64(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_PARALLEL_RANGE_SIZE",
+                                        &parameter))
+  {
+    parallel_range_size = String2Uint64(parameter);
+  }
+  if (cvmfs::options_manager_->GetValue("CVMFS_HEDGE_PERCENTILE", &parameter))
+    hedge_percentile = String2Uint64(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_PROCESSING_THREADS",
+                                        &parameter))
+  {
+    processing_threads = String2Uint64(parameter);
+  }
+  if (cvmfs::options_manager_->GetValue("CVMFS_PREFETCH_WINDOW", &parameter))
+    prefetch_window = String2Uint64(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_EAGER_CHUNK_FETCH", &parameter))
+    eager_chunks = String2Uint64(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_LISTING_CACHE_SIZE", &parameter))
+    listing_cache_size = String2Uint64(parameter) * 1024*1024;
+  if (cvmfs::options_manager_->GetValue("CVMFS_RAM_CACHE_SIZE", &parameter))
+    ram_cache_size = String2Uint64(parameter) * 1024*1024;
+  if (cvmfs::options_manager_->GetValue("CVMFS_RAM_CACHE_MAX_OBJECT",
+                                        &parameter))
+  {
+    ram_cache_max_object = String2Uint64(parameter) * 1024;
+  }
+  if (cvmfs::options_manager_->GetValue("CVMFS_GROUP_COMMIT", &parameter))
+    group_commit = String2Uint64(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_CACHE_SHARED_TIER", &parameter))
+    cache_shared_tier = MakeCanonicalPath(parameter);
+  if (cvmfs::options_manager_->GetValue("CVMFS_CACHE_SHARED_TIER_QUOTA",
+                                        &parameter))
+  {
+    cache_shared_tier_quota = String2Int64(parameter) * 1024*1024;
+  }
   if (cvmfs::options_manager_->GetValue("CVMFS_TRACEFILE", &parameter))
     tracefile = parameter;
   if (cvmfs::options_manager_->GetValue("CVMFS_MAX_TTL", &parameter))
@@ -2251,6 +2462,12 @@ static int Init(const loader::LoaderExports *loader_exports) {
   {
     cvmfs::hide_magic_xattrs_ = true;
   }
+  if (cvmfs::options_manager_->GetValue("CVMFS_PRIME_LISTING_ATTRS",
+                                        &parameter)
+      && !cvmfs::options_manager_->IsOn(parameter))
+  {
+    cvmfs::prime_listing_attrs_ = false;
+  }
   if (cvmfs::options_manager_->GetValue("CVMFS_SERVER_CACHE_MODE", &parameter)
       && cvmfs::options_manager_->IsOn(parameter))
   {
@@ -2325,6 +2542,10 @@ static int Init(const loader::LoaderExports *loader_exports) {
     "inode_tracker.n_hit_path", "overall number of successful path lookups");
   cvmfs::statistics_->Register(
     "inode_tracker.n_miss_path", "overall number of unsuccessful path lookups");
+  cvmfs::statistics_->Register("inode_tracker.n_contended_read",
+    "overall number of path and inode lookups that waited for the lock");
+  cvmfs::statistics_->Register("inode_tracker.n_contended_write",
+    "overall number of inode reference updates that waited for the lock");
 
   // Fill cvmfs option variables from configuration
   cvmfs::foreground_ = loader_exports->foreground;
@@ -2361,6 +2582,11 @@ static int Init(const loader::LoaderExports *loader_exports) {
   // 4 KB
   retval = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, 32, 128);
   assert(retval == SQLITE_OK);
+  // Let SQlite fetch catalog pages from the memory mapping of the cvmfs VFS
+  const sqlite3_int64 sqlite_mmap_size = sqlite::kMaxMmapSize;
+  retval = sqlite3_config(SQLITE_CONFIG_MMAP_SIZE,
+                          sqlite_mmap_size, sqlite_mmap_size);
+  assert(retval == SQLITE_OK);
 
   // Disable SQlite3 locks
   retval = sqlite3_vfs_register(sqlite3_vfs_find("unix-none"), 1);
@@ -2369,19 +2595,28 @@ static int Init(const loader::LoaderExports *loader_exports) {
   // Meta-data memory caches
   const double memcache_unit_size =
     7.0 * lru::Md5PathCache::GetEntrySize() +
-    lru::InodeCache::GetEntrySize() + lru::PathCache::GetEntrySize();
+    lru::InodeCache::GetEntrySize() + lru::PathCache::GetEntrySize() +
+    lru::NegativeCache::GetEntrySize();
   const unsigned memcache_num_units =
     mem_cache_size / static_cast<unsigned>(memcache_unit_size);
   // Number of cache entries must be a multiple of 64
   const unsigned mask_64 = ~((1 << 6) - 1);
+  // Lock striping, roughly one shard per concurrent fuse thread
+  const unsigned memcache_num_shards = GetNumberOfCpuCores();
   cvmfs::inode_cache_ = new lru::InodeCache(memcache_num_units & mask_64,
-      cvmfs::statistics_);
+      cvmfs::statistics_, memcache_num_shards);
   cvmfs::path_cache_ = new lru::PathCache(memcache_num_units & mask_64,
-      cvmfs::statistics_);
+      cvmfs::statistics_, memcache_num_shards);
   cvmfs::md5path_cache_ =
     new lru::Md5PathCache((memcache_num_units*7) & mask_64,
-        cvmfs::statistics_);
+        cvmfs::statistics_, memcache_num_shards);
+  cvmfs::negative_cache_ = new lru::NegativeCache(
+    memcache_num_units & mask_64, cvmfs::statistics_, memcache_num_shards);
   cvmfs::inode_tracker_ = new glue::InodeTracker();
+  if (listing_cache_size > 0) {
+    cvmfs::listing_cache_ =
+      new cvmfs::ListingCache(listing_cache_size, cvmfs::statistics_);
+  }
 
   cvmfs::directory_handles_ = new cvmfs::DirectoryHandles();
   cvmfs::directory_handles_->set_empty_key((uint64_t)(-1));
@@ -2401,6 +2636,8 @@ static int Init(const loader::LoaderExports *loader_exports) {
       "Number of stats");
   cvmfs::n_fs_read_ = cvmfs::statistics_->Register("cvmfs.n_fs_read",
       "Number of files read");
+  cvmfs::n_fs_read_fd_ = cvmfs::statistics_->Register("cvmfs.n_fs_read_fd",
+      "Number of reads handed to fuse as cache file descriptors");
   cvmfs::n_fs_readlink_ = cvmfs::statistics_->Register("cvmfs.n_fs_readlink",
       "Number of links read");
   cvmfs::n_fs_forget_ = cvmfs::statistics_->Register("cvmfs.n_fs_forget",
@@ -2487,13 +2724,15 @@ static int Init(const loader::LoaderExports *loader_exports) {
       return loader::kFailCacheDir;
     }
   }
-  cvmfs::cache_manager_ = cache::PosixCacheManager::Create(
+  cache::PosixCacheManager *posix_cache_mgr = cache::PosixCacheManager::Create(
     alien_cache, alien_cache != ".", server_cache_mode);
-  if (cvmfs::cache_manager_ == NULL) {
+  if (posix_cache_mgr == NULL) {
     *g_boot_error = "Failed to setup cache in " + alien_cache +
                     ": " + strerror(errno);
     return loader::kFailCacheDir;
   }
+  posix_cache_mgr->SetGroupCommit(group_commit);
+  cvmfs::cache_manager_ = posix_cache_mgr;
   CreateFile("./.cvmfscache", 0600);
 
   // Init quota / managed cache
@@ -2536,6 +2775,60 @@ static int Init(const loader::LoaderExports *loader_exports) {
   }
   g_quota_ready = true;
 
+  // Regular objects go to a node-wide cache directory that deduplicates them
+  // across repositories; the repository's cache keeps the rest.
+  if (cache_shared_tier != "") {
+    if (alien_cache != ".") {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslogWarn,
+               "CVMFS_CACHE_SHARED_TIER is ignored for alien caches");
+    } else {
+      cache::PosixCacheManager *shared_tier =
+        cache::PosixCacheManager::Create(cache_shared_tier, false);
+      if (shared_tier == NULL) {
+        *g_boot_error = "Failed to setup shared cache tier in " +
+                        cache_shared_tier + ": " + strerror(errno);
+        return loader::kFailCacheDir;
+      }
+      shared_tier->SetGroupCommit(group_commit);
+      if (cache_shared_tier_quota < 0)
+        cache_shared_tier_quota = quota_limit;
+      if (cache_shared_tier_quota > 0) {
+        PosixQuotaManager *shared_quota_mgr = PosixQuotaManager::CreateShared(
+          loader_exports->program_name, cache_shared_tier,
+          cache_shared_tier_quota, cache_shared_tier_quota/2);
+        if (shared_quota_mgr == NULL) {
+          delete shared_tier;
+          *g_boot_error = "Failed to initialize lru cache of the shared tier";
+          return loader::kFailQuota;
+        }
+        retval = shared_tier->AcquireQuotaManager(shared_quota_mgr);
+        assert(retval);
+      }
+      cvmfs::cache_manager_ = cache::TieredCacheManager::Create(
+        shared_tier, cvmfs::cache_manager_, cvmfs::statistics_);
+      LogCvmfs(kLogCvmfs, kLogDebug,
+               "CernVM-FS: shared cache tier in %s initialized",
+               cache_shared_tier.c_str());
+    }
+  }
+
+  // Keep small hot objects in memory on top of the cache directory.  Alien
+  // caches keep the plain posix cache manager, which is required to find the
+  // cached catalog checksum.
+  if (ram_cache_size > 0) {
+    if (alien_cache != ".") {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslogWarn,
+               "CVMFS_RAM_CACHE_SIZE is ignored for alien caches");
+    } else {
+      cvmfs::cache_manager_ = cache::RamCacheManager::Create(
+        cvmfs::cache_manager_, ram_cache_size, ram_cache_max_object,
+        cvmfs::statistics_);
+      LogCvmfs(kLogCvmfs, kLogDebug,
+               "CernVM-FS: memory cache tier of %"PRIu64"MB initialized",
+               ram_cache_size / (1024*1024));
+    }
+  }
+
   // Start NFS maps module, if necessary
 #ifdef CVMFS_NFS_SUPPORT
   if (nfs_source) {
@@ -2599,9 +2892,26 @@ static int Init(const loader::LoaderExports *loader_exports) {
   }
 
   // Network initialization
+  const bool ipv4_only = (getenv("CVMFS_IPV4_ONLY") != NULL) &&
+                         (strlen(getenv("CVMFS_IPV4_ONLY")) > 0);
+  dns::NormalResolver *resolver =
+    dns::NormalResolver::Create(ipv4_only, dns_retries, dns_timeout_ms);
+  assert(resolver);
+  if (!dns_server.empty()) {
+    vector<string> dns_servers;
+    dns_servers.push_back(dns_server);
+    if (!resolver->SetResolvers(dns_servers)) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslogWarn,
+               "failed to set nameserver %s", dns_server.c_str());
+    }
+  }
+  resolver->set_throttle(max_ipaddr_per_proxy);
+  cvmfs::host_cache_ = dns::HostCache::Create(resolver, cvmfs::statistics_);
+
   cvmfs::download_manager_ = new download::DownloadManager();
   cvmfs::download_manager_->Init(cvmfs::kDefaultNumConnections, false,
       cvmfs::statistics_);
+  cvmfs::download_manager_->SetHostCache(cvmfs::host_cache_);
   cvmfs::download_manager_->SetHostChain(hostname);
   if ((dns_timeout_ms != download::DownloadManager::kDnsDefaultTimeoutMs) ||
       (dns_retries != download::DownloadManager::kDnsDefaultRetries))
@@ -2614,6 +2924,25 @@ static int Init(const loader::LoaderExports *loader_exports) {
   if (follow_redirects) {
     cvmfs::download_manager_->EnableRedirects();
   }
+  if (use_http2) {
+    cvmfs::download_manager_->EnableHttp2(http2_max_streams);
+  }
+  if ((parallel_ranges > 1) && (parallel_range_size > 0)) {
+    cvmfs::download_manager_->SetParallelRanges(parallel_ranges,
+                                                parallel_range_size);
+  }
+  if (adaptive_proxies) {
+    cvmfs::download_manager_->EnableAdaptiveProxies();
+  }
+  if ((hedge_percentile > 0) && (hedge_percentile <= 100)) {
+    cvmfs::download_manager_->EnableHedging(hedge_percentile);
+  }
+  if (prewarm_connections) {
+    cvmfs::download_manager_->EnablePrewarming();
+  }
+  if (processing_threads > 0) {
+    cvmfs::download_manager_->SetProcessingThreads(processing_threads);
+  }
   cvmfs::download_manager_->SetTimeout(timeout, timeout_direct);
   cvmfs::download_manager_->SetLowSpeedLimit(low_speed_limit);
   cvmfs::download_manager_->SetProxyGroupResetDelay(proxy_reset_after);
@@ -2653,6 +2982,10 @@ static int Init(const loader::LoaderExports *loader_exports) {
   cvmfs::external_download_manager_ = new download::DownloadManager();
   cvmfs::external_download_manager_->Init(cvmfs::kDefaultNumConnections, false,
       cvmfs::statistics_, "download-external");
+  // Both managers talk to the same proxies
+  cvmfs::external_download_manager_->ShareCurlCaches(
+    cvmfs::download_manager_);
+  cvmfs::external_download_manager_->SetHostCache(cvmfs::host_cache_);
 
   cvmfs::external_download_manager_->SetHostChain(!external_host.empty() ?
                                                   external_host : hostname);
@@ -2668,6 +3001,10 @@ static int Init(const loader::LoaderExports *loader_exports) {
   if (follow_redirects) {
     cvmfs::external_download_manager_->EnableRedirects();
   }
+  if ((parallel_ranges > 1) && (parallel_range_size > 0)) {
+    cvmfs::external_download_manager_->SetParallelRanges(parallel_ranges,
+                                                         parallel_range_size);
+  }
   cvmfs::external_download_manager_->SetTimeout(external_timeout,
                                                 external_timeout_direct);
   cvmfs::external_download_manager_->SetLowSpeedLimit(low_speed_limit);
@@ -2772,6 +3109,17 @@ static int Init(const loader::LoaderExports *loader_exports) {
     "fetch-external",
     is_external_data);
 
+  if ((prefetch_window > 0) || (eager_chunks > 0)) {
+    cvmfs::chunk_prefetcher_ = new cvmfs::ChunkPrefetcher(
+      cvmfs::fetcher_,
+      cvmfs::external_fetcher_,
+      prefetch_window,
+      eager_chunks,
+      cvmfs::statistics_);
+    LogCvmfs(kLogCvmfs, kLogDebug, "prefetching %u chunks of sequentially "
+             "read files, %u chunks on open", prefetch_window, eager_chunks);
+  }
+
   // Load initial file catalog
   LogCvmfs(kLogCvmfs, kLogDebug, "fuse inode size is %d bits",
            sizeof(fuse_ino_t) * 8);
@@ -2943,7 +3291,11 @@ static void Spawn() {
 
   cvmfs::download_manager_->Spawn();
   cvmfs::external_download_manager_->Spawn();
+  cvmfs::host_cache_->Spawn();
+  if (cvmfs::chunk_prefetcher_)
+    cvmfs::chunk_prefetcher_->Spawn();
   cvmfs::cache_manager_->quota_mgr()->Spawn();
+  cvmfs::cache_manager_->Spawn();
   if (cvmfs::cache_manager_->quota_mgr()->IsEnforcing()) {
     cvmfs::watchdog_listener_ = quota::RegisterWatchdogListener(
       cvmfs::cache_manager_->quota_mgr(),
@@ -3002,6 +3354,12 @@ static void Fini() {
   delete cvmfs::catalog_manager_;
   cvmfs::catalog_manager_ = NULL;
 
+  // Uses the fetchers
+  if (cvmfs::chunk_prefetcher_) {
+    delete cvmfs::chunk_prefetcher_;
+    cvmfs::chunk_prefetcher_ = NULL;
+  }
+
   if (cvmfs::fetcher_) {
     delete cvmfs::fetcher_;
     cvmfs::fetcher_ = NULL;
@@ -3028,6 +3386,7 @@ static void Fini() {
   delete cvmfs::signature_manager_;
   delete cvmfs::download_manager_;
   delete cvmfs::external_download_manager_;
+  delete cvmfs::host_cache_;
   delete cvmfs::inode_annotation_;
   delete cvmfs::directory_handles_;
   delete cvmfs::chunk_tables_;
@@ -3035,6 +3394,8 @@ static void Fini() {
   delete cvmfs::path_cache_;
   delete cvmfs::inode_cache_;
   delete cvmfs::md5path_cache_;
+  delete cvmfs::negative_cache_;
+  delete cvmfs::listing_cache_;
   delete cvmfs::cachedir_;
   delete cvmfs::nfs_shared_dir_;
   delete cvmfs::tracefile_;
@@ -3046,6 +3407,7 @@ static void Fini() {
   cvmfs::signature_manager_ = NULL;
   cvmfs::download_manager_ = NULL;
   cvmfs::external_download_manager_ = NULL;
+  cvmfs::host_cache_ = NULL;
   cvmfs::inode_annotation_ = NULL;
   cvmfs::directory_handles_ = NULL;
   cvmfs::chunk_tables_ = NULL;
@@ -3053,6 +3415,8 @@ static void Fini() {
   cvmfs::path_cache_ = NULL;
   cvmfs::inode_cache_ = NULL;
   cvmfs::md5path_cache_ = NULL;
+  cvmfs::negative_cache_ = NULL;
+  cvmfs::listing_cache_ = NULL;
   cvmfs::cachedir_ = NULL;
   cvmfs::nfs_shared_dir_ = NULL;
   cvmfs::tracefile_ = NULL;
@@ -3155,7 +3519,7 @@ static bool SaveState(const int fd_progress, loader::StateList *saved_states) {
     glue::InodeTracker *saved_inode_tracker =
       new glue::InodeTracker(*cvmfs::inode_tracker_);
     loader::SavedState *state_glue_buffer = new loader::SavedState();
-    state_glue_buffer->state_id = loader::kStateGlueBufferV4;
+    state_glue_buffer->state_id = loader::kStateGlueBufferV5;
     state_glue_buffer->state = saved_inode_tracker;
     saved_states->push_back(state_glue_buffer);
   }
@@ -3168,6 +3532,16 @@ static bool SaveState(const int fd_progress, loader::StateList *saved_states) {
   state_chunk_tables->state = saved_chunk_tables;
   saved_states->push_back(state_chunk_tables);
 
+  cache::SavedFdTable *saved_cache_fds = cvmfs::cache_manager_->SaveFdTable();
+  if (saved_cache_fds != NULL) {
+    msg_progress = "Saving file descriptors of the cache manager\n";
+    SendMsg2Socket(fd_progress, msg_progress);
+    loader::SavedState *state_cache_fds = new loader::SavedState();
+    state_cache_fds->state_id = loader::kStateCacheFdTable;
+    state_cache_fds->state = saved_cache_fds;
+    saved_states->push_back(state_cache_fds);
+  }
+
   msg_progress = "Saving inode generation\n";
   SendMsg2Socket(fd_progress, msg_progress);
   cvmfs::inode_generation_info_.inode_generation +=
@@ -3194,6 +3568,7 @@ static bool SaveState(const int fd_progress, loader::StateList *saved_states) {
 static bool RestoreState(const int fd_progress,
                          const loader::StateList &saved_states)
 {
+  cache::SavedFdTable *saved_cache_fds = NULL;
   for (unsigned i = 0, l = saved_states.size(); i < l; ++i) {
     if (saved_states[i]->state_id == loader::kStateOpenDirs) {
       SendMsg2Socket(fd_progress, "Restoring open directory handles... ");
@@ -3214,7 +3589,7 @@ static bool RestoreState(const int fd_progress,
     }
 
     if (saved_states[i]->state_id == loader::kStateGlueBuffer) {
-      SendMsg2Socket(fd_progress, "Migrating inode tracker (v1 to v4)... ");
+      SendMsg2Socket(fd_progress, "Migrating inode tracker (v1 to v5)... ");
       compat::inode_tracker::InodeTracker *saved_inode_tracker =
         (compat::inode_tracker::InodeTracker *)saved_states[i]->state;
       compat::inode_tracker::Migrate(
@@ -3223,7 +3598,7 @@ static bool RestoreState(const int fd_progress,
     }
 
     if (saved_states[i]->state_id == loader::kStateGlueBufferV2) {
-      SendMsg2Socket(fd_progress, "Migrating inode tracker (v2 to v4)... ");
+      SendMsg2Socket(fd_progress, "Migrating inode tracker (v2 to v5)... ");
       compat::inode_tracker_v2::InodeTracker *saved_inode_tracker =
         (compat::inode_tracker_v2::InodeTracker *)saved_states[i]->state;
       compat::inode_tracker_v2::Migrate(saved_inode_tracker,
@@ -3232,7 +3607,7 @@ static bool RestoreState(const int fd_progress,
     }
 
     if (saved_states[i]->state_id == loader::kStateGlueBufferV3) {
-      SendMsg2Socket(fd_progress, "Migrating inode tracker (v3 to v4)... ");
+      SendMsg2Socket(fd_progress, "Migrating inode tracker (v3 to v5)... ");
       compat::inode_tracker_v3::InodeTracker *saved_inode_tracker =
         (compat::inode_tracker_v3::InodeTracker *)saved_states[i]->state;
       compat::inode_tracker_v3::Migrate(saved_inode_tracker,
@@ -3241,6 +3616,15 @@ static bool RestoreState(const int fd_progress,
     }
 
     if (saved_states[i]->state_id == loader::kStateGlueBufferV4) {
+      SendMsg2Socket(fd_progress, "Migrating inode tracker (v4 to v5)... ");
+      compat::inode_tracker_v4::InodeTracker *saved_inode_tracker =
+        (compat::inode_tracker_v4::InodeTracker *)saved_states[i]->state;
+      compat::inode_tracker_v4::Migrate(saved_inode_tracker,
+                                        cvmfs::inode_tracker_);
+      SendMsg2Socket(fd_progress, " done\n");
+    }
+
+    if (saved_states[i]->state_id == loader::kStateGlueBufferV5) {
       SendMsg2Socket(fd_progress, "Restoring inode tracker... ");
       delete cvmfs::inode_tracker_;
       glue::InodeTracker *saved_inode_tracker =
@@ -3301,7 +3685,28 @@ static bool RestoreState(const int fd_progress,
         saved_states[i]->state)));
       SendMsg2Socket(fd_progress, " done\n");
     }
+
+    if (saved_states[i]->state_id == loader::kStateCacheFdTable) {
+      saved_cache_fds =
+        reinterpret_cast<cache::SavedFdTable *>(saved_states[i]->state);
+    }
+  }
+
+  // Open files refer to file descriptors of the cache manager.  If the cache
+  // manager keeps its own table, it has to be the same kind of table as before
+  // the reload, otherwise the file descriptors of open files would point to
+  // arbitrary objects.
+  SendMsg2Socket(fd_progress, "Restoring file descriptors of the cache "
+                              "manager... ");
+  if (!cvmfs::cache_manager_->RestoreFdTable(saved_cache_fds) &&
+      (cvmfs::no_open_files_->Get() > 0))
+  {
+    SendMsg2Socket(fd_progress, "failed, the cache configuration changed "
+                                "while files are open\n");
+    return false;
   }
+  SendMsg2Socket(fd_progress, " done\n");
+
   if (cvmfs::inode_annotation_) {
     uint64_t saved_generation = cvmfs::inode_generation_info_.inode_generation;
     cvmfs::inode_annotation_->IncGeneration(saved_generation);
@@ -3339,6 +3744,12 @@ static void FreeSavedState(const int fd_progress,
           saved_states[i]->state);
         break;
       case loader::kStateGlueBufferV4:
+        SendMsg2Socket(
+          fd_progress, "Releasing saved glue buffer (version 4)\n");
+        delete static_cast<compat::inode_tracker_v4::InodeTracker *>(
+          saved_states[i]->state);
+        break;
+      case loader::kStateGlueBufferV5:
         SendMsg2Socket(fd_progress, "Releasing saved glue buffer\n");
         delete static_cast<glue::InodeTracker *>(saved_states[i]->state);
         break;
@@ -3365,6 +3776,11 @@ static void FreeSavedState(const int fd_progress,
         SendMsg2Socket(fd_progress, "Releasing open files counter\n");
         delete static_cast<uint32_t *>(saved_states[i]->state);
         break;
+      case loader::kStateCacheFdTable:
+        SendMsg2Socket(fd_progress,
+                       "Releasing file descriptors of the cache manager\n");
+        delete static_cast<cache::SavedFdTable *>(saved_states[i]->state);
+        break;
       default:
         break;
     }
@@ -36,7 +36,9 @@
 #include "logging.h"
 #include "sanitizer.h"
 #include "smalloc.h"
+#include "statistics.h"
 #include "util.h"
+#include "util_concurrency.h"
 
 using namespace std;  // NOLINT
 
@@ -1293,4 +1295,242 @@ NormalResolver::~NormalResolver() {
   delete hostfile_resolver_;
 }
 
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Takes ownership of the resolver.
+ */
+HostCache *HostCache::Create(Resolver *resolver, perf::Statistics *statistics) {
+  assert(resolver != NULL);
+  return new HostCache(resolver, statistics);
+}
+
+
+HostCache::HostCache(Resolver *resolver, perf::Statistics *statistics)
+  : resolver_(resolver)
+  , spawned_(false)
+{
+  int retval = pthread_mutex_init(&lock_, NULL);
+  assert(retval == 0);
+  retval = pthread_mutex_init(&lock_resolver_, NULL);
+  assert(retval == 0);
+  pipe_terminate_[0] = pipe_terminate_[1] = -1;
+
+  n_hit_ = statistics->Register("dns.n_hit",
+    "Number of host names served fresh from the DNS cache");
+  n_miss_ = statistics->Register("dns.n_miss",
+    "Number of host names not found in the DNS cache");
+  n_refresh_ = statistics->Register("dns.n_refresh",
+    "Number of background DNS cache refreshes");
+  n_stale_ = statistics->Register("dns.n_stale",
+    "Number of expired DNS cache entries served while refreshing");
+}
+
+
+HostCache::~HostCache() {
+  if (spawned_) {
+    char buf = 'T';
+    WritePipe(pipe_terminate_[1], &buf, 1);
+    pthread_join(thread_refresh_, NULL);
+    ClosePipe(pipe_terminate_);
+  }
+  delete resolver_;
+  pthread_mutex_destroy(&lock_resolver_);
+  pthread_mutex_destroy(&lock_);
+}
+
+
+/**
+ * Returns the cached host without ever resolving in the calling thread.
+ * Unknown names are scheduled for resolution and returned as not yet
+ * resolved.
+ */
+Host HostCache::Lookup(const string &name) {
+  MutexLockGuard guard(&lock_);
+  map<string, Entry>::iterator iter = entries_.find(name);
+  if (iter == entries_.end()) {
+    perf::Inc(n_miss_);
+    entries_[name] = Entry();
+    return Host();
+  }
+
+  Entry *entry = &iter->second;
+  entry->used = true;
+  if (!entry->host.IsExpired()) {
+    perf::Inc(n_hit_);
+    return entry->host;
+  }
+  if (entry->host.status() != kFailOk)
+    return entry->host;
+  perf::Inc(n_stale_);
+  LogCvmfs(kLogDns, kLogDebug, "serving expired DNS entry for %s",
+           name.c_str());
+  return Host::ExtendDeadline(entry->host, kStaleTtl);
+}
+
+
+/**
+ * Background resolution of the names that are due.  Called periodically by
+ * the refresh thread.
+ */
+void HostCache::Refresh() {
+  const time_t now = time(NULL);
+  vector<string> names;
+  {
+    MutexLockGuard guard(&lock_);
+    for (map<string, Entry>::const_iterator i = entries_.begin(),
+         iEnd = entries_.end(); i != iEnd; ++i)
+    {
+      if (i->second.used && (i->second.refresh_at <= now))
+        names.push_back(i->first);
+    }
+  }
+  if (names.empty())
+    return;
+
+  vector<Host> hosts;
+  pthread_mutex_lock(&lock_resolver_);
+  resolver_->ResolveMany(names, &hosts);
+  pthread_mutex_unlock(&lock_resolver_);
+
+  MutexLockGuard guard(&lock_);
+  for (unsigned i = 0; i < names.size(); ++i) {
+    perf::Inc(n_refresh_);
+    if (hosts[i].status() == kFailOk) {
+      StoreUnlocked(names[i], hosts[i]);
+      continue;
+    }
+    LogCvmfs(kLogDns, kLogDebug | kLogSyslogWarn,
+             "failed to refresh IP addresses for %s (%d - %s)",
+             names[i].c_str(), hosts[i].status(),
+             Code2Ascii(hosts[i].status()));
+    map<string, Entry>::iterator iter = entries_.find(names[i]);
+    if (iter == entries_.end())
+      continue;
+    // Keep serving the previous addresses
+    if (iter->second.host.status() != kFailOk)
+      iter->second.host = hosts[i];
+    iter->second.refresh_at = time(NULL) + kRetryDelay;
+  }
+}
+
+
+/**
+ * Like Lookup() but names without valid addresses are resolved in the calling
+ * thread.  If resolving fails, expired addresses are preferred over the error.
+ */
+Host HostCache::Resolve(const string &name) {
+  vector<string> names;
+  names.push_back(name);
+  vector<Host> hosts;
+  ResolveMany(names, &hosts);
+  return hosts[0];
+}
+
+
+void HostCache::ResolveMany(const vector<string> &names, vector<Host> *hosts) {
+  hosts->clear();
+  hosts->resize(names.size());
+  vector<string> unresolved_names;
+  vector<unsigned> unresolved_idx;
+  {
+    MutexLockGuard guard(&lock_);
+    for (unsigned i = 0; i < names.size(); ++i) {
+      map<string, Entry>::iterator iter = entries_.find(names[i]);
+      if ((iter != entries_.end()) && !iter->second.host.IsExpired()) {
+        perf::Inc(n_hit_);
+        iter->second.used = true;
+        (*hosts)[i] = iter->second.host;
+      } else {
+        if (!names[i].empty())
+          perf::Inc(n_miss_);
+        unresolved_names.push_back(names[i]);
+        unresolved_idx.push_back(i);
+      }
+    }
+  }
+  if (unresolved_names.empty())
+    return;
+
+  vector<Host> resolved;
+  pthread_mutex_lock(&lock_resolver_);
+  resolver_->ResolveMany(unresolved_names, &resolved);
+  pthread_mutex_unlock(&lock_resolver_);
+
+  MutexLockGuard guard(&lock_);
+  for (unsigned i = 0; i < unresolved_names.size(); ++i) {
+    const string &name = unresolved_names[i];
+    if (resolved[i].status() == kFailOk) {
+      StoreUnlocked(name, resolved[i]);
+      // Subsequent lookups use the fully qualified name
+      if (resolved[i].name() != name)
+        StoreUnlocked(resolved[i].name(), resolved[i]);
+      (*hosts)[unresolved_idx[i]] = resolved[i];
+      continue;
+    }
+    map<string, Entry>::iterator iter = entries_.find(name);
+    if ((iter != entries_.end()) && (iter->second.host.status() == kFailOk)) {
+      perf::Inc(n_stale_);
+      (*hosts)[unresolved_idx[i]] =
+        Host::ExtendDeadline(iter->second.host, kStaleTtl);
+    } else {
+      (*hosts)[unresolved_idx[i]] = resolved[i];
+    }
+  }
+}
+
+
+unsigned HostCache::size() {
+  MutexLockGuard guard(&lock_);
+  return entries_.size();
+}
+
+
+void HostCache::StoreUnlocked(const string &name, const Host &host) {
+  const time_t now = time(NULL);
+  Entry *entry = &entries_[name];
+  entry->host = host;
+  entry->used = false;
+  entry->refresh_at = host.deadline();
+  if (host.deadline() > now) {
+    entry->refresh_at -=
+      (host.deadline() - now) * kRefreshAheadPercent / 100;
+  }
+}
+
+
+void *HostCache::MainRefresh(void *data) {
+  HostCache *host_cache = reinterpret_cast<HostCache *>(data);
+  LogCvmfs(kLogDns, kLogDebug, "starting DNS refresh thread");
+
+  struct pollfd watch_term;
+  watch_term.fd = host_cache->pipe_terminate_[0];
+  watch_term.events = POLLIN | POLLPRI;
+  while (true) {
+    watch_term.revents = 0;
+    int retval = poll(&watch_term, 1, kRefreshIntervalMs);
+    if ((retval < 0) && (errno == EINTR))
+      continue;
+    assert(retval >= 0);
+    if (watch_term.revents)
+      break;
+    host_cache->Refresh();
+  }
+
+  LogCvmfs(kLogDns, kLogDebug, "stopping DNS refresh thread");
+  return NULL;
+}
+
+
+void HostCache::Spawn() {
+  assert(!spawned_);
+  MakePipe(pipe_terminate_);
+  int retval = pthread_create(&thread_refresh_, NULL, MainRefresh, this);
+  assert(retval == 0);
+  spawned_ = true;
+}
+
 }  // namespace dns
@@ -5,6 +5,7 @@
 #ifndef CVMFS_DNS_H_
 #define CVMFS_DNS_H_
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include <cstdio>
@@ -20,6 +21,11 @@
 #include "prng.h"
 #include "util.h"
 
+namespace perf {
+class Counter;
+class Statistics;
+}
+
 namespace dns {
 
 /**
@@ -92,6 +98,7 @@ class Host {
   FRIEND_TEST(T_Dns, HostValid);
   FRIEND_TEST(T_Dns, HostExtendDeadline);
   FRIEND_TEST(T_Dns, HostBestAddresses);
+  FRIEND_TEST(T_Dns, HostCacheRefresh);
   friend class Resolver;
 
  public:
@@ -388,6 +395,87 @@ class NormalResolver : public Resolver {
   HostfileResolver *hostfile_resolver_;
 };
 
+
+/**
+ * Process-wide cache of resolved host names on top of a resolver, shared by
+ * all the download managers of a process.  Entries are refreshed by a
+ * background thread shortly before they expire.  Lookup() never blocks on the
+ * resolver: if an entry has expired because the refresh is late or failed,
+ * the last known addresses are served with a short grace period
+ * (stale-while-revalidate).  ResolveMany() resolves unknown names in the
+ * calling thread and is meant for the configuration path.
+ *
+ * Only names that have been looked up since their last resolution are
+ * refreshed, so that unused names do not generate DNS traffic.
+ */
+class HostCache : SingleCopy {
+  FRIEND_TEST(T_Dns, HostCacheRefresh);
+
+ public:
+  /**
+   * Entries are refreshed once 90% of their time to live has passed.
+   */
+  static const unsigned kRefreshAheadPercent = 10;
+  /**
+   * Expired entries are served with this deadline while they are refreshed.
+   */
+  static const unsigned kStaleTtl = 10;
+  /**
+   * Delay between two refresh attempts of a name that failed to resolve.
+   */
+  static const unsigned kRetryDelay = 10;
+  static const unsigned kRefreshIntervalMs = 1000;
+
+  static HostCache *Create(Resolver *resolver, perf::Statistics *statistics);
+  ~HostCache();
+  void Spawn();
+
+  Host Lookup(const std::string &name);
+  Host Resolve(const std::string &name);
+  void ResolveMany(const std::vector<std::string> &names,
+                   std::vector<Host> *hosts);
+  void Refresh();
+
+  unsigned size();
+
+ private:
+  struct Entry {
+    Entry() : refresh_at(0), used(true) { }
+    Host host;
+    /**
+     * The next background resolution is due at this point in time.
+     */
+    time_t refresh_at;
+    /**
+     * Looked up since the last resolution.
+     */
+    bool used;
+  };
+
+  HostCache(Resolver *resolver, perf::Statistics *statistics);
+  static void *MainRefresh(void *data);
+  void StoreUnlocked(const std::string &name, const Host &host);
+
+  /**
+   * Protects entries_.  Never held during name resolution.
+   */
+  pthread_mutex_t lock_;
+  /**
+   * Serializes the access to the resolver.
+   */
+  pthread_mutex_t lock_resolver_;
+  std::map<std::string, Entry> entries_;
+  Resolver *resolver_;
+  bool spawned_;
+  pthread_t thread_refresh_;
+  int pipe_terminate_[2];
+
+  perf::Counter *n_hit_;
+  perf::Counter *n_miss_;
+  perf::Counter *n_refresh_;
+  perf::Counter *n_stale_;
+};
+
 }  // namespace dns
 
 #endif  // CVMFS_DNS_H_
@@ -11,7 +11,8 @@
  * blocks but there is a separate I/O thread using asynchronous I/O, which
  * maintains all concurrent connections simultaneously.  As there might be more
  * than 1024 file descriptors for the CernVM-FS process, the I/O thread uses
- * poll and the libcurl multi socket interface.
+ * epoll (poll on OS X) and the libcurl multi socket interface.  Jobs are
+ * submitted through a lock-free stack and an eventfd wakeup.
  *
  * While downloading, files can be decompressed and the secure hash can be
  * calculated on the fly.
@@ -33,9 +34,12 @@
 #include <alloca.h>
 #include <errno.h>
 #include <inttypes.h>
-#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
+#ifndef __APPLE__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -44,6 +48,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <set>
 
 #include "atomic.h"
@@ -163,11 +168,41 @@ static Failures PrepareDownloadDestination(JobInfo *info) {
 }
 
 
+/**
+ * Discards the data received so far, e.g. before the download is retried.
+ */
+static bool ResetDownloadDestination(JobInfo *info) {
+  if ((info->destination == kDestinationMem) && info->destination_mem.data) {
+    free(info->destination_mem.data);
+    info->destination_mem.data = NULL;
+    info->destination_mem.size = 0;
+    info->destination_mem.pos = 0;
+  }
+  if ((info->destination == kDestinationFile) ||
+      (info->destination == kDestinationPath))
+  {
+    if ((fflush(info->destination_file) != 0) ||
+        (ftruncate(fileno(info->destination_file), 0) != 0))
+    {
+      return false;
+    }
+    rewind(info->destination_file);
+  }
+  if (info->destination == kDestinationSink) {
+    if (info->destination_sink->Reset() != 0)
+      return false;
+  }
+  return true;
+}
+
+
 /**
  * Called by curl for every HTTP header. Not called for file:// transfers.
  */
-static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
-                                 void *info_link)
+size_t DownloadManager::CallbackCurlHeader(void *ptr,
+                                           size_t size,
+                                           size_t nmemb,
+                                           void *info_link)
 {
   const size_t num_bytes = size*nmemb;
   const string header_line(static_cast<const char *>(ptr), num_bytes);
@@ -177,12 +212,17 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
   //          header_line.c_str());
 
   // Check http status codes
-  if (HasPrefix(header_line, "HTTP/1.", false)) {
+  if (HasPrefix(header_line, "HTTP/1.", false) ||
+      HasPrefix(header_line, "HTTP/2", false))
+  {
     if (header_line.length() < 10)
       return 0;
 
-    unsigned i;
-    for (i = 8; (i < header_line.length()) && (header_line[i] == ' '); ++i) {}
+    // Skip the protocol version, "HTTP/1.1" or "HTTP/2"
+    unsigned i = header_line.find(' ');
+    for (; (i < header_line.length()) && (header_line[i] == ' '); ++i) {}
+    if (i >= header_line.length())
+      return 0;
 
     // TODO(jblomer): consolidate the code
     if (header_line.length() > i+2) {
@@ -248,6 +288,16 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
       info->destination_mem.data = NULL;
     }
     info->destination_mem.size = length;
+  } else if (HasPrefix(header_line, "CONTENT-RANGE:", true)) {
+    // Content-Range: bytes 0-1023/4096, the size can be "*" (unknown)
+    const size_t pos_size = header_line.find('/');
+    int64_t object_size;
+    if ((pos_size != string::npos) &&
+        (sscanf(header_line.c_str() + pos_size + 1, "%"PRId64,
+                &object_size) == 1))
+    {
+      info->object_size = object_size;
+    }
   } else if (HasPrefix(header_line, "LOCATION:", true)) {
     // This comes along with redirects
     LogCvmfs(kLogDownload, kLogDebug, "%s", header_line.c_str());
@@ -258,19 +308,11 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
 
 
 /**
- * Called by curl for every received data chunk.
+ * Hashes, decompresses, and writes a chunk of received data to the
+ * destination.  Called by the I/O thread or, one chunk at a time per job, by
+ * a processing thread.
  */
-static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
-                               void *info_link)
-{
-  const size_t num_bytes = size*nmemb;
-  JobInfo *info = static_cast<JobInfo *>(info_link);
-
-  // LogCvmfs(kLogDownload, kLogDebug, "Data callback,  %d bytes", num_bytes);
-
-  if (num_bytes == 0)
-    return 0;
-
+static Failures WriteData(JobInfo *info, void *ptr, const size_t num_bytes) {
   if (info->expected_hash)
     shash::Update((unsigned char *)ptr, num_bytes, info->hash_context);
 
@@ -282,21 +324,18 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
       if (retval == zlib::kStreamDataError) {
         LogCvmfs(kLogDownload, kLogDebug, "failed to decompress %s",
                  info->url->c_str());
-        info->error_code = kFailBadData;
-        return 0;
+        return kFailBadData;
       } else if (retval == zlib::kStreamIOError) {
         LogCvmfs(kLogDownload, kLogSyslogErr,
                  "decompressing %s, local IO error", info->url->c_str());
-        info->error_code = kFailLocalIO;
-        return 0;
+        return kFailLocalIO;
       }
     } else {
       int64_t written = info->destination_sink->Write(ptr, num_bytes);
       if ((written < 0) || (static_cast<uint64_t>(written) != num_bytes)) {
         LogCvmfs(kLogDownload, kLogDebug, "Failed to perform write on path"
                  " %s.", info->destination_path->c_str());
-        info->error_code = kFailLocalIO;
-        return 0;
+        return kFailLocalIO;
       }
     }
   } else if (info->destination == kDestinationMem) {
@@ -313,8 +352,7 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
                  num_bytes,
                  info->destination_mem.size);
       }
-      info->error_code = kFailBadData;
-      return 0;
+      return kFailBadData;
     }
     memcpy(info->destination_mem.data + info->destination_mem.pos,
            ptr, num_bytes);
@@ -330,25 +368,58 @@ static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
       if (retval == zlib::kStreamDataError) {
         LogCvmfs(kLogDownload, kLogDebug, "failed to decompress %s",
                  info->url->c_str());
-        info->error_code = kFailBadData;
-        return 0;
+        return kFailBadData;
       } else if (retval == zlib::kStreamIOError) {
         LogCvmfs(kLogDownload, kLogSyslogErr,
                  "decompressing %s, local IO error", info->url->c_str());
-        info->error_code = kFailLocalIO;
-        return 0;
+        return kFailLocalIO;
       }
     } else {
       if (fwrite(ptr, 1, num_bytes, info->destination_file) != num_bytes) {
        LogCvmfs(kLogDownload, kLogDebug,
                  "downloading %s, IO failure: %s (errno=%d)",
                  info->url->c_str(), strerror(errno), errno);
-        info->error_code = kFailLocalIO;
-        return 0;
+        return kFailLocalIO;
       }
     }
   }
 
+  return kFailOk;
+}
+
+
+/**
+ * Called by curl for every received data chunk.
+ */
+static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
+                               void *info_link)
+{
+  const size_t num_bytes = size*nmemb;
+  JobInfo *info = static_cast<JobInfo *>(info_link);
+
+  // LogCvmfs(kLogDownload, kLogDebug, "Data callback,  %d bytes", num_bytes);
+
+  if (num_bytes == 0)
+    return 0;
+
+  if (info->hedge != NULL) {
+    // First data of a hedged request, the I/O thread cancels the other half
+    info->hedge->hedge_lost = true;
+    info->hedge->hedge = NULL;
+    info->hedge = NULL;
+  } else if (info->hedge_lost) {
+    return 0;
+  }
+  info->timestamp_ms = 0;
+
+  if (info->processing_mgr != NULL)
+    return info->processing_mgr->QueueData(info, ptr, num_bytes);
+
+  const Failures result = WriteData(info, ptr, num_bytes);
+  if (result != kFailOk) {
+    info->error_code = result;
+    return 0;
+  }
   return num_bytes;
 }
 
@@ -361,6 +432,30 @@ const int DownloadManager::kProbeDown     = -2;
 const int DownloadManager::kProbeGeo      = -3;
 const unsigned DownloadManager::kMaxMemSize = 1024*1024;
 
+/**
+ * Weight of a new sample in the moving averages of the proxy statistics
+ */
+static const double kProxyStatsWeight = 0.125;
+/**
+ * Throughput is only sampled from transfers of at least this size
+ */
+static const double kProxyStatsMinTransfer = 64 * 1024;
+/**
+ * The proxy cost is the expected time to fetch an object of that size
+ */
+static const double kProxyStatsObjectSize = 256 * 1024;
+/**
+ * The hedge delay is recalculated after that many new latency samples
+ */
+static const unsigned kHedgeUpdateInterval = 16;
+
+
+static uint64_t NowMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
 
 /**
  * -1 of digits is not a valid Http return code
@@ -393,163 +488,325 @@ int DownloadManager::CallbackCurlSocket(CURL *easy,
   if (action == CURL_POLL_NONE)
     return 0;
 
-  // Find s in watch_fds_
+  if (action == CURL_POLL_REMOVE) {
+    download_mgr->UnwatchFd(s);
+    return 0;
+  }
+
+  // curl keeps the socket pointer until the socket is removed, so it marks
+  // the sockets that are already watched
+  const bool is_new = (socketp == NULL);
+  if (is_new)
+    curl_multi_assign(download_mgr->curl_multi_, s, download_mgr);
+  download_mgr->WatchFd(s, action, is_new);
+  return 0;
+}
+
+
+/**
+ * Called by curl when the timeout for the next call to
+ * curl_multi_socket_action(CURL_SOCKET_TIMEOUT) changes.  A negative value
+ * removes the timer.
+ */
+int DownloadManager::CallbackCurlTimer(
+  CURLM *multi,
+  long timeout_ms,  // NOLINT
+  void *userp)
+{
+  DownloadManager *download_mgr = static_cast<DownloadManager *>(userp);
+  download_mgr->curl_timeout_ms_ = (timeout_ms < 0) ? -1 : timeout_ms;
+  return 0;
+}
+
+
+/**
+ * Starts watching fd or changes the events (CURL_POLL_IN, CURL_POLL_OUT, or
+ * both) it is watched for.
+ */
+void DownloadManager::WatchFd(
+  const int fd,
+  const int curl_action,
+  const bool is_new)
+{
+#ifdef __APPLE__
+  // Find fd in watch_fds_
   unsigned index;
-  for (index = 0; index < download_mgr->watch_fds_inuse_; ++index) {
-    if (download_mgr->watch_fds_[index].fd == s)
+  for (index = 0; index < watch_fds_inuse_; ++index) {
+    if (watch_fds_[index].fd == fd)
       break;
   }
   // Or create newly
-  if (index == download_mgr->watch_fds_inuse_) {
+  if (index == watch_fds_inuse_) {
     // Extend array if necessary
-    if (download_mgr->watch_fds_inuse_ == download_mgr->watch_fds_size_)
-    {
-      download_mgr->watch_fds_size_ *= 2;
-      download_mgr->watch_fds_ = static_cast<struct pollfd *>(
-        srealloc(download_mgr->watch_fds_,
-                 download_mgr->watch_fds_size_*sizeof(struct pollfd)));
+    if (watch_fds_inuse_ == watch_fds_size_) {
+      watch_fds_size_ *= 2;
+      watch_fds_ = static_cast<struct pollfd *>(
+        srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
     }
-    download_mgr->watch_fds_[download_mgr->watch_fds_inuse_].fd = s;
-    download_mgr->watch_fds_[download_mgr->watch_fds_inuse_].events = 0;
-    download_mgr->watch_fds_[download_mgr->watch_fds_inuse_].revents = 0;
-    download_mgr->watch_fds_inuse_++;
+    watch_fds_[watch_fds_inuse_].fd = fd;
+    watch_fds_[watch_fds_inuse_].revents = 0;
+    watch_fds_inuse_++;
   }
 
-  switch (action) {
-    case CURL_POLL_IN:
-      download_mgr->watch_fds_[index].events |= POLLIN | POLLPRI;
-      break;
-    case CURL_POLL_OUT:
-      download_mgr->watch_fds_[index].events |= POLLOUT | POLLWRBAND;
-      break;
-    case CURL_POLL_INOUT:
-      download_mgr->watch_fds_[index].events |=
-        POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
-      break;
-    case CURL_POLL_REMOVE:
-      if (index < download_mgr->watch_fds_inuse_-1)
-        download_mgr->watch_fds_[index] =
-          download_mgr->watch_fds_[download_mgr->watch_fds_inuse_-1];
-      download_mgr->watch_fds_inuse_--;
-      // Shrink array if necessary
-      if ((download_mgr->watch_fds_inuse_ > download_mgr->watch_fds_max_) &&
-          (download_mgr->watch_fds_inuse_ < download_mgr->watch_fds_size_/2))
-      {
-        download_mgr->watch_fds_size_ /= 2;
-        // LogCvmfs(kLogDownload, kLogDebug, "shrinking watch_fds_ (%d)",
-        //          watch_fds_size_);
-        download_mgr->watch_fds_ = static_cast<struct pollfd *>(
-          srealloc(download_mgr->watch_fds_,
-                   download_mgr->watch_fds_size_*sizeof(struct pollfd)));
-        // LogCvmfs(kLogDownload, kLogDebug, "shrinking watch_fds_ done",
-        //          watch_fds_size_);
-      }
-      break;
-    default:
+  watch_fds_[index].events = 0;
+  if (curl_action & CURL_POLL_IN)
+    watch_fds_[index].events |= POLLIN | POLLPRI;
+  if (curl_action & CURL_POLL_OUT)
+    watch_fds_[index].events |= POLLOUT | POLLWRBAND;
+#else
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  if (curl_action & CURL_POLL_IN)
+    event.events |= EPOLLIN | EPOLLPRI;
+  if (curl_action & CURL_POLL_OUT)
+    event.events |= EPOLLOUT;
+  event.data.fd = fd;
+  int retval = epoll_ctl(epoll_fd_, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                         fd, &event);
+  perf::Inc(counters_->n_loop_syscalls);
+  if (retval != 0) {
+    LogCvmfs(kLogDownload, kLogDebug | kLogSyslogErr,
+             "failed to watch file descriptor %d (%d)", fd, errno);
+  }
+#endif
+}
+
+
+void DownloadManager::UnwatchFd(const int fd) {
+#ifdef __APPLE__
+  unsigned index;
+  for (index = 0; index < watch_fds_inuse_; ++index) {
+    if (watch_fds_[index].fd == fd)
       break;
   }
+  if (index == watch_fds_inuse_)
+    return;
 
-  return 0;
+  if (index < watch_fds_inuse_-1)
+    watch_fds_[index] = watch_fds_[watch_fds_inuse_-1];
+  watch_fds_inuse_--;
+  // Shrink array if necessary
+  if ((watch_fds_inuse_ > watch_fds_max_) &&
+      (watch_fds_inuse_ < watch_fds_size_/2))
+  {
+    watch_fds_size_ /= 2;
+    watch_fds_ = static_cast<struct pollfd *>(
+      srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
+  }
+#else
+  if (epoll_fd_ < 0)
+    return;
+  // Kernels before 2.6.9 require a non-NULL event
+  struct epoll_event event;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, &event);
+  perf::Inc(counters_->n_loop_syscalls);
+#endif
+}
+
+
+/**
+ * Waits at most timeout_ms (-1: no timeout) for activity on the watched file
+ * descriptors.  The ready file descriptors are returned in events, which is
+ * empty on timeout.
+ */
+void DownloadManager::WaitForEvents(
+  const int timeout_ms,
+  vector<SocketEvent> *events)
+{
+  events->clear();
+#ifdef __APPLE__
+  int retval = poll(watch_fds_, watch_fds_inuse_, timeout_ms);
+  perf::Inc(counters_->n_loop_syscalls);
+  if (retval <= 0)
+    return;
+  for (unsigned i = 0; i < watch_fds_inuse_; ++i) {
+    const short revents = watch_fds_[i].revents;  // NOLINT
+    if (revents == 0)
+      continue;
+    int curl_events = 0;
+    if (revents & (POLLIN | POLLPRI))
+      curl_events |= CURL_CSELECT_IN;
+    if (revents & (POLLOUT | POLLWRBAND))
+      curl_events |= CURL_CSELECT_OUT;
+    if (revents & (POLLERR | POLLHUP | POLLNVAL))
+      curl_events |= CURL_CSELECT_ERR;
+    watch_fds_[i].revents = 0;
+    events->push_back(SocketEvent(watch_fds_[i].fd, curl_events));
+  }
+#else
+  const int kMaxEvents = 64;
+  struct epoll_event ready[kMaxEvents];
+  int retval = epoll_wait(epoll_fd_, ready, kMaxEvents, timeout_ms);
+  perf::Inc(counters_->n_loop_syscalls);
+  for (int i = 0; i < retval; ++i) {
+    int curl_events = 0;
+    if (ready[i].events & (EPOLLIN | EPOLLPRI))
+      curl_events |= CURL_CSELECT_IN;
+    if (ready[i].events & EPOLLOUT)
+      curl_events |= CURL_CSELECT_OUT;
+    if (ready[i].events & (EPOLLERR | EPOLLHUP))
+      curl_events |= CURL_CSELECT_ERR;
+    events->push_back(SocketEvent(ready[i].data.fd, curl_events));
+  }
+#endif
+}
+
+
+/**
+ * Called by FetchAsync() from any thread.  Only the job that finds the stack
+ * empty wakes up the I/O thread, further jobs are picked up in the same batch.
+ */
+void DownloadManager::PushJob(JobInfo *info) {
+  perf::Inc(counters_->sz_job_queue);
+  JobInfo *head;
+  do {
+    head = job_stack_;
+    info->next_job = head;
+  } while (!atomic_casptr(&job_stack_, head, info));
+
+  if (head == NULL) {
+    const uint64_t wakeup = 1;
+    WritePipe(wakeup_jobs_[1], &wakeup, sizeof(wakeup));
+    perf::Inc(counters_->n_loop_syscalls);
+  }
 }
 
 
 /**
- * Worker thread event loop.  Waits on new JobInfo structs on a pipe.
+ * Takes all submitted jobs from the stack and returns them as a list in the
+ * order of submission.  Called by the I/O thread.
+ */
+JobInfo *DownloadManager::PopJobs() {
+  // Reset the wakeup before taking the jobs.  A job pushed afterwards finds the
+  // stack empty and wakes up the I/O thread again.
+  uint64_t wakeup;
+#ifdef __APPLE__
+  while (read(wakeup_jobs_[0], &wakeup, sizeof(wakeup)) > 0) {
+    perf::Inc(counters_->n_loop_syscalls);
+  }
+#else
+  // Never blocks, the eventfd is non-blocking
+  int retval = read(wakeup_jobs_[0], &wakeup, sizeof(wakeup));
+  assert((retval == sizeof(wakeup)) || (errno == EAGAIN));
+#endif
+  perf::Inc(counters_->n_loop_syscalls);
+
+  JobInfo *head;
+  do {
+    head = job_stack_;
+  } while (!atomic_casptr(&job_stack_, head, static_cast<JobInfo *>(NULL)));
+
+  JobInfo *result = NULL;
+  int64_t num_jobs = 0;
+  while (head != NULL) {
+    JobInfo *next = head->next_job;
+    head->next_job = result;
+    result = head;
+    head = next;
+    num_jobs++;
+  }
+  perf::Xadd(counters_->sz_job_queue, -num_jobs);
+  return result;
+}
+
+
+/**
+ * Worker thread event loop.  Waits for new JobInfo structs on the job stack
+ * and for activity on the curl sockets.  Finished jobs are handed back through
+ * their callbacks (see FetchAsync()).
  */
 void *DownloadManager::MainDownload(void *data) {
   LogCvmfs(kLogDownload, kLogDebug, "download I/O thread started");
   DownloadManager *download_mgr = static_cast<DownloadManager *>(data);
 
-  download_mgr->watch_fds_ =
-    static_cast<struct pollfd *>(smalloc(2 * sizeof(struct pollfd)));
-  download_mgr->watch_fds_size_ = 2;
-  download_mgr->watch_fds_[0].fd = download_mgr->pipe_terminate_[0];
-  download_mgr->watch_fds_[0].events = POLLIN | POLLPRI;
-  download_mgr->watch_fds_[0].revents = 0;
-  download_mgr->watch_fds_[1].fd = download_mgr->pipe_jobs_[0];
-  download_mgr->watch_fds_[1].events = POLLIN | POLLPRI;
-  download_mgr->watch_fds_[1].revents = 0;
-  download_mgr->watch_fds_inuse_ = 2;
+  download_mgr->WatchFd(download_mgr->pipe_terminate_[0], CURL_POLL_IN, true);
+  download_mgr->WatchFd(download_mgr->wakeup_jobs_[0], CURL_POLL_IN, true);
+  if (download_mgr->opt_num_processing_threads_ > 0) {
+    download_mgr->WatchFd(download_mgr->wakeup_processing_[0], CURL_POLL_IN,
+                          true);
+  }
 
+  vector<SocketEvent> events;
+  bool terminate = false;
   int still_running = 0;
   struct timeval timeval_start, timeval_stop;
   gettimeofday(&timeval_start, NULL);
-  while (true) {
-    int timeout;
-    if (still_running) {
-      /* NOTE: The following might degrade the performance for many small files
-       * use case. TODO(jblomer): look into it.
-      // Specify a timeout for polling in ms; this allows us to return
-      // to libcurl once a second so it can look for internal operations
-      // which timed out.  libcurl has a more elaborate mechanism
-      // (CURLMOPT_TIMERFUNCTION) that would inform us of the next potential
-      // timeout.  TODO(bbockelm) we should switch to that in the future.
-      timeout = 100;
-      */
-      timeout = 1;
-    } else {
-      timeout = -1;
+  while (!terminate) {
+    if (!still_running) {
       gettimeofday(&timeval_stop, NULL);
       int64_t delta = static_cast<int64_t>(
         1000 * DiffTimeSeconds(timeval_start, timeval_stop));
       perf::Xadd(download_mgr->counters_->sz_transfer_time, delta);
     }
-    int retval = poll(download_mgr->watch_fds_, download_mgr->watch_fds_inuse_,
-                      timeout);
-    if (retval < 0) {
-      continue;
+    perf::Inc(download_mgr->counters_->n_loop_iterations);
+    // Timeouts are driven by curl's timer callback and by the hedge delay
+    int timeout_ms = -1;
+    if (download_mgr->opt_hedge_percentile_ > 0)
+      timeout_ms = download_mgr->HedgeSlowTransfers();
+    if ((timeout_ms < 0) ||
+        ((download_mgr->curl_timeout_ms_ >= 0) &&
+         (download_mgr->curl_timeout_ms_ < timeout_ms)))
+    {
+      timeout_ms = download_mgr->curl_timeout_ms_;
     }
+    download_mgr->WaitForEvents(timeout_ms, &events);
 
     // Handle timeout
-    if (retval == 0) {
-      retval = curl_multi_socket_action(download_mgr->curl_multi_,
-                                        CURL_SOCKET_TIMEOUT,
-                                        0,
-                                        &still_running);
+    if (events.empty()) {
+      curl_multi_socket_action(download_mgr->curl_multi_,
+                               CURL_SOCKET_TIMEOUT,
+                               0,
+                               &still_running);
     }
 
-    // Terminate I/O thread
-    if (download_mgr->watch_fds_[0].revents)
-      break;
+    for (unsigned i = 0; i < events.size(); ++i) {
+      const int fd = events[i].fd;
 
-    // New job arrives
-    if (download_mgr->watch_fds_[1].revents) {
-      download_mgr->watch_fds_[1].revents = 0;
-      JobInfo *info;
-      ReadPipe(download_mgr->pipe_jobs_[0], &info, sizeof(info));
-      if (!still_running)
-        gettimeofday(&timeval_start, NULL);
-      CURL *handle = download_mgr->AcquireCurlHandle();
-      download_mgr->InitializeRequest(info, handle);
-      download_mgr->SetUrlOptions(info);
-      curl_multi_add_handle(download_mgr->curl_multi_, handle);
-      retval = curl_multi_socket_action(download_mgr->curl_multi_,
-                                        CURL_SOCKET_TIMEOUT,
-                                        0,
-                                        &still_running);
-    }
-
-    // Activity on curl sockets
-    for (unsigned i = 2; i < download_mgr->watch_fds_inuse_; ++i) {
-      if (download_mgr->watch_fds_[i].revents) {
-        int ev_bitmask = 0;
-        if (download_mgr->watch_fds_[i].revents & (POLLIN | POLLPRI))
-          ev_bitmask |= CURL_CSELECT_IN;
-        if (download_mgr->watch_fds_[i].revents & (POLLOUT | POLLWRBAND))
-          ev_bitmask |= CURL_CSELECT_OUT;
-        if (download_mgr->watch_fds_[i].revents &
-            (POLLERR | POLLHUP | POLLNVAL))
-        {
-          ev_bitmask |= CURL_CSELECT_ERR;
+      // Terminate I/O thread
+      if (fd == download_mgr->pipe_terminate_[0]) {
+        terminate = true;
+        break;
+      }
+
+      // New jobs arrive
+      if (fd == download_mgr->wakeup_jobs_[0]) {
+        JobInfo *info = download_mgr->PopJobs();
+        if (!still_running)
+          gettimeofday(&timeval_start, NULL);
+        while (info != NULL) {
+          JobInfo *next = info->next_job;
+          info->next_job = NULL;
+          CURL *handle = download_mgr->AcquireCurlHandle();
+          download_mgr->InitializeRequest(info, handle);
+          download_mgr->SetUrlOptions(info);
+          curl_multi_add_handle(download_mgr->curl_multi_, handle);
+          info = next;
         }
-        download_mgr->watch_fds_[i].revents = 0;
+        curl_multi_socket_action(download_mgr->curl_multi_,
+                                 CURL_SOCKET_TIMEOUT,
+                                 0,
+                                 &still_running);
+        continue;
+      }
 
-        retval = curl_multi_socket_action(download_mgr->curl_multi_,
-                                          download_mgr->watch_fds_[i].fd,
-                                          ev_bitmask,
-                                          &still_running);
+      // Processing threads are done with a job or ready for more data
+      if (fd == download_mgr->wakeup_processing_[0]) {
+        download_mgr->HandleProcessingEvents(&still_running);
+        continue;
       }
+
+      // Activity on curl sockets
+      curl_multi_socket_action(download_mgr->curl_multi_,
+                               fd,
+                               events[i].curl_events,
+                               &still_running);
     }
+    if (terminate)
+      break;
+
+    // Hedged transfers are decided in the data callback
+    if (!download_mgr->hedges_.empty())
+      download_mgr->ReapLostHedges();
 
     // Check if transfers are completed
     CURLMsg *curl_msg;
@@ -565,19 +822,22 @@ void *DownloadManager::MainDownload(void *data) {
         curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info);
 
         curl_multi_remove_handle(download_mgr->curl_multi_, easy_handle);
-        if (download_mgr->VerifyAndFinalize(curl_error, info)) {
-          curl_multi_add_handle(download_mgr->curl_multi_, easy_handle);
-          retval = curl_multi_socket_action(download_mgr->curl_multi_,
-                                            CURL_SOCKET_TIMEOUT,
-                                            0,
-                                            &still_running);
-        } else {
-          // Return easy handle into pool and write result back
-          download_mgr->ReleaseCurlHandle(easy_handle);
-
-          WritePipe(info->wait_at[1], &info->error_code,
-                    sizeof(info->error_code));
+        if (info->hedge_lost ||
+            ((info->hedge != NULL) && (curl_error != CURLE_OK)))
+        {
+          // The other half of the hedged request carries on
+          download_mgr->DropHedgedTransfer(info);
+          continue;
+        }
+        if (info->hedge != NULL)
+          download_mgr->DropHedgedTransfer(info->hedge);
+        if ((info->processing_mgr != NULL) &&
+            !download_mgr->CollectProcessing(info, &curl_error))
+        {
+          // Finalized once the processing threads are done with the data
+          continue;
         }
+        download_mgr->FinalizeTransfer(info, curl_error, &still_running);
       }
     }
   }
@@ -589,13 +849,248 @@ void *DownloadManager::MainDownload(void *data) {
     curl_easy_cleanup(*i);
   }
   download_mgr->pool_handles_inuse_->clear();
-  free(download_mgr->watch_fds_);
+  for (unsigned i = 0; i < download_mgr->hedges_.size(); ++i) {
+    free(download_mgr->hedges_[i]->hash_context.buffer);
+    delete download_mgr->hedges_[i];
+  }
+  download_mgr->hedges_.clear();
 
   LogCvmfs(kLogDownload, kLogDebug, "download I/O thread terminated");
   return NULL;
 }
 
 
+/**
+ * Checks the result of a finished transfer and either restarts it or hands
+ * back the job.  Called by the I/O thread once the received data is processed.
+ */
+void DownloadManager::FinalizeTransfer(
+  JobInfo *info,
+  int curl_error,
+  int *still_running)
+{
+  CURL *easy_handle = info->curl_handle;
+  if (VerifyAndFinalize(curl_error, info)) {
+    curl_multi_add_handle(curl_multi_, easy_handle);
+    curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
+                             still_running);
+    return;
+  }
+
+  // Return easy handle into pool and hand back the result
+  if ((opt_hedge_percentile_ > 0) && (info->error_code == kFailOk))
+    UpdateHedgeDelay(easy_handle);
+  ReleaseCurlHandle(easy_handle);
+  if (info->hedge_origin != NULL)
+    info = AdoptHedge(info);
+  CompleteJob(info);
+}
+
+
+/**
+ * Called by the I/O thread from the curl data callback.  Copies the data into
+ * the job's queue for the processing threads.  If too much data of the job is
+ * queued already, the transfer is paused; it is resumed by
+ * HandleProcessingEvents().  A processing failure aborts the transfer.
+ */
+size_t DownloadManager::QueueData(
+  JobInfo *info,
+  const void *ptr,
+  const size_t num_bytes)
+{
+  ProcessingState *state = &info->processing;
+  pthread_mutex_lock(&lock_processing_);
+  if (state->error_code != kFailOk) {
+    pthread_mutex_unlock(&lock_processing_);
+    return 0;
+  }
+  if (state->queued_bytes >= kProcessingMaxQueued) {
+    state->paused = true;
+    pthread_mutex_unlock(&lock_processing_);
+    perf::Inc(counters_->n_processing_pauses);
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  unsigned char *chunk = static_cast<unsigned char *>(smalloc(num_bytes));
+  memcpy(chunk, ptr, num_bytes);
+  state->chunks.push_back(make_pair(chunk, num_bytes));
+  state->queued_bytes += num_bytes;
+  perf::Xadd(counters_->sz_processing_queue, num_bytes);
+  if (!state->scheduled) {
+    state->scheduled = true;
+    processing_ready_.push_back(info);
+    pthread_cond_signal(&cond_processing_);
+  }
+  pthread_mutex_unlock(&lock_processing_);
+  return num_bytes;
+}
+
+
+/**
+ * Hands a job over to the I/O thread.  The I/O thread is only woken up for
+ * the first job in the list.
+ */
+void DownloadManager::NotifyProcessingUnlocked(JobInfo *info) {
+  if (info->processing.notified)
+    return;
+  info->processing.notified = true;
+  processing_notify_.push_back(info);
+  if (processing_notify_.size() == 1) {
+    const uint64_t wakeup = 1;
+    WritePipe(wakeup_processing_[1], &wakeup, sizeof(wakeup));
+  }
+}
+
+
+/**
+ * Processing thread.  Takes a job from the ready queue and processes the data
+ * that is queued at this point.  If more data arrived in the meantime, the job
+ * goes to the back of the ready queue, so that a single large download does
+ * not starve the others.  The chunks of a job are processed strictly in order
+ * because a job is in the ready queue at most once.
+ */
+void *DownloadManager::MainProcessing(void *data) {
+  LogCvmfs(kLogDownload, kLogDebug, "download processing thread started");
+  DownloadManager *download_mgr = static_cast<DownloadManager *>(data);
+  perf::Counter *sz_processing_queue =
+    download_mgr->counters_->sz_processing_queue;
+
+  pthread_mutex_lock(&download_mgr->lock_processing_);
+  while (true) {
+    while (download_mgr->processing_ready_.empty() &&
+           !download_mgr->processing_terminate_)
+    {
+      pthread_cond_wait(&download_mgr->cond_processing_,
+                        &download_mgr->lock_processing_);
+    }
+    if (download_mgr->processing_terminate_)
+      break;
+
+    JobInfo *info = download_mgr->processing_ready_.front();
+    download_mgr->processing_ready_.pop_front();
+    ProcessingState *state = &info->processing;
+    for (unsigned i = state->chunks.size(); i > 0; --i) {
+      const pair<unsigned char *, size_t> chunk = state->chunks.front();
+      state->chunks.pop_front();
+      // After a failure, the remaining data is dropped
+      const bool skip = (state->error_code != kFailOk);
+      pthread_mutex_unlock(&download_mgr->lock_processing_);
+
+      Failures result = kFailOk;
+      if (!skip)
+        result = WriteData(info, chunk.first, chunk.second);
+      free(chunk.first);
+
+      pthread_mutex_lock(&download_mgr->lock_processing_);
+      if ((result != kFailOk) && (state->error_code == kFailOk))
+        state->error_code = result;
+      state->queued_bytes -= chunk.second;
+      perf::Xadd(sz_processing_queue, -static_cast<int64_t>(chunk.second));
+      if (state->paused &&
+          (state->queued_bytes <= kProcessingMaxQueued / 2))
+      {
+        state->paused = false;
+        state->resume = true;
+        download_mgr->NotifyProcessingUnlocked(info);
+      }
+    }
+
+    if (!state->chunks.empty()) {
+      download_mgr->processing_ready_.push_back(info);
+      continue;
+    }
+    // Once unscheduled, the job can be finalized by the I/O thread at any time
+    state->scheduled = false;
+    if (state->transfer_done)
+      download_mgr->NotifyProcessingUnlocked(info);
+  }
+  pthread_mutex_unlock(&download_mgr->lock_processing_);
+
+  LogCvmfs(kLogDownload, kLogDebug, "download processing thread terminated");
+  return NULL;
+}
+
+
+/**
+ * Called by the I/O thread for a finished transfer of a job that uses the
+ * processing threads.  Returns false if data of the job is still being
+ * processed; in this case the transfer is finalized by
+ * HandleProcessingEvents().  Otherwise, a processing failure is handed over
+ * like a failure of the data callback.  A job that is finalized right away
+ * is taken off the notification list, e.g. if its transfer failed while it
+ * was paused and waited to be resumed.
+ */
+bool DownloadManager::CollectProcessing(JobInfo *info, int *curl_error) {
+  ProcessingState *state = &info->processing;
+  pthread_mutex_lock(&lock_processing_);
+  if (state->scheduled) {
+    state->transfer_done = true;
+    state->curl_error = *curl_error;
+    pthread_mutex_unlock(&lock_processing_);
+    return false;
+  }
+
+  if (state->notified) {
+    processing_notify_.erase(find(processing_notify_.begin(),
+                                  processing_notify_.end(), info));
+    state->notified = false;
+  }
+  state->transfer_done = false;
+  state->paused = state->resume = false;
+  if (state->error_code != kFailOk) {
+    info->error_code = state->error_code;
+    state->error_code = kFailOk;
+    *curl_error = CURLE_WRITE_ERROR;
+  }
+  pthread_mutex_unlock(&lock_processing_);
+  return true;
+}
+
+
+/**
+ * Resumes the paused transfers whose queues got short enough and finalizes the
+ * transfers whose data is processed.  Called by the I/O thread.
+ */
+void DownloadManager::HandleProcessingEvents(int *still_running) {
+  uint64_t wakeup;
+#ifdef __APPLE__
+  while (read(wakeup_processing_[0], &wakeup, sizeof(wakeup)) > 0) { }
+#else
+  int retval = read(wakeup_processing_[0], &wakeup, sizeof(wakeup));
+  assert((retval == sizeof(wakeup)) || (errno == EAGAIN));
+#endif
+  perf::Inc(counters_->n_loop_syscalls);
+
+  vector<JobInfo *> notified;
+  vector<JobInfo *> resume;
+  vector<JobInfo *> done;
+  pthread_mutex_lock(&lock_processing_);
+  notified.swap(processing_notify_);
+  for (unsigned i = 0; i < notified.size(); ++i) {
+    ProcessingState *state = &notified[i]->processing;
+    state->notified = false;
+    if (state->transfer_done) {
+      if (!state->scheduled)
+        done.push_back(notified[i]);
+    } else if (state->resume) {
+      state->resume = false;
+      resume.push_back(notified[i]);
+    }
+  }
+  pthread_mutex_unlock(&lock_processing_);
+
+  // Unpausing can call the data callback
+  for (unsigned i = 0; i < resume.size(); ++i)
+    curl_easy_pause(resume[i]->curl_handle, CURLPAUSE_CONT);
+  for (unsigned i = 0; i < done.size(); ++i) {
+    int curl_error = done[i]->processing.curl_error;
+    CollectProcessing(done[i], &curl_error);
+    FinalizeTransfer(done[i], curl_error, still_running);
+  }
+  curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0, still_running);
+}
+
+
 //------------------------------------------------------------------------------
 
 
@@ -694,6 +1189,58 @@ void HeaderLists::AddBlock() {
 //------------------------------------------------------------------------------
 
 
+CurlShare::CurlShare() {
+  for (unsigned i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+    int retval = pthread_mutex_init(&locks_[i], NULL);
+    assert(retval == 0);
+  }
+  atomic_init32(&refcount_);
+  atomic_inc32(&refcount_);
+
+  handle_ = curl_share_init();
+  assert(handle_ != NULL);
+  curl_share_setopt(handle_, CURLSHOPT_LOCKFUNC, CallbackLock);
+  curl_share_setopt(handle_, CURLSHOPT_UNLOCKFUNC, CallbackUnlock);
+  curl_share_setopt(handle_, CURLSHOPT_USERDATA, static_cast<void *>(this));
+  curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+
+/**
+ * All the easy handles using the share need to be cleaned up before.
+ */
+CurlShare::~CurlShare() {
+  curl_share_cleanup(handle_);
+  for (unsigned i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    pthread_mutex_destroy(&locks_[i]);
+}
+
+
+void CurlShare::CallbackLock(
+  CURL *handle,
+  curl_lock_data data,
+  curl_lock_access access,
+  void *userptr)
+{
+  CurlShare *share = static_cast<CurlShare *>(userptr);
+  pthread_mutex_lock(&share->locks_[data]);
+}
+
+
+void CurlShare::CallbackUnlock(
+  CURL *handle,
+  curl_lock_data data,
+  void *userptr)
+{
+  CurlShare *share = static_cast<CurlShare *>(userptr);
+  pthread_mutex_unlock(&share->locks_[data]);
+}
+
+
+//------------------------------------------------------------------------------
+
+
 string DownloadManager::ProxyInfo::Print() {
   if (url == "DIRECT")
     return url;
@@ -718,6 +1265,38 @@ string DownloadManager::ProxyInfo::Print() {
 }
 
 
+/**
+ * Expected time in milliseconds to fetch a typical object.  An error costs
+ * error_penalty_ms, i.e. the time until the failover.  Proxies without recent
+ * samples cost nothing, so that they are (re-)probed.
+ */
+double DownloadManager::ProxyStats::Cost(
+  const time_t now,
+  const double error_penalty_ms) const
+{
+  if ((num_samples == 0) ||
+      (now > timestamp + static_cast<time_t>(kProxyStatsTtl)))
+  {
+    return 0.0;
+  }
+  double transfer_ms = 0.0;
+  if (throughput > 0.0)
+    transfer_ms = 1000.0 * kProxyStatsObjectSize / throughput;
+  return latency_ms + transfer_ms + error_rate * error_penalty_ms;
+}
+
+
+string DownloadManager::ProxyStats::Print() const {
+  if (num_samples == 0)
+    return "no samples";
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer),
+           "latency %.1f ms, throughput %.0f kB/s, errors %.1f%%, %u samples",
+           latency_ms, throughput / 1024.0, 100.0 * error_rate, num_samples);
+  return buffer;
+}
+
+
 /**
  * Gets an idle CURL handle from the pool. Creates a new one and adds it to
  * the pool if necessary.
@@ -734,6 +1313,11 @@ CURL *DownloadManager::AcquireCurlHandle() {
     // curl_easy_setopt(curl_default, CURLOPT_FAILONERROR, 1);
     curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, CallbackCurlHeader);
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CallbackCurlData);
+    curl_easy_setopt(handle, CURLOPT_SHARE, curl_share_->handle());
+#if LIBCURL_VERSION_NUM >= 0x073500
+    curl_easy_setopt(handle, CURLOPT_BUFFERSIZE,
+                     static_cast<long>(kCurlBufferSize));  // NOLINT
+#endif
   } else {
     handle = *(pool_handles_idle_->begin());
     pool_handles_idle_->erase(pool_handles_idle_->begin());
@@ -767,12 +1351,14 @@ void DownloadManager::InitializeRequest(JobInfo *info, CURL *handle) {
   info->curl_handle = handle;
   info->error_code = kFailOk;
   info->http_code = -1;
+  info->object_size = -1;
   info->nocache = false;
   info->follow_redirects = follow_redirects_;
   info->num_used_proxies = 1;
   info->num_used_hosts = 1;
   info->num_retries = 0;
   info->backoff_ms = 0;
+  info->timestamp_ms = (opt_hedge_percentile_ > 0) ? NowMs() : 0;
   info->headers = header_lists_->DuplicateList(default_headers_);
   if (info->info_header) {
     header_lists_->AppendHeader(info->headers, info->info_header);
@@ -784,6 +1370,16 @@ void DownloadManager::InitializeRequest(JobInfo *info, CURL *handle) {
     assert(info->hash_context.buffer != NULL);
     shash::Init(info->hash_context);
   }
+  // Memory downloads are cheap to process.  Pausing file:// transfers loses
+  // data.
+  info->processing_mgr = NULL;
+  if (!processing_threads_.empty() &&
+      (info->destination != kDestinationMem) &&
+      (info->compressed || info->expected_hash) &&
+      !HasPrefix(*(info->url), "file://", false))
+  {
+    info->processing_mgr = this;
+  }
 
   if ((info->destination == kDestinationMem) &&
       (HasPrefix(*(info->url), "file://", false)))
@@ -820,6 +1416,15 @@ void DownloadManager::InitializeRequest(JobInfo *info, CURL *handle) {
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
     curl_easy_setopt(handle, CURLOPT_MAXREDIRS, 4);
   }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  if (opt_http2_) {
+    // Falls back to HTTP/1.1 if the server (or the proxy) does not speak
+    // HTTP/2.  Wait for a connection that can be multiplexed instead of
+    // opening a new one.
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+  }
+#endif
 }
 
 
@@ -894,10 +1499,34 @@ void DownloadManager::SetUrlOptions(JobInfo *info) {
     info->proxy = "DIRECT";
     curl_easy_setopt(info->curl_handle, CURLOPT_PROXY, "");
   } else {
-    ProxyInfo proxy = (*opt_proxy_groups_)[opt_proxy_groups_current_][0];
+    vector<ProxyInfo> *group =
+      &((*opt_proxy_groups_)[opt_proxy_groups_current_]);
+    unsigned idx = 0;
+    if ((info->num_used_proxies == 1) && (info->num_retries == 0) &&
+        ((info->proxy_offset > 0) || opt_adaptive_proxies_ ||
+         (info->hedge_origin != NULL)))
+    {
+      const unsigned num_usable = CountUsableProxiesUnlocked();
+      if (info->hedge_origin != NULL) {
+        // The duplicate of a hedged request takes the proxy after the one of
+        // the original request
+        for (unsigned i = 0; i < num_usable; ++i) {
+          if ((*group)[i].url == info->hedge_origin->proxy) {
+            idx = (i + 1) % num_usable;
+            break;
+          }
+        }
+      } else if (info->proxy_offset > 0) {
+        idx = info->proxy_offset % num_usable;
+      } else {
+        idx = SelectProxyUnlocked(*group, num_usable);
+      }
+      if ((*group)[idx].url == "DIRECT")
+        idx = 0;
+    }
+    ProxyInfo proxy = (*group)[idx];
     ValidateProxyIpsUnlocked(proxy.url, proxy.host);
-    ProxyInfo *proxy_ptr =
-      &((*opt_proxy_groups_)[opt_proxy_groups_current_][0]);
+    ProxyInfo *proxy_ptr = &((*group)[idx]);
     info->proxy = proxy_ptr->url;
     if (proxy_ptr->host.status() == dns::kFailOk) {
       curl_easy_setopt(info->curl_handle, CURLOPT_PROXY, info->proxy.c_str());
@@ -917,8 +1546,17 @@ void DownloadManager::SetUrlOptions(JobInfo *info) {
   if (opt_dns_server_)
     curl_easy_setopt(curl_handle, CURLOPT_DNS_SERVERS, opt_dns_server_);
 
-  if (info->probe_hosts && opt_host_chain_)
-    url_prefix = (*opt_host_chain_)[opt_host_chain_current_];
+  if (info->probe_hosts && opt_host_chain_) {
+    unsigned host_idx = opt_host_chain_current_;
+    // Without another proxy, the duplicate of a hedged request tries the next
+    // host
+    if ((info->hedge_origin != NULL) && (info->num_used_hosts == 1) &&
+        (info->proxy == info->hedge_origin->proxy))
+    {
+      host_idx = (host_idx + 1) % opt_host_chain_->size();
+    }
+    url_prefix = (*opt_host_chain_)[host_idx];
+  }
 
   string url = url_prefix + *(info->url);
 
@@ -988,7 +1626,9 @@ void DownloadManager::ValidateProxyIpsUnlocked(
            host.name().c_str());
 
   unsigned group_idx = opt_proxy_groups_current_;
-  dns::Host new_host = resolver_->Resolve(host.name());
+  dns::Host new_host = (host_cache_ != NULL) ?
+                       host_cache_->Lookup(host.name()) :
+                       resolver_->Resolve(host.name());
 
   bool update_only = true;  // No changes to the list of IP addresses.
   if (new_host.status() != dns::kFailOk) {
@@ -1053,6 +1693,21 @@ void DownloadManager::UpdateStatistics(CURL *handle) {
   assert(retval == CURLE_OK);
   sum += static_cast<int64_t>(val);*/
   perf::Xadd(counters_->sz_transferred_bytes, sum);
+
+  long num_connects;  // NOLINT
+  if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &num_connects) ==
+      CURLE_OK)
+  {
+    perf::Xadd(counters_->n_connections, num_connects);
+  }
+#if LIBCURL_VERSION_NUM >= 0x073200
+  long http_version;  // NOLINT
+  if ((curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &http_version) ==
+       CURLE_OK) && (http_version == CURL_HTTP_VERSION_2_0))
+  {
+    perf::Inc(counters_->n_http2_requests);
+  }
+#endif
 }
 
 
@@ -1213,6 +1868,8 @@ bool DownloadManager::VerifyAndFinalize(const int curl_error, JobInfo *info) {
       break;
   }
 
+  UpdateProxyStats(info);
+
   std::vector<std::string> *host_chain = opt_host_chain_;
 
   // Determination if download should be repeated
@@ -1283,28 +1940,9 @@ bool DownloadManager::VerifyAndFinalize(const int curl_error, JobInfo *info) {
     LogCvmfs(kLogDownload, kLogDebug, "Trying again on same curl handle, "
              "same url: %d, error code %d", same_url_retry, info->error_code);
     // Reset internal state and destination
-    if ((info->destination == kDestinationMem) && info->destination_mem.data) {
-      free(info->destination_mem.data);
-      info->destination_mem.data = NULL;
-      info->destination_mem.size = 0;
-      info->destination_mem.pos = 0;
-    }
-    if ((info->destination == kDestinationFile) ||
-        (info->destination == kDestinationPath))
-    {
-      if ((fflush(info->destination_file) != 0) ||
-          (ftruncate(fileno(info->destination_file), 0) != 0))
-      {
-        info->error_code = kFailLocalIO;
-        goto verify_and_finalize_stop;
-      }
-      rewind(info->destination_file);
-    }
-    if (info->destination == kDestinationSink) {
-      if (info->destination_sink->Reset() != 0) {
-        info->error_code = kFailLocalIO;
-        goto verify_and_finalize_stop;
-      }
+    if (!ResetDownloadDestination(info)) {
+      info->error_code = kFailLocalIO;
+      goto verify_and_finalize_stop;
     }
     if (info->expected_hash)
       shash::Init(info->hash_context);
@@ -1356,6 +1994,8 @@ bool DownloadManager::VerifyAndFinalize(const int curl_error, JobInfo *info) {
       info->num_used_hosts++;
       SetUrlOptions(info);
     }
+    if (opt_hedge_percentile_ > 0)
+      info->timestamp_ms = NowMs();
 
     return true;  // try again
   }
@@ -1390,14 +2030,21 @@ DownloadManager::DownloadManager() {
   pool_max_handles_ = 0;
   curl_multi_ = NULL;
   default_headers_ = NULL;
+  curl_share_ = NULL;
 
   atomic_init32(&multi_threaded_);
   pipe_terminate_[0] = pipe_terminate_[1] = -1;
 
-  pipe_jobs_[0] = pipe_jobs_[1] = -1;
+  job_stack_ = NULL;
+  wakeup_jobs_[0] = wakeup_jobs_[1] = -1;
+  curl_timeout_ms_ = -1;
+#ifdef __APPLE__
   watch_fds_ = NULL;
   watch_fds_size_ = 0;
   watch_fds_inuse_ = 0;
+#else
+  epoll_fd_ = -1;
+#endif
   watch_fds_max_ = 0;
 
   lock_options_ =
@@ -1427,8 +2074,25 @@ DownloadManager::DownloadManager() {
   enable_info_header_ = false;
   opt_ipv4_only_ = false;
   follow_redirects_ = false;
+  opt_http2_ = false;
+  opt_parallel_ranges_ = 0;
+  opt_parallel_range_size_ = kDefaultParallelRangeSize;
+  opt_adaptive_proxies_ = false;
+  opt_hedge_percentile_ = 0;
+  hedge_latencies_next_ = 0;
+  hedge_num_samples_ = 0;
+  hedge_delay_ms_ = -1;
+  opt_prewarm_ = false;
+  opt_num_processing_threads_ = 0;
+  retval = pthread_mutex_init(&lock_processing_, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&cond_processing_, NULL);
+  assert(retval == 0);
+  wakeup_processing_[0] = wakeup_processing_[1] = -1;
+  processing_terminate_ = false;
 
   resolver_ = NULL;
+  host_cache_ = NULL;
 
   opt_timestamp_backup_proxies_ = 0;
   opt_timestamp_failover_proxies_ = 0;
@@ -1445,6 +2109,8 @@ DownloadManager::~DownloadManager() {
   pthread_mutex_destroy(lock_synchronous_mode_);
   free(lock_options_);
   free(lock_synchronous_mode_);
+  pthread_cond_destroy(&cond_processing_);
+  pthread_mutex_destroy(&lock_processing_);
 }
 
 void DownloadManager::InitHeaders() {
@@ -1504,11 +2170,15 @@ void DownloadManager::Init(const unsigned max_pool_handles,
   user_agent_ = NULL;
   InitHeaders();
 
+  curl_share_ = new CurlShare();
   curl_multi_ = curl_multi_init();
   assert(curl_multi_ != NULL);
   curl_multi_setopt(curl_multi_, CURLMOPT_SOCKETFUNCTION, CallbackCurlSocket);
   curl_multi_setopt(curl_multi_, CURLMOPT_SOCKETDATA,
                     static_cast<void *>(this));
+  curl_multi_setopt(curl_multi_, CURLMOPT_TIMERFUNCTION, CallbackCurlTimer);
+  curl_multi_setopt(curl_multi_, CURLMOPT_TIMERDATA,
+                    static_cast<void *>(this));
   curl_multi_setopt(curl_multi_, CURLMOPT_MAXCONNECTS, watch_fds_max_);
   curl_multi_setopt(curl_multi_, CURLMOPT_MAX_TOTAL_CONNECTIONS,
                     pool_max_handles_);
@@ -1516,117 +2186,618 @@ void DownloadManager::Init(const unsigned max_pool_handles,
 
   prng_.InitLocaltime();
 
-  // Name resolving
-  if ((getenv("CVMFS_IPV4_ONLY") != NULL) &&
-      (strlen(getenv("CVMFS_IPV4_ONLY")) > 0))
+  // Name resolving
+  if ((getenv("CVMFS_IPV4_ONLY") != NULL) &&
+      (strlen(getenv("CVMFS_IPV4_ONLY")) > 0))
+  {
+    opt_ipv4_only_ = true;
+  }
+  resolver_ = dns::NormalResolver::Create(opt_ipv4_only_,
+    kDnsDefaultRetries, kDnsDefaultTimeoutMs);
+  assert(resolver_);
+
+  // Parsing environment variables
+  if (use_system_proxy) {
+    if (getenv("http_proxy") == NULL) {
+      SetProxyChain("", "", kSetProxyRegular);
+    } else {
+      SetProxyChain(string(getenv("http_proxy")), "", kSetProxyRegular);
+    }
+  }
+}
+
+
+void DownloadManager::Fini() {
+  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
+    // Shutdown I/O thread
+    char buf = 'T';
+    WritePipe(pipe_terminate_[1], &buf, 1);
+    pthread_join(thread_download_, NULL);
+    // All handles are removed from the multi stack
+    close(pipe_terminate_[1]);
+    close(pipe_terminate_[0]);
+#ifdef __APPLE__
+    ClosePipe(wakeup_jobs_);
+    free(watch_fds_);
+    watch_fds_ = NULL;
+    watch_fds_size_ = watch_fds_inuse_ = 0;
+#else
+    close(wakeup_jobs_[0]);
+    close(epoll_fd_);
+    epoll_fd_ = -1;
+#endif
+    wakeup_jobs_[0] = wakeup_jobs_[1] = -1;
+
+    if (!processing_threads_.empty()) {
+      pthread_mutex_lock(&lock_processing_);
+      processing_terminate_ = true;
+      pthread_cond_broadcast(&cond_processing_);
+      pthread_mutex_unlock(&lock_processing_);
+      for (unsigned i = 0; i < processing_threads_.size(); ++i)
+        pthread_join(processing_threads_[i], NULL);
+      processing_threads_.clear();
+      processing_terminate_ = false;
+      // Data of unfinished jobs
+      for (unsigned i = 0; i < processing_ready_.size(); ++i) {
+        ProcessingState *state = &processing_ready_[i]->processing;
+        for (unsigned j = 0; j < state->chunks.size(); ++j)
+          free(state->chunks[j].first);
+        state->chunks.clear();
+      }
+      processing_ready_.clear();
+      processing_notify_.clear();
+#ifdef __APPLE__
+      ClosePipe(wakeup_processing_);
+#else
+      close(wakeup_processing_[0]);
+#endif
+      wakeup_processing_[0] = wakeup_processing_[1] = -1;
+    }
+  }
+
+  for (set<CURL *>::iterator i = pool_handles_idle_->begin(),
+       iEnd = pool_handles_idle_->end(); i != iEnd; ++i)
+  {
+    curl_easy_cleanup(*i);
+  }
+  delete pool_handles_idle_;
+  delete pool_handles_inuse_;
+  curl_multi_cleanup(curl_multi_);
+  pool_handles_idle_ = NULL;
+  pool_handles_inuse_ = NULL;
+  curl_multi_ = NULL;
+  if (curl_share_->Unref())
+    delete curl_share_;
+  curl_share_ = NULL;
+
+  FiniHeaders();
+  if (user_agent_)
+    free(user_agent_);
+  user_agent_ = NULL;
+
+  delete counters_;
+  counters_ = NULL;
+
+  delete opt_host_chain_;
+  delete opt_host_chain_rtt_;
+  delete opt_proxy_groups_;
+  opt_host_chain_ = NULL;
+  opt_host_chain_rtt_ = NULL;
+  opt_proxy_groups_ = NULL;
+
+  curl_global_cleanup();
+
+  delete resolver_;
+  resolver_ = NULL;
+}
+
+
+/**
+ * Spawns the I/O worker thread and switches the module in multi-threaded mode.
+ * No way back except Fini(); Init();
+ */
+void DownloadManager::Spawn() {
+  MakePipe(pipe_terminate_);
+#ifdef __APPLE__
+  MakePipe(wakeup_jobs_);
+  watch_fds_ =
+    static_cast<struct pollfd *>(smalloc(2 * sizeof(struct pollfd)));
+  watch_fds_size_ = 2;
+  watch_fds_inuse_ = 0;
+#else
+  wakeup_jobs_[0] = wakeup_jobs_[1] = eventfd(0, 0);
+  assert(wakeup_jobs_[0] >= 0);
+  epoll_fd_ = epoll_create(watch_fds_max_ + 2);
+  assert(epoll_fd_ >= 0);
+#endif
+  Block2Nonblock(wakeup_jobs_[0]);
+
+  if (opt_num_processing_threads_ > 0) {
+#ifdef __APPLE__
+    MakePipe(wakeup_processing_);
+#else
+    wakeup_processing_[0] = wakeup_processing_[1] = eventfd(0, 0);
+    assert(wakeup_processing_[0] >= 0);
+#endif
+    Block2Nonblock(wakeup_processing_[0]);
+    for (unsigned i = 0; i < opt_num_processing_threads_; ++i) {
+      pthread_t thread;
+      int retval = pthread_create(&thread, NULL, MainProcessing,
+                                  static_cast<void *>(this));
+      assert(retval == 0);
+      processing_threads_.push_back(thread);
+    }
+  }
+
+  int retval = pthread_create(&thread_download_, NULL, MainDownload,
+                              static_cast<void *>(this));
+  assert(retval == 0);
+
+  atomic_inc32(&multi_threaded_);
+  Prewarm();
+}
+
+
+/**
+ * Downloads data from an unsecure outside channel (currently HTTP or file).
+ * Blocks until the download is finished.
+ */
+Failures DownloadManager::Fetch(JobInfo *info) {
+  if (IsParallelRangeCandidate(info) && FetchRanges(info))
+    return info->error_code;
+
+  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
+    if (info->wait_at[0] == -1) {
+      MakePipe(info->wait_at);
+    }
+    FetchAsync(info, new Callback<JobInfo *>(SignalFetchDone));
+    Failures result;
+    ReadPipe(info->wait_at[0], &result, sizeof(result));
+    // LogCvmfs(kLogDownload, kLogDebug, "got result %d", result);
+    return result;
+  }
+
+  FetchAsync(info, NULL);
+  return info->error_code;
+}
+
+
+/**
+ * Objects that are expected to span several ranges are fetched in parallel.
+ * Only for sink and file destinations, i.e. object downloads into the cache.
+ */
+bool DownloadManager::IsParallelRangeCandidate(const JobInfo *info) {
+  if (atomic_xadd32(&multi_threaded_, 0) == 0)
+    return false;
+  if (info->head_request || (info->range_offset != -1))
+    return false;
+  if ((info->destination != kDestinationSink) &&
+      (info->destination != kDestinationFile))
+  {
+    return false;
+  }
+
+  pthread_mutex_lock(lock_options_);
+  const bool result = (opt_parallel_ranges_ > 1) &&
+    (info->range_size >= 2 * static_cast<off_t>(opt_parallel_range_size_));
+  pthread_mutex_unlock(lock_options_);
+  return result;
+}
+
+
+/**
+ * Submits a range request into memory.  The returned job is owned by the
+ * caller and signals its completion on the wait_at pipe.
+ */
+JobInfo *DownloadManager::StartRange(
+  const JobInfo *info,
+  const off_t offset,
+  const off_t size,
+  const unsigned proxy_offset)
+{
+  JobInfo *range = new JobInfo(info->url, false /* compressed */,
+                               info->probe_hosts, NULL);
+  range->extra_info = info->extra_info;
+  range->pid = info->pid;
+  range->uid = info->uid;
+  range->gid = info->gid;
+  range->range_offset = offset;
+  range->range_size = size;
+  range->proxy_offset = proxy_offset;
+  MakePipe(range->wait_at);
+  FetchAsync(range, new Callback<JobInfo *>(SignalFetchDone));
+  return range;
+}
+
+
+/**
+ * Splits the download into ranges that are fetched concurrently, possibly
+ * through different proxies.  The ranges are passed in order to the regular
+ * data callback, so that hashing, decompression and writing to the
+ * destination happen as for a single transfer.  The first range also tells
+ * the size of the object.
+ *
+ * Returns false if the download should be retried as a single transfer, e.g.
+ * because the server does not support ranges or a range failed.  In this case
+ * the destination is left empty.
+ */
+bool DownloadManager::FetchRanges(JobInfo *info) {
+  pthread_mutex_lock(lock_options_);
+  const unsigned num_parallel = opt_parallel_ranges_;
+  const off_t range_size = opt_parallel_range_size_;
+  pthread_mutex_unlock(lock_options_);
+
+  JobInfo *range = StartRange(info, 0, range_size, 0);
+  Failures result;
+  ReadPipe(range->wait_at[0], &result, sizeof(result));
+  off_t object_size = range->object_size;
+  if ((result == kFailOk) && (object_size < 0)) {
+    // The server sent the entire object or the size is unknown
+    if ((range->http_code == 200) ||
+        (static_cast<off_t>(range->destination_mem.size) < range_size))
+    {
+      object_size = range->destination_mem.size;
+    }
+  }
+  if ((result != kFailOk) || (object_size < 0) ||
+      (object_size < static_cast<off_t>(range->destination_mem.size)))
+  {
+    free(range->destination_mem.data);
+    delete range;
+    return false;
+  }
+  if (object_size > range_size)
+    perf::Inc(counters_->n_range_fetches);
+  LogCvmfs(kLogDownload, kLogDebug, "fetching %s (%"PRId64" bytes) in ranges "
+           "of %"PRId64" bytes", info->url->c_str(),
+           static_cast<int64_t>(object_size), static_cast<int64_t>(range_size));
+
+  // Same state as for a single transfer, see InitializeRequest()
+  info->error_code = kFailOk;
+  info->destination_mem.size = info->destination_mem.pos = 0;
+  info->destination_mem.data = NULL;
+  info->hash_context.buffer = NULL;
+  if (info->expected_hash) {
+    info->hash_context.algorithm = info->expected_hash->algorithm;
+    info->hash_context.size =
+      shash::GetContextSize(info->hash_context.algorithm);
+    info->hash_context.buffer = smalloc(info->hash_context.size);
+    shash::Init(info->hash_context);
+  }
+  if (info->compressed)
+    zlib::DecompressInit(&info->zstream);
+
+  // The ranges are consumed in order while up to num_parallel are in flight
+  std::deque<JobInfo *> ranges;
+  off_t next_offset = range->destination_mem.size;
+  unsigned num_ranges = 1;
+  while (range != NULL) {
+    while ((info->error_code == kFailOk) && (next_offset < object_size) &&
+           (ranges.size() + 1 < num_parallel))
+    {
+      const off_t size = std::min(range_size, object_size - next_offset);
+      ranges.push_back(StartRange(info, next_offset, size, num_ranges++));
+      next_offset += size;
+    }
+
+    const size_t size = range->destination_mem.size;
+    if (info->error_code != kFailOk) {
+      // Drain the remaining ranges
+    } else if (result != kFailOk) {
+      info->error_code = result;
+    } else if ((range->range_offset > 0) &&
+               ((range->http_code != 206) ||
+                (static_cast<off_t>(size) != range->range_size) ||
+                (range->object_size != object_size)))
+    {
+      LogCvmfs(kLogDownload, kLogDebug, "unexpected response to range "
+               "%"PRId64"-%"PRId64" of %s", static_cast<int64_t>(
+               range->range_offset), static_cast<int64_t>(
+               range->range_offset + range->range_size - 1),
+               info->url->c_str());
+      info->error_code = kFailBadData;
+    } else if (size > 0) {
+      info->error_code = WriteData(info, range->destination_mem.data, size);
+    }
+    free(range->destination_mem.data);
+    delete range;
+
+    range = NULL;
+    if (!ranges.empty()) {
+      range = ranges.front();
+      ranges.pop_front();
+      ReadPipe(range->wait_at[0], &result, sizeof(result));
+    }
+  }
+
+  if ((info->error_code == kFailOk) && info->expected_hash) {
+    shash::Any match_hash;
+    shash::Final(info->hash_context, &match_hash);
+    if (match_hash != *(info->expected_hash)) {
+      LogCvmfs(kLogDownload, kLogDebug,
+               "hash verification of %s failed (expected %s, got %s)",
+               info->url->c_str(), info->expected_hash->ToString().c_str(),
+               match_hash.ToString().c_str());
+      info->error_code = kFailBadData;
+    }
+  }
+  if (info->compressed)
+    zlib::DecompressFini(&info->zstream);
+  free(info->hash_context.buffer);
+  info->hash_context.buffer = NULL;
+  if ((info->error_code == kFailOk) &&
+      (info->destination == kDestinationFile) &&
+      (fflush(info->destination_file) != 0))
   {
-    opt_ipv4_only_ = true;
+    info->error_code = kFailLocalIO;
   }
-  resolver_ = dns::NormalResolver::Create(opt_ipv4_only_,
-    kDnsDefaultRetries, kDnsDefaultTimeoutMs);
-  assert(resolver_);
+  if ((info->error_code == kFailOk) || (info->error_code == kFailLocalIO))
+    return true;
 
-  // Parsing environment variables
-  if (use_system_proxy) {
-    if (getenv("http_proxy") == NULL) {
-      SetProxyChain("", "", kSetProxyRegular);
-    } else {
-      SetProxyChain(string(getenv("http_proxy")), "", kSetProxyRegular);
-    }
+  // The single transfer takes care of failover and of bypassing the caches
+  LogCvmfs(kLogDownload, kLogDebug, "ranged download of %s failed (%d - %s), "
+           "retrying as a single transfer", info->url->c_str(),
+           info->error_code, Code2Ascii(info->error_code));
+  if (!ResetDownloadDestination(info)) {
+    info->error_code = kFailLocalIO;
+    return true;
   }
+  return false;
 }
 
 
-void DownloadManager::Fini() {
-  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
-    // Shutdown I/O thread
-    char buf = 'T';
-    WritePipe(pipe_terminate_[1], &buf, 1);
-    pthread_join(thread_download_, NULL);
-    // All handles are removed from the multi stack
-    close(pipe_terminate_[1]);
-    close(pipe_terminate_[0]);
-    close(pipe_jobs_[1]);
-    close(pipe_jobs_[0]);
+/**
+ * Duplicates the transfers that did not receive data within the hedge delay.
+ * Returns the time in milliseconds until the next transfer becomes due, -1 if
+ * there is none.  Only used by the I/O thread.
+ */
+int DownloadManager::HedgeSlowTransfers() {
+  if (hedge_delay_ms_ < 0)
+    return -1;
+
+  const uint64_t now = NowMs();
+  const uint64_t delay_ms = hedge_delay_ms_;
+  int timeout_ms = -1;
+  vector<JobInfo *> due;
+  for (set<CURL *>::const_iterator i = pool_handles_inuse_->begin(),
+       iEnd = pool_handles_inuse_->end(); i != iEnd; ++i)
+  {
+    JobInfo *info;
+    curl_easy_getinfo(*i, CURLINFO_PRIVATE, &info);
+    if ((info->timestamp_ms == 0) || (info->hedge != NULL) ||
+        (info->hedge_origin != NULL) || (info->cred_data != NULL))
+    {
+      continue;
+    }
+    const uint64_t elapsed_ms =
+      (now > info->timestamp_ms) ? now - info->timestamp_ms : 0;
+    if (elapsed_ms >= delay_ms) {
+      due.push_back(info);
+    } else {
+      const int remaining_ms = delay_ms - elapsed_ms;
+      if ((timeout_ms < 0) || (remaining_ms < timeout_ms))
+        timeout_ms = remaining_ms;
+    }
   }
 
-  for (set<CURL *>::iterator i = pool_handles_idle_->begin(),
-       iEnd = pool_handles_idle_->end(); i != iEnd; ++i)
-  {
-    curl_easy_cleanup(*i);
+  for (unsigned i = 0; i < due.size(); ++i) {
+    // The remaining ones are reconsidered in the next round
+    if (hedges_.size() >= kHedgeMaxInflight)
+      break;
+    StartHedge(due[i]);
   }
-  delete pool_handles_idle_;
-  delete pool_handles_inuse_;
-  curl_multi_cleanup(curl_multi_);
-  pool_handles_idle_ = NULL;
-  pool_handles_inuse_ = NULL;
-  curl_multi_ = NULL;
+  return timeout_ms;
+}
 
-  FiniHeaders();
-  if (user_agent_)
-    free(user_agent_);
-  user_agent_ = NULL;
 
-  delete counters_;
-  counters_ = NULL;
+/**
+ * Sends a duplicate of a slow transfer to another proxy or host.  The
+ * duplicate shares the destination with the original transfer; only the one
+ * that receives data first writes to it.
+ */
+void DownloadManager::StartHedge(JobInfo *info) {
+  JobInfo *hedge = new JobInfo();
+  hedge->url = info->url;
+  hedge->compressed = info->compressed;
+  hedge->probe_hosts = info->probe_hosts;
+  hedge->head_request = info->head_request;
+  hedge->pid = info->pid;
+  hedge->uid = info->uid;
+  hedge->gid = info->gid;
+  hedge->destination = info->destination;
+  hedge->destination_file = info->destination_file;
+  hedge->destination_path = info->destination_path;
+  hedge->destination_sink = info->destination_sink;
+  hedge->expected_hash = info->expected_hash;
+  hedge->extra_info = info->extra_info;
+  hedge->range_offset = info->range_offset;
+  hedge->range_size = info->range_size;
+  // Owned by the original job
+  hedge->info_header = info->info_header;
+  if (info->expected_hash) {
+    hedge->hash_context.algorithm = info->hash_context.algorithm;
+    hedge->hash_context.size = info->hash_context.size;
+    hedge->hash_context.buffer = smalloc(hedge->hash_context.size);
+  }
+  hedge->hedge_origin = info;
+  hedge->hedge = info;
+  info->hedge = hedge;
+  // At most one duplicate per attempt
+  info->timestamp_ms = 0;
+
+  CURL *handle = AcquireCurlHandle();
+  InitializeRequest(hedge, handle);
+  if (info->nocache) {
+    header_lists_->AppendHeader(hedge->headers, "Pragma: no-cache");
+    header_lists_->AppendHeader(hedge->headers, "Cache-Control: no-cache");
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, hedge->headers);
+    hedge->nocache = true;
+  }
+  SetUrlOptions(hedge);
+  curl_multi_add_handle(curl_multi_, handle);
+  hedges_.push_back(hedge);
+  perf::Inc(counters_->n_hedged_requests);
+  LogCvmfs(kLogDownload, kLogDebug, "hedging slow request for %s "
+           "(proxy %s, duplicate via proxy %s)", info->url->c_str(),
+           info->proxy.c_str(), hedge->proxy.c_str());
+}
 
-  delete opt_host_chain_;
-  delete opt_host_chain_rtt_;
-  delete opt_proxy_groups_;
-  opt_host_chain_ = NULL;
-  opt_host_chain_rtt_ = NULL;
-  opt_proxy_groups_ = NULL;
 
-  curl_global_cleanup();
+/**
+ * Cancels one half of a hedged request.  A dropped duplicate is deleted, a
+ * dropped original waits for its duplicate to finish.
+ */
+void DownloadManager::DropHedgedTransfer(JobInfo *info) {
+  LogCvmfs(kLogDownload, kLogDebug, "cancel hedged transfer of %s (proxy %s)",
+           info->url->c_str(), info->proxy.c_str());
+  if (info->hedge != NULL) {
+    info->hedge->hedge = NULL;
+    info->hedge = NULL;
+  }
+  info->hedge_lost = false;
+  curl_multi_remove_handle(curl_multi_, info->curl_handle);
+  ReleaseCurlHandle(info->curl_handle);
+  info->curl_handle = NULL;
+  if (info->headers) {
+    header_lists_->PutList(info->headers);
+    info->headers = NULL;
+  }
+  if (info->compressed)
+    zlib::DecompressFini(&info->zstream);
+  if (info->destination_mem.data) {
+    free(info->destination_mem.data);
+    info->destination_mem.data = NULL;
+    info->destination_mem.size = 0;
+    info->destination_mem.pos = 0;
+  }
 
-  delete resolver_;
-  resolver_ = NULL;
+  if (info->hedge_origin != NULL) {
+    hedges_.erase(find(hedges_.begin(), hedges_.end(), info));
+    free(info->hash_context.buffer);
+    delete info;
+  }
 }
 
 
 /**
- * Spawns the I/O worker thread and switches the module in multi-threaded mode.
- * No way back except Fini(); Init();
+ * Cancels the transfers that lost the race of a hedged request.
  */
-void DownloadManager::Spawn() {
-  MakePipe(pipe_terminate_);
-  MakePipe(pipe_jobs_);
+void DownloadManager::ReapLostHedges() {
+  const vector<JobInfo *> hedges(hedges_);
+  for (unsigned i = 0; i < hedges.size(); ++i) {
+    if (hedges[i]->hedge_lost)
+      DropHedgedTransfer(hedges[i]);
+    else if (hedges[i]->hedge_origin->hedge_lost)
+      DropHedgedTransfer(hedges[i]->hedge_origin);
+  }
+}
 
-  int retval = pthread_create(&thread_download_, NULL, MainDownload,
-                              static_cast<void *>(this));
-  assert(retval == 0);
 
-  atomic_inc32(&multi_threaded_);
+/**
+ * Hands over the result of a finished duplicate to the original job, which is
+ * returned.
+ */
+JobInfo *DownloadManager::AdoptHedge(JobInfo *hedge) {
+  JobInfo *info = hedge->hedge_origin;
+  if (info->curl_handle != NULL)
+    DropHedgedTransfer(info);
+
+  info->error_code = hedge->error_code;
+  info->http_code = hedge->http_code;
+  info->object_size = hedge->object_size;
+  info->proxy = hedge->proxy;
+  info->nocache = hedge->nocache;
+  info->num_used_proxies = hedge->num_used_proxies;
+  info->num_used_hosts = hedge->num_used_hosts;
+  info->num_retries = hedge->num_retries;
+  info->destination_mem = hedge->destination_mem;
+  info->destination_file = hedge->destination_file;
+  hedge->destination_mem.data = NULL;
+
+  hedges_.erase(find(hedges_.begin(), hedges_.end(), hedge));
+  free(hedge->hash_context.buffer);
+  delete hedge;
+  perf::Inc(counters_->n_hedged_wins);
+  return info;
 }
 
 
 /**
- * Downloads data from an unsecure outside channel (currently HTTP or file).
+ * Adds the time to the first byte of a successful transfer to the samples and
+ * recalculates the hedge delay every kHedgeUpdateInterval samples.
  */
-Failures DownloadManager::Fetch(JobInfo *info) {
+void DownloadManager::UpdateHedgeDelay(CURL *handle) {
+  double latency;
+  if (curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &latency) !=
+      CURLE_OK)
+  {
+    return;
+  }
+  hedge_latencies_[hedge_latencies_next_] =
+    static_cast<uint32_t>(1000.0 * latency);
+  hedge_latencies_next_ = (hedge_latencies_next_ + 1) % kHedgeNumSamples;
+  if (hedge_num_samples_ < kHedgeNumSamples)
+    hedge_num_samples_++;
+  if ((hedge_num_samples_ < kHedgeMinSamples) ||
+      (hedge_latencies_next_ % kHedgeUpdateInterval != 0))
+  {
+    return;
+  }
+
+  vector<uint32_t> samples(hedge_latencies_.begin(),
+                           hedge_latencies_.begin() + hedge_num_samples_);
+  const unsigned rank = (samples.size() - 1) * opt_hedge_percentile_ / 100;
+  nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  // Localhost transfers can take less than a millisecond
+  hedge_delay_ms_ = std::max(samples[rank], static_cast<uint32_t>(1));
+  LogCvmfs(kLogDownload, kLogDebug, "hedge delay set to %d ms",
+           hedge_delay_ms_);
+}
+
+
+/**
+ * Hands over the download to the I/O thread and returns immediately.  Once
+ * the download is finished, the callback is called with the job as a
+ * parameter and deleted afterwards.  The result is in info->error_code.  The
+ * callback is called from the I/O thread and must not block.  The job is not
+ * touched anymore after the callback, so the callback can free it.
+ *
+ * If the download manager is not (yet) multi-threaded or if the download
+ * destination cannot be prepared, the callback is called from the calling
+ * thread before FetchAsync returns.
+ */
+void DownloadManager::FetchAsync(
+  JobInfo *info,
+  CallbackBase<JobInfo *> *callback)
+{
   assert(info != NULL);
   assert(info->url != NULL);
 
-  Failures result;
-  result = PrepareDownloadDestination(info);
-  if (result != kFailOk)
-    return result;
+  info->callback = callback;
+  info->info_header = NULL;
+  info->hash_context.buffer = NULL;
+  info->error_code = PrepareDownloadDestination(info);
+  if (info->error_code != kFailOk) {
+    NotifyJob(info);
+    return;
+  }
 
+  // The job can outlive the calling function, so the buffers are taken from
+  // the heap.  They are freed in CompleteJob().
   if (info->expected_hash) {
     const shash::Algorithms algorithm = info->expected_hash->algorithm;
     info->hash_context.algorithm = algorithm;
     info->hash_context.size = shash::GetContextSize(algorithm);
-    info->hash_context.buffer = alloca(info->hash_context.size);
+    info->hash_context.buffer = smalloc(info->hash_context.size);
   }
 
-  // Prepare cvmfs-info: header, allocate string on the stack
-  info->info_header = NULL;
+  // Prepare cvmfs-info: header
   if (enable_info_header_ && info->extra_info) {
     const char *header_name = "cvmfs-info: ";
     const size_t header_name_len = strlen(header_name);
     const unsigned header_size = 1 + header_name_len +
       EscapeHeader(*(info->extra_info), NULL, 0);
-    info->info_header = static_cast<char *>(alloca(header_size));
+    info->info_header = static_cast<char *>(smalloc(header_size));
     memcpy(info->info_header, header_name, header_name_len);
     EscapeHeader(*(info->extra_info), info->info_header + header_name_len,
                  header_size - header_name_len);
@@ -1634,34 +2805,40 @@ Failures DownloadManager::Fetch(JobInfo *info) {
   }
 
   if (atomic_xadd32(&multi_threaded_, 0) == 1) {
-    if (info->wait_at[0] == -1) {
-      MakePipe(info->wait_at);
-    }
-
-    // LogCvmfs(kLogDownload, kLogDebug, "send job to thread, pipe %d %d",
-    //          info->wait_at[0], info->wait_at[1]);
-    WritePipe(pipe_jobs_[1], &info, sizeof(info));
-    ReadPipe(info->wait_at[0], &result, sizeof(result));
-    // LogCvmfs(kLogDownload, kLogDebug, "got result %d", result);
-  } else {
-    pthread_mutex_lock(lock_synchronous_mode_);
-    CURL *handle = AcquireCurlHandle();
-    InitializeRequest(info, handle);
-    SetUrlOptions(info);
-    // curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
-    int retval;
-    do {
-      retval = curl_easy_perform(handle);
-      perf::Inc(counters_->n_requests);
-      double elapsed;
-      if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &elapsed) == CURLE_OK)
-        perf::Xadd(counters_->sz_transfer_time, (int64_t)(elapsed * 1000));
-    } while (VerifyAndFinalize(retval, info));
-    result = info->error_code;
-    ReleaseCurlHandle(info->curl_handle);
-    pthread_mutex_unlock(lock_synchronous_mode_);
+    // LogCvmfs(kLogDownload, kLogDebug, "send job to thread");
+    PushJob(info);
+    return;
   }
 
+  pthread_mutex_lock(lock_synchronous_mode_);
+  CURL *handle = AcquireCurlHandle();
+  InitializeRequest(info, handle);
+  SetUrlOptions(info);
+  // curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
+  int retval;
+  do {
+    retval = curl_easy_perform(handle);
+    perf::Inc(counters_->n_requests);
+    double elapsed;
+    if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &elapsed) == CURLE_OK)
+      perf::Xadd(counters_->sz_transfer_time, (int64_t)(elapsed * 1000));
+  } while (VerifyAndFinalize(retval, info));
+  ReleaseCurlHandle(info->curl_handle);
+  pthread_mutex_unlock(lock_synchronous_mode_);
+  CompleteJob(info);
+}
+
+
+/**
+ * Cleans up after a finished download and notifies the submitter of the job.
+ */
+void DownloadManager::CompleteJob(JobInfo *info) {
+  free(info->hash_context.buffer);
+  info->hash_context.buffer = NULL;
+  free(info->info_header);
+  info->info_header = NULL;
+
+  const Failures result = info->error_code;
   if (result != kFailOk) {
     LogCvmfs(kLogDownload, kLogDebug, "download failed (error %d - %s)", result,
              Code2Ascii(result));
@@ -1676,7 +2853,25 @@ Failures DownloadManager::Fetch(JobInfo *info) {
     }
   }
 
-  return result;
+  NotifyJob(info);
+}
+
+
+void DownloadManager::NotifyJob(JobInfo *info) {
+  CallbackBase<JobInfo *> *callback = info->callback;
+  if (callback == NULL)
+    return;
+  info->callback = NULL;
+  (*callback)(info);
+  delete callback;
+}
+
+
+/**
+ * Used by the blocking Fetch() in multi-threaded mode.
+ */
+void DownloadManager::SignalFetchDone(JobInfo * const &info) {
+  WritePipe(info->wait_at[1], &info->error_code, sizeof(info->error_code));
 }
 
 
@@ -1839,6 +3034,7 @@ void DownloadManager::SwitchProxy(JobInfo *info) {
 
   perf::Inc(counters_->n_proxy_failover);
   string old_proxy = (*opt_proxy_groups_)[opt_proxy_groups_current_][0].url;
+  const unsigned old_group = opt_proxy_groups_current_;
 
   // If all proxies from the current load-balancing group are burned, switch to
   // another group
@@ -1885,7 +3081,8 @@ void DownloadManager::SwitchProxy(JobInfo *info) {
 
   // Select new one
   if ((group_size - opt_proxy_groups_current_burned_) > 0) {
-    int select = prng_.Next(group_size - opt_proxy_groups_current_burned_ + 1);
+    const unsigned select = SelectProxyUnlocked(*group,
+      group_size - opt_proxy_groups_current_burned_ + 1);
 
     // Move selected proxy to front
     const ProxyInfo swap = (*group)[select];
@@ -1898,8 +3095,12 @@ void DownloadManager::SwitchProxy(JobInfo *info) {
            old_proxy.c_str(), (*group)[0].url.c_str());
   LogCvmfs(kLogDownload, kLogDebug, "%d proxies remain in group",
            group_size - opt_proxy_groups_current_burned_);
+  const bool switched_group = (opt_proxy_groups_current_ != old_group);
 
   pthread_mutex_unlock(lock_options_);
+
+  if (switched_group)
+    Prewarm();
 }
 
 
@@ -1952,6 +3153,9 @@ void DownloadManager::SwitchHost(JobInfo *info) {
     }
   }
   pthread_mutex_unlock(lock_options_);
+
+  if (do_switch)
+    Prewarm();
 }
 
 
@@ -2371,7 +3575,10 @@ void DownloadManager::SetProxyChain(
   vector<dns::Host> hosts;
   LogCvmfs(kLogDownload, kLogDebug, "resolving %u proxy addresses",
            hostnames.size());
-  resolver_->ResolveMany(hostnames, &hosts);
+  if (host_cache_ != NULL)
+    host_cache_->ResolveMany(hostnames, &hosts);
+  else
+    resolver_->ResolveMany(hostnames, &hosts);
 
   // Construct opt_proxy_groups_: traverse proxy list in same order and expand
   // names to resolved IP addresses.
@@ -2487,7 +3694,7 @@ void DownloadManager::RebalanceProxiesUnlocked() {
   opt_timestamp_failover_proxies_ = 0;
   opt_proxy_groups_current_burned_ = 1;
   vector<ProxyInfo> *group = &((*opt_proxy_groups_)[opt_proxy_groups_current_]);
-  int select = prng_.Next(group->size());
+  const unsigned select = SelectProxyUnlocked(*group, group->size());
   swap((*group)[select], (*group)[0]);
   // LogCvmfs(kLogDownload, kLogDebug | kLogSyslog,
   //          "switching proxy from %s to %s (rebalance)",
@@ -2495,6 +3702,105 @@ void DownloadManager::RebalanceProxiesUnlocked() {
 }
 
 
+/**
+ * Picks one of the first num_candidates proxies of the group.  With adaptive
+ * proxy selection, the cheaper one of two random candidates is taken ("power
+ * of two choices").  Otherwise the proxy is chosen randomly.
+ */
+unsigned DownloadManager::SelectProxyUnlocked(
+  const vector<ProxyInfo> &group,
+  const unsigned num_candidates)
+{
+  assert((num_candidates > 0) && (num_candidates <= group.size()));
+  const unsigned first = prng_.Next(num_candidates);
+  if (!opt_adaptive_proxies_ || (num_candidates == 1))
+    return first;
+
+  unsigned second = prng_.Next(num_candidates - 1);
+  if (second >= first)
+    second++;
+  const time_t now = time(NULL);
+  const double error_penalty_ms = 1000.0 * opt_timeout_proxy_;
+  return (group[second].stats.Cost(now, error_penalty_ms) <
+          group[first].stats.Cost(now, error_penalty_ms)) ? second : first;
+}
+
+
+/**
+ * Number of proxies of the current load-balancing group that are not burned.
+ * The burned proxies are at the end of the group, the active one at the front
+ * counts as burned, too.
+ */
+unsigned DownloadManager::CountUsableProxiesUnlocked() {
+  const vector<ProxyInfo> &group =
+    (*opt_proxy_groups_)[opt_proxy_groups_current_];
+  const unsigned num_burned =
+    std::max(1U, std::min(opt_proxy_groups_current_burned_,
+                          static_cast<unsigned>(group.size())));
+  return group.size() - num_burned + 1;
+}
+
+
+/**
+ * Adds the outcome of a transfer to the statistics of the proxy that was
+ * used.  Host errors do not count against the proxy.
+ */
+void DownloadManager::UpdateProxyStats(const JobInfo *info) {
+  if (info->proxy.empty() || (info->proxy == "DIRECT"))
+    return;
+  const bool is_proxy_error =
+    (info->error_code == kFailProxyResolve) ||
+    (info->error_code == kFailProxyConnection) ||
+    (info->error_code == kFailProxyHttp);
+  if ((info->error_code != kFailOk) && !is_proxy_error)
+    return;
+
+  double latency = 0.0;
+  double total_time = 0.0;
+  double size = 0.0;
+  curl_easy_getinfo(info->curl_handle, CURLINFO_STARTTRANSFER_TIME, &latency);
+  curl_easy_getinfo(info->curl_handle, CURLINFO_TOTAL_TIME, &total_time);
+  curl_easy_getinfo(info->curl_handle, CURLINFO_SIZE_DOWNLOAD, &size);
+
+  pthread_mutex_lock(lock_options_);
+  if (!opt_proxy_groups_) {
+    pthread_mutex_unlock(lock_options_);
+    return;
+  }
+  for (unsigned i = 0; i < opt_proxy_groups_->size(); ++i) {
+    vector<ProxyInfo> *group = &((*opt_proxy_groups_)[i]);
+    for (unsigned j = 0; j < group->size(); ++j) {
+      if ((*group)[j].url != info->proxy)
+        continue;
+
+      ProxyStats *stats = &((*group)[j].stats);
+      stats->error_rate +=
+        kProxyStatsWeight * ((is_proxy_error ? 1.0 : 0.0) - stats->error_rate);
+      if (!is_proxy_error) {
+        if (stats->latency_ms == 0.0)
+          stats->latency_ms = 1000.0 * latency;
+        else
+          stats->latency_ms +=
+            kProxyStatsWeight * (1000.0 * latency - stats->latency_ms);
+        if ((size >= kProxyStatsMinTransfer) && (total_time > latency)) {
+          const double throughput = size / (total_time - latency);
+          if (stats->throughput == 0.0)
+            stats->throughput = throughput;
+          else
+            stats->throughput +=
+              kProxyStatsWeight * (throughput - stats->throughput);
+        }
+      }
+      stats->num_samples++;
+      stats->timestamp = time(NULL);
+      pthread_mutex_unlock(lock_options_);
+      return;
+    }
+  }
+  pthread_mutex_unlock(lock_options_);
+}
+
+
 void DownloadManager::RebalanceProxies() {
   pthread_mutex_lock(lock_options_);
   RebalanceProxiesUnlocked();
@@ -2525,6 +3831,8 @@ void DownloadManager::SwitchProxyGroup() {
   //          (*opt_proxy_groups_)[opt_proxy_groups_current_][0].c_str());
 
   pthread_mutex_unlock(lock_options_);
+
+  Prewarm();
 }
 
 
@@ -2589,8 +3897,180 @@ void DownloadManager::EnablePipelining() {
 }
 
 
+/**
+ * Multiplexes concurrent requests to the same host as HTTP/2 streams on a
+ * single connection, with at most max_streams streams per connection.  The
+ * limit requires libcurl >= 7.67, older versions ignore it with a warning.
+ * Servers and proxies that do not support HTTP/2 are still used with
+ * HTTP/1.1.  Returns false and leaves HTTP/1.1 in place if libcurl is built
+ * without HTTP/2 support.  Needs to be called before Spawn().
+ */
+bool DownloadManager::EnableHttp2(const unsigned max_streams) {
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  curl_version_info_data *curl_info = curl_version_info(CURLVERSION_NOW);
+  if (curl_info->features & CURL_VERSION_HTTP2) {
+    curl_multi_setopt(curl_multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+    curl_multi_setopt(curl_multi_, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                      static_cast<long>(max_streams));  // NOLINT
+#else
+    LogCvmfs(kLogDownload, kLogDebug | kLogSyslogWarn,
+             "libcurl %s cannot limit the number of HTTP/2 streams per "
+             "connection, ignoring limit of %u streams",
+             curl_info->version, max_streams);
+#endif
+    opt_http2_ = true;
+    return true;
+  }
+#endif
+  LogCvmfs(kLogDownload, kLogDebug | kLogSyslogWarn,
+           "HTTP/2 is not supported by libcurl %s, using HTTP/1.1",
+           curl_version_info(CURLVERSION_NOW)->version);
+  return false;
+}
+
+
 void DownloadManager::EnableRedirects() {
   follow_redirects_ = true;
 }
 
+
+/**
+ * Objects of at least two ranges are downloaded with num_parallel concurrent
+ * range requests.  Values smaller than 2 disable parallel ranges.  The range
+ * size is capped at kMaxMemSize.
+ */
+void DownloadManager::SetParallelRanges(
+  const unsigned num_parallel,
+  const unsigned range_size)
+{
+  assert(range_size > 0);
+  pthread_mutex_lock(lock_options_);
+  opt_parallel_ranges_ = num_parallel;
+  opt_parallel_range_size_ = std::min(range_size, kMaxMemSize);
+  pthread_mutex_unlock(lock_options_);
+}
+
+
+/**
+ * Spreads the requests over the proxies of the current load-balancing group
+ * according to their measured performance.
+ */
+void DownloadManager::EnableAdaptiveProxies() {
+  pthread_mutex_lock(lock_options_);
+  opt_adaptive_proxies_ = true;
+  pthread_mutex_unlock(lock_options_);
+}
+
+
+/**
+ * Duplicates transfers that did not receive data within the given percentile
+ * of the recent latencies to another proxy or host.  Only effective in
+ * multi-threaded mode and to be set before Spawn().
+ */
+void DownloadManager::EnableHedging(const unsigned percentile) {
+  assert((percentile > 0) && (percentile <= 100));
+  opt_hedge_percentile_ = percentile;
+  hedge_latencies_.assign(kHedgeNumSamples, 0);
+  hedge_latencies_next_ = 0;
+  hedge_num_samples_ = 0;
+  hedge_delay_ms_ = -1;
+}
+
+
+
+/**
+ * Opens connections in advance (see Prewarm()).
+ */
+void DownloadManager::EnablePrewarming() {
+  pthread_mutex_lock(lock_options_);
+  opt_prewarm_ = true;
+  pthread_mutex_unlock(lock_options_);
+}
+
+
+/**
+ * Uses the DNS cache and the TLS session cache of another download manager.
+ * Connections are not shared, every manager drives its own multi handle from
+ * its own I/O thread.  Needs to be called right after Init().
+ */
+void DownloadManager::ShareCurlCaches(DownloadManager *other) {
+  assert(pool_handles_idle_->empty() && pool_handles_inuse_->empty());
+  if (curl_share_->Unref())
+    delete curl_share_;
+  curl_share_ = other->curl_share_;
+  curl_share_->Ref();
+}
+
+
+/**
+ * Resolves proxy names through a DNS cache that is shared with other download
+ * managers of the process.  Needs to be set before the proxy chain.  The DNS
+ * server and parameters of the cache's resolver are the ones of the cache,
+ * not the ones of this manager.
+ */
+void DownloadManager::SetHostCache(dns::HostCache *host_cache) {
+  pthread_mutex_lock(lock_options_);
+  host_cache_ = host_cache;
+  pthread_mutex_unlock(lock_options_);
+}
+
+
+/**
+ * Offloads decompression, hashing, and writing of file and sink downloads to
+ * num_threads threads.  Needs to be called before Spawn().
+ */
+void DownloadManager::SetProcessingThreads(const unsigned num_threads) {
+  assert(atomic_xadd32(&multi_threaded_, 0) == 0);
+  opt_num_processing_threads_ = num_threads;
+}
+
+
+/**
+ * Sends a HEAD request for the manifest of the active host through every
+ * usable proxy of the active load-balancing group, or directly to the host.
+ * The requests run in the background.  They resolve the proxy names and leave
+ * idle keep-alive connections behind, so that the first requests after mount
+ * or after switching the host or the proxy group don't pay for the connection
+ * setup.  Only in multi-threaded mode.
+ */
+void DownloadManager::Prewarm() {
+  if (atomic_read32(&multi_threaded_) == 0)
+    return;
+
+  pthread_mutex_lock(lock_options_);
+  if (!opt_prewarm_ || !opt_host_chain_) {
+    pthread_mutex_unlock(lock_options_);
+    return;
+  }
+  const string url =
+    (*opt_host_chain_)[opt_host_chain_current_] + "/.cvmfspublished";
+  unsigned num_requests = 1;
+  if (opt_proxy_groups_ &&
+      ((*opt_proxy_groups_)[opt_proxy_groups_current_][0].url != "DIRECT"))
+  {
+    num_requests = CountUsableProxiesUnlocked();
+  }
+  pthread_mutex_unlock(lock_options_);
+
+  LogCvmfs(kLogDownload, kLogDebug, "pre-warming %u connection(s) for %s",
+           num_requests, url.c_str());
+  for (unsigned i = 0; i < num_requests; ++i) {
+    JobInfo *info = new JobInfo(new string(url), false /* probe_hosts */);
+    // Selects the i-th usable proxy, see SetUrlOptions()
+    info->proxy_offset = i;
+    FetchAsync(info, new Callback<JobInfo *>(OnPrewarmed));
+  }
+  perf::Xadd(counters_->n_prewarm_requests, num_requests);
+}
+
+
+void DownloadManager::OnPrewarmed(JobInfo * const &info) {
+  LogCvmfs(kLogDownload, kLogDebug, "pre-warmed %s via %s (%d - %s)",
+           info->url->c_str(), info->proxy.c_str(), info->error_code,
+           Code2Ascii(info->error_code));
+  delete info->url;
+  delete info;
+}
+
 }  // namespace download
@@ -5,14 +5,18 @@
 #ifndef CVMFS_DOWNLOAD_H_
 #define CVMFS_DOWNLOAD_H_
 
+#ifdef __APPLE__
 #include <poll.h>
+#endif
 #include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
 
 #include <cstdio>
+#include <deque>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "gtest/gtest_prod.h"
@@ -25,6 +29,7 @@
 #include "prng.h"
 #include "sink.h"
 #include "statistics.h"
+#include "util.h"
 
 
 namespace download {
@@ -94,6 +99,17 @@ struct Counters {
   perf::Counter *n_retries;
   perf::Counter *n_proxy_failover;
   perf::Counter *n_host_failover;
+  perf::Counter *n_loop_iterations;
+  perf::Counter *n_loop_syscalls;
+  perf::Counter *sz_job_queue;
+  perf::Counter *n_connections;
+  perf::Counter *n_http2_requests;
+  perf::Counter *n_range_fetches;
+  perf::Counter *n_hedged_requests;
+  perf::Counter *n_hedged_wins;
+  perf::Counter *n_prewarm_requests;
+  perf::Counter *sz_processing_queue;
+  perf::Counter *n_processing_pauses;
 
   Counters(perf::Statistics *statistics, const std::string &name) {
     sz_transferred_bytes = statistics->Register(name + ".sz_transferred_bytes",
@@ -107,10 +123,68 @@ struct Counters {
         "Number of proxy failovers");
     n_host_failover = statistics->Register(name + ".n_host_failover",
         "Number of host failovers");
+    n_loop_iterations = statistics->Register(name + ".n_loop_iterations",
+        "Number of I/O thread event loop iterations");
+    n_loop_syscalls = statistics->Register(name + ".n_loop_syscalls",
+        "Number of system calls for event polling and job dispatch");
+    sz_job_queue = statistics->Register(name + ".sz_job_queue",
+        "Number of submitted jobs not yet picked up by the I/O thread");
+    n_connections = statistics->Register(name + ".n_connections",
+        "Number of new connections (requests per connection: "
+        "n_requests / n_connections)");
+    n_http2_requests = statistics->Register(name + ".n_http2_requests",
+        "Number of requests served as HTTP/2 streams");
+    n_range_fetches = statistics->Register(name + ".n_range_fetches",
+        "Number of downloads split into parallel range requests");
+    n_hedged_requests = statistics->Register(name + ".n_hedged_requests",
+        "Number of slow requests duplicated to another proxy or host");
+    n_hedged_wins = statistics->Register(name + ".n_hedged_wins",
+        "Number of hedged requests served by the duplicate");
+    n_prewarm_requests = statistics->Register(name + ".n_prewarm_requests",
+        "Number of requests that open connections in advance");
+    sz_processing_queue = statistics->Register(name + ".sz_processing_queue",
+        "Number of received bytes waiting for the processing threads");
+    n_processing_pauses = statistics->Register(name + ".n_processing_pauses",
+        "Number of times a transfer waited for the processing threads");
   }
 };  // Counters
 
 
+class DownloadManager;
+
+/**
+ * Received data of a job on its way to the processing threads of the download
+ * manager, see DownloadManager::SetProcessingThreads().  Protected by the
+ * download manager's processing lock.
+ */
+struct ProcessingState {
+  ProcessingState()
+    : queued_bytes(0)
+    , scheduled(false)
+    , paused(false)
+    , resume(false)
+    , notified(false)
+    , transfer_done(false)
+    , curl_error(0)
+    , error_code(kFailOk)
+  { }
+
+  /**
+   * In the order of arrival, processed by one thread at a time
+   */
+  std::deque<std::pair<unsigned char *, size_t> > chunks;
+  size_t queued_bytes;
+  bool scheduled;  ///< In the ready queue or taken by a processing thread
+  bool paused;  ///< curl holds back data until the queue is shorter
+  bool resume;  ///< The I/O thread should unpause the transfer
+  bool notified;  ///< In the I/O thread's notification list
+  bool transfer_done;  ///< Completion waits for the processing threads
+  int curl_error;  ///< Result of the finished transfer
+  Failures error_code;  ///< Set by a processing thread on failure
+};
+
+
+
 /**
  * Contains all the information to specify a download job.
  */
@@ -138,7 +212,8 @@ struct JobInfo {
   const shash::Any *expected_hash;
   const std::string *extra_info;
 
-  // Allow byte ranges to be specified.
+  // Allow byte ranges to be specified.  Without an offset, the range size is
+  // the expected size of the object (used to decide on parallel ranges).
   off_t range_offset;
   off_t range_size;
 
@@ -163,6 +238,8 @@ struct JobInfo {
     expected_hash = NULL;
     extra_info = NULL;
 
+    callback = NULL;
+    next_job = NULL;
     curl_handle = NULL;
     headers = NULL;
     memset(&zstream, 0, sizeof(zstream));
@@ -175,7 +252,14 @@ struct JobInfo {
 
     range_offset = -1;
     range_size = -1;
+    object_size = -1;
+    proxy_offset = 0;
     http_code = -1;
+    hedge = NULL;
+    hedge_origin = NULL;
+    hedge_lost = false;
+    timestamp_ms = 0;
+    processing_mgr = NULL;
   }
 
   // One constructor per destination + head request
@@ -239,6 +323,8 @@ struct JobInfo {
   }
 
   // Internal state, don't touch
+  CallbackBase<JobInfo *> *callback;  /**< Set by FetchAsync() */
+  JobInfo *next_job;  /**< Link in the download manager's job queue */
   CURL *curl_handle;
   curl_slist *headers;
   char *info_header;
@@ -249,6 +335,31 @@ struct JobInfo {
   bool nocache;
   Failures error_code;
   int http_code;
+  /**
+   * Size of the entire object according to the Content-Range header of a
+   * partial response, -1 if unknown
+   */
+  off_t object_size;
+  /**
+   * Spreads the ranges of a parallel download over the proxies of the current
+   * load-balancing group.  Only used for the first attempt.
+   */
+  unsigned proxy_offset;
+  /**
+   * A transfer that did not receive data within the hedge delay is duplicated.
+   * The original and the duplicate are linked through hedge until one of them
+   * receives data; the other one is marked as lost and cancelled.
+   */
+  JobInfo *hedge;
+  JobInfo *hedge_origin;  ///< Set in the duplicate
+  bool hedge_lost;
+  uint64_t timestamp_ms;  ///< Start of the transfer, 0 once data arrived
+  /**
+   * Set if the received data is handed to the processing threads of the
+   * download manager instead of being written by the I/O thread
+   */
+  DownloadManager *processing_mgr;
+  ProcessingState processing;
   unsigned char num_used_proxies;
   unsigned char num_used_hosts;
   unsigned char num_retries;
@@ -287,11 +398,73 @@ class HeaderLists {
 };
 
 
+/**
+ * A curl share handle together with the locks that curl requires to use it
+ * from several threads.  Through the share, download managers use a common
+ * DNS cache and TLS session cache.  The connection cache is not shared: curl
+ * does not support using a shared connection cache from concurrently running
+ * multi handles.  The share is reference counted, the last download manager
+ * deletes it.
+ */
+class CurlShare : SingleCopy {
+ public:
+  CurlShare();
+  ~CurlShare();
+  void Ref() { atomic_inc32(&refcount_); }
+  bool Unref() { return atomic_xadd32(&refcount_, -1) == 1; }
+  CURLSH *handle() { return handle_; }
+
+ private:
+  static void CallbackLock(CURL *handle, curl_lock_data data,
+                           curl_lock_access access, void *userptr);
+  static void CallbackUnlock(CURL *handle, curl_lock_data data, void *userptr);
+
+  CURLSH *handle_;
+  pthread_mutex_t locks_[CURL_LOCK_DATA_LAST];
+  atomic_int32 refcount_;
+};
+
+
 class DownloadManager {
   FRIEND_TEST(T_Download, ValidateGeoReply);
   FRIEND_TEST(T_Download, StripDirect);
+  FRIEND_TEST(T_Download, HeaderStatusLine);
+  FRIEND_TEST(T_Download, CollectNotifiedJob);
+
+  /**
+   * A ready file descriptor as returned by WaitForEvents(), the events are
+   * given as CURL_CSELECT_... bitmask.
+   */
+  struct SocketEvent {
+    SocketEvent(const int fd, const int curl_events)
+      : fd(fd), curl_events(curl_events) { }
+    int fd;
+    int curl_events;
+  };
 
  public:
+  /**
+   * Measured performance of a proxy as exponentially weighted moving averages
+   * of the latency (time to first byte), the throughput, and the rate of
+   * proxy errors.
+   */
+  struct ProxyStats {
+    ProxyStats()
+      : num_samples(0)
+      , latency_ms(0.0)
+      , throughput(0.0)
+      , error_rate(0.0)
+      , timestamp(0)
+    { }
+    double Cost(const time_t now, const double error_penalty_ms) const;
+    std::string Print() const;
+    unsigned num_samples;
+    double latency_ms;
+    double throughput;  ///< bytes per second
+    double error_rate;
+    time_t timestamp;  ///< of the last sample
+  };
+
   struct ProxyInfo {
     ProxyInfo() { }
     explicit ProxyInfo(const std::string &url) : url(url) { }
@@ -302,6 +475,7 @@ class DownloadManager {
     std::string Print();
     dns::Host host;
     std::string url;
+    ProxyStats stats;
   };
 
   enum ProxySetModes {
@@ -329,6 +503,47 @@ class DownloadManager {
    */
   static const unsigned kMaxMemSize;
 
+  /**
+   * Concurrent HTTP/2 streams on a single connection, if not limited
+   * otherwise by the server.
+   */
+  static const unsigned kHttp2DefaultMaxStreams = 100;
+
+  /**
+   * Size of curl's receive buffer, i.e. the maximum amount of data handed to
+   * the data callback at once.  Fewer and larger chunks make the inflate and
+   * hash loops in the download thread cheaper.  Values larger than 16k are
+   * only supported by libcurl >= 7.53.
+   */
+  static const unsigned kCurlBufferSize = 128 * 1024;
+
+  /**
+   * Ranges are downloaded into memory, so they are limited to kMaxMemSize.
+   */
+  static const unsigned kDefaultParallelRangeSize = 1024 * 1024;
+
+  /**
+   * Proxy statistics older than that are ignored for proxy selection, so that
+   * slow or failed proxies are eventually probed again.
+   */
+  static const unsigned kProxyStatsTtl = 60;
+
+  /**
+   * The hedge delay is the configured percentile of the time to the first
+   * byte of the last kHedgeNumSamples successful transfers.  Hedging starts
+   * with kHedgeMinSamples samples.  At most kHedgeMaxInflight duplicates are
+   * in flight at any time.
+   */
+  static const unsigned kHedgeNumSamples = 128;
+  static const unsigned kHedgeMinSamples = 32;
+  static const unsigned kHedgeMaxInflight = 8;
+
+  /**
+   * A transfer is paused if more than kProcessingMaxQueued bytes of it wait
+   * for the processing threads.  It continues once half of it is processed.
+   */
+  static const unsigned kProcessingMaxQueued = 1024 * 1024;
+
   static const unsigned kDnsDefaultRetries = 1;
   static const unsigned kDnsDefaultTimeoutMs = 3000;
 
@@ -342,6 +557,7 @@ class DownloadManager {
   void Fini();
   void Spawn();
   Failures Fetch(JobInfo *info);
+  void FetchAsync(JobInfo *info, CallbackBase<JobInfo *> *callback);
 
   void SetDnsServer(const std::string &address);
   void SetDnsParameters(const unsigned retries, const unsigned timeout_ms);
@@ -381,12 +597,32 @@ class DownloadManager {
   void SetProxyTemplates(const std::string &direct, const std::string &forced);
   void EnableInfoHeader();
   void EnablePipelining();
+  bool EnableHttp2(const unsigned max_streams);
   void EnableRedirects();
+  void SetParallelRanges(const unsigned num_parallel,
+                         const unsigned range_size);
+  void EnableAdaptiveProxies();
+  void EnableHedging(const unsigned percentile);
+  void EnablePrewarming();
+  void ShareCurlCaches(DownloadManager *other);
+  void Prewarm();
+  void SetHostCache(dns::HostCache *host_cache);
+  void SetProcessingThreads(const unsigned num_threads);
+
+  // Used by the curl data callback
+  size_t QueueData(JobInfo *info, const void *ptr, const size_t num_bytes);
 
  private:
+  static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
+                                   void *info_link);
   static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
                                 void *userp, void *socketp);
+  static int CallbackCurlTimer(CURLM *multi, long timeout_ms,  // NOLINT
+                               void *userp);
   static void *MainDownload(void *data);
+  static void *MainProcessing(void *data);
+  static void SignalFetchDone(JobInfo * const &info);
+  static void OnPrewarmed(JobInfo * const &info);
 
   bool StripDirect(const std::string &proxy_list, std::string *cleaned_list);
   bool ValidateGeoReply(const std::string &reply_order,
@@ -395,6 +631,10 @@ class DownloadManager {
   void SwitchHost(JobInfo *info);
   void SwitchProxy(JobInfo *info);
   void RebalanceProxiesUnlocked();
+  unsigned CountUsableProxiesUnlocked();
+  unsigned SelectProxyUnlocked(const std::vector<ProxyInfo> &group,
+                               const unsigned num_candidates);
+  void UpdateProxyStats(const JobInfo *info);
   CURL *AcquireCurlHandle();
   void ReleaseCurlHandle(CURL *handle);
   void InitializeRequest(JobInfo *info, CURL *handle);
@@ -404,6 +644,27 @@ class DownloadManager {
   bool CanRetry(const JobInfo *info);
   void Backoff(JobInfo *info);
   bool VerifyAndFinalize(const int curl_error, JobInfo *info);
+  void CompleteJob(JobInfo *info);
+  void PushJob(JobInfo *info);
+  JobInfo *PopJobs();
+  void WatchFd(const int fd, const int curl_action, const bool is_new);
+  void UnwatchFd(const int fd);
+  void WaitForEvents(const int timeout_ms, std::vector<SocketEvent> *events);
+  void NotifyJob(JobInfo *info);
+  bool IsParallelRangeCandidate(const JobInfo *info);
+  bool FetchRanges(JobInfo *info);
+  JobInfo *StartRange(const JobInfo *info, const off_t offset,
+                      const off_t size, const unsigned proxy_offset);
+  int HedgeSlowTransfers();
+  void StartHedge(JobInfo *info);
+  void DropHedgedTransfer(JobInfo *info);
+  void ReapLostHedges();
+  JobInfo *AdoptHedge(JobInfo *hedge);
+  void UpdateHedgeDelay(CURL *handle);
+  void FinalizeTransfer(JobInfo *info, int curl_error, int *still_running);
+  void NotifyProcessingUnlocked(JobInfo *info);
+  bool CollectProcessing(JobInfo *info, int *curl_error);
+  void HandleProcessingEvents(int *still_running);
   void InitHeaders();
   void FiniHeaders();
 
@@ -414,16 +675,35 @@ class DownloadManager {
   CURLM *curl_multi_;
   HeaderLists *header_lists_;
   curl_slist *default_headers_;
+  CurlShare *curl_share_;
   char *user_agent_;
 
   pthread_t thread_download_;
   atomic_int32 multi_threaded_;
   int pipe_terminate_[2];
 
-  int pipe_jobs_[2];
+  /**
+   * Lock-free stack of submitted jobs, linked through JobInfo::next_job.
+   * FetchAsync() pushes, the I/O thread takes all the jobs at once.
+   */
+  JobInfo *job_stack_;
+  /**
+   * Wakes up the I/O thread when the job stack becomes non-empty.  Both ends
+   * are the same eventfd on Linux, it is a pipe on OS X.
+   */
+  int wakeup_jobs_[2];
+  /**
+   * Timeout of the next curl timer as requested by CallbackCurlTimer(), -1 if
+   * there is none.
+   */
+  int curl_timeout_ms_;
+#ifdef __APPLE__
   struct pollfd *watch_fds_;
   uint32_t watch_fds_size_;
   uint32_t watch_fds_inuse_;
+#else
+  int epoll_fd_;
+#endif
   uint32_t watch_fds_max_;
 
   pthread_mutex_t *lock_options_;
@@ -438,6 +718,71 @@ class DownloadManager {
   bool enable_info_header_;
   bool opt_ipv4_only_;
   bool follow_redirects_;
+  /**
+   * Requests are sent as HTTP/2 streams multiplexed on a connection per host,
+   * if the server supports it
+   */
+  bool opt_http2_;
+  /**
+   * Large objects are fetched with up to opt_parallel_ranges_ concurrent range
+   * requests of opt_parallel_range_size_ bytes.  Zero if disabled.
+   */
+  unsigned opt_parallel_ranges_;
+  unsigned opt_parallel_range_size_;
+  /**
+   * Requests are sent to the better one of two randomly chosen proxies of the
+   * current load-balancing group instead of to the active proxy only.
+   */
+  bool opt_adaptive_proxies_;
+  /**
+   * Percentile of recent latencies after which slow transfers are duplicated,
+   * zero if hedging is disabled.  The remaining hedging state is only used by
+   * the I/O thread.
+   */
+  unsigned opt_hedge_percentile_;
+  /**
+   * Ring buffer of the time to the first byte of recent transfers (ms)
+   */
+  std::vector<uint32_t> hedge_latencies_;
+  unsigned hedge_latencies_next_;
+  unsigned hedge_num_samples_;
+  /**
+   * Recalculated from hedge_latencies_ every few samples, -1 as long as there
+   * are not enough samples
+   */
+  int hedge_delay_ms_;
+  /**
+   * The duplicates in flight
+   */
+  std::vector<JobInfo *> hedges_;
+  /**
+   * Connections to the active proxies or host are opened in advance after
+   * Spawn() and after switching the host or the proxy group
+   */
+  bool opt_prewarm_;
+
+  /**
+   * Decompression, hashing, and writing of the received data of file and sink
+   * downloads is done by opt_num_processing_threads_ threads so that the I/O
+   * thread only receives data.  Zero if the I/O thread processes the data
+   * itself.  The processing state is protected by lock_processing_.
+   */
+  unsigned opt_num_processing_threads_;
+  std::vector<pthread_t> processing_threads_;
+  pthread_mutex_t lock_processing_;
+  pthread_cond_t cond_processing_;
+  /**
+   * Jobs with received data that is not yet processed, in the order in which
+   * the processing threads take them
+   */
+  std::deque<JobInfo *> processing_ready_;
+  /**
+   * Jobs that the I/O thread needs to resume or to finalize.  Only the first
+   * job added to the empty list wakes up the I/O thread.
+   */
+  std::vector<JobInfo *> processing_notify_;
+  int wakeup_processing_[2];
+  bool processing_terminate_;
 
   // Host list
   std::vector<std::string> *opt_host_chain_;
@@ -482,6 +827,13 @@ class DownloadManager {
    */
   dns::NormalResolver *resolver_;
 
+  /**
+   * Optional process-wide DNS cache, not owned.  If set, proxy names are
+   * resolved through the cache instead of resolver_, so that the download
+   * thread does not block on expired DNS entries.
+   */
+  dns::HostCache *host_cache_;
+
   /**
    * If a proxy has IPv4 and IPv6 addresses, which one to prefer
    */
@@ -58,12 +58,31 @@ void PathStore::CopyFrom(const PathStore &other) {
 
 void InodeTracker::InitLock() {
   lock_ =
-    reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
-  int retval = pthread_mutex_init(lock_, NULL);
+    reinterpret_cast<pthread_rwlock_t *>(smalloc(sizeof(pthread_rwlock_t)));
+  int retval = pthread_rwlock_init(lock_, NULL);
   assert(retval == 0);
 }
 
 
+/**
+ * Replaces the contents of the tracker.  Used to migrate the state of an older
+ * version of the inode tracker on reload.
+ */
+void InodeTracker::Import(
+  const PathMap &path_map,
+  const InodeMap &inode_map,
+  const InodeReferences &inode_references,
+  const Statistics &statistics)
+{
+  WriteLock();
+  path_map_ = path_map;
+  inode_map_ = inode_map;
+  inode_references_ = inode_references;
+  statistics_ = statistics;
+  Unlock();
+}
+
+
 void InodeTracker::CopyFrom(const InodeTracker &other) {
   assert(other.version_ == kVersion);
   version_ = kVersion;
@@ -96,7 +115,7 @@ InodeTracker &InodeTracker::operator= (const InodeTracker &other) {
 
 
 InodeTracker::~InodeTracker() {
-  pthread_mutex_destroy(lock_);
+  pthread_rwlock_destroy(lock_);
   free(lock_);
 }
 
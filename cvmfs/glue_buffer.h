@@ -397,6 +397,12 @@ class InodeReferences {
 
 /**
  * Tracks inode reference counters as given by Fuse.
+ *
+ * The maps are protected by a read-write lock.  Path and inode lookups, which
+ * happen on almost every file system call, only take the read lock and can
+ * run concurrently.  Only the kernel's lookup and forget calls modify the maps.
+ * The lock is first tried without blocking, so that contention shows up in the
+ * statistics.
  */
 class InodeTracker {
  public:
@@ -410,6 +416,8 @@ class InodeTracker {
       atomic_init64(&num_hits_inode);
       atomic_init64(&num_hits_path);
       atomic_init64(&num_misses_path);
+      atomic_init64(&num_contended_reads);
+      atomic_init64(&num_contended_writes);
     }
     std::string Print() {
       return
@@ -418,7 +426,11 @@ class InodeTracker {
       "  references: " + StringifyInt(atomic_read64(&num_references)) +
       "  hits(inode): " + StringifyInt(atomic_read64(&num_hits_inode)) +
       "  hits(path): " + StringifyInt(atomic_read64(&num_hits_path)) +
-      "  misses(path): " + StringifyInt(atomic_read64(&num_misses_path));
+      "  misses(path): " + StringifyInt(atomic_read64(&num_misses_path)) +
+      "  contended(read): " +
+        StringifyInt(atomic_read64(&num_contended_reads)) +
+      "  contended(write): " +
+        StringifyInt(atomic_read64(&num_contended_writes));
     }
     atomic_int64 num_inserts;
     atomic_int64 num_removes;
@@ -426,6 +438,12 @@ class InodeTracker {
     atomic_int64 num_hits_inode;
     atomic_int64 num_hits_path;
     atomic_int64 num_misses_path;
+    /**
+     * Number of times the read lock or the write lock was not immediately
+     * available.
+     */
+    atomic_int64 num_contended_reads;
+    atomic_int64 num_contended_writes;
   };
   Statistics GetStatistics() { return statistics_; }
 
@@ -434,9 +452,13 @@ class InodeTracker {
   InodeTracker &operator= (const InodeTracker &other);
   ~InodeTracker();
 
+  void Import(const PathMap &path_map, const InodeMap &inode_map,
+              const InodeReferences &inode_references,
+              const Statistics &statistics);
+
   void VfsGetBy(const uint64_t inode, const uint32_t by, const PathString &path)
   {
-    Lock();
+    WriteLock();
     bool new_inode = inode_references_.Get(inode, by);
     shash::Md5 md5path = path_map_.Insert(path, inode);
     inode_map_.Insert(inode, md5path);
@@ -451,7 +473,7 @@ class InodeTracker {
   }
 
   void VfsPut(const uint64_t inode, const uint32_t by) {
-    Lock();
+    WriteLock();
     bool removed = inode_references_.Put(inode, by);
     if (removed) {
       // TODO(jblomer): pop operation (Lookup+Erase)
@@ -467,7 +489,7 @@ class InodeTracker {
   }
 
   bool FindPath(const uint64_t inode, PathString *path) {
-    Lock();
+    ReadLock();
     shash::Md5 md5path;
     bool found = inode_map_.LookupMd5Path(inode, &md5path);
     if (found) {
@@ -485,7 +507,7 @@ class InodeTracker {
   }
 
   uint64_t FindInode(const PathString &path) {
-    Lock();
+    ReadLock();
     uint64_t inode = path_map_.LookupInode(path);
     Unlock();
     atomic_inc64(&statistics_.num_hits_inode);
@@ -494,21 +516,31 @@ class InodeTracker {
 
 
  private:
-  static const unsigned kVersion = 4;
+  static const unsigned kVersion = 5;
 
   void InitLock();
   void CopyFrom(const InodeTracker &other);
-  inline void Lock() const {
-    int retval = pthread_mutex_lock(lock_);
+  inline void ReadLock() {
+    if (pthread_rwlock_tryrdlock(lock_) == 0)
+      return;
+    atomic_inc64(&statistics_.num_contended_reads);
+    int retval = pthread_rwlock_rdlock(lock_);
+    assert(retval == 0);
+  }
+  inline void WriteLock() {
+    if (pthread_rwlock_trywrlock(lock_) == 0)
+      return;
+    atomic_inc64(&statistics_.num_contended_writes);
+    int retval = pthread_rwlock_wrlock(lock_);
     assert(retval == 0);
   }
   inline void Unlock() const {
-    int retval = pthread_mutex_unlock(lock_);
+    int retval = pthread_rwlock_unlock(lock_);
     assert(retval == 0);
   }
 
   unsigned version_;
-  pthread_mutex_t *lock_;
+  pthread_rwlock_t *lock_;
   PathMap path_map_;
   InodeMap inode_map_;
   InodeReferences inode_references_;
@@ -168,6 +168,11 @@ int cvmfs_globals::Setup(const options &opts) {
   // 4 KB
   retval = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, 32, 128);
   assert(retval == SQLITE_OK);
+  // Let SQlite fetch catalog pages from the memory mapping of the cvmfs VFS
+  const sqlite3_int64 sqlite_mmap_size = sqlite::kMaxMmapSize;
+  retval = sqlite3_config(SQLITE_CONFIG_MMAP_SIZE,
+                          sqlite_mmap_size, sqlite_mmap_size);
+  assert(retval == SQLITE_OK);
 
   // Libcrypto
   libcrypto_locks_ = static_cast<pthread_mutex_t *>(OPENSSL_malloc(
@@ -0,0 +1,146 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "listing_cache.h"
+
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstring>
+
+#include "logging.h"
+#include "lru.h"
+#include "smalloc.h"
+#include "util_concurrency.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs {
+
+ListingCache::ListingCache(
+  const uint64_t arena_size,
+  perf::Statistics *statistics)
+  : arena_size_(arena_size)
+  , head_(0)
+{
+  assert(arena_size_ > 0);
+  int retval = pthread_mutex_init(&lock_, NULL);
+  assert(retval == 0);
+  // Pages are only backed by memory once they are written to
+  arena_ = static_cast<char *>(smmap(arena_size_));
+  index_.Init(16, shash::Md5(shash::AsciiPtr("!")), lru::hasher_md5);
+
+  n_hit_ = statistics->Register("listing_cache.n_hit",
+    "Number of directory listings served from memory");
+  n_miss_ = statistics->Register("listing_cache.n_miss",
+    "Number of directory listings built from the catalogs");
+  n_insert_ = statistics->Register("listing_cache.n_insert",
+    "Number of cached directory listings");
+  n_evict_ = statistics->Register("listing_cache.n_evict",
+    "Number of directory listings evicted from the arena");
+  sz_used_ = statistics->Register("listing_cache.sz_used",
+    "Number of bytes of cached directory listings");
+}
+
+
+ListingCache::~ListingCache() {
+  smunmap(arena_);
+  pthread_mutex_destroy(&lock_);
+}
+
+
+void ListingCache::Drop() {
+  MutexLockGuard guard(&lock_);
+  entries_.clear();
+  index_.Clear();
+  head_ = 0;
+  sz_used_->Set(0);
+}
+
+
+void ListingCache::EvictOldest() {
+  const Entry &oldest = entries_.front();
+  index_.Erase(oldest.key);
+  perf::Inc(n_evict_);
+  perf::Xadd(sz_used_, -static_cast<int64_t>(oldest.size));
+  entries_.pop_front();
+}
+
+
+/**
+ * Copies the listing into the buffer of the arena.  Returns false if the
+ * listing is too large to be cached.
+ */
+bool ListingCache::Insert(
+  const shash::Md5 &key,
+  const char *buffer,
+  const uint64_t size)
+{
+  if ((size == 0) || (size > arena_size_ / 2))
+    return false;
+
+  MutexLockGuard guard(&lock_);
+  // Opened concurrently
+  if (index_.Contains(key))
+    return true;
+
+  if (head_ + size > arena_size_) {
+    // Listings behind the head are older than anything at the beginning of the
+    // arena
+    while (!entries_.empty() && (entries_.front().offset >= head_))
+      EvictOldest();
+    head_ = 0;
+  }
+  // Evict the listings of the previous round that are in the way
+  while (!entries_.empty() &&
+         (entries_.front().offset >= head_) &&
+         (entries_.front().offset < head_ + size))
+  {
+    EvictOldest();
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.offset = head_;
+  entry.size = size;
+  memcpy(arena_ + head_, buffer, size);
+  entries_.push_back(entry);
+  index_.Insert(key, entry);
+  head_ += size;
+
+  perf::Inc(n_insert_);
+  perf::Xadd(sz_used_, size);
+  LogCvmfs(kLogCvmfs, kLogDebug, "cached listing %s (%"PRIu64" bytes)",
+           key.ToString().c_str(), size);
+  return true;
+}
+
+
+/**
+ * On a hit, the listing is copied into the (empty) listing vector.
+ */
+bool ListingCache::Lookup(const shash::Md5 &key, BigVector<char> *listing) {
+  assert(listing->IsEmpty());
+  MutexLockGuard guard(&lock_);
+  Entry entry;
+  if (!index_.Lookup(key, &entry)) {
+    perf::Inc(n_miss_);
+    return false;
+  }
+
+  while (listing->capacity() < entry.size)
+    listing->DoubleCapacity();
+  char *buffer;
+  bool large_alloc;
+  listing->ShareBuffer(&buffer, &large_alloc);
+  memcpy(buffer, arena_ + entry.offset, entry.size);
+  listing->SetSize(entry.size);
+  perf::Inc(n_hit_);
+  return true;
+}
+
+}  // namespace cvmfs
@@ -0,0 +1,80 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_LISTING_CACHE_H_
+#define CVMFS_LISTING_CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+
+#include "bigvector.h"
+#include "hash.h"
+#include "smallhash.h"
+#include "statistics.h"
+#include "util.h"
+
+namespace cvmfs {
+
+/**
+ * Keeps the serialized directory listings (the fuse_add_direntry buffers) of
+ * recently opened directories, so that reopening a large directory does not
+ * require a catalog query for every entry.  Listings are keyed by the md5 of
+ * the directory path.
+ *
+ * The listings are stored back to back in a single anonymous memory mapping
+ * that is used as a ring: new listings are appended at the head, a listing
+ * that does not fit at the end of the arena starts over at the beginning.
+ * Listings that are overwritten are evicted, i.e. the oldest listings go
+ * first.  Listings larger than half of the arena are not cached.
+ *
+ * The serialized listings contain inode numbers, which are only stable for a
+ * given catalog revision.  The cache needs to be dropped on remount.
+ */
+class ListingCache : SingleCopy {
+ public:
+  ListingCache(const uint64_t arena_size, perf::Statistics *statistics);
+  ~ListingCache();
+
+  bool Lookup(const shash::Md5 &key, BigVector<char> *listing);
+  bool Insert(const shash::Md5 &key, const char *buffer, const uint64_t size);
+  void Drop();
+
+  uint64_t arena_size() const { return arena_size_; }
+  unsigned num_entries() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    Entry() : offset(0), size(0) { }
+    shash::Md5 key;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  void EvictOldest();
+
+  pthread_mutex_t lock_;
+  char *arena_;
+  uint64_t arena_size_;
+  /**
+   * Offset of the next listing in the arena
+   */
+  uint64_t head_;
+  /**
+   * In the order of insertion, which is also the order in the arena
+   */
+  std::deque<Entry> entries_;
+  SmallHashDynamic<shash::Md5, Entry> index_;
+
+  perf::Counter *n_hit_;
+  perf::Counter *n_miss_;
+  perf::Counter *n_insert_;
+  perf::Counter *n_evict_;
+  perf::Counter *sz_used_;
+};
+
+}  // namespace cvmfs
+
+#endif  // CVMFS_LISTING_CACHE_H_
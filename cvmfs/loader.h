@@ -92,6 +92,8 @@ enum StateId {
   kStateGlueBufferV4,       // >= 2.1.20
   kStateOpenFilesV2,        // >= 2.1.20
   kStateOpenFilesV3,        // >= 2.2.0
+  kStateGlueBufferV5,       // >= 2.3.0
+  kStateCacheFdTable,       // >= 2.3.0
 };
 
 
@@ -54,6 +54,7 @@
 #include <functional>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "atomic.h"
 #include "directory_entry.h"
@@ -118,6 +119,8 @@ struct Counters {
  */
 template<class Key, class Value>
 class LruCache : SingleCopy {
+  template<class K, class V> friend class ShardedLruCache;
+
  private:
   // Forward declarations of private internal data structures
   template<class T> class ListEntry;
@@ -539,6 +542,33 @@ class LruCache : SingleCopy {
     perf::Xadd(counters_.sz_allocated, allocator_.bytes_allocated() +
                   cache_.bytes_allocated());
 
+#ifdef LRU_CACHE_THREAD_SAFE
+    int retval = pthread_mutex_init(&lock_, NULL);
+    assert(retval == 0);
+#endif
+  }
+
+  /**
+   * Creates a shard of a ShardedLruCache.  The shards share the counters of
+   * the sharded cache.
+   */
+  LruCache(const unsigned   cache_size,
+           const Key       &empty_key,
+           uint32_t (*hasher)(const Key &key),
+           const Counters  &counters) :
+    counters_(counters),
+    pause_(false),
+    cache_gauge_(0),
+    cache_size_(cache_size),
+    allocator_(cache_size),
+    lru_list_(&allocator_)
+  {
+    assert(cache_size > 0);
+
+    cache_.Init(cache_size_, empty_key, hasher);
+    perf::Xadd(counters_.sz_allocated, allocator_.bytes_allocated() +
+                  cache_.bytes_allocated());
+
 #ifdef LRU_CACHE_THREAD_SAFE
     int retval = pthread_mutex_init(&lock_, NULL);
     assert(retval == 0);
@@ -666,9 +696,7 @@ class LruCache : SingleCopy {
   virtual void Drop() {
     this->Lock();
 
-    cache_gauge_ = 0;
-    lru_list_.clear();
-    cache_.Clear();
+    DoDrop();
     perf::Inc(counters_.n_drop);
     counters_.sz_allocated->Set(0);
     perf::Xadd(counters_.sz_allocated, allocator_.bytes_allocated() +
@@ -715,6 +743,15 @@ class LruCache : SingleCopy {
     return cache_.Lookup(key, entry);
   }
 
+  /**
+   * Removes all entries without touching the counters
+   */
+  inline void DoDrop() {
+    cache_gauge_ = 0;
+    lru_list_.clear();
+    cache_.Clear();
+  }
+
   /**
    * Touch an entry.
    * The entry will be moved to the back of the LRU list to mark it
@@ -777,6 +814,150 @@ class LruCache : SingleCopy {
 #endif
 };  // class LruCache
 
+
+/**
+ * Lock striping for LruCache.  The key space is split by the key hash into a
+ * number of independent LRU caches ("shards"), each protected by its own lock.
+ * Threads that look up different keys then rarely contend for the same mutex.
+ * The least recently used entry is evicted per shard, so the LRU order is only
+ * maintained approximately for the cache as a whole.  All shards update the
+ * same counters.
+ *
+ * With a single shard, the sharded cache behaves like a plain LruCache.
+ */
+template<class Key, class Value>
+class ShardedLruCache : SingleCopy {
+ public:
+  /**
+   * The cache is split into fewer shards rather than into shards smaller than
+   * this.
+   */
+  static const unsigned kMinShardSize = 1024;
+  static const unsigned kMaxShards = 64;
+
+  /**
+   * @param max_shards the number of shards is the largest power of 2 below
+   *        max_shards that respects kMinShardSize
+   */
+  ShardedLruCache(const unsigned    cache_size,
+                  const Key        &empty_key,
+                  uint32_t (*hasher)(const Key &key),
+                  perf::Statistics *statistics,
+                  const std::string &name,
+                  const unsigned    max_shards) :
+    counters_(statistics, name),
+    hasher_(hasher),
+    num_shards_(1)
+  {
+    assert(cache_size > 0);
+
+    unsigned limit = max_shards;
+    if (limit > kMaxShards)
+      limit = kMaxShards;
+    while ((2 * num_shards_ <= limit) &&
+           (cache_size / (2 * num_shards_) >= kMinShardSize))
+    {
+      num_shards_ *= 2;
+    }
+    // The size of the shards has to be a multiple of 64, too
+    const unsigned shard_size = (num_shards_ == 1) ?
+      cache_size : ((cache_size / num_shards_) & ~63U);
+
+    counters_.sz_size->Set(shard_size * num_shards_);
+    for (unsigned i = 0; i < num_shards_; ++i) {
+      shards_.push_back(
+        new LruCache<Key, Value>(shard_size, empty_key, hasher, counters_));
+    }
+  }
+
+  static double GetEntrySize() {
+    return LruCache<Key, Value>::GetEntrySize();
+  }
+
+  virtual ~ShardedLruCache() {
+    for (unsigned i = 0; i < num_shards_; ++i)
+      delete shards_[i];
+  }
+
+  bool Insert(const Key &key, const Value &value) {
+    return GetShard(key)->Insert(key, value);
+  }
+
+  bool Lookup(const Key &key, Value *value) {
+    return GetShard(key)->Lookup(key, value);
+  }
+
+  bool Forget(const Key &key) {
+    return GetShard(key)->Forget(key);
+  }
+
+  void Drop() {
+    for (unsigned i = 0; i < num_shards_; ++i) {
+      shards_[i]->Lock();
+      shards_[i]->DoDrop();
+      shards_[i]->Unlock();
+    }
+    perf::Inc(counters_.n_drop);
+  }
+
+  void Pause() {
+    for (unsigned i = 0; i < num_shards_; ++i)
+      shards_[i]->Pause();
+  }
+
+  void Resume() {
+    for (unsigned i = 0; i < num_shards_; ++i)
+      shards_[i]->Resume();
+  }
+
+  bool IsFull() const {
+    for (unsigned i = 0; i < num_shards_; ++i) {
+      if (!shards_[i]->IsFull())
+        return false;
+    }
+    return true;
+  }
+
+  bool IsEmpty() const {
+    for (unsigned i = 0; i < num_shards_; ++i) {
+      if (!shards_[i]->IsEmpty())
+        return false;
+    }
+    return true;
+  }
+
+  Counters counters() {
+    Counters result = counters_;
+    result.num_collisions = 0;
+    result.max_collisions = 0;
+    for (unsigned i = 0; i < num_shards_; ++i) {
+      const Counters shard_counters = shards_[i]->counters();
+      result.num_collisions += shard_counters.num_collisions;
+      result.max_collisions =
+        std::max(result.max_collisions, shard_counters.max_collisions);
+    }
+    return result;
+  }
+
+  unsigned num_shards() const { return num_shards_; }
+
+ protected:
+  Counters counters_;
+
+ private:
+  /**
+   * The shard is selected by the lower bits of the hash whereas the hash
+   * tables inside the shards use the higher bits.
+   */
+  inline LruCache<Key, Value> *GetShard(const Key &key) {
+    return shards_[hasher_(key) & (num_shards_ - 1)];
+  }
+
+  uint32_t (*hasher_)(const Key &key);
+  unsigned num_shards_;
+  std::vector<LruCache<Key, Value> *> shards_;
+};  // class ShardedLruCache
+
 // Hash functions
 static inline uint32_t hasher_md5(const shash::Md5 &key) {
   // Don't start with the first bytes, because == is using them as well
@@ -790,12 +971,14 @@ static inline uint32_t hasher_inode(const fuse_ino_t &inode) {
 // uint32_t hasher_inode(const fuse_ino_t &inode);
 
 
-class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
+class InodeCache : public ShardedLruCache<fuse_ino_t, catalog::DirectoryEntry>
 {
  public:
-  explicit InodeCache(unsigned int cache_size, perf::Statistics *statistics) :
-    LruCache<fuse_ino_t, catalog::DirectoryEntry>(
-      cache_size, fuse_ino_t(-1), hasher_inode, statistics, "inode_cache")
+  InodeCache(unsigned int cache_size, perf::Statistics *statistics,
+             unsigned max_shards = 1) :
+    ShardedLruCache<fuse_ino_t, catalog::DirectoryEntry>(
+      cache_size, fuse_ino_t(-1), hasher_inode, statistics, "inode_cache",
+      max_shards)
   {
   }
 
@@ -803,13 +986,15 @@ class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
     LogCvmfs(kLogLru, kLogDebug, "insert inode --> dirent: %u -> '%s'",
              inode, dirent.name().c_str());
     const bool result =
-      LruCache<fuse_ino_t, catalog::DirectoryEntry>::Insert(inode, dirent);
+      ShardedLruCache<fuse_ino_t, catalog::DirectoryEntry>::Insert(inode,
+                                                                   dirent);
     return result;
   }
 
   bool Lookup(const fuse_ino_t &inode, catalog::DirectoryEntry *dirent) {
     const bool result =
-      LruCache<fuse_ino_t, catalog::DirectoryEntry>::Lookup(inode, dirent);
+      ShardedLruCache<fuse_ino_t, catalog::DirectoryEntry>::Lookup(inode,
+                                                                   dirent);
     LogCvmfs(kLogLru, kLogDebug, "lookup inode --> dirent: %u (%s)",
              inode, result ? "hit" : "miss");
     return result;
@@ -817,16 +1002,17 @@ class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
 
   void Drop() {
     LogCvmfs(kLogLru, kLogDebug, "dropping inode cache");
-    LruCache<fuse_ino_t, catalog::DirectoryEntry>::Drop();
+    ShardedLruCache<fuse_ino_t, catalog::DirectoryEntry>::Drop();
   }
 };  // InodeCache
 
 
-class PathCache : public LruCache<fuse_ino_t, PathString> {
+class PathCache : public ShardedLruCache<fuse_ino_t, PathString> {
  public:
-  explicit PathCache(unsigned int cache_size, perf::Statistics *statistics) :
-    LruCache<fuse_ino_t, PathString>(cache_size, fuse_ino_t(-1), hasher_inode,
-        statistics, "path_cache")
+  PathCache(unsigned int cache_size, perf::Statistics *statistics,
+            unsigned max_shards = 1) :
+    ShardedLruCache<fuse_ino_t, PathString>(cache_size, fuse_ino_t(-1),
+        hasher_inode, statistics, "path_cache", max_shards)
   {
   }
 
@@ -834,13 +1020,13 @@ class PathCache : public LruCache<fuse_ino_t, PathString> {
     LogCvmfs(kLogLru, kLogDebug, "insert inode --> path %u -> '%s'",
              inode, path.c_str());
     const bool result =
-      LruCache<fuse_ino_t, PathString>::Insert(inode, path);
+      ShardedLruCache<fuse_ino_t, PathString>::Insert(inode, path);
     return result;
   }
 
   bool Lookup(const fuse_ino_t &inode, PathString *path) {
     const bool found =
-      LruCache<fuse_ino_t, PathString>::Lookup(inode, path);
+      ShardedLruCache<fuse_ino_t, PathString>::Lookup(inode, path);
     LogCvmfs(kLogLru, kLogDebug, "lookup inode --> path: %u (%s)",
              inode, found ? "hit" : "miss");
     return found;
@@ -848,19 +1034,20 @@ class PathCache : public LruCache<fuse_ino_t, PathString> {
 
   void Drop() {
     LogCvmfs(kLogLru, kLogDebug, "dropping path cache");
-    LruCache<fuse_ino_t, PathString>::Drop();
+    ShardedLruCache<fuse_ino_t, PathString>::Drop();
   }
 };  // PathCache
 
 
 class Md5PathCache :
-  public LruCache<shash::Md5, catalog::DirectoryEntry>
+  public ShardedLruCache<shash::Md5, catalog::DirectoryEntry>
 {
  public:
-  explicit Md5PathCache(unsigned int cache_size, perf::Statistics *statistics) :
-    LruCache<shash::Md5, catalog::DirectoryEntry>(
+  Md5PathCache(unsigned int cache_size, perf::Statistics *statistics,
+               unsigned max_shards = 1) :
+    ShardedLruCache<shash::Md5, catalog::DirectoryEntry>(
       cache_size, shash::Md5(shash::AsciiPtr("!")), hasher_md5, statistics,
-      "md5_path_cache")
+      "md5_path_cache", max_shards)
   {
     dirent_negative_ = catalog::DirectoryEntry(catalog::kDirentNegative);
   }
@@ -869,7 +1056,8 @@ class Md5PathCache :
     LogCvmfs(kLogLru, kLogDebug, "insert md5 --> dirent: %s -> '%s'",
              hash.ToString().c_str(), dirent.name().c_str());
     const bool result =
-      LruCache<shash::Md5, catalog::DirectoryEntry>::Insert(hash, dirent);
+      ShardedLruCache<shash::Md5, catalog::DirectoryEntry>::Insert(hash,
+                                                                   dirent);
     return result;
   }
 
@@ -882,7 +1070,8 @@ class Md5PathCache :
 
   bool Lookup(const shash::Md5 &hash, catalog::DirectoryEntry *dirent) {
     const bool result =
-      LruCache<shash::Md5, catalog::DirectoryEntry>::Lookup(hash, dirent);
+      ShardedLruCache<shash::Md5, catalog::DirectoryEntry>::Lookup(hash,
+                                                                   dirent);
     LogCvmfs(kLogLru, kLogDebug, "lookup md5 --> dirent: %s (%s)",
              hash.ToString().c_str(), result ? "hit" : "miss");
     return result;
@@ -891,18 +1080,81 @@ class Md5PathCache :
   bool Forget(const shash::Md5 &hash) {
     LogCvmfs(kLogLru, kLogDebug, "forget md5: %s",
              hash.ToString().c_str());
-    return LruCache<shash::Md5, catalog::DirectoryEntry>::Forget(hash);
+    return ShardedLruCache<shash::Md5, catalog::DirectoryEntry>::Forget(hash);
   }
 
   void Drop() {
     LogCvmfs(kLogLru, kLogDebug, "dropping md5path cache");
-    LruCache<shash::Md5, catalog::DirectoryEntry>::Drop();
+    ShardedLruCache<shash::Md5, catalog::DirectoryEntry>::Drop();
   }
 
  private:
   catalog::DirectoryEntry dirent_negative_;
 };  // Md5PathCache
 
+
+/**
+ * Key of the negative lookup cache: a name in a directory.  The name is stored
+ * as md5 hash in order to keep the entries small.
+ */
+struct DirectoryName {
+  DirectoryName() : parent(fuse_ino_t(-1)) { }
+  DirectoryName(const fuse_ino_t p, const shash::Md5 &n) : parent(p), name(n)
+  { }
+  bool operator ==(const DirectoryName &other) const {
+    return (parent == other.parent) && (name == other.name);
+  }
+  bool operator !=(const DirectoryName &other) const {
+    return !(*this == other);
+  }
+
+  fuse_ino_t parent;
+  shash::Md5 name;
+};
+
+static inline uint32_t hasher_directory_name(const DirectoryName &key) {
+  return MurmurHash2(&key.parent, sizeof(key.parent), hasher_md5(key.name));
+}
+
+
+/**
+ * Remembers names that do not exist in a directory.  Search path probing
+ * (e.g. by interpreters) results in many lookups of names that do not exist.
+ * With this cache, these lookups neither need to construct the full path nor
+ * query the catalogs.  Parent inodes are only stable for a given catalog
+ * revision, so the cache needs to be dropped on every remount.
+ */
+class NegativeCache : public ShardedLruCache<DirectoryName, bool> {
+ public:
+  NegativeCache(unsigned int cache_size, perf::Statistics *statistics,
+                unsigned max_shards = 1) :
+    ShardedLruCache<DirectoryName, bool>(cache_size, DirectoryName(),
+        hasher_directory_name, statistics, "negative_cache", max_shards)
+  {
+  }
+
+  bool Insert(const fuse_ino_t parent, const char *name) {
+    LogCvmfs(kLogLru, kLogDebug, "insert negative --> %"PRIu64"/%s",
+             uint64_t(parent), name);
+    return ShardedLruCache<DirectoryName, bool>::Insert(
+      DirectoryName(parent, shash::Md5(name, strlen(name))), true);
+  }
+
+  bool Lookup(const fuse_ino_t parent, const char *name) {
+    bool value;
+    const bool result = ShardedLruCache<DirectoryName, bool>::Lookup(
+      DirectoryName(parent, shash::Md5(name, strlen(name))), &value);
+    LogCvmfs(kLogLru, kLogDebug, "lookup negative --> %"PRIu64"/%s (%s)",
+             uint64_t(parent), name, result ? "hit" : "miss");
+    return result;
+  }
+
+  void Drop() {
+    LogCvmfs(kLogLru, kLogDebug, "dropping negative cache");
+    ShardedLruCache<DirectoryName, bool>::Drop();
+  }
+};  // NegativeCache
+
 }  // namespace lru
 
 #endif  // CVMFS_LRU_H_
@@ -0,0 +1,265 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include "cvmfs_config.h"
+#include "prefetch.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+#include "fetch.h"
+#include "logging.h"
+#include "murmur.h"
+#include "smalloc.h"
+#include "util_concurrency.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs {
+
+const unsigned ChunkPrefetcher::kSequentialThreshold;
+const unsigned ChunkPrefetcher::kMaxNumThreads;
+const unsigned ChunkPrefetcher::kMaxQueueLength;
+
+
+static inline uint32_t hasher_handle(const uint64_t &value) {
+  return MurmurHash2(&value, sizeof(value), 0x07387a4f);
+}
+
+
+ChunkPrefetcher::ChunkPrefetcher(
+  Fetcher *fetcher,
+  Fetcher *external_fetcher,
+  const unsigned window,
+  const unsigned num_eager,
+  perf::Statistics *statistics)
+  : fetcher_(fetcher)
+  , external_fetcher_(external_fetcher)
+  , window_(window)
+  , num_eager_(num_eager)
+  , num_threads_(std::min(std::max(window, num_eager), kMaxNumThreads))
+  , spawned_(false)
+  , terminate_(false)
+{
+  assert(num_threads_ > 0);
+  handles_.Init(16, uint64_t(-1), hasher_handle);
+
+  lock_ =
+    reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
+  int retval = pthread_mutex_init(lock_, NULL);
+  assert(retval == 0);
+  cond_jobs_ =
+    reinterpret_cast<pthread_cond_t *>(smalloc(sizeof(pthread_cond_t)));
+  retval = pthread_cond_init(cond_jobs_, NULL);
+  assert(retval == 0);
+
+  sz_window_ = statistics->Register("prefetch.sz_window",
+    "number of chunks read ahead of a sequential reader");
+  sz_window_->Set(window_);
+  n_scheduled_ = statistics->Register("prefetch.n_scheduled",
+    "overall number of chunks queued for prefetching");
+  n_dropped_ = statistics->Register("prefetch.n_dropped",
+    "overall number of prefetch requests dropped due to a full queue");
+  n_hit_ = statistics->Register("prefetch.n_hit",
+    "overall number of chunk switches served by a prefetched chunk");
+  n_miss_ = statistics->Register("prefetch.n_miss",
+    "overall number of chunk switches of sequential readers not prefetched");
+  n_failed_ = statistics->Register("prefetch.n_failed",
+    "overall number of failed prefetches");
+  n_eager_ = statistics->Register("prefetch.n_eager",
+    "overall number of chunks queued on the first open of a file");
+}
+
+
+ChunkPrefetcher::~ChunkPrefetcher() {
+  pthread_mutex_lock(lock_);
+  terminate_ = true;
+  jobs_.clear();
+  pthread_cond_broadcast(cond_jobs_);
+  pthread_mutex_unlock(lock_);
+  for (unsigned i = 0; i < threads_.size(); ++i)
+    pthread_join(threads_[i], NULL);
+
+  pthread_cond_destroy(cond_jobs_);
+  free(cond_jobs_);
+  pthread_mutex_destroy(lock_);
+  free(lock_);
+}
+
+
+/**
+ * Removes the access pattern of a released chunk handle.  Already queued
+ * prefetches still go through.
+ */
+void ChunkPrefetcher::Forget(const uint64_t chunk_handle) {
+  MutexLockGuard lock_guard(lock_);
+  handles_.Erase(chunk_handle);
+}
+
+
+void *ChunkPrefetcher::MainPrefetch(void *data) {
+  ChunkPrefetcher *prefetcher = reinterpret_cast<ChunkPrefetcher *>(data);
+  LogCvmfs(kLogCvmfs, kLogDebug, "starting prefetch thread");
+
+  while (true) {
+    pthread_mutex_lock(prefetcher->lock_);
+    while (prefetcher->jobs_.empty() && !prefetcher->terminate_)
+      pthread_cond_wait(prefetcher->cond_jobs_, prefetcher->lock_);
+    if (prefetcher->terminate_) {
+      pthread_mutex_unlock(prefetcher->lock_);
+      break;
+    }
+    Job job = prefetcher->jobs_.front();
+    prefetcher->jobs_.pop_front();
+    pthread_mutex_unlock(prefetcher->lock_);
+
+    Fetcher *fetcher = job.external_data ?
+                       prefetcher->external_fetcher_ : prefetcher->fetcher_;
+    int fd = fetcher->Fetch(job.id, job.size, job.verbose_path,
+                            job.compression_alg, job.object_type,
+                            job.alt_url, job.range_offset);
+    if (fd >= 0) {
+      fetcher->cache_mgr()->Close(fd);
+    } else {
+      LogCvmfs(kLogCvmfs, kLogDebug, "failed to prefetch %s (%d)",
+               job.id.ToString().c_str(), fd);
+      perf::Inc(prefetcher->n_failed_);
+    }
+  }
+
+  LogCvmfs(kLogCvmfs, kLogDebug, "stopping prefetch thread");
+  return NULL;
+}
+
+
+/**
+ * Called by the Fuse module when a read() on a chunk handle opens a new chunk.
+ * Sequential readers get the next window_ chunks queued for download.
+ */
+void ChunkPrefetcher::OnChunkAccess(
+  const uint64_t chunk_handle,
+  const FileChunkReflist &chunks,
+  const unsigned chunk_idx,
+  const cache::CacheManager::ObjectType object_type)
+{
+  assert(chunks.list != NULL);
+  if (window_ == 0)
+    return;
+
+  MutexLockGuard lock_guard(lock_);
+  HandleState state;
+  if (!handles_.Lookup(chunk_handle, &state)) {
+    state.last_idx = chunk_idx;
+    state.streak = (chunk_idx == 0) ? 1 : 0;
+  } else {
+    if (chunk_idx == state.last_idx)
+      return;
+    if ((chunk_idx >= state.prefetch_begin) &&
+        (chunk_idx < state.prefetch_end))
+    {
+      perf::Inc(n_hit_);
+    } else if (state.streak >= kSequentialThreshold) {
+      perf::Inc(n_miss_);
+    }
+    state.streak = (chunk_idx == state.last_idx + 1) ? state.streak + 1 : 0;
+    state.last_idx = chunk_idx;
+  }
+
+  if (state.streak >= kSequentialThreshold) {
+    unsigned from = chunk_idx + 1;
+    const bool extend_range = state.prefetch_end > from;
+    if (extend_range)
+      from = state.prefetch_end;
+    const unsigned to = chunk_idx + 1 + window_;
+
+    const unsigned end = Schedule(chunks, from, to, object_type);
+    if (end > from) {
+      if (!extend_range)
+        state.prefetch_begin = from;
+      state.prefetch_end = end;
+    }
+  }
+
+  handles_.Insert(chunk_handle, state);
+}
+
+
+/**
+ * Called by the Fuse module when the chunk list of a file is loaded, i.e. on
+ * the first open() of the file.  The first num_eager_ chunks are queued at
+ * once so that the workers download them in parallel.
+ */
+void ChunkPrefetcher::OnOpen(
+  const FileChunkReflist &chunks,
+  const cache::CacheManager::ObjectType object_type)
+{
+  assert(chunks.list != NULL);
+  if (num_eager_ == 0)
+    return;
+
+  MutexLockGuard lock_guard(lock_);
+  const unsigned end = Schedule(chunks, 0, num_eager_, object_type);
+  perf::Xadd(n_eager_, end);
+}
+
+
+/**
+ * Queues the chunks [from, to) for download, as far as they exist and as long
+ * as there is space in the queue.  Returns the end of the queued range.  Needs
+ * to be called with lock_ held.
+ */
+unsigned ChunkPrefetcher::Schedule(
+  const FileChunkReflist &chunks,
+  const unsigned from,
+  const unsigned to,
+  const cache::CacheManager::ObjectType object_type)
+{
+  const unsigned end = std::min(to, static_cast<unsigned>(chunks.list->size()));
+  unsigned i = from;
+  for (; i < end; ++i) {
+    if (jobs_.size() >= kMaxQueueLength) {
+      perf::Inc(n_dropped_);
+      break;
+    }
+    const FileChunk *chunk = chunks.list->AtPtr(i);
+    Job job;
+    job.id = chunk->content_hash();
+    job.size = chunk->size();
+    job.compression_alg = chunks.compression_alg;
+    job.object_type = object_type;
+    job.verbose_path = "Part of " + chunks.path.ToString();
+    job.external_data = chunks.external_data;
+    if (chunks.external_data) {
+      job.alt_url = chunks.path.ToString();
+      job.range_offset = chunk->offset();
+    }
+    jobs_.push_back(job);
+    perf::Inc(n_scheduled_);
+  }
+
+  if (i > from) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "prefetching chunks [%u-%u) of %s",
+             from, i, chunks.path.c_str());
+    pthread_cond_broadcast(cond_jobs_);
+  }
+  return i;
+}
+
+
+/**
+ * Starts the worker threads.  Needs to be called after the Fuse module forked
+ * into the background.
+ */
+void ChunkPrefetcher::Spawn() {
+  assert(!spawned_);
+  threads_.resize(num_threads_);
+  for (unsigned i = 0; i < num_threads_; ++i) {
+    int retval = pthread_create(&threads_[i], NULL, MainPrefetch, this);
+    assert(retval == 0);
+  }
+  spawned_ = true;
+}
+
+}  // namespace cvmfs
@@ -0,0 +1,156 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_PREFETCH_H_
+#define CVMFS_PREFETCH_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "compression.h"
+#include "file_chunk.h"
+#include "gtest/gtest_prod.h"
+#include "hash.h"
+#include "smallhash.h"
+#include "statistics.h"
+#include "util.h"
+
+namespace cvmfs {
+
+class Fetcher;
+
+/**
+ * Read-ahead for chunked files.  The Fuse module reports to the prefetcher
+ * whenever a read() on a chunk handle moves to a different chunk.  If a handle
+ * walks through the file chunk by chunk, the next "window" chunks are queued
+ * and a small pool of worker threads pulls them into the cache through the
+ * regular Fetcher.  The Fetcher collapses concurrent downloads of the same
+ * object, so a reader that catches up with the prefetcher waits for the
+ * download in flight instead of starting a second one.
+ *
+ * In addition, the first chunks of a file can be queued eagerly when the file
+ * is opened for the first time.  The download of the head of large files then
+ * takes roughly one round trip instead of one round trip per chunk.
+ *
+ * The per-handle state is kept here and not in ChunkFd because ChunkFd is part
+ * of the state that survives a reload of the Fuse module.
+ */
+class ChunkPrefetcher : SingleCopy {
+  FRIEND_TEST(T_ChunkPrefetcher, SequentialDetection);
+
+ public:
+  /**
+   * Number of consecutive chunk transitions (including the first read at the
+   * beginning of the file) before a handle is considered a sequential reader.
+   */
+  static const unsigned kSequentialThreshold = 2;
+  static const unsigned kMaxNumThreads = 16;
+  /**
+   * Prefetch requests beyond this queue length are dropped.
+   */
+  static const unsigned kMaxQueueLength = 1024;
+
+  ChunkPrefetcher(Fetcher *fetcher,
+                  Fetcher *external_fetcher,
+                  const unsigned window,
+                  const unsigned num_eager,
+                  perf::Statistics *statistics);
+  ~ChunkPrefetcher();
+  void Spawn();
+
+  void OnChunkAccess(const uint64_t chunk_handle,
+                     const FileChunkReflist &chunks,
+                     const unsigned chunk_idx,
+                     const cache::CacheManager::ObjectType object_type);
+  void OnOpen(const FileChunkReflist &chunks,
+              const cache::CacheManager::ObjectType object_type);
+  void Forget(const uint64_t chunk_handle);
+
+  unsigned window() const { return window_; }
+  unsigned num_eager() const { return num_eager_; }
+  unsigned num_threads() const { return num_threads_; }
+
+ private:
+  /**
+   * Access pattern of a single chunk handle.  Prefetched chunks are in the
+   * range [prefetch_begin, prefetch_end).
+   */
+  struct HandleState {
+    HandleState()
+      : last_idx(0), streak(0), prefetch_begin(0), prefetch_end(0) { }
+    unsigned last_idx;
+    unsigned streak;
+    unsigned prefetch_begin;
+    unsigned prefetch_end;
+  };
+
+  /**
+   * Self-contained copy of everything the Fetcher needs.  The chunk list of
+   * the file might be gone by the time a worker picks up the job.
+   */
+  struct Job {
+    Job()
+      : size(0)
+      , compression_alg(zlib::kZlibDefault)
+      , object_type(cache::CacheManager::kTypeRegular)
+      , range_offset(-1)
+      , external_data(false)
+    { }
+    shash::Any id;
+    uint64_t size;
+    zlib::Algorithms compression_alg;
+    cache::CacheManager::ObjectType object_type;
+    std::string verbose_path;
+    std::string alt_url;
+    off_t range_offset;
+    bool external_data;
+  };
+
+  static void *MainPrefetch(void *data);
+  unsigned Schedule(const FileChunkReflist &chunks,
+                    const unsigned from,
+                    const unsigned to,
+                    const cache::CacheManager::ObjectType object_type);
+
+  Fetcher *fetcher_;
+  Fetcher *external_fetcher_;
+  /**
+   * Number of chunks read ahead of a sequential reader, 0 if disabled
+   */
+  unsigned window_;
+  /**
+   * Number of chunks queued on the first open of a file, 0 if disabled
+   */
+  unsigned num_eager_;
+  unsigned num_threads_;
+  bool spawned_;
+  bool terminate_;
+
+  SmallHashDynamic<uint64_t, HandleState> handles_;
+  std::deque<Job> jobs_;
+  std::vector<pthread_t> threads_;
+  /**
+   * Protects handles_, jobs_, and terminate_
+   */
+  pthread_mutex_t *lock_;
+  pthread_cond_t *cond_jobs_;
+
+  perf::Counter *sz_window_;
+  perf::Counter *n_scheduled_;
+  perf::Counter *n_dropped_;
+  perf::Counter *n_hit_;
+  perf::Counter *n_miss_;
+  perf::Counter *n_failed_;
+  perf::Counter *n_eager_;
+};
+
+}  // namespace cvmfs
+
+#endif  // CVMFS_PREFETCH_H_
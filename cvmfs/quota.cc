@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
@@ -47,6 +48,7 @@
 #include "logging.h"
 #include "monitor.h"
 #include "platform.h"
+#include "shm_ring.h"
 #include "smalloc.h"
 #include "statistics.h"
 #include "util.h"
@@ -54,7 +56,7 @@
 
 using namespace std;  // NOLINT
 
-const uint32_t QuotaManager::kProtocolRevision = 2;
+const uint32_t QuotaManager::kProtocolRevision = 3;
 
 void QuotaManager::BroadcastBackchannels(const string &message) {
   assert(message.length() > 0);
@@ -139,6 +141,74 @@ void PosixQuotaManager::CheckHighPinWatermark() {
 }
 
 
+/**
+ * Writes the changes of the in-memory index since the last checkpoint to the
+ * cache database in a single transaction.
+ */
+void PosixQuotaManager::Checkpoint() {
+  last_checkpoint_ = platform_monotonic_time();
+  vector<shash::Any> hashes;
+  index_.TakePending(&hashes);
+  if (hashes.empty())
+    return;
+
+  int retval = sqlite3_exec(database_, "BEGIN", NULL, NULL, NULL);
+  assert(retval == SQLITE_OK);
+
+  for (unsigned i = 0; i < hashes.size(); ++i) {
+    const string hash_str = hashes[i].ToString();
+    QuotaIndex::Entry *entry = index_.Lookup(hashes[i]);
+    sqlite3_stmt *stmt;
+    if (entry == NULL) {
+      stmt = stmt_rm_;
+      sqlite3_bind_text(stmt, 1, &hash_str[0], hash_str.length(),
+                        SQLITE_STATIC);
+    } else if (entry->state == QuotaIndex::kStateNew) {
+      stmt = stmt_new_;
+      sqlite3_bind_text(stmt, 1, &hash_str[0], hash_str.length(),
+                        SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 2, entry->size);
+      sqlite3_bind_int64(stmt, 3, entry->seq);
+      sqlite3_bind_text(stmt, 4, entry->description.data(),
+                        entry->description.length(), SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 5, entry->type);
+      sqlite3_bind_int64(stmt, 6, entry->pinned);
+    } else if (entry->state == QuotaIndex::kStateModified) {
+      stmt = stmt_update_;
+      sqlite3_bind_int64(stmt, 1, entry->seq);
+      sqlite3_bind_int64(stmt, 2, entry->pinned);
+      sqlite3_bind_text(stmt, 3, &hash_str[0], hash_str.length(),
+                        SQLITE_STATIC);
+    } else {
+      // Listed more than once
+      continue;
+    }
+
+    retval = sqlite3_step(stmt);
+    if ((retval != SQLITE_DONE) && (retval != SQLITE_OK)) {
+      LogCvmfs(kLogQuota, kLogSyslogErr,
+               "failed to write %s to cachedb, error %d",
+               hash_str.c_str(), retval);
+      abort();
+    }
+    sqlite3_reset(stmt);
+    if (entry != NULL) {
+      entry->state = QuotaIndex::kStateClean;
+      string().swap(entry->description);
+    }
+  }
+
+  retval = sqlite3_exec(database_, "COMMIT", NULL, NULL, NULL);
+  if (retval != SQLITE_OK) {
+    LogCvmfs(kLogQuota, kLogSyslogErr,
+             "failed to commit to cachedb, error %d", retval);
+    abort();
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "checkpoint: %u changes written to cachedb",
+           static_cast<unsigned>(hashes.size()));
+}
+
+
 void PosixQuotaManager::CleanupPipes() {
   DIR *dirp = opendir(cache_dir_.c_str());
   assert(dirp != NULL);
@@ -193,17 +263,15 @@ bool PosixQuotaManager::Cleanup(const uint64_t leave_size) {
 
 
 void PosixQuotaManager::CloseDatabase() {
+  if (database_) Checkpoint();
+  index_.Clear();
+
   if (stmt_list_catalogs_) sqlite3_finalize(stmt_list_catalogs_);
   if (stmt_list_pinned_) sqlite3_finalize(stmt_list_pinned_);
   if (stmt_list_volatile_) sqlite3_finalize(stmt_list_volatile_);
   if (stmt_list_) sqlite3_finalize(stmt_list_);
-  if (stmt_lru_) sqlite3_finalize(stmt_lru_);
   if (stmt_rm_) sqlite3_finalize(stmt_rm_);
-  if (stmt_size_) sqlite3_finalize(stmt_size_);
-  if (stmt_touch_) sqlite3_finalize(stmt_touch_);
-  if (stmt_unpin_) sqlite3_finalize(stmt_unpin_);
-  if (stmt_block_) sqlite3_finalize(stmt_block_);
-  if (stmt_unblock_) sqlite3_finalize(stmt_unblock_);
+  if (stmt_update_) sqlite3_finalize(stmt_update_);
   if (stmt_new_) sqlite3_finalize(stmt_new_);
   if (database_) sqlite3_close(database_);
   UnlockFile(fd_lock_cachedb_);
@@ -213,11 +281,7 @@ void PosixQuotaManager::CloseDatabase() {
   stmt_list_volatile_ = NULL;
   stmt_list_ = NULL;
   stmt_rm_ = NULL;
-  stmt_size_ = NULL;
-  stmt_touch_ = NULL;
-  stmt_unpin_ = NULL;
-  stmt_block_ = NULL;
-  stmt_unblock_ = NULL;
+  stmt_update_ = NULL;
   stmt_new_ = NULL;
   database_ = NULL;
 
@@ -236,13 +300,8 @@ void PosixQuotaManager::CloseReturnPipe(int pipe[2]) {
 
 
 bool PosixQuotaManager::Contains(const string &hash_str) {
-  bool result = false;
-
-  sqlite3_bind_text(stmt_size_, 1, &hash_str[0], hash_str.length(),
-                    SQLITE_STATIC);
-  if (sqlite3_step(stmt_size_) == SQLITE_ROW)
-    result = true;
-  sqlite3_reset(stmt_size_);
+  const shash::Any hash = shash::MkFromHexPtr(shash::HexPtr(hash_str));
+  const bool result = (index_.Lookup(hash) != NULL);
   LogCvmfs(kLogQuota, kLogDebug, "contains %s returns %d",
            hash_str.c_str(), result);
 
@@ -272,6 +331,7 @@ PosixQuotaManager *PosixQuotaManager::Create(
     return NULL;
   }
   MakePipe(quota_manager->pipe_lru_);
+  quota_manager->command_ring_ = ShmRing::Create("");
 
   quota_manager->protocol_revision_ = kProtocolRevision;
   quota_manager->initialized_ = true;
@@ -318,6 +378,10 @@ PosixQuotaManager *PosixQuotaManager::CreateShared(
       quota_mgr->protocol_revision_ = quota_mgr->GetProtocolRevision();
       LogCvmfs(kLogQuota, kLogDebug, "connected protocol revision %u",
                quota_mgr->protocol_revision_);
+      if (quota_mgr->protocol_revision_ >= 3) {
+        quota_mgr->command_ring_ =
+          ShmRing::Attach(cache_dir + "/cachemgr.ring");
+      }
     } else {
       LogCvmfs(kLogQuota, kLogDebug, "connected to ancient cache manager");
     }
@@ -427,6 +491,7 @@ PosixQuotaManager *PosixQuotaManager::CreateShared(
   Nonblock2Block(quota_mgr->pipe_lru_[1]);
   LogCvmfs(kLogQuota, kLogDebug, "connected to a new cache manager");
   quota_mgr->protocol_revision_ = kProtocolRevision;
+  quota_mgr->command_ring_ = ShmRing::Attach(cache_dir + "/cachemgr.ring");
 
   UnlockFile(fd_lockfile);
 
@@ -442,61 +507,32 @@ bool PosixQuotaManager::DoCleanup(const uint64_t leave_size) {
   if (gauge_ <= leave_size)
     return true;
 
-  // TODO(jblomer) transaction
   LogCvmfs(kLogQuota, kLogSyslog,
            "cleanup cache until %lu KB are free", leave_size/1024);
   LogCvmfs(kLogQuota, kLogDebug, "gauge %"PRIu64, gauge_);
   cleanup_recorder_.Tick();
 
-  bool result;
-  string hash_str;
   vector<string> trash;
-
-  do {
-    sqlite3_reset(stmt_lru_);
-    if (sqlite3_step(stmt_lru_) != SQLITE_ROW) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not get lru-entry");
-      break;
-    }
-
-    hash_str = string(reinterpret_cast<const char *>(
-                      sqlite3_column_text(stmt_lru_, 0)));
-    LogCvmfs(kLogQuota, kLogDebug, "removing %s", hash_str.c_str());
-    shash::Any hash = shash::MkFromHexPtr(shash::HexPtr(hash_str));
+  QuotaIndex::Entry *entry = index_.First();
+  while ((entry != NULL) && (gauge_ > leave_size)) {
+    QuotaIndex::Entry *next = index_.Next(entry);
+    LogCvmfs(kLogQuota, kLogDebug, "removing %s",
+             entry->hash.ToString().c_str());
 
     // That's a critical condition.  We must not delete a not yet inserted
     // pinned file as it is already reserved (but will be inserted later).
-    // Instead, set the pin bit in the db to not run into an endless loop
-    if (pinned_chunks_.find(hash) == pinned_chunks_.end()) {
-      trash.push_back(cache_dir_ + "/" + hash.MakePathWithoutSuffix());
-      gauge_ -= sqlite3_column_int64(stmt_lru_, 1);
+    // Such entries are skipped.
+    if (pinned_chunks_.find(entry->hash) == pinned_chunks_.end()) {
+      trash.push_back(cache_dir_ + "/" + entry->hash.MakePathWithoutSuffix());
+      gauge_ -= entry->size;
       LogCvmfs(kLogQuota, kLogDebug, "lru cleanup %s, new gauge %"PRIu64,
-               hash_str.c_str(), gauge_);
-
-      sqlite3_bind_text(stmt_rm_, 1, &hash_str[0], hash_str.length(),
-                        SQLITE_STATIC);
-      result = (sqlite3_step(stmt_rm_) == SQLITE_DONE);
-      sqlite3_reset(stmt_rm_);
-
-      if (!result) {
-        LogCvmfs(kLogQuota, kLogDebug | kLogSyslogErr,
-                 "failed to find %s in cache database (%d). "
-                 "Cache database is out of sync. "
-                 "Restart cvmfs with clean cache.", hash_str.c_str(), result);
-        return false;
-      }
-    } else {
-      sqlite3_bind_text(stmt_block_, 1, &hash_str[0], hash_str.length(),
-                        SQLITE_STATIC);
-      result = (sqlite3_step(stmt_block_) == SQLITE_DONE);
-      sqlite3_reset(stmt_block_);
-      assert(result);
+               entry->hash.ToString().c_str(), gauge_);
+      index_.Remove(entry);
     }
-  } while (gauge_ > leave_size);
-
-  result = (sqlite3_step(stmt_unblock_) == SQLITE_DONE);
-  sqlite3_reset(stmt_unblock_);
-  assert(result);
+    entry = next;
+  }
+  // Files are about to disappear, the cache database should follow suit
+  Checkpoint();
 
   // Double fork avoids zombie, forked removal process must not flush file
   // buffers
@@ -566,7 +602,7 @@ void PosixQuotaManager::DoInsert(
   cmd->desc_length = desc_length;
   memcpy(reinterpret_cast<char *>(cmd)+sizeof(LruCommand),
          &description[0], desc_length);
-  WritePipe(pipe_lru_[1], cmd, sizeof(LruCommand) + desc_length);
+  SendAsyncCommand(cmd, sizeof(LruCommand) + desc_length);
 }
 
 
@@ -596,6 +632,46 @@ vector<string> PosixQuotaManager::DoList(const CommandType list_command) {
 }
 
 
+/**
+ * Processes the commands from the shared memory ring up to the given ring
+ * position.  Only asynchronous commands are accepted through the ring.
+ */
+void PosixQuotaManager::DrainCommandRing(
+  const uint64_t until,
+  LruCommand *command_buffer,
+  char *description_buffer,
+  unsigned *num_commands)
+{
+  unsigned char message[ShmRing::kSlotSize];
+  while (command_ring_->tail() < until) {
+    const unsigned size = command_ring_->Dequeue(message);
+    if (size == 0)
+      break;
+    if (size < sizeof(LruCommand)) {
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+               "ignoring truncated command in ring");
+      continue;
+    }
+
+    LruCommand *command = &command_buffer[*num_commands];
+    memcpy(command, message, sizeof(LruCommand));
+    const CommandType command_type = command->command_type;
+    if ((command_type != kTouch) && (command_type != kInsert) &&
+        (command_type != kInsertVolatile) && (command_type != kPin) &&
+        (command_type != kPinRegular) && (command_type != kUnpin))
+    {
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+               "ignoring command %d in ring", command_type);
+      continue;
+    }
+    command->desc_length = size - sizeof(LruCommand);
+    memcpy(&description_buffer[kMaxDescription * (*num_commands)],
+           message + sizeof(LruCommand), command->desc_length);
+    ProcessCommand(command_buffer, description_buffer, num_commands);
+  }
+}
+
+
 uint64_t PosixQuotaManager::GetCapacity() {
   return limit_;
 }
@@ -844,31 +920,17 @@ bool PosixQuotaManager::InitDatabase(const bool rebuild_database) {
   }
   sqlite3_finalize(stmt);
 
-  // Prepare touch, new, remove statements
+  // Prepare update, new, remove statements
   sqlite3_prepare_v2(database_,
-                     "UPDATE cache_catalog SET acseq=:seq | (acseq&(1<<63)) "
-                     "WHERE sha1=:sha1;", -1, &stmt_touch_, NULL);
-  sqlite3_prepare_v2(database_, "UPDATE cache_catalog SET pinned=0 "
-                     "WHERE sha1=:sha1;", -1, &stmt_unpin_, NULL);
-  sqlite3_prepare_v2(database_, "UPDATE cache_catalog SET pinned=2 "
-                     "WHERE sha1=:sha1;", -1, &stmt_block_, NULL);
-  sqlite3_prepare_v2(database_, "UPDATE cache_catalog SET pinned=1 "
-                     "WHERE pinned=2;", -1, &stmt_unblock_, NULL);
+                     "UPDATE cache_catalog SET acseq=:seq, pinned=:pin "
+                     "WHERE sha1=:sha1;", -1, &stmt_update_, NULL);
   sqlite3_prepare_v2(database_,
                      "INSERT OR REPLACE INTO cache_catalog "
                      "(sha1, size, acseq, path, type, pinned) "
                      "VALUES (:sha1, :s, :seq, :p, :t, :pin);",
                      -1, &stmt_new_, NULL);
-  sqlite3_prepare_v2(database_,
-                     "SELECT size, pinned FROM cache_catalog WHERE sha1=:sha1;",
-                     -1, &stmt_size_, NULL);
   sqlite3_prepare_v2(database_, "DELETE FROM cache_catalog WHERE sha1=:sha1;",
                      -1, &stmt_rm_, NULL);
-  sqlite3_prepare_v2(database_,
-                     "SELECT sha1, size FROM cache_catalog WHERE "
-                     "acseq=(SELECT min(acseq) "
-                     "FROM cache_catalog WHERE pinned<>2);",
-                     -1, &stmt_lru_, NULL);
   sqlite3_prepare_v2(database_,
                      ("SELECT path FROM cache_catalog WHERE type=" +
                       StringifyInt(kFileRegular) +
@@ -883,6 +945,13 @@ bool PosixQuotaManager::InitDatabase(const bool rebuild_database) {
                      ("SELECT path FROM cache_catalog WHERE type=" +
                       StringifyInt(kFileCatalog) +
                       ";").c_str(), -1, &stmt_list_catalogs_, NULL);
+
+  if (!LoadIndex()) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not load cache database");
+    CloseDatabase();
+    return false;
+  }
+  last_checkpoint_ = platform_monotonic_time();
   return true;
 
  init_database_fail:
@@ -955,6 +1024,57 @@ vector<string> PosixQuotaManager::ListVolatile() {
 /**
  * Entry point for the shared cache manager process
  */
+/**
+ * Fills the in-memory index from the cache database in LRU order.  Rows that
+ * do not describe a valid content hash are removed.
+ */
+bool PosixQuotaManager::LoadIndex() {
+  index_.Clear();
+
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(database_,
+                     "SELECT sha1, size, acseq, type, pinned "
+                     "FROM cache_catalog ORDER BY acseq;", -1, &stmt, NULL);
+  vector<string> invalid;
+  int retval;
+  while ((retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const string hash_str(
+      reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+    const uint64_t size = sqlite3_column_int64(stmt, 1);
+    const shash::Any hash = shash::MkFromHexPtr(shash::HexPtr(hash_str));
+    if ((hash.ToString() != hash_str) ||
+        !index_.Restore(hash, size, sqlite3_column_int64(stmt, 2),
+                        sqlite3_column_int(stmt, 3),
+                        sqlite3_column_int(stmt, 4)))
+    {
+      invalid.push_back(hash_str);
+      gauge_ -= size;
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (retval != SQLITE_DONE) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not read cache catalog (%d)",
+             retval);
+    return false;
+  }
+
+  for (unsigned i = 0; i < invalid.size(); ++i) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+             "removing invalid entry %s from cache database",
+             invalid[i].c_str());
+    sqlite3_bind_text(stmt_rm_, 1, &invalid[i][0], invalid[i].length(),
+                      SQLITE_STATIC);
+    retval = sqlite3_step(stmt_rm_);
+    sqlite3_reset(stmt_rm_);
+    if ((retval != SQLITE_DONE) && (retval != SQLITE_OK))
+      return false;
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "loaded %u entries from cache database",
+           index_.size());
+  return true;
+}
+
+
 int PosixQuotaManager::MainCacheManager(int argc, char **argv) {
   LogCvmfs(kLogQuota, kLogDebug, "starting quota manager");
   int retval;
@@ -1046,6 +1166,14 @@ int PosixQuotaManager::MainCacheManager(int argc, char **argv) {
     return 1;
   }
 
+  // Clients fall back to the pipe if the ring is missing
+  const string ring_path = shared_manager.cache_dir_ + "/cachemgr.ring";
+  shared_manager.command_ring_ = ShmRing::Create(ring_path);
+  if (shared_manager.command_ring_ == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+             "failed to create command ring, using pipe only");
+  }
+
   const string fifo_path = shared_manager.cache_dir_ + "/cachemgr";
   shared_manager.pipe_lru_[0] = open(fifo_path.c_str(), O_RDONLY | O_NONBLOCK);
   if (shared_manager.pipe_lru_[0] < 0) {
@@ -1073,6 +1201,7 @@ int PosixQuotaManager::MainCacheManager(int argc, char **argv) {
   shared_manager.MainCommandServer(&shared_manager);
   unlink(fifo_path.c_str());
   unlink(protocol_revision_path.c_str());
+  unlink(ring_path.c_str());
   shared_manager.CloseDatabase();
   unlink(crash_guard.c_str());
   UnlockFile(fd_lockfile_fifo);
@@ -1097,296 +1226,73 @@ void *PosixQuotaManager::MainCommandServer(void *data) {
   LruCommand command_buffer[kCommandBufferSize];
   char description_buffer[kCommandBufferSize*kMaxDescription];
   unsigned num_commands = 0;
-
-  while (read(quota_mgr->pipe_lru_[0], &command_buffer[num_commands],
-              sizeof(command_buffer[0])) == sizeof(command_buffer[0]))
-  {
-    const CommandType command_type = command_buffer[num_commands].command_type;
-    LogCvmfs(kLogQuota, kLogDebug, "received command %d", command_type);
-    const uint64_t size = command_buffer[num_commands].GetSize();
-
-    // Inserts and pins come with a description (usually a path)
-    if ((command_type == kInsert) || (command_type == kInsertVolatile) ||
-        (command_type == kPin) || (command_type == kPinRegular))
-    {
-      const int desc_length = command_buffer[num_commands].desc_length;
-      ReadPipe(quota_mgr->pipe_lru_[0],
-               &description_buffer[kMaxDescription*num_commands], desc_length);
-    }
-
-    // The protocol revision is returned immediately
-    if (command_type == kGetProtocolRevision) {
-      int return_pipe =
-        quota_mgr->BindReturnPipe(command_buffer[num_commands].return_pipe);
-      if (return_pipe < 0)
+  ShmRing *ring = quota_mgr->command_ring_;
+
+  while (true) {
+    // Only block on the pipe if there is nothing left in the ring
+    if ((ring != NULL) && !ring->PrepareSleep()) {
+      const uint64_t tail = ring->tail();
+      quota_mgr->DrainCommandRing(ring->head(), command_buffer,
+                                  description_buffer, &num_commands);
+      if (ring->tail() != tail)
         continue;
-      WritePipe(return_pipe, &quota_mgr->kProtocolRevision,
-                sizeof(quota_mgr->kProtocolRevision));
-      quota_mgr->UnbindReturnPipe(return_pipe);
-      continue;
-    }
-
-    // The cleanup rate is returned immediately
-    if (command_type == kCleanupRate) {
-      int return_pipe =
-        quota_mgr->BindReturnPipe(command_buffer[num_commands].return_pipe);
-      if (return_pipe < 0)
+      // The next message is not yet published.  Instead of waiting for the
+      // producer, keep serving the pipe.
+      struct pollfd watch_pipe;
+      watch_pipe.fd = quota_mgr->pipe_lru_[0];
+      watch_pipe.events = POLLIN | POLLPRI;
+      watch_pipe.revents = 0;
+      if (poll(&watch_pipe, 1, kRingPendingPollMs) <= 0)
         continue;
-      uint64_t period_s = size;  // use the size field to transmit the period
-      uint64_t rate = quota_mgr->cleanup_recorder_.GetNoTicks(period_s);
-      WritePipe(return_pipe, &rate, sizeof(rate));
-      quota_mgr->UnbindReturnPipe(return_pipe);
-      continue;
     }
 
-    // Reservations are handled immediately and "out of band"
-    if (command_type == kReserve) {
-      bool success = true;
-      int return_pipe =
-        quota_mgr->BindReturnPipe(command_buffer[num_commands].return_pipe);
-      if (return_pipe < 0)
-        continue;
-
-      const shash::Any hash = command_buffer[num_commands].RetrieveHash();
-      const string hash_str(hash.ToString());
-      LogCvmfs(kLogQuota, kLogDebug, "reserve %d bytes for %s",
-               size, hash_str.c_str());
-
-      if (quota_mgr->pinned_chunks_.find(hash) ==
-          quota_mgr->pinned_chunks_.end())
-      {
-        if ((quota_mgr->pinned_ + size) > quota_mgr->cleanup_threshold_) {
-          LogCvmfs(kLogQuota, kLogDebug,
-                   "failed to insert %s (pinned), no space", hash_str.c_str());
-          success = false;
-        } else {
-          quota_mgr->pinned_chunks_[hash] = size;
-          quota_mgr->pinned_ += size;
-          quota_mgr->CheckHighPinWatermark();
-        }
-      }
-
-      WritePipe(return_pipe, &success, sizeof(success));
-      quota_mgr->UnbindReturnPipe(return_pipe);
-      continue;
+    LruCommand command;
+    if (read(quota_mgr->pipe_lru_[0], &command, sizeof(command)) !=
+        sizeof(command))
+    {
+      break;
     }
 
-    // Back channels are also handled out of band
-    if (command_type == kRegisterBackChannel) {
-      int return_pipe =
-        quota_mgr->BindReturnPipe(command_buffer[num_commands].return_pipe);
-      if (return_pipe < 0)
-        continue;
-
-      quota_mgr->UnlinkReturnPipe(command_buffer[num_commands].return_pipe);
-      Block2Nonblock(return_pipe);  // back channels are opportunistic
-      shash::Md5 hash;
-      memcpy(hash.digest, command_buffer[num_commands].digest,
-             shash::kDigestSizes[shash::kMd5]);
-
-      quota_mgr->LockBackChannels();
-      map<shash::Md5, int>::const_iterator iter =
-        quota_mgr->back_channels_.find(hash);
-      if (iter != quota_mgr->back_channels_.end()) {
-        LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
-                 "closing left-over back channel %s", hash.ToString().c_str());
-        close(iter->second);
+    if (ring != NULL) {
+      ring->CancelSleep();
+      // Commands that went through the ring before this one was sent.  A
+      // client's ring commands can sit behind a slot that another producer
+      // has not yet published, so wait for that one in order to keep the
+      // order of the client's commands.  Slots of dead producers are skipped
+      // by the ring after ShmRing::kPublishTimeoutSec.
+      const uint64_t until = ring->head();
+      while (true) {
+        quota_mgr->DrainCommandRing(until, command_buffer,
+                                    description_buffer, &num_commands);
+        if (ring->tail() >= until)
+          break;
+        SafeSleepMs(kRingPendingPollMs);
       }
-      quota_mgr->back_channels_[hash] = return_pipe;
-      quota_mgr->UnlockBackChannels();
-
-      char success = 'S';
-      WritePipe(return_pipe, &success, sizeof(success));
-      LogCvmfs(kLogQuota, kLogDebug, "register back channel %s on fd %d",
-               hash.ToString().c_str(), return_pipe);
-
-      continue;
     }
-
-    if (command_type == kUnregisterBackChannel) {
-      shash::Md5 hash;
-      memcpy(hash.digest, command_buffer[num_commands].digest,
-             shash::kDigestSizes[shash::kMd5]);
-
-      quota_mgr->LockBackChannels();
-      map<shash::Md5, int>::iterator iter =
-        quota_mgr->back_channels_.find(hash);
-      if (iter != quota_mgr->back_channels_.end()) {
-        LogCvmfs(kLogQuota, kLogDebug,
-                 "closing back channel %s", hash.ToString().c_str());
-        close(iter->second);
-        quota_mgr->back_channels_.erase(iter);
-      } else {
-        LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
-                 "did not find back channel %s", hash.ToString().c_str());
-      }
-      quota_mgr->UnlockBackChannels();
-
+    if (command.command_type == kRingDoorbell)
       continue;
-    }
 
-    // Unpinnings are also handled immediately with respect to the pinned gauge
-    if (command_type == kUnpin) {
-      const shash::Any hash = command_buffer[num_commands].RetrieveHash();
-      const string hash_str(hash.ToString());
-
-      map<shash::Any, uint64_t>::iterator iter =
-        quota_mgr->pinned_chunks_.find(hash);
-      if (iter != quota_mgr->pinned_chunks_.end()) {
-        quota_mgr->pinned_ -= iter->second;
-        quota_mgr->pinned_chunks_.erase(iter);
-        // It can happen that files get pinned that were removed from the cache
-        // (see cache.cc).  We fix this at this point, where we remove such
-        // entries from the cache database.
-        if (!FileExists(quota_mgr->cache_dir_ + "/" +
-                        hash.MakePathWithoutSuffix()))
-        {
-          LogCvmfs(kLogQuota, kLogDebug,
-                   "remove orphaned pinned hash %s from cache database",
-                   hash_str.c_str());
-          sqlite3_bind_text(quota_mgr->stmt_size_, 1, &hash_str[0],
-                            hash_str.length(), SQLITE_STATIC);
-          int retval;
-          if ((retval = sqlite3_step(quota_mgr->stmt_size_)) == SQLITE_ROW) {
-            uint64_t size = sqlite3_column_int64(quota_mgr->stmt_size_, 0);
-            sqlite3_bind_text(quota_mgr->stmt_rm_, 1, &(hash_str[0]),
-                              hash_str.length(), SQLITE_STATIC);
-            retval = sqlite3_step(quota_mgr->stmt_rm_);
-            if ((retval == SQLITE_DONE) || (retval == SQLITE_OK)) {
-              quota_mgr->gauge_ -= size;
-            } else {
-              LogCvmfs(kLogQuota, kLogDebug | kLogSyslogErr,
-                       "failed to delete %s (%d)", hash_str.c_str(), retval);
-            }
-            sqlite3_reset(quota_mgr->stmt_rm_);
-          }
-          sqlite3_reset(quota_mgr->stmt_size_);
-        }
-      } else {
-        LogCvmfs(kLogQuota, kLogDebug, "this chunk was not pinned");
-      }
-    }
-
-    // Immediate commands trigger flushing of the buffer
-    bool immediate_command = (command_type == kCleanup) ||
-      (command_type == kList) || (command_type == kListPinned) ||
-      (command_type == kListCatalogs) || (command_type == kListVolatile) ||
-      (command_type == kRemove) || (command_type == kStatus) ||
-      (command_type == kLimits) || (command_type == kPid);
-    if (!immediate_command) num_commands++;
-
-    if ((num_commands == kCommandBufferSize) || immediate_command)
+    command_buffer[num_commands] = command;
+    // Inserts and pins come with a description (usually a path)
+    if ((command.command_type == kInsert) ||
+        (command.command_type == kInsertVolatile) ||
+        (command.command_type == kPin) ||
+        (command.command_type == kPinRegular))
     {
-      quota_mgr->ProcessCommandBunch(num_commands, command_buffer,
-                                     description_buffer);
-      if (!immediate_command) num_commands = 0;
-    }
-
-    if (immediate_command) {
-      // Process cleanup, listings
-      int return_pipe =
-        quota_mgr->BindReturnPipe(command_buffer[num_commands].return_pipe);
-      if (return_pipe < 0) {
-        num_commands = 0;
-        continue;
-      }
-
-      int retval;
-      sqlite3_stmt *this_stmt_list = NULL;
-      switch (command_type) {
-        case kRemove: {
-          const shash::Any hash = command_buffer[num_commands].RetrieveHash();
-          const string hash_str = hash.ToString();
-          LogCvmfs(kLogQuota, kLogDebug, "manually removing %s",
-                   hash_str.c_str());
-          bool success = false;
-
-          sqlite3_bind_text(quota_mgr->stmt_size_, 1, &hash_str[0],
-                            hash_str.length(), SQLITE_STATIC);
-          int retval;
-          if ((retval = sqlite3_step(quota_mgr->stmt_size_)) == SQLITE_ROW) {
-            uint64_t size = sqlite3_column_int64(quota_mgr->stmt_size_, 0);
-            uint64_t is_pinned = sqlite3_column_int64(quota_mgr->stmt_size_, 1);
-
-            sqlite3_bind_text(quota_mgr->stmt_rm_, 1, &(hash_str[0]),
-                              hash_str.length(), SQLITE_STATIC);
-            retval = sqlite3_step(quota_mgr->stmt_rm_);
-            if ((retval == SQLITE_DONE) || (retval == SQLITE_OK)) {
-              success = true;
-              quota_mgr->gauge_ -= size;
-              if (is_pinned) {
-                quota_mgr->pinned_chunks_.erase(hash);
-                quota_mgr->pinned_ -= size;
-              }
-            } else {
-              LogCvmfs(kLogQuota, kLogDebug | kLogSyslogErr,
-                       "failed to delete %s (%d)", hash_str.c_str(), retval);
-            }
-            sqlite3_reset(quota_mgr->stmt_rm_);
-          } else {
-            // File does not exist
-            success = true;
-          }
-          sqlite3_reset(quota_mgr->stmt_size_);
-
-          WritePipe(return_pipe, &success, sizeof(success));
-          break; }
-        case kCleanup:
-          retval = quota_mgr->DoCleanup(size);
-          WritePipe(return_pipe, &retval, sizeof(retval));
-          break;
-        case kList:
-          if (!this_stmt_list) this_stmt_list = quota_mgr->stmt_list_;
-        case kListPinned:
-          if (!this_stmt_list) this_stmt_list = quota_mgr->stmt_list_pinned_;
-        case kListCatalogs:
-          if (!this_stmt_list) this_stmt_list = quota_mgr->stmt_list_catalogs_;
-        case kListVolatile:
-          if (!this_stmt_list) this_stmt_list = quota_mgr->stmt_list_volatile_;
-
-          // Pipe back the list, one by one
-          int length;
-          while (sqlite3_step(this_stmt_list) == SQLITE_ROW) {
-            string path = "(NULL)";
-            if (sqlite3_column_type(this_stmt_list, 0) != SQLITE_NULL) {
-              path = string(
-                reinterpret_cast<const char *>(
-                  sqlite3_column_text(this_stmt_list, 0)));
-            }
-            length = path.length();
-            WritePipe(return_pipe, &length, sizeof(length));
-            if (length > 0)
-              WritePipe(return_pipe, &path[0], length);
-          }
-          length = -1;
-          WritePipe(return_pipe, &length, sizeof(length));
-          sqlite3_reset(this_stmt_list);
-          break;
-        case kStatus:
-          WritePipe(return_pipe, &quota_mgr->gauge_, sizeof(quota_mgr->gauge_));
-          WritePipe(return_pipe, &quota_mgr->pinned_,
-                    sizeof(quota_mgr->pinned_));
-          break;
-        case kLimits:
-          WritePipe(return_pipe, &quota_mgr->limit_, sizeof(quota_mgr->limit_));
-          WritePipe(return_pipe, &quota_mgr->cleanup_threshold_,
-                    sizeof(quota_mgr->cleanup_threshold_));
-          break;
-        case kPid: {
-          pid_t pid = getpid();
-          WritePipe(return_pipe, &pid, sizeof(pid));
-          break;
-        }
-        default:
-          abort();  // other types are handled by the bunch processor
-      }
-      quota_mgr->UnbindReturnPipe(return_pipe);
-      num_commands = 0;
+      ReadPipe(quota_mgr->pipe_lru_[0],
+               &description_buffer[kMaxDescription*num_commands],
+               command.desc_length);
     }
+    quota_mgr->ProcessCommand(command_buffer, description_buffer,
+                              &num_commands);
   }
 
   LogCvmfs(kLogQuota, kLogDebug, "stopping cache manager (%d)", errno);
   close(quota_mgr->pipe_lru_[0]);
+  if (ring != NULL) {
+    quota_mgr->DrainCommandRing(ring->head(), command_buffer,
+                                description_buffer, &num_commands);
+  }
   quota_mgr->ProcessCommandBunch(num_commands, command_buffer,
                                  description_buffer);
 
@@ -1459,24 +1365,15 @@ bool PosixQuotaManager::Pin(
         CheckHighPinWatermark();
       }
     }
-    bool exists = Contains(hash_str);
+    bool exists = (index_.Lookup(hash) != NULL);
     if (!exists && (gauge_ + size > limit_)) {
       LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
                gauge_, size);
       int retval = DoCleanup(cleanup_threshold_);
       assert(retval != 0);
     }
-    sqlite3_bind_text(stmt_new_, 1, &hash_str[0], hash_str.length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_new_, 2, size);
-    sqlite3_bind_int64(stmt_new_, 3, seq_++);
-    sqlite3_bind_text(stmt_new_, 4, &description[0], description.length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_new_, 5, is_catalog ? kFileCatalog : kFileRegular);
-    sqlite3_bind_int64(stmt_new_, 6, 1);
-    int retval = sqlite3_step(stmt_new_);
-    assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-    sqlite3_reset(stmt_new_);
+    index_.Insert(hash, size, seq_++, description,
+                  is_catalog ? kFileCatalog : kFileRegular, 1);
     if (!exists) gauge_ += size;
     return true;
   }
@@ -1513,16 +1410,13 @@ PosixQuotaManager::PosixQuotaManager(
   , pinned_(0)
   , seq_(0)
   , cache_dir_(cache_dir)
+  , last_checkpoint_(0)
+  , command_ring_(NULL)
   , fd_lock_cachedb_(-1)
   , async_delete_(true)
   , database_(NULL)
-  , stmt_touch_(NULL)
-  , stmt_unpin_(NULL)
-  , stmt_block_(NULL)
-  , stmt_unblock_(NULL)
+  , stmt_update_(NULL)
   , stmt_new_(NULL)
-  , stmt_lru_(NULL)
-  , stmt_size_(NULL)
   , stmt_rm_(NULL)
   , stmt_list_(NULL)
   , stmt_list_pinned_(NULL)
@@ -1547,6 +1441,7 @@ PosixQuotaManager::~PosixQuotaManager() {
   if (shared_) {
     // Most of cleanup is done elsewhen by shared cache manager
     close(pipe_lru_[1]);
+    delete command_ring_;
     return;
   }
 
@@ -1558,63 +1453,291 @@ PosixQuotaManager::~PosixQuotaManager() {
   } else {
     ClosePipe(pipe_lru_);
   }
+  delete command_ring_;
 
   CloseDatabase();
 }
 
 
+/**
+ * Handles the command at position num_commands in the command buffer.  The
+ * description of inserts and pins needs to be already in place.  Asynchronous
+ * commands are collected and processed in bunches, immediate commands flush
+ * the buffer and are answered on the command's return pipe.
+ */
+void PosixQuotaManager::ProcessCommand(
+  LruCommand *command_buffer,
+  char *description_buffer,
+  unsigned *num_commands)
+{
+  LruCommand *command = &command_buffer[*num_commands];
+  const CommandType command_type = command->command_type;
+  LogCvmfs(kLogQuota, kLogDebug, "received command %d", command_type);
+  const uint64_t size = command->GetSize();
+
+  // The protocol revision is returned immediately
+  if (command_type == kGetProtocolRevision) {
+    int return_pipe = BindReturnPipe(command->return_pipe);
+    if (return_pipe < 0)
+      return;
+    WritePipe(return_pipe, &kProtocolRevision, sizeof(kProtocolRevision));
+    UnbindReturnPipe(return_pipe);
+    return;
+  }
+
+  // The cleanup rate is returned immediately
+  if (command_type == kCleanupRate) {
+    int return_pipe = BindReturnPipe(command->return_pipe);
+    if (return_pipe < 0)
+      return;
+    uint64_t period_s = size;  // use the size field to transmit the period
+    uint64_t rate = cleanup_recorder_.GetNoTicks(period_s);
+    WritePipe(return_pipe, &rate, sizeof(rate));
+    UnbindReturnPipe(return_pipe);
+    return;
+  }
+
+  // Reservations are handled immediately and "out of band"
+  if (command_type == kReserve) {
+    bool success = true;
+    int return_pipe = BindReturnPipe(command->return_pipe);
+    if (return_pipe < 0)
+      return;
+
+    const shash::Any hash = command->RetrieveHash();
+    const string hash_str(hash.ToString());
+    LogCvmfs(kLogQuota, kLogDebug, "reserve %d bytes for %s",
+             size, hash_str.c_str());
+
+    if (pinned_chunks_.find(hash) == pinned_chunks_.end()) {
+      if ((pinned_ + size) > cleanup_threshold_) {
+        LogCvmfs(kLogQuota, kLogDebug,
+                 "failed to insert %s (pinned), no space", hash_str.c_str());
+        success = false;
+      } else {
+        pinned_chunks_[hash] = size;
+        pinned_ += size;
+        CheckHighPinWatermark();
+      }
+    }
+
+    WritePipe(return_pipe, &success, sizeof(success));
+    UnbindReturnPipe(return_pipe);
+    return;
+  }
+
+  // Back channels are also handled out of band
+  if (command_type == kRegisterBackChannel) {
+    int return_pipe = BindReturnPipe(command->return_pipe);
+    if (return_pipe < 0)
+      return;
+
+    UnlinkReturnPipe(command->return_pipe);
+    Block2Nonblock(return_pipe);  // back channels are opportunistic
+    shash::Md5 hash;
+    memcpy(hash.digest, command->digest, shash::kDigestSizes[shash::kMd5]);
+
+    LockBackChannels();
+    map<shash::Md5, int>::const_iterator iter = back_channels_.find(hash);
+    if (iter != back_channels_.end()) {
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+               "closing left-over back channel %s", hash.ToString().c_str());
+      close(iter->second);
+    }
+    back_channels_[hash] = return_pipe;
+    UnlockBackChannels();
+
+    char success = 'S';
+    WritePipe(return_pipe, &success, sizeof(success));
+    LogCvmfs(kLogQuota, kLogDebug, "register back channel %s on fd %d",
+             hash.ToString().c_str(), return_pipe);
+
+    return;
+  }
+
+  if (command_type == kUnregisterBackChannel) {
+    shash::Md5 hash;
+    memcpy(hash.digest, command->digest, shash::kDigestSizes[shash::kMd5]);
+
+    LockBackChannels();
+    map<shash::Md5, int>::iterator iter = back_channels_.find(hash);
+    if (iter != back_channels_.end()) {
+      LogCvmfs(kLogQuota, kLogDebug,
+               "closing back channel %s", hash.ToString().c_str());
+      close(iter->second);
+      back_channels_.erase(iter);
+    } else {
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+               "did not find back channel %s", hash.ToString().c_str());
+    }
+    UnlockBackChannels();
+
+    return;
+  }
+
+  // Unpinnings are also handled immediately with respect to the pinned gauge
+  if (command_type == kUnpin) {
+    const shash::Any hash = command->RetrieveHash();
+    const string hash_str(hash.ToString());
+
+    map<shash::Any, uint64_t>::iterator iter = pinned_chunks_.find(hash);
+    if (iter != pinned_chunks_.end()) {
+      pinned_ -= iter->second;
+      pinned_chunks_.erase(iter);
+      // It can happen that files get pinned that were removed from the cache
+      // (see cache.cc).  We fix this at this point, where we remove such
+      // entries from the cache database.
+      if (!FileExists(cache_dir_ + "/" + hash.MakePathWithoutSuffix())) {
+        LogCvmfs(kLogQuota, kLogDebug,
+                 "remove orphaned pinned hash %s from cache database",
+                 hash_str.c_str());
+        QuotaIndex::Entry *entry = index_.Lookup(hash);
+        if (entry != NULL) {
+          gauge_ -= entry->size;
+          index_.Remove(entry);
+        }
+      }
+    } else {
+      LogCvmfs(kLogQuota, kLogDebug, "this chunk was not pinned");
+    }
+  }
+
+  // Immediate commands trigger flushing of the buffer
+  bool immediate_command = (command_type == kCleanup) ||
+    (command_type == kList) || (command_type == kListPinned) ||
+    (command_type == kListCatalogs) || (command_type == kListVolatile) ||
+    (command_type == kRemove) || (command_type == kStatus) ||
+    (command_type == kLimits) || (command_type == kPid);
+  if (!immediate_command) (*num_commands)++;
+
+  if ((*num_commands == kCommandBufferSize) || immediate_command)
+  {
+    ProcessCommandBunch(*num_commands, command_buffer, description_buffer);
+    if (!immediate_command) *num_commands = 0;
+  }
+
+  if (immediate_command) {
+    // Process cleanup, listings
+    int return_pipe = BindReturnPipe(command->return_pipe);
+    if (return_pipe < 0) {
+      *num_commands = 0;
+      return;
+    }
+
+    int retval;
+    sqlite3_stmt *this_stmt_list = NULL;
+    switch (command_type) {
+      case kRemove: {
+        const shash::Any hash = command->RetrieveHash();
+        const string hash_str = hash.ToString();
+        LogCvmfs(kLogQuota, kLogDebug, "manually removing %s",
+                 hash_str.c_str());
+        // Also succeeds if the file does not exist
+        bool success = true;
+
+        QuotaIndex::Entry *entry = index_.Lookup(hash);
+        if (entry != NULL) {
+          gauge_ -= entry->size;
+          if (entry->pinned) {
+            pinned_chunks_.erase(hash);
+            pinned_ -= entry->size;
+          }
+          index_.Remove(entry);
+        }
+
+        WritePipe(return_pipe, &success, sizeof(success));
+        break; }
+      case kCleanup:
+        retval = DoCleanup(size);
+        WritePipe(return_pipe, &retval, sizeof(retval));
+        break;
+      case kList:
+        if (!this_stmt_list) this_stmt_list = stmt_list_;
+      case kListPinned:
+        if (!this_stmt_list) this_stmt_list = stmt_list_pinned_;
+      case kListCatalogs:
+        if (!this_stmt_list) this_stmt_list = stmt_list_catalogs_;
+      case kListVolatile:
+        if (!this_stmt_list) this_stmt_list = stmt_list_volatile_;
+        // Listings are served from the cache database
+        Checkpoint();
+
+        // Pipe back the list, one by one
+        int length;
+        while (sqlite3_step(this_stmt_list) == SQLITE_ROW) {
+          string path = "(NULL)";
+          if (sqlite3_column_type(this_stmt_list, 0) != SQLITE_NULL) {
+            path = string(
+              reinterpret_cast<const char *>(
+                sqlite3_column_text(this_stmt_list, 0)));
+          }
+          length = path.length();
+          WritePipe(return_pipe, &length, sizeof(length));
+          if (length > 0)
+            WritePipe(return_pipe, &path[0], length);
+        }
+        length = -1;
+        WritePipe(return_pipe, &length, sizeof(length));
+        sqlite3_reset(this_stmt_list);
+        break;
+      case kStatus:
+        WritePipe(return_pipe, &gauge_, sizeof(gauge_));
+        WritePipe(return_pipe, &pinned_, sizeof(pinned_));
+        break;
+      case kLimits:
+        WritePipe(return_pipe, &limit_, sizeof(limit_));
+        WritePipe(return_pipe, &cleanup_threshold_, sizeof(cleanup_threshold_));
+        break;
+      case kPid: {
+        pid_t pid = getpid();
+        WritePipe(return_pipe, &pid, sizeof(pid));
+        break;
+      }
+      default:
+        abort();  // other types are handled by the bunch processor
+    }
+    UnbindReturnPipe(return_pipe);
+    *num_commands = 0;
+  }
+}
+
+
 void PosixQuotaManager::ProcessCommandBunch(
   const unsigned num,
   const LruCommand *commands,
   const char *descriptions)
 {
-  int retval = sqlite3_exec(database_, "BEGIN", NULL, NULL, NULL);
-  assert(retval == SQLITE_OK);
-
   for (unsigned i = 0; i < num; ++i) {
     const shash::Any hash = commands[i].RetrieveHash();
-    const string hash_str = hash.ToString();
     const unsigned size = commands[i].GetSize();
+    const CommandType command_type = commands[i].command_type;
     LogCvmfs(kLogQuota, kLogDebug, "processing %s (%d)",
-             hash_str.c_str(), commands[i].command_type);
+             hash.ToString().c_str(), command_type);
 
+    QuotaIndex::Entry *entry;
     bool exists;
-    switch (commands[i].command_type) {
+    int retval;
+    switch (command_type) {
       case kTouch:
-        sqlite3_bind_int64(stmt_touch_, 1, seq_++);
-        sqlite3_bind_text(stmt_touch_, 2, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        retval = sqlite3_step(stmt_touch_);
-        LogCvmfs(kLogQuota, kLogDebug, "touching %s (%ld): %d",
-                 hash_str.c_str(), seq_-1, retval);
-        if ((retval != SQLITE_DONE) && (retval != SQLITE_OK)) {
-          LogCvmfs(kLogQuota, kLogSyslogErr,
-                   "failed to update %s in cachedb, error %d",
-                   hash_str.c_str(), retval);
-          abort();
-        }
-        sqlite3_reset(stmt_touch_);
+        entry = index_.Lookup(hash);
+        LogCvmfs(kLogQuota, kLogDebug, "touching %s (%"PRIu64"): %d",
+                 hash.ToString().c_str(), seq_, entry != NULL);
+        if (entry != NULL)
+          index_.Touch(entry, seq_++);
         break;
       case kUnpin:
-        sqlite3_bind_text(stmt_unpin_, 1, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        retval = sqlite3_step(stmt_unpin_);
+        entry = index_.Lookup(hash);
         LogCvmfs(kLogQuota, kLogDebug, "unpinning %s: %d",
-                 hash_str.c_str(), retval);
-        if ((retval != SQLITE_DONE) && (retval != SQLITE_OK)) {
-          LogCvmfs(kLogQuota, kLogSyslogErr,
-                   "failed to unpin %s in cachedb, error %d",
-                   hash_str.c_str(), retval);
-          abort();
-        }
-        sqlite3_reset(stmt_unpin_);
+                 hash.ToString().c_str(), entry != NULL);
+        if (entry != NULL)
+          index_.SetPinned(entry, 0);
         break;
       case kPin:
       case kPinRegular:
       case kInsert:
       case kInsertVolatile:
         // It could already be in, check
-        exists = Contains(hash_str);
+        exists = (index_.Lookup(hash) != NULL);
 
         // Cleanup, move to trash and unlink
         if (!exists && (gauge_ + size > limit_)) {
@@ -1625,31 +1748,13 @@ void PosixQuotaManager::ProcessCommandBunch(
         }
 
         // Insert or replace
-        sqlite3_bind_text(stmt_new_, 1, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_new_, 2, size);
-        if (commands[i].command_type == kInsertVolatile) {
-          sqlite3_bind_int64(stmt_new_, 3, (seq_++) | kVolatileFlag);
-        } else {
-          sqlite3_bind_int64(stmt_new_, 3, seq_++);
-        }
-        sqlite3_bind_text(stmt_new_, 4, &descriptions[i*kMaxDescription],
-                          commands[i].desc_length, SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_new_, 5, (commands[i].command_type == kPin) ?
-                           kFileCatalog : kFileRegular);
-        sqlite3_bind_int64(stmt_new_, 6,
-          ((commands[i].command_type == kPin) ||
-           (commands[i].command_type == kPinRegular)) ? 1 : 0);
-        retval = sqlite3_step(stmt_new_);
-        LogCvmfs(kLogQuota, kLogDebug, "insert or replace %s, method %d: %d",
-                 hash_str.c_str(), commands[i].command_type, retval);
-        if ((retval != SQLITE_DONE) && (retval != SQLITE_OK)) {
-          LogCvmfs(kLogQuota, kLogSyslogErr,
-                   "failed to insert %s in cachedb, error %d",
-                   hash_str.c_str(), retval);
-          abort();
-        }
-        sqlite3_reset(stmt_new_);
+        index_.Insert(hash, size,
+          (command_type == kInsertVolatile) ? (seq_++ | kVolatileFlag) : seq_++,
+          string(&descriptions[i*kMaxDescription], commands[i].desc_length),
+          (command_type == kPin) ? kFileCatalog : kFileRegular,
+          ((command_type == kPin) || (command_type == kPinRegular)) ? 1 : 0);
+        LogCvmfs(kLogQuota, kLogDebug, "insert or replace %s, method %d",
+                 hash.ToString().c_str(), command_type);
 
         if (!exists) gauge_ += size;
         break;
@@ -1658,11 +1763,10 @@ void PosixQuotaManager::ProcessCommandBunch(
     }
   }
 
-  retval = sqlite3_exec(database_, "COMMIT", NULL, NULL, NULL);
-  if (retval != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogSyslogErr,
-             "failed to commit to cachedb, error %d", retval);
-    abort();
+  if ((index_.num_pending() >= kCheckpointThreshold) ||
+      (platform_monotonic_time() >= last_checkpoint_ + kCheckpointIntervalS))
+  {
+    Checkpoint();
   }
 }
 
@@ -1838,6 +1942,41 @@ void PosixQuotaManager::Remove(const shash::Any &hash) {
 }
 
 
+/**
+ * Commands that do not expect an answer go through the shared memory ring, if
+ * the command server provides one.  The pipe is then only used to wake up the
+ * command server if it is idle.
+ */
+void PosixQuotaManager::SendAsyncCommand(
+  const LruCommand *command,
+  const unsigned size)
+{
+  if (command_ring_ == NULL) {
+    WritePipe(pipe_lru_[1], command, size);
+    return;
+  }
+
+  while (true) {
+    switch (command_ring_->Enqueue(command, size)) {
+      case ShmRing::kEnqueueOk:
+        return;
+      case ShmRing::kEnqueueWakeup: {
+        LruCommand doorbell;
+        doorbell.command_type = kRingDoorbell;
+        WritePipe(pipe_lru_[1], &doorbell, sizeof(doorbell));
+        return;
+      }
+      case ShmRing::kEnqueueFull:
+        // Like a full pipe, wait for the command server to catch up
+        SafeSleepMs(1);
+        break;
+      default:
+        abort();
+    }
+  }
+}
+
+
 void PosixQuotaManager::Spawn() {
   if (spawned_)
     return;
@@ -1860,7 +1999,7 @@ void PosixQuotaManager::Touch(const shash::Any &hash) {
   LruCommand cmd;
   cmd.command_type = kTouch;
   cmd.StoreHash(hash);
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  SendAsyncCommand(&cmd, sizeof(cmd));
 }
 
 
@@ -1882,7 +2021,7 @@ void PosixQuotaManager::Unpin(const shash::Any &hash) {
   LruCommand cmd;
   cmd.command_type = kUnpin;
   cmd.StoreHash(hash);
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  SendAsyncCommand(&cmd, sizeof(cmd));
 }
 
 
@@ -16,12 +16,14 @@
 
 #include "duplex_sqlite3.h"
 #include "hash.h"
+#include "quota_index.h"
 #include "statistics.h"
 #include "util.h"
 
 namespace perf {
 class Recorder;
 }
+class ShmRing;
 
 /**
  * The QuotaManager keeps track of the cache contents.  It is informed by the
@@ -48,6 +50,9 @@ class QuotaManager : SingleCopy {
    *  - backchannel command 'R': release pinned files if possible
    * Revision 2:
    *  - add kCleanupRate command
+   * Revision 3:
+   *  - asynchronous commands through the shared memory ring cachemgr.ring,
+   *    kRingDoorbell wakes up the command server
    */
   static const uint32_t kProtocolRevision;
 
@@ -166,7 +171,10 @@ class NoopQuotaManager : public QuotaManager {
  */
 class PosixQuotaManager : public QuotaManager {
   FRIEND_TEST(T_QuotaManager, BindReturnPipe);
+  FRIEND_TEST(T_QuotaManager, Checkpoint);
   FRIEND_TEST(T_QuotaManager, Cleanup);
+  FRIEND_TEST(T_QuotaManager, CommandRing);
+  FRIEND_TEST(T_QuotaManager, CommandThroughputSlow);
   FRIEND_TEST(T_QuotaManager, Contains);
   FRIEND_TEST(T_QuotaManager, InitDatabase);
   FRIEND_TEST(T_QuotaManager, MakeReturnPipe);
@@ -247,6 +255,8 @@ class PosixQuotaManager : public QuotaManager {
     // as of protocol revision 2
     kListVolatile,
     kCleanupRate,
+    // as of protocol revision 3
+    kRingDoorbell,
   };
 
   /**
@@ -313,6 +323,14 @@ class PosixQuotaManager : public QuotaManager {
    */
   static const unsigned kCommandBufferSize = 32;
 
+  /**
+   * While the next message in the command ring is claimed but not yet
+   * published, the command server looks at the pipe for that long before it
+   * checks the ring again.  Once it has read a command from the pipe, it
+   * only polls the ring until the messages before that command are through.
+   */
+  static const unsigned kRingPendingPollMs = 1;
+
   /**
    * Make sure that the amount of data transferred through the RPC pipe is
    * within the OS's guarantees for atomiticity.
@@ -332,8 +350,18 @@ class PosixQuotaManager : public QuotaManager {
    */
   static const uint64_t kVolatileFlag = 1ULL << 63;
 
+  /**
+   * The in-memory index is written to the cache database once this many
+   * entries changed or when the last checkpoint is older than
+   * kCheckpointIntervalS.
+   */
+  static const unsigned kCheckpointThreshold = 8192;
+  static const unsigned kCheckpointIntervalS = 60;
+
   bool InitDatabase(const bool rebuild_database);
   bool RebuildDatabase();
+  bool LoadIndex();
+  void Checkpoint();
   void CloseDatabase();
   bool Contains(const std::string &hash_str);
   bool DoCleanup(const uint64_t leave_size);
@@ -346,6 +374,14 @@ class PosixQuotaManager : public QuotaManager {
   void CleanupPipes();
 
   void CheckHighPinWatermark();
+  void SendAsyncCommand(const LruCommand *command, const unsigned size);
+  void DrainCommandRing(const uint64_t until,
+                        LruCommand *command_buffer,
+                        char *description_buffer,
+                        unsigned *num_commands);
+  void ProcessCommand(LruCommand *command_buffer,
+                      char *description_buffer,
+                      unsigned *num_commands);
   void ProcessCommandBunch(const unsigned num,
                            const LruCommand *commands,
                            const char *descriptions);
@@ -408,11 +444,31 @@ class PosixQuotaManager : public QuotaManager {
    */
   std::map<shash::Any, uint64_t> pinned_chunks_;
 
+  /**
+   * Authoritative for the cache contents and the LRU order while the database
+   * is open.  The cache database lags behind by up to one checkpoint.  After a
+   * crash, the cache database is rebuilt from the cache directory anyway.
+   */
+  QuotaIndex index_;
+
+  /**
+   * Time of the last write-back of the index to the cache database
+   */
+  uint64_t last_checkpoint_;
+
   /**
    * Used to send RPCs to the quota manager thread or process.
    */
   int pipe_lru_[2];
 
+  /**
+   * Carries asynchronous commands (touch, insert, pin, unpin) from the clients
+   * to the command server without a system call, unless the server is idle.
+   * Synchronous commands and their replies still go through the pipes.  NULL
+   * if the command server does not provide a ring.
+   */
+  ShmRing *command_ring_;
+
   /**
    * In exclusive mode, controls the quota manager thread.
    */
@@ -436,13 +492,8 @@ class PosixQuotaManager : public QuotaManager {
   perf::MultiRecorder cleanup_recorder_;
 
   sqlite3 *database_;
-  sqlite3_stmt *stmt_touch_;
-  sqlite3_stmt *stmt_unpin_;
-  sqlite3_stmt *stmt_block_;
-  sqlite3_stmt *stmt_unblock_;
+  sqlite3_stmt *stmt_update_;
   sqlite3_stmt *stmt_new_;
-  sqlite3_stmt *stmt_lru_;
-  sqlite3_stmt *stmt_size_;
   sqlite3_stmt *stmt_rm_;
   sqlite3_stmt *stmt_list_;
   sqlite3_stmt *stmt_list_pinned_;  /**< Loaded catalogs are pinned. */
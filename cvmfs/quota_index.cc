@@ -0,0 +1,205 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include "cvmfs_config.h"
+#include "quota_index.h"
+
+#include "murmur.h"
+
+using namespace std;  // NOLINT
+
+static inline uint32_t hasher_any(const shash::Any &key) {
+  return MurmurHash2(key.digest, shash::kDigestSizes[key.algorithm],
+                     0x07387a4f);
+}
+
+
+QuotaIndex::QuotaIndex() {
+  // The empty key has the algorithm kAny, which never appears in the cache
+  entries_.Init(1024, shash::Any(), hasher_any);
+}
+
+
+QuotaIndex::~QuotaIndex() {
+  Clear();
+}
+
+
+void QuotaIndex::Append(Entry *entry) {
+  List *list = GetList(entry);
+  entry->prev = list->tail;
+  entry->next = NULL;
+  if (list->tail != NULL)
+    list->tail->next = entry;
+  else
+    list->head = entry;
+  list->tail = entry;
+}
+
+
+/**
+ * Removes all entries, including the pending changes.
+ */
+void QuotaIndex::Clear() {
+  Entry *entry = First();
+  while (entry != NULL) {
+    Entry *next = Next(entry);
+    delete entry;
+    entry = next;
+  }
+  volatile_ = List();
+  regular_ = List();
+  entries_.Clear();
+  pending_.clear();
+}
+
+
+QuotaIndex::Entry *QuotaIndex::First() const {
+  return (volatile_.head != NULL) ? volatile_.head : regular_.head;
+}
+
+
+/**
+ * Inserts a new entry or replaces an existing one.  In both cases the entry
+ * becomes the most recently used one.
+ */
+QuotaIndex::Entry *QuotaIndex::Insert(
+  const shash::Any &hash,
+  const uint64_t size,
+  const uint64_t seq,
+  const string &description,
+  const int type,
+  const int pinned)
+{
+  Entry *entry = Lookup(hash);
+  if (entry != NULL) {
+    Unlink(entry);
+  } else {
+    entry = new Entry();
+    entry->hash = hash;
+    entry->state = kStateClean;
+    entries_.Insert(hash, entry);
+  }
+  entry->size = size;
+  entry->seq = seq;
+  entry->description = description;
+  entry->type = type;
+  entry->pinned = pinned;
+  Append(entry);
+  MarkDirty(entry, kStateNew);
+  return entry;
+}
+
+
+QuotaIndex::Entry *QuotaIndex::Lookup(const shash::Any &hash) const {
+  Entry *entry;
+  if (entries_.Lookup(hash, &entry))
+    return entry;
+  return NULL;
+}
+
+
+void QuotaIndex::MarkDirty(Entry *entry, const EntryState state) {
+  if (entry->state == kStateClean)
+    pending_.push_back(entry->hash);
+  if (state > entry->state)
+    entry->state = state;
+}
+
+
+/**
+ * Iterates in eviction order: volatile entries first, then regular entries,
+ * each from the least recently used to the most recently used one.
+ */
+QuotaIndex::Entry *QuotaIndex::Next(const Entry *entry) const {
+  if (entry->next != NULL)
+    return entry->next;
+  return IsVolatile(entry) ? regular_.head : NULL;
+}
+
+
+/**
+ * Removes the entry and records the removal as a pending change.  The entry
+ * pointer is invalid afterwards.
+ */
+void QuotaIndex::Remove(Entry *entry) {
+  if (entry->state == kStateClean)
+    pending_.push_back(entry->hash);
+  Unlink(entry);
+  entries_.Erase(entry->hash);
+  delete entry;
+}
+
+
+/**
+ * Adds an entry that is already in the database.  Entries need to be restored
+ * in the order of their sequence numbers.  Returns false if the hash is
+ * already present.
+ */
+bool QuotaIndex::Restore(
+  const shash::Any &hash,
+  const uint64_t size,
+  const uint64_t seq,
+  const int type,
+  const int pinned)
+{
+  if (Lookup(hash) != NULL)
+    return false;
+  Entry *entry = new Entry();
+  entry->hash = hash;
+  entry->size = size;
+  entry->seq = seq;
+  entry->type = type;
+  entry->pinned = pinned;
+  entry->state = kStateClean;
+  entries_.Insert(hash, entry);
+  Append(entry);
+  return true;
+}
+
+
+void QuotaIndex::SetPinned(Entry *entry, const int pinned) {
+  if (entry->pinned == pinned)
+    return;
+  entry->pinned = pinned;
+  MarkDirty(entry, kStateModified);
+}
+
+
+/**
+ * Hands over the hashes of all entries changed or removed since the last call.
+ * The caller is supposed to write the changes to the database and to reset the
+ * state of the entries to clean.  A hash can appear more than once.
+ */
+void QuotaIndex::TakePending(vector<shash::Any> *hashes) {
+  hashes->clear();
+  hashes->swap(pending_);
+}
+
+
+/**
+ * Makes the entry the most recently used one.  The volatile flag of the
+ * entry's sequence number is preserved.
+ */
+void QuotaIndex::Touch(Entry *entry, const uint64_t seq) {
+  const uint64_t volatile_flag = entry->seq & (1ULL << 63);
+  Unlink(entry);
+  entry->seq = seq | volatile_flag;
+  Append(entry);
+  MarkDirty(entry, kStateModified);
+}
+
+
+void QuotaIndex::Unlink(Entry *entry) {
+  List *list = GetList(entry);
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    list->head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    list->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
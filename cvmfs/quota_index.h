@@ -0,0 +1,100 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_QUOTA_INDEX_H_
+#define CVMFS_QUOTA_INDEX_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "smallhash.h"
+#include "util.h"
+
+/**
+ * In-memory copy of the cache database that is authoritative for the LRU order
+ * of the files in the cache.  Entries are kept in a hash table and in two
+ * doubly linked lists in access order, one for volatile entries and one for
+ * all the others.  Touching an entry moves it to the end of its list, cleanup
+ * walks the volatile list first and then the regular list from the front.
+ *
+ * Volatile entries have the highest bit of the sequence number set, i.e. their
+ * sequence number is negative in the database.
+ *
+ * Changes are collected and written back to the database by the quota manager
+ * in bulk (see PosixQuotaManager::Checkpoint()).  An entry is clean, modified
+ * (sequence number or pin flag changed) or new (the full row needs to be
+ * written).  The hashes of changed and removed entries are recorded once in
+ * the list of pending hashes.
+ */
+class QuotaIndex : SingleCopy {
+ public:
+  enum EntryState {
+    kStateClean = 0,
+    kStateModified,
+    kStateNew,
+  };
+
+  struct Entry {
+    shash::Any hash;
+    uint64_t size;
+    uint64_t seq;
+    /**
+     * Only kept until the new entry is written to the database
+     */
+    std::string description;
+    int type;
+    int pinned;
+    EntryState state;
+    Entry *prev;
+    Entry *next;
+  };
+
+  QuotaIndex();
+  ~QuotaIndex();
+
+  Entry *Lookup(const shash::Any &hash) const;
+  Entry *Insert(const shash::Any &hash, const uint64_t size, const uint64_t seq,
+                const std::string &description, const int type,
+                const int pinned);
+  bool Restore(const shash::Any &hash, const uint64_t size, const uint64_t seq,
+               const int type, const int pinned);
+  void Touch(Entry *entry, const uint64_t seq);
+  void SetPinned(Entry *entry, const int pinned);
+  void Remove(Entry *entry);
+  void Clear();
+
+  Entry *First() const;
+  Entry *Next(const Entry *entry) const;
+
+  void TakePending(std::vector<shash::Any> *hashes);
+  unsigned num_pending() const { return pending_.size(); }
+  unsigned size() const { return entries_.size(); }
+
+ private:
+  struct List {
+    List() : head(NULL), tail(NULL) { }
+    Entry *head;
+    Entry *tail;
+  };
+
+  static bool IsVolatile(const Entry *entry) {
+    return static_cast<int64_t>(entry->seq) < 0;
+  }
+  List *GetList(const Entry *entry) {
+    return IsVolatile(entry) ? &volatile_ : &regular_;
+  }
+  void Append(Entry *entry);
+  void Unlink(Entry *entry);
+  void MarkDirty(Entry *entry, const EntryState state);
+
+  SmallHashDynamic<shash::Any, Entry *> entries_;
+  List volatile_;
+  List regular_;
+  std::vector<shash::Any> pending_;
+};
+
+#endif  // CVMFS_QUOTA_INDEX_H_
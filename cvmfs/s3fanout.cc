@@ -11,6 +11,7 @@
 
 #include "cvmfs_config.h"
 #include "s3fanout.h"
+#include "statistics.h"
 #include "upload_facility.h"
 #include "util_concurrency.h"
 
@@ -28,12 +29,17 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
   JobInfo *info = static_cast<JobInfo *>(info_link);
 
   // Check for http status code errors
-  if (HasPrefix(header_line, "HTTP/1.", false)) {
+  if (HasPrefix(header_line, "HTTP/1.", false) ||
+      HasPrefix(header_line, "HTTP/2", false))
+  {
     if (header_line.length() < 10)
       return 0;
 
-    unsigned i;
-    for (i = 8; (i < header_line.length()) && (header_line[i] == ' '); ++i) {}
+    // Skip the protocol version, "HTTP/1.1" or "HTTP/2"
+    unsigned i = header_line.find(' ');
+    for (; (i < header_line.length()) && (header_line[i] == ' '); ++i) {}
+    if (i >= header_line.length())
+      return 0;
 
     if (header_line[i] == '2') {
       return num_bytes;
@@ -462,7 +468,7 @@ int S3FanoutManager::InitializeDnsSettings(
 
   // We need to resolve the hostname
   // TODO(ssheikki): support ipv6 also...  if (opt_ipv4_only_)
-  dns::Host host = resolver_->Resolve(remote_host);
+  dns::Host host = host_cache_->Resolve(remote_host);
   set<string> ipv4_addresses = host.ipv4_addresses();
   std::set<string>::iterator its = ipv4_addresses.begin();
   S3FanOutDnsEntry *dnse = NULL;
@@ -652,6 +658,16 @@ Failures S3FanoutManager::InitializeRequest(JobInfo *info, CURL *handle) const {
   // Follow HTTP redirects
   retval = curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
   assert(retval == CURLE_OK);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  if (opt_http2_) {
+    // Falls back to HTTP/1.1 if the S3 endpoint does not speak HTTP/2
+    retval = curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+                              CURL_HTTP_VERSION_2_0);
+    assert(retval == CURLE_OK);
+    retval = curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    assert(retval == CURLE_OK);
+  }
+#endif
 
   return kFailOk;
 }
@@ -683,6 +699,17 @@ void S3FanoutManager::UpdateStatistics(CURL *handle) {
 
   if (curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD, &val) == CURLE_OK)
     statistics_->transferred_bytes += val;
+
+  long lval;  // NOLINT
+  if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &lval) == CURLE_OK)
+    statistics_->num_connections += lval;
+#if LIBCURL_VERSION_NUM >= 0x073200
+  if ((curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &lval) == CURLE_OK) &&
+      (lval == CURL_HTTP_VERSION_2_0))
+  {
+    statistics_->num_http2_requests++;
+  }
+#endif
 }
 
 
@@ -876,11 +903,13 @@ S3FanoutManager::S3FanoutManager() {
   opt_backoff_init_ms_ = 0;
   opt_backoff_max_ms_ = 0;
   opt_ipv4_only_ = false;
+  opt_http2_ = false;
 
   max_available_jobs_ = 0;
   thread_upload_ = 0;
   thread_upload_run_ = false;
-  resolver_ = NULL;
+  host_cache_ = NULL;
+  dns_statistics_ = NULL;
   statistics_ = NULL;
 }
 
@@ -945,7 +974,9 @@ void S3FanoutManager::Init(const unsigned int max_pool_handles) {
 
   SetRetryParameters(3, 100, 2000);
 
-  resolver_ = dns::CaresResolver::Create(opt_ipv4_only_, 2, 2000);
+  dns_statistics_ = new perf::Statistics();
+  host_cache_ = dns::HostCache::Create(
+    dns::CaresResolver::Create(opt_ipv4_only_, 2, 2000), dns_statistics_);
 }
 
 
@@ -987,6 +1018,10 @@ void S3FanoutManager::Fini() {
 
   delete statistics_;
   statistics_ = NULL;
+  delete host_cache_;
+  host_cache_ = NULL;
+  delete dns_statistics_;
+  dns_statistics_ = NULL;
 
   delete available_jobs_;
 
@@ -1004,6 +1039,8 @@ void S3FanoutManager::Spawn() {
   int retval = pthread_create(&thread_upload_, NULL, MainUpload,
                               static_cast<void *>(this));
   assert(retval == 0);
+  // Refreshes the S3 host names ahead of their expiry
+  host_cache_->Spawn();
 
   atomic_inc32(&multi_threaded_);
 }
@@ -1030,7 +1067,49 @@ void S3FanoutManager::GetTimeout(unsigned *seconds) {
 }
 
 
+/**
+ * Multiplexes concurrent uploads to the same host as HTTP/2 streams on a
+ * single connection.  Returns false if libcurl has no HTTP/2 support, uploads
+ * then use HTTP/1.1.  Limiting the streams per connection to max_streams
+ * requires libcurl >= 7.67.  Needs to be called before Spawn().
+ */
+bool S3FanoutManager::EnableHttp2(const unsigned max_streams) {
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  curl_version_info_data *curl_info = curl_version_info(CURLVERSION_NOW);
+  if (curl_info->features & CURL_VERSION_HTTP2) {
+    CURLMcode mretval = curl_multi_setopt(curl_multi_, CURLMOPT_PIPELINING,
+                                          CURLPIPE_MULTIPLEX);
+    assert(mretval == CURLM_OK);
+#if LIBCURL_VERSION_NUM >= 0x074300
+    mretval = curl_multi_setopt(curl_multi_, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                                static_cast<long>(max_streams));  // NOLINT
+    assert(mretval == CURLM_OK);
+#else
+    LogCvmfs(kLogS3Fanout, kLogStderr,
+             "libcurl %s cannot limit the number of HTTP/2 streams per "
+             "connection, ignoring limit of %u streams",
+             curl_info->version, max_streams);
+#endif
+    opt_http2_ = true;
+    return true;
+  }
+#endif
+  LogCvmfs(kLogS3Fanout, kLogStderr,
+           "HTTP/2 is not supported by libcurl %s, using HTTP/1.1",
+           curl_version_info(CURLVERSION_NOW)->version);
+  return false;
+}
+
+
+/**
+ * The DNS counters are taken from the host cache at the time of the call.
+ */
 const Statistics &S3FanoutManager::GetStatistics() {
+  statistics_->num_dns_hits = dns_statistics_->Lookup("dns.n_hit")->Get();
+  statistics_->num_dns_misses = dns_statistics_->Lookup("dns.n_miss")->Get();
+  statistics_->num_dns_refreshes =
+    dns_statistics_->Lookup("dns.n_refresh")->Get();
+  statistics_->num_dns_stale = dns_statistics_->Lookup("dns.n_stale")->Get();
   return *statistics_;
 }
 
@@ -1114,7 +1193,19 @@ string Statistics::Print() const {
       "Number of requests: " +
       StringifyInt(num_requests) + "\n" +
       "Number of retries:  " +
-      StringifyInt(num_retries) + "\n";
+      StringifyInt(num_retries) + "\n" +
+      "Connections:        " +
+      StringifyInt(num_connections) + "\n" +
+      "HTTP/2 requests:    " +
+      StringifyInt(num_http2_requests) + "\n" +
+      "DNS cache hits:     " +
+      StringifyInt(num_dns_hits) + "\n" +
+      "DNS cache misses:   " +
+      StringifyInt(num_dns_misses) + "\n" +
+      "DNS refreshes:      " +
+      StringifyInt(num_dns_refreshes) + "\n" +
+      "DNS stale entries:  " +
+      StringifyInt(num_dns_stale) + "\n";
 }
 
 }  // namespace s3fanout
@@ -21,6 +21,10 @@
 #include "util.h"
 #include "util_concurrency.h"
 
+namespace perf {
+class Statistics;
+}
+
 namespace s3fanout {
 
 /**
@@ -71,12 +75,24 @@ struct Statistics {
   double transfer_time;
   uint64_t num_requests;
   uint64_t num_retries;
+  uint64_t num_connections;
+  uint64_t num_http2_requests;
+  uint64_t num_dns_hits;
+  uint64_t num_dns_misses;
+  uint64_t num_dns_refreshes;
+  uint64_t num_dns_stale;
 
   Statistics() {
     transferred_bytes = 0.0;
     transfer_time = 0.0;
     num_requests = 0;
     num_retries = 0;
+    num_connections = 0;
+    num_http2_requests = 0;
+    num_dns_hits = 0;
+    num_dns_misses = 0;
+    num_dns_refreshes = 0;
+    num_dns_stale = 0;
   }
 
   std::string Print() const;
@@ -183,6 +199,12 @@ class S3FanoutManager : SingleCopy {
   typedef SynchronizingCounter<uint32_t> Semaphore;
 
  public:
+  /**
+   * Concurrent HTTP/2 streams on a single connection, if not limited
+   * otherwise by the server.
+   */
+  static const unsigned kHttp2DefaultMaxStreams = 100;
+
   S3FanoutManager();
   ~S3FanoutManager();
 
@@ -199,6 +221,7 @@ class S3FanoutManager : SingleCopy {
   void SetRetryParameters(const unsigned max_retries,
                           const unsigned backoff_init_ms,
                           const unsigned backoff_max_ms);
+  bool EnableHttp2(const unsigned max_streams);
 
   bool DoSingleJob(JobInfo *info) const;
 
@@ -243,7 +266,12 @@ class S3FanoutManager : SingleCopy {
   std::set<CURL *> *pool_handles_inuse_;
   std::set<S3FanOutDnsEntry *> *sharehandles_;
   std::map<CURL *, S3FanOutDnsEntry *> *curl_sharehandles_;
-  dns::CaresResolver *resolver_;
+  dns::HostCache *host_cache_;
+  /**
+   * Holds the counters of the host cache, which are reported as part of
+   * GetStatistics().
+   */
+  perf::Statistics *dns_statistics_;
   uint32_t pool_max_handles_;
   CURLM *curl_multi_;
   std::string *user_agent_;
@@ -264,6 +292,7 @@ class S3FanoutManager : SingleCopy {
   unsigned opt_backoff_init_ms_;
   unsigned opt_backoff_max_ms_;
   bool opt_ipv4_only_;
+  bool opt_http2_;
 
   unsigned int max_available_jobs_;
   Semaphore *available_jobs_;
@@ -0,0 +1,286 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+
+#include "logging.h"
+#include "platform.h"
+
+using namespace std;  // NOLINT
+
+const unsigned ShmRing::kNumSlots;
+const unsigned ShmRing::kSlotSize;
+
+
+ShmRing::ShmRing()
+  : header_(NULL)
+  , slots_(NULL)
+  , num_lost_(0)
+  , pending_pos_(static_cast<uint64_t>(-1))
+  , pending_since_(0)
+{ }
+
+
+ShmRing::~ShmRing() {
+  if (header_ != NULL)
+    munmap(header_, GetMappingSize());
+}
+
+
+/**
+ * Connects to a ring created by another process.
+ */
+ShmRing *ShmRing::Attach(const string &path) {
+  const int fd = open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to open ring %s (%d)",
+             path.c_str(), errno);
+    return NULL;
+  }
+  platform_stat64 info;
+  if ((platform_fstat(fd, &info) != 0) ||
+      (static_cast<size_t>(info.st_size) != GetMappingSize()))
+  {
+    LogCvmfs(kLogQuota, kLogDebug, "invalid ring size %s", path.c_str());
+    close(fd);
+    return NULL;
+  }
+  ShmRing *ring = Map(fd, false);
+  close(fd);
+  if (ring == NULL)
+    return NULL;
+
+  const Header *header = ring->header_;
+  if ((header->magic != kMagic) || (header->version != kVersion) ||
+      (header->num_slots != kNumSlots) || (header->slot_size != kSlotSize))
+  {
+    LogCvmfs(kLogQuota, kLogDebug, "incompatible ring %s", path.c_str());
+    delete ring;
+    return NULL;
+  }
+  return ring;
+}
+
+
+/**
+ * Removes a possibly existing ring at path and creates a fresh one.  With an
+ * empty path, the ring is created in anonymous memory.
+ */
+ShmRing *ShmRing::Create(const string &path) {
+  if (path.empty())
+    return Map(-1, true);
+
+  unlink(path.c_str());
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to create ring %s (%d)",
+             path.c_str(), errno);
+    return NULL;
+  }
+  if (ftruncate(fd, GetMappingSize()) != 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to resize ring %s (%d)",
+             path.c_str(), errno);
+    close(fd);
+    unlink(path.c_str());
+    return NULL;
+  }
+  ShmRing *ring = Map(fd, true);
+  close(fd);
+  if (ring == NULL)
+    unlink(path.c_str());
+  return ring;
+}
+
+
+void ShmRing::CancelSleep() {
+  atomic_write32(&header_->sleeping, 0);
+}
+
+
+/**
+ * Returns the size of the message copied into buffer, which needs to be at
+ * least kSlotSize bytes large.  Returns 0 if the ring is empty or if the next
+ * message is claimed but not yet published.  In the latter case, the ring is
+ * not empty and the consumer should come back a bit later.  Must only be called
+ * by the single consumer.
+ */
+unsigned ShmRing::Dequeue(void *buffer) {
+  while (true) {
+    const uint64_t pos = tail();
+    if (head() == pos)
+      return 0;
+    Slot *slot = GetSlot(pos);
+    // Claimed but maybe not yet published
+    for (unsigned i = 0; (i < 100) &&
+         (static_cast<uint64_t>(atomic_read64(&slot->seq)) != pos + 1); ++i)
+    {
+      sched_yield();
+    }
+    if (static_cast<uint64_t>(atomic_read64(&slot->seq)) != pos + 1) {
+      if (!RevokeClaim(slot, pos))
+        return 0;
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslogWarn,
+               "skipping unpublished message %"PRIu64" in ring", pos);
+      num_lost_++;
+      atomic_write64(&header_->tail, pos + 1);
+      continue;
+    }
+
+    const unsigned size = slot->size;
+    assert(size <= kSlotSize);
+    memcpy(buffer, slot->data, size);
+    atomic_write64(&slot->seq, pos + kNumSlots);
+    atomic_write64(&header_->tail, pos + 1);
+    return size;
+  }
+}
+
+
+/**
+ * Never blocks.  If the ring is full, the caller should wait a bit and try
+ * again.  On kEnqueueWakeup, the message is in the ring and the caller has to
+ * wake up the consumer by other means.
+ */
+ShmRing::EnqueueResult ShmRing::Enqueue(
+  const void *message,
+  const unsigned size)
+{
+  assert((size > 0) && (size <= kSlotSize));
+
+  uint64_t pos;
+  Slot *slot;
+  while (true) {
+    pos = head();
+    while (true) {
+      slot = GetSlot(pos);
+      const int64_t diff =
+        atomic_read64(&slot->seq) - static_cast<int64_t>(pos);
+      if (diff == 0) {
+        if (atomic_cas64(&header_->head, pos, pos + 1))
+          break;
+      } else if (diff < 0) {
+        return kEnqueueFull;
+      }
+      pos = head();
+    }
+
+    // The previous owner is the one of the last round.  Fails if the consumer
+    // revoked our claim before we registered, in which case we start over
+    // without touching the slot.
+    const int64_t owner = atomic_read64(&slot->owner);
+    if (IsOwnerOf(owner, pos - kNumSlots) &&
+        atomic_cas64(&slot->owner, owner, MakeOwner(getpid(), pos)))
+    {
+      break;
+    }
+  }
+
+  slot->size = size;
+  memcpy(slot->data, message, size);
+  // Registered owners of a live process keep their slot
+  atomic_write64(&slot->seq, pos + 1);
+
+  if (atomic_read32(&header_->sleeping) &&
+      atomic_cas32(&header_->sleeping, 1, 0))
+  {
+    return kEnqueueWakeup;
+  }
+  return kEnqueueOk;
+}
+
+
+ShmRing *ShmRing::Map(const int fd, const bool initialize) {
+  const int flags = (fd < 0) ? (MAP_SHARED | MAP_ANON) : MAP_SHARED;
+  void *mapping =
+    mmap(NULL, GetMappingSize(), PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (mapping == MAP_FAILED) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to map ring (%d)", errno);
+    return NULL;
+  }
+
+  ShmRing *ring = new ShmRing();
+  ring->header_ = reinterpret_cast<Header *>(mapping);
+  ring->slots_ = reinterpret_cast<Slot *>(
+    reinterpret_cast<char *>(mapping) + sizeof(Header));
+  if (initialize) {
+    memset(ring->header_, 0, sizeof(Header));
+    for (unsigned i = 0; i < kNumSlots; ++i) {
+      ring->slots_[i].seq = i;
+      ring->slots_[i].owner =
+        MakeOwner(0, static_cast<uint64_t>(i) - kNumSlots);
+      ring->slots_[i].size = 0;
+    }
+    ring->header_->num_slots = kNumSlots;
+    ring->header_->slot_size = kSlotSize;
+    ring->header_->version = kVersion;
+    // Written last, attaching processes check the magic number
+    __sync_synchronize();
+    ring->header_->magic = kMagic;
+  }
+  return ring;
+}
+
+
+/**
+ * Called by the consumer before it blocks on a different channel.  Returns
+ * false if there are messages in the ring, in which case the consumer should
+ * not go to sleep.
+ */
+bool ShmRing::PrepareSleep() {
+  atomic_write32(&header_->sleeping, 1);
+  if (IsEmpty())
+    return true;
+  CancelSleep();
+  return false;
+}
+
+
+/**
+ * Called by the consumer for the slot at the tail that is claimed but not
+ * published.  Returns true if the claim was taken back and the slot can be
+ * skipped.  Never waits; the owner is only checked once the slot is pending
+ * for kPublishTimeoutSec.  A process id that got recycled in the meantime
+ * keeps the slot alive, that is rare enough to be neglected.
+ */
+bool ShmRing::RevokeClaim(Slot *slot, const uint64_t pos) {
+  const uint64_t now = platform_monotonic_time();
+  if (pending_pos_ != pos) {
+    pending_pos_ = pos;
+    pending_since_ = now;
+    return false;
+  }
+  if (now < pending_since_ + kPublishTimeoutSec)
+    return false;
+
+  const int64_t owner = atomic_read64(&slot->owner);
+  if (IsOwnerOf(owner, pos)) {
+    // Only producers of processes that are gone cannot publish anymore
+    if ((kill(GetOwnerPid(owner), 0) == 0) || (errno != ESRCH))
+      return false;
+  } else {
+    // The producer claimed the slot but did not register yet.  It will notice
+    // and start over with a new slot.  Fails if it registered in the meantime.
+    if (!atomic_cas64(&slot->owner, owner, MakeOwner(0, pos)))
+      return false;
+  }
+
+  // Nobody is going to write into the slot anymore
+  atomic_write64(&slot->seq, pos + kNumSlots);
+  return true;
+}
@@ -0,0 +1,153 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_SHM_RING_H_
+#define CVMFS_SHM_RING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include "atomic.h"
+#include "gtest/gtest_prod.h"
+#include "util.h"
+
+/**
+ * Bounded multiple-producer, single-consumer queue of small messages in shared
+ * memory.  The ring is mapped from a file so that unrelated processes (fuse
+ * clients and the shared cache manager) can attach to it.  Without a file, the
+ * ring lives in anonymous memory and is only shared among threads (and forked
+ * children).
+ *
+ * Producers claim a slot by advancing the head with a compare-and-swap,
+ * register as the slot's owner, copy the message, and publish the slot by
+ * setting its sequence number.  No locks are involved, producers never wait
+ * for each other unless the ring is full.  The consumer reads the slots in
+ * order.  It never waits for a claimed but unpublished slot; Dequeue() returns
+ * and the slot is tried again on the next call.  The claim is only taken back
+ * if the owner is gone (see kPublishTimeoutSec).
+ *
+ * The ring has no means of blocking the consumer.  Instead, the consumer
+ * announces with PrepareSleep() that it is about to block on some other
+ * channel.  The first producer that finds the consumer asleep is told by
+ * Enqueue() to wake up the consumer, similar to the futex protocol.  Under
+ * load, the consumer does not sleep and producers do not issue any blocking
+ * system call.
+ */
+class ShmRing : SingleCopy {
+ public:
+  static const unsigned kNumSlots = 1024;  // must be a power of 2
+  static const unsigned kSlotSize = 512;
+  static const uint32_t kMagic = 0x52494e47;  // 'RING'
+  static const uint32_t kVersion = 2;
+  /**
+   * A slot that is claimed but not published within this time is checked for
+   * its owner.  If the owning process is gone, for instance because it died in
+   * the middle of Enqueue(), the slot is skipped.  If the producer did not
+   * even register as owner yet, its claim is revoked and the producer starts
+   * over.  Slots of producers that are alive but stalled are never taken.
+   */
+  static const unsigned kPublishTimeoutSec = 2;
+
+  enum EnqueueResult {
+    kEnqueueOk = 0,
+    kEnqueueWakeup,  ///< Succeeded but the consumer needs to be woken up
+    kEnqueueFull,
+  };
+
+  static ShmRing *Create(const std::string &path);
+  static ShmRing *Attach(const std::string &path);
+  ~ShmRing();
+
+  EnqueueResult Enqueue(const void *message, const unsigned size);
+  unsigned Dequeue(void *buffer);
+  bool PrepareSleep();
+  void CancelSleep();
+
+  /**
+   * Number of messages ever enqueued resp. dequeued.  The consumer can drain
+   * the ring up to a certain head position in order to process all messages
+   * that were enqueued before an event on another channel.
+   */
+  uint64_t head() { return atomic_read64(&header_->head); }
+  uint64_t tail() { return atomic_read64(&header_->tail); }
+  bool IsEmpty() { return head() == tail(); }
+  uint64_t num_lost() { return num_lost_; }
+
+ private:
+  FRIEND_TEST(T_ShmRing, ProducerForkedAfterAttach);
+  FRIEND_TEST(T_ShmRing, UnpublishedSlots);
+
+  /**
+   * Head and tail are on separate cache lines so that producers and the
+   * consumer do not thrash each other's caches.
+   */
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    char padding1[48];
+    atomic_int64 head;
+    char padding2[56];
+    atomic_int64 tail;
+    char padding3[56];
+    atomic_int32 sleeping;
+    char padding4[60];
+  };
+
+  /**
+   * The slot with index i is free for the producer that claimed position p
+   * if seq == p, and it is ready for the consumer if seq == p + 1.  The owner
+   * combines the pid of the producer (upper half) and the lower half of the
+   * claimed position.  A pid of 0 marks a claim revoked by the consumer.  The
+   * pid is taken when the slot is claimed, so that rings attached before a
+   * fork() are safe to use in the child.
+   */
+  struct Slot {
+    atomic_int64 seq;
+    atomic_int64 owner;
+    uint32_t size;
+    uint32_t padding;
+    unsigned char data[kSlotSize];
+  };
+
+  static size_t GetMappingSize() {
+    return sizeof(Header) + kNumSlots * sizeof(Slot);
+  }
+  static ShmRing *Map(const int fd, const bool initialize);
+
+  ShmRing();
+  Slot *GetSlot(const uint64_t pos) {
+    return &slots_[pos & (kNumSlots - 1)];
+  }
+  static int64_t MakeOwner(const pid_t pid, const uint64_t pos) {
+    return static_cast<int64_t>((static_cast<uint64_t>(pid) << 32) |
+                                (pos & 0xFFFFFFFFULL));
+  }
+  static pid_t GetOwnerPid(const int64_t owner) {
+    return static_cast<pid_t>(static_cast<uint64_t>(owner) >> 32);
+  }
+  static bool IsOwnerOf(const int64_t owner, const uint64_t pos) {
+    return (static_cast<uint64_t>(owner) & 0xFFFFFFFFULL) ==
+           (pos & 0xFFFFFFFFULL);
+  }
+  bool RevokeClaim(Slot *slot, const uint64_t pos);
+
+  Header *header_;
+  Slot *slots_;
+  /**
+   * Number of slots skipped by the consumer because they were never published
+   */
+  uint64_t num_lost_;
+  /**
+   * Position and time at which the consumer first found the slot at the tail
+   * claimed but unpublished.
+   */
+  uint64_t pending_pos_;
+  uint64_t pending_since_;
+};
+
+#endif  // CVMFS_SHM_RING_H_
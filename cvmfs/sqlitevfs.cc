@@ -16,14 +16,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 
@@ -43,6 +46,11 @@ namespace {
 
 const char *kVfsName = "cvmfs-readonly";
 
+/**
+ * Size of the read buffer for files that cannot be memory mapped.
+ */
+const unsigned kReadBufferSize = 64 * 1024;
+
 /**
  * The private user data attached to the sqlite_vfs object.
  */
@@ -55,6 +63,9 @@ struct VfsRdOnly {
     , sz_rand(NULL)
     , n_read(NULL)
     , sz_read(NULL)
+    , n_fetch(NULL)
+    , sz_fetch(NULL)
+    , n_pread(NULL)
     , n_sleep(NULL)
     , sz_sleep(NULL)
     , n_time(NULL)
@@ -66,6 +77,9 @@ struct VfsRdOnly {
   perf::Counter *sz_rand;
   perf::Counter *n_read;
   perf::Counter *sz_read;
+  perf::Counter *n_fetch;
+  perf::Counter *sz_fetch;
+  perf::Counter *n_pread;
   perf::Counter *n_sleep;
   perf::Counter *sz_sleep;
   perf::Counter *n_time;
@@ -79,6 +93,17 @@ struct VfsRdOnlyFile {
   VfsRdOnly *vfs_rdonly;
   int fd;
   uint64_t size;
+  /**
+   * The whole file mapped into memory if the cache manager exposes a file
+   * descriptor, NULL otherwise.
+   */
+  unsigned char *mapping;
+  /**
+   * Reads are served from this buffer if there is no mapping.
+   */
+  unsigned char *buffer;
+  uint64_t buffer_offset;
+  uint64_t buffer_size;
 };
 
 }  // anonymous namespace
@@ -86,6 +111,12 @@ struct VfsRdOnlyFile {
 
 static int VfsRdOnlyClose(sqlite3_file *pFile) {
   VfsRdOnlyFile *p = reinterpret_cast<VfsRdOnlyFile *>(pFile);
+  if (p->mapping != NULL) {
+    munmap(p->mapping, p->size);
+    p->mapping = NULL;
+  }
+  free(p->buffer);
+  p->buffer = NULL;
   int retval = p->vfs_rdonly->cache_mgr->Close(p->fd);
   if (retval == 0) {
     perf::Dec(p->vfs_rdonly->no_open);
@@ -96,8 +127,48 @@ static int VfsRdOnlyClose(sqlite3_file *pFile) {
 
 
 /**
- * On a short read, the remaining bytes must be zero'ed.
- * TODO(jblomer): the reads seem to be rather small.  Investigate buffered read.
+ * SQlite reads a few pages at a time.  Without a memory mapping, every read
+ * would result in a call to the cache manager.  Instead, reads are served from
+ * a buffer that is filled in chunks of kReadBufferSize.
+ */
+static int64_t VfsRdOnlyBufferedRead(
+  VfsRdOnlyFile *p,
+  void *buf,
+  const uint64_t size,
+  const uint64_t offset)
+{
+  const uint64_t buffer_end = p->buffer_offset + p->buffer_size;
+  const bool hit = (offset >= p->buffer_offset) &&
+                   ((offset + size <= buffer_end) || (buffer_end == p->size));
+  if (!hit) {
+    if (p->buffer == NULL)
+      p->buffer = static_cast<unsigned char *>(smalloc(kReadBufferSize));
+    uint64_t window = offset - (offset % kReadBufferSize);
+    if (offset + size > window + kReadBufferSize)
+      window = offset;
+    const int64_t nbytes = p->vfs_rdonly->cache_mgr->Pread(
+      p->fd, p->buffer, kReadBufferSize, window);
+    perf::Inc(p->vfs_rdonly->n_pread);
+    if (nbytes < 0) {
+      p->buffer_size = 0;
+      return nbytes;
+    }
+    p->buffer_offset = window;
+    p->buffer_size = nbytes;
+  }
+
+  if (offset >= p->buffer_offset + p->buffer_size)
+    return 0;
+  const uint64_t got =
+    std::min(size, p->buffer_offset + p->buffer_size - offset);
+  memcpy(buf, p->buffer + (offset - p->buffer_offset), got);
+  return got;
+}
+
+
+/**
+ * On a short read, the remaining bytes must be zero'ed.  If the file is mapped,
+ * the pages are copied from the mapping.
  */
 static int VfsRdOnlyRead(
   sqlite3_file *pFile,
@@ -106,7 +177,20 @@ static int VfsRdOnlyRead(
   sqlite_int64 iOfst
 ) {
   VfsRdOnlyFile *p = reinterpret_cast<VfsRdOnlyFile *>(pFile);
-  ssize_t got = p->vfs_rdonly->cache_mgr->Pread(p->fd, zBuf, iAmt, iOfst);
+  int64_t got;
+  if (p->mapping != NULL) {
+    got = 0;
+    if (static_cast<uint64_t>(iOfst) < p->size) {
+      got = std::min(static_cast<uint64_t>(iAmt),
+                     p->size - static_cast<uint64_t>(iOfst));
+      memcpy(zBuf, p->mapping + iOfst, got);
+    }
+  } else if (static_cast<unsigned>(iAmt) <= kReadBufferSize) {
+    got = VfsRdOnlyBufferedRead(p, zBuf, iAmt, iOfst);
+  } else {
+    got = p->vfs_rdonly->cache_mgr->Pread(p->fd, zBuf, iAmt, iOfst);
+    perf::Inc(p->vfs_rdonly->n_pread);
+  }
   perf::Inc(p->vfs_rdonly->n_read);
   if (got == iAmt) {
     perf::Xadd(p->vfs_rdonly->sz_read, iAmt);
@@ -209,6 +293,42 @@ static int VfsRdOnlyDeviceCharacteristics(
 }
 
 
+/**
+ * Catalogs are immutable, so pages are handed out directly from the mapping
+ * of the file.  Without a mapping, *pp is set to NULL and SQlite falls back to
+ * xRead.
+ */
+static int VfsRdOnlyFetch(
+  sqlite3_file *pFile,
+  sqlite3_int64 iOfst,
+  int iAmt,
+  void **pp)
+{
+  VfsRdOnlyFile *p = reinterpret_cast<VfsRdOnlyFile *>(pFile);
+  *pp = NULL;
+  if ((p->mapping != NULL) &&
+      (static_cast<uint64_t>(iOfst + iAmt) <= p->size))
+  {
+    *pp = p->mapping + iOfst;
+    perf::Inc(p->vfs_rdonly->n_fetch);
+    perf::Xadd(p->vfs_rdonly->sz_fetch, iAmt);
+  }
+  return SQLITE_OK;
+}
+
+
+/**
+ * The mapping stays valid until the file is closed.
+ */
+static int VfsRdOnlyUnfetch(
+  sqlite3_file *pFile __attribute__((unused)),
+  sqlite3_int64 iOfst __attribute__((unused)),
+  void *p __attribute__((unused)))
+{
+  return SQLITE_OK;
+}
+
+
 /**
  * Supports only read-only opens.  The "file name" has to be in the form of
  * '@<file descriptor>', where file descriptor is usable by the cache manager.
@@ -221,7 +341,7 @@ static int VfsRdOnlyOpen(
   int *pOutFlags)
 {
   static const sqlite3_io_methods io_methods = {
-    1,  // iVersion
+    3,  // iVersion
     VfsRdOnlyClose,
     VfsRdOnlyRead,
     VfsRdOnlyWrite,
@@ -233,7 +353,13 @@ static int VfsRdOnlyOpen(
     VfsRdOnlyCheckReservedLock,
     VfsRdOnlyFileControl,
     VfsRdOnlySectorSize,
-    VfsRdOnlyDeviceCharacteristics
+    VfsRdOnlyDeviceCharacteristics,
+    NULL,  // xShmMap
+    NULL,  // xShmLock
+    NULL,  // xShmBarrier
+    NULL,  // xShmUnmap
+    VfsRdOnlyFetch,
+    VfsRdOnlyUnfetch
   };
 
   VfsRdOnlyFile *p = reinterpret_cast<VfsRdOnlyFile *>(pFile);
@@ -241,6 +367,10 @@ static int VfsRdOnlyOpen(
     reinterpret_cast<VfsRdOnly *>(vfs->pAppData)->cache_mgr;
   // Prevent xClose from being called in case of errors
   p->base.pMethods = NULL;
+  p->mapping = NULL;
+  p->buffer = NULL;
+  p->buffer_offset = 0;
+  p->buffer_size = 0;
 
   if (flags & SQLITE_OPEN_READWRITE)
     return SQLITE_IOERR;
@@ -265,13 +395,23 @@ static int VfsRdOnlyOpen(
     return SQLITE_IOERR;
   }
   p->size = static_cast<uint64_t>(size);
+  // Without a file descriptor or if mapping fails, reads are buffered
+  const int raw_fd = cache_mgr->GetRawFd(p->fd);
+  if ((raw_fd >= 0) && (p->size > 0) &&
+      (static_cast<uint64_t>(static_cast<size_t>(p->size)) == p->size))
+  {
+    void *mapping = mmap(NULL, p->size, PROT_READ, MAP_SHARED, raw_fd, 0);
+    if (mapping != MAP_FAILED)
+      p->mapping = static_cast<unsigned char *>(mapping);
+  }
   if (pOutFlags)
     *pOutFlags = flags;
   p->vfs_rdonly = reinterpret_cast<VfsRdOnly *>(vfs->pAppData);
   p->base.pMethods = &io_methods;
   perf::Inc(p->vfs_rdonly->no_open);
-  LogCvmfs(kLogSql, kLogDebug, "open sqlite3 catalog on fd %d, size %"PRIu64,
-           p->fd, p->size);
+  LogCvmfs(kLogSql, kLogDebug, "open sqlite3 catalog on fd %d, size %"PRIu64
+           " (%s)", p->fd, p->size,
+           (p->mapping != NULL) ? "mapped" : "buffered");
   return SQLITE_OK;
 }
 
@@ -487,6 +627,12 @@ bool RegisterVfsRdOnly(
     statistics->Register("sqlite.n_read", "overall number of read() calls");
   vfs_rdonly->sz_read =
     statistics->Register("sqlite.sz_read", "overall bytes read()");
+  vfs_rdonly->n_fetch = statistics->Register("sqlite.n_fetch",
+    "overall number of pages served from memory mapped catalogs");
+  vfs_rdonly->sz_fetch = statistics->Register("sqlite.sz_fetch",
+    "overall bytes served from memory mapped catalogs");
+  vfs_rdonly->n_pread = statistics->Register("sqlite.n_pread",
+    "overall number of reads from the cache manager");
   vfs_rdonly->n_sleep =
     statistics->Register("sqlite.n_sleep", "overall number of sleep() calls");
   vfs_rdonly->sz_sleep =
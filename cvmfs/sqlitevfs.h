@@ -5,6 +5,8 @@
 #ifndef CVMFS_SQLITEVFS_H_
 #define CVMFS_SQLITEVFS_H_
 
+#include <stdint.h>
+
 #include <string>
 
 namespace cache {
@@ -17,6 +19,13 @@ class Statistics;
 
 namespace sqlite {
 
+/**
+ * Catalogs opened through the VFS are memory mapped if the cache manager can
+ * provide a file descriptor.  SQlite fetches pages from the mapping only up to
+ * this offset (SQLITE_CONFIG_MMAP_SIZE), later pages are copied by xRead.
+ */
+const int64_t kMaxMmapSize = 1024 * 1024 * 1024;
+
 enum VfsOptions {
   kVfsOptNone = 0,
   kVfsOptDefault,  // the VFS becomes the default for new database connections.
@@ -333,6 +333,29 @@ static void *MainTalk(void *data __attribute__((unused))) {
         }
 
         Answer(con_fd, proxy_str);
+      } else if (line == "proxy stats") {
+        vector< vector<download::DownloadManager::ProxyInfo> > proxy_chain;
+        unsigned active_group;
+        cvmfs::download_manager_->GetProxyInfo(&proxy_chain, &active_group,
+                                               NULL);
+
+        string stats_str;
+        if (proxy_chain.size()) {
+          for (unsigned i = 0; i < proxy_chain.size(); ++i) {
+            stats_str += "[" + StringifyInt(i) + "]";
+            if (i == active_group)
+              stats_str += " (active group)";
+            stats_str += "\n";
+            for (unsigned j = 0; j < proxy_chain[i].size(); ++j) {
+              stats_str += "  " + proxy_chain[i][j].url + ": " +
+                           proxy_chain[i][j].stats.Print() + "\n";
+            }
+          }
+        } else {
+          stats_str = "No proxies defined\n";
+        }
+
+        Answer(con_fd, stats_str);
       } else if (line == "proxy rebalance") {
         cvmfs::download_manager_->RebalanceProxies();
         Answer(con_fd, "OK\n");
@@ -424,21 +447,21 @@ static void *MainTalk(void *data __attribute__((unused))) {
           atomic_read64(&inode_stats.num_hits_path));
         cvmfs::statistics_->Lookup("inode_tracker.n_miss_path")->Set(
           atomic_read64(&inode_stats.num_misses_path));
-
-        if (cvmfs::cache_manager_->id() == cache::kPosixCacheManager) {
-          cache::PosixCacheManager *cache_mgr =
-            reinterpret_cast<cache::PosixCacheManager *>(cvmfs::cache_manager_);
-          result += "\nCache Mode: ";
-          switch (cache_mgr->cache_mode()) {
-            case cache::PosixCacheManager::kCacheReadWrite:
-              result += "read-write";
-              break;
-            case cache::PosixCacheManager::kCacheReadOnly:
-              result += "read-only";
-              break;
-            default:
-              result += "unknown";
-          }
+        cvmfs::statistics_->Lookup("inode_tracker.n_contended_read")->Set(
+          atomic_read64(&inode_stats.num_contended_reads));
+        cvmfs::statistics_->Lookup("inode_tracker.n_contended_write")->Set(
+          atomic_read64(&inode_stats.num_contended_writes));
+
+        result += "\nCache Mode: ";
+        switch (cvmfs::cache_manager_->GetCacheMode()) {
+          case cache::kCacheReadWrite:
+            result += "read-write";
+            break;
+          case cache::kCacheReadOnly:
+            result += "read-only";
+            break;
+          default:
+            result += "unknown";
         }
         bool drainout_mode;
         bool maintenance_mode;
@@ -446,6 +469,19 @@ static void *MainTalk(void *data __attribute__((unused))) {
         result += "\nDrainout Mode: " + StringifyBool(drainout_mode) + "\n";
         result += "Maintenance Mode: " + StringifyBool(maintenance_mode) + "\n";
 
+        const int64_t negative_hits =
+          cvmfs::statistics_->Lookup("negative_cache.n_hit")->Get();
+        const int64_t negative_misses =
+          cvmfs::statistics_->Lookup("negative_cache.n_miss")->Get();
+        const int64_t negative_lookups = negative_hits + negative_misses;
+        result += "Negative Lookup Cache: " + StringifyInt(negative_hits) +
+                  " hits / " + StringifyInt(negative_lookups) + " lookups";
+        if (negative_lookups > 0) {
+          result += " (" +
+            StringifyInt(100 * negative_hits / negative_lookups) + "%)";
+        }
+        result += "\n";
+
         if (cvmfs::nfs_maps_) {
           result += "\nNFS Map Statistics:\n";
           result += nfs_maps::GetStatistics();
@@ -527,16 +563,12 @@ static void *MainTalk(void *data __attribute__((unused))) {
       } else if (line == "version patchlevel") {
         Answer(con_fd, string(CVMFS_PATCH_LEVEL) + "\n");
       } else if (line == "tear down to read-only") {
-        if (cvmfs::cache_manager_->id() != cache::kPosixCacheManager) {
-          Answer(con_fd, "not supported\n");
-        } else {
-          // hack
-          cvmfs::UnregisterQuotaListener();
-          cache::PosixCacheManager *cache_mgr =
-            reinterpret_cast<cache::PosixCacheManager *>(cvmfs::cache_manager_);
-          cache_mgr->TearDown2ReadOnly();
+        // hack
+        cvmfs::UnregisterQuotaListener();
+        if (cvmfs::cache_manager_->TearDown2ReadOnly())
           Answer(con_fd, "In read-only mode\n");
-        }
+        else
+          Answer(con_fd, "not supported\n");
       } else {
         Answer(con_fd, "unknown command\n");
       }
@@ -35,6 +35,9 @@ S3Uploader::S3Uploader(const SpoolerDefinition &spooler_definition)
          spooler_definition.driver_type == SpoolerDefinition::S3);
 
   s3fanout_mgr_.Init(max_num_parallel_uploads_);
+  if (use_http2_) {
+    s3fanout_mgr_.EnableHttp2(http2_max_streams_);
+  }
   s3fanout_mgr_.Spawn();
 
   atomic_init32(&copy_errors_);
@@ -124,6 +127,18 @@ bool S3Uploader::ParseSpoolerDefinition(
     return false;
   }
   max_num_parallel_uploads_ = String2Uint64(parameter);
+  use_http2_ = options_manager->GetValue("CVMFS_S3_USE_HTTP2", &parameter) &&
+               options_manager->IsOn(parameter);
+  http2_max_streams_ = s3fanout::S3FanoutManager::kHttp2DefaultMaxStreams;
+  if (options_manager->GetValue("CVMFS_S3_HTTP2_MAX_STREAMS", &parameter)) {
+    http2_max_streams_ = String2Uint64(parameter);
+    if (http2_max_streams_ < 1) {
+      LogCvmfs(kLogUploadS3, kLogStderr,
+               "Fail, invalid CVMFS_S3_HTTP2_MAX_STREAMS given: '%s'.",
+               parameter.c_str());
+      return false;
+    }
+  }
   delete options_manager;
   options_manager = NULL;
 
@@ -95,6 +95,8 @@ class S3Uploader : public AbstractUploader {
   std::string bucket_body_name_;
   int         number_of_buckets_;
   int         max_num_parallel_uploads_;
+  bool        use_http2_;
+  unsigned    http2_max_streams_;
   std::vector<std::pair<std::string, std::string> > keys_;
 
   const std::string    temporary_path_;
@@ -183,6 +183,19 @@ TEST_F(T_Atomic, CompareAndSetAtomicInts) {
   const int32_t value2 = atomic_read32(&atomic32_);
   EXPECT_TRUE(res2);
   EXPECT_EQ(off3, value2);
+
+  const int64_t off4 = 0x100000000LL;
+  atomic_xadd64(&atomic64_, off4);
+
+  const int32_t res3   = atomic_cas64(&atomic64_, off4 + 1, off1);
+  const int64_t value3 = atomic_read64(&atomic64_);
+  EXPECT_FALSE(res3);
+  EXPECT_EQ(off4, value3);
+
+  const int32_t res4   = atomic_cas64(&atomic64_, off4, off4 + off1);
+  const int64_t value4 = atomic_read64(&atomic64_);
+  EXPECT_TRUE(res4);
+  EXPECT_EQ(off4 + off1, value4);
 }
 
 
@@ -8,11 +8,14 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include "../../cvmfs/cache.h"
 #include "../../cvmfs/compression.h"
@@ -579,6 +582,17 @@ TEST_F(T_CacheManager, Dup) {
 }
 
 
+TEST_F(T_CacheManager, GetRawFd) {
+  int fd = cache_mgr_->Open(hash_one_);
+  EXPECT_GE(fd, 0);
+  int raw_fd = cache_mgr_->GetRawFd(fd);
+  EXPECT_EQ(fd, raw_fd);
+  char c;
+  EXPECT_EQ(1, pread(raw_fd, &c, 1, 0));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+}
+
+
 TEST_F(T_CacheManager, GetSize) {
   int fd = cache_mgr_->Open(hash_null_);
   EXPECT_GE(fd, 0);
@@ -594,6 +608,155 @@ TEST_F(T_CacheManager, GetSize) {
 }
 
 
+static shash::Any MakeCommitHash(const unsigned i, const unsigned char set) {
+  shash::Any hash(shash::kSha1);
+  hash.digest[0] = i & 0xff;
+  hash.digest[1] = (i >> 8) & 0xff;
+  hash.digest[2] = set;
+  return hash;
+}
+
+
+static void CommitSmallObject(
+  CacheManager *cache_mgr,
+  const shash::Any &hash,
+  const unsigned char content,
+  const CacheManager::ObjectType type)
+{
+  void *txn = alloca(cache_mgr->SizeOfTxn());
+  unsigned char buf[512];
+  memset(buf, content, sizeof(buf));
+  int retval = cache_mgr->StartTxn(hash, sizeof(buf), txn);
+  assert(retval >= 0);
+  cache_mgr->CtrlTxn("object", type, 0, txn);
+  int64_t written = cache_mgr->Write(buf, sizeof(buf), txn);
+  assert(written == sizeof(buf));
+  retval = cache_mgr->CommitTxn(txn);
+  assert(retval == 0);
+}
+
+
+TEST_F(T_CacheManager, GroupCommit) {
+  const unsigned kNumObjects = 256;
+  cache_mgr_->SetGroupCommit(16);
+  cache_mgr_->Spawn();
+
+  // Objects are readable right after the commit, whether or not the commit
+  // thread has already moved them
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    shash::Any hash = MakeCommitHash(i, 0x10);
+    CommitSmallObject(cache_mgr_, hash, i & 0xff, CacheManager::kTypeRegular);
+    int fd = cache_mgr_->Open(hash);
+    ASSERT_GE(fd, 0);
+    unsigned char c;
+    EXPECT_EQ(1, cache_mgr_->Pread(fd, &c, 1, 511));
+    EXPECT_EQ(i & 0xff, c);
+    EXPECT_EQ(0, cache_mgr_->Close(fd));
+  }
+  while (atomic_read32(&cache_mgr_->no_inflight_txns_) != 0)
+    SafeSleepMs(10);
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    EXPECT_TRUE(FileExists(tmp_path_ + "/" +
+                           MakeCommitHash(i, 0x10).MakePath()));
+  }
+  EXPECT_TRUE(cache_mgr_->pending_paths_.empty());
+
+  // Quota notifications are sent by the commit thread, pinned objects are
+  // committed synchronously
+  delete cache_mgr_->quota_mgr_;
+  TestQuotaManager *quota_mgr = new TestQuotaManager();
+  cache_mgr_->quota_mgr_ = quota_mgr;
+  shash::Any hash_volatile = MakeCommitHash(0, 0x11);
+  CommitSmallObject(cache_mgr_, hash_volatile, 'v',
+                    CacheManager::kTypeVolatile);
+  while (atomic_read32(&cache_mgr_->no_inflight_txns_) != 0)
+    SafeSleepMs(10);
+  EXPECT_EQ(TestQuotaManager::kCmdInsertVolatile, quota_mgr->last_cmd.cmd);
+  EXPECT_EQ(hash_volatile, quota_mgr->last_cmd.hash);
+  EXPECT_EQ(512U, quota_mgr->last_cmd.size);
+
+  shash::Any hash_pinned = MakeCommitHash(1, 0x11);
+  CommitSmallObject(cache_mgr_, hash_pinned, 'p', CacheManager::kTypePinned);
+  EXPECT_EQ(TestQuotaManager::kCmdPin, quota_mgr->last_cmd.cmd);
+  EXPECT_TRUE(FileExists(tmp_path_ + "/" + hash_pinned.MakePath()));
+  EXPECT_EQ(0, atomic_read32(&cache_mgr_->no_inflight_txns_));
+
+  // Pending commits are processed on destruction
+  shash::Any hash_last = MakeCommitHash(2, 0x11);
+  CommitSmallObject(cache_mgr_, hash_last, 'l', CacheManager::kTypeRegular);
+  delete cache_mgr_;
+  cache_mgr_ = NULL;
+  EXPECT_TRUE(FileExists(tmp_path_ + "/" + hash_last.MakePath()));
+}
+
+
+TEST_F(T_CacheManager, OpenPending) {
+  shash::Any hash = MakeCommitHash(0, 0x12);
+  EXPECT_EQ(-1, cache_mgr_->OpenPending(hash));
+  EXPECT_EQ(ENOENT, errno);
+
+  // The commit thread moved the object and removed it from the pending paths
+  // between the failed open() of Open() and the lookup in OpenPending()
+  CommitSmallObject(cache_mgr_, hash, 'x', CacheManager::kTypeRegular);
+  ASSERT_TRUE(cache_mgr_->pending_paths_.empty());
+  int fd = cache_mgr_->OpenPending(hash);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+
+  // The commit thread moved the object but did not yet remove it from the
+  // pending paths
+  cache_mgr_->pending_paths_[hash] = tmp_path_ + "/txn/moved";
+  fd = cache_mgr_->OpenPending(hash);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  cache_mgr_->pending_paths_.clear();
+}
+
+
+/**
+ * Benchmark: commits of small objects per second, with and without group
+ * commit.  The group commit rate includes waiting for the commit thread; the
+ * caller rate is how fast CommitTxn() returns.
+ */
+TEST_F(T_CacheManager, GroupCommitThroughput) {
+  const unsigned kNumObjects = 4000;
+  struct timeval start, end;
+
+  gettimeofday(&start, NULL);
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    CommitSmallObject(cache_mgr_, MakeCommitHash(i, 0x20), 'x',
+                      CacheManager::kTypeRegular);
+  }
+  gettimeofday(&end, NULL);
+  const double rate_sync = kNumObjects /
+    ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+
+  cache_mgr_->SetGroupCommit(256);
+  cache_mgr_->Spawn();
+  gettimeofday(&start, NULL);
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    CommitSmallObject(cache_mgr_, MakeCommitHash(i, 0x21), 'x',
+                      CacheManager::kTypeRegular);
+  }
+  gettimeofday(&end, NULL);
+  const double rate_caller = kNumObjects /
+    ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+  while (atomic_read32(&cache_mgr_->no_inflight_txns_) != 0)
+    SafeSleepMs(1);
+  gettimeofday(&end, NULL);
+  const double rate_group = kNumObjects /
+    ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+
+  printf("commits of 512B objects: synchronous %.0f/s, group commit %.0f/s "
+         "(%.0f/s returned to the caller)\n",
+         rate_sync, rate_group, rate_caller);
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    EXPECT_TRUE(FileExists(tmp_path_ + "/" +
+                           MakeCommitHash(i, 0x21).MakePath()));
+  }
+}
+
+
 TEST_F(T_CacheManager, Open) {
   delete cache_mgr_->quota_mgr_;
   cache_mgr_->quota_mgr_ = new TestQuotaManager();
@@ -825,8 +988,9 @@ TEST_F(T_CacheManager, Write) {
 
   fd = cache_mgr_->StartTxn(rnd_hash, 10000, txn);
   close(fd);
-  EXPECT_EQ(-EBADF, cache_mgr_->Write(large_buf, 10000, txn));
-  cache_mgr_->AbortTxn(txn);
+  // The object fits into the transaction buffer, the failure shows on commit
+  EXPECT_EQ(10000, cache_mgr_->Write(large_buf, 10000, txn));
+  EXPECT_EQ(-EBADF, cache_mgr_->CommitTxn(txn));
 
   fd = cache_mgr_->StartTxn(rnd_hash, 1, txn);
   EXPECT_GE(fd, 0);
@@ -861,4 +1025,72 @@ TEST_F(T_CacheManager, WriteCompare) {
   cache_mgr_->Close(fd);
 }
 
+
+/**
+ * Number of write() system calls of the process so far (Linux only), -1 if
+ * unknown.
+ */
+static int64_t GetNoWriteSyscalls() {
+  FILE *f = fopen("/proc/self/io", "r");
+  if (f == NULL)
+    return -1;
+  int64_t result = -1;
+  char key[64];
+  long long value;  // NOLINT
+  while (fscanf(f, "%63s %lld", key, &value) == 2) {
+    if (strcmp(key, "syscw:") == 0)
+      result = value;
+  }
+  fclose(f);
+  return result;
+}
+
+
+/**
+ * Writes a 16M object in download-sized pieces, with known and with unknown
+ * size, and reports the number of write() calls per MB.
+ */
+TEST_F(T_CacheManager, WriteSyscalls) {
+  if (GetNoWriteSyscalls() < 0) {
+    printf("Skipping, no system call statistics available\n");
+    return;
+  }
+  const unsigned kMB = 1024 * 1024;
+  const unsigned kObjectSize = 16 * kMB;
+  const unsigned kPieceSize = 16 * 1024;
+  unsigned char *object = static_cast<unsigned char *>(smalloc(kObjectSize));
+  Prng prng;
+  prng.InitLocaltime();
+  for (unsigned i = 0; i < kObjectSize; ++i)
+    object[i] = prng.Next(256);
+
+  const uint64_t sizes[] = { kObjectSize, CacheManager::kSizeUnknown };
+  void *txn = alloca(cache_mgr_->SizeOfTxn());
+  for (unsigned i = 0; i < 2; ++i) {
+    shash::Any hash(shash::kSha1);
+    hash.digest[0] = 0x30 + i;
+    const int64_t syscalls_before = GetNoWriteSyscalls();
+    ASSERT_GE(cache_mgr_->StartTxn(hash, sizes[i], txn), 0);
+    for (unsigned pos = 0; pos < kObjectSize; pos += kPieceSize) {
+      ASSERT_EQ(static_cast<int64_t>(kPieceSize),
+                cache_mgr_->Write(object + pos, kPieceSize, txn));
+    }
+    ASSERT_EQ(0, cache_mgr_->CommitTxn(txn));
+    const double syscalls_per_mb =
+      static_cast<double>(GetNoWriteSyscalls() - syscalls_before) /
+      (kObjectSize / kMB);
+    printf("%s size: %.1f write() calls per MB\n",
+           (i == 0) ? "known" : "unknown", syscalls_per_mb);
+    EXPECT_LE(syscalls_per_mb, 8.0);
+
+    unsigned char *buffer;
+    uint64_t size;
+    ASSERT_TRUE(cache_mgr_->Open2Mem(hash, &buffer, &size));
+    EXPECT_EQ(kObjectSize, size);
+    EXPECT_EQ(0, memcmp(object, buffer, kObjectSize));
+    free(buffer);
+  }
+  free(object);
+}
+
 }  // namespace cache
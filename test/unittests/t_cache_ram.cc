@@ -0,0 +1,321 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <alloca.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../../cvmfs/cache.h"
+#include "../../cvmfs/cache_ram.h"
+#include "../../cvmfs/hash.h"
+#include "../../cvmfs/quota.h"
+#include "../../cvmfs/statistics.h"
+#include "../../cvmfs/util.h"
+#include "testutil.h"
+
+using namespace std;  // NOLINT
+
+namespace cache {
+
+class T_RamCacheManager : public ::testing::Test {
+ protected:
+  static const uint64_t kMaxSize = 64 * 1024;
+  static const uint64_t kMaxObjectSize = 16 * 1024;
+
+  virtual void SetUp() {
+    used_fds_ = GetNoUsedFds();
+    tmp_path_ = CreateTempDir("./cvmfs_ut_cache_ram");
+    PosixCacheManager *backing = PosixCacheManager::Create(tmp_path_, false);
+    ASSERT_TRUE(backing != NULL);
+    cache_mgr_ = RamCacheManager::Create(backing, kMaxSize, kMaxObjectSize,
+                                         &statistics_);
+  }
+
+  virtual void TearDown() {
+    delete cache_mgr_;
+    if (tmp_path_ != "")
+      RemoveTree(tmp_path_);
+    EXPECT_EQ(used_fds_, GetNoUsedFds());
+  }
+
+  perf::Statistics statistics_;
+  RamCacheManager *cache_mgr_;
+  string tmp_path_;
+  unsigned used_fds_;
+};
+
+
+TEST_F(T_RamCacheManager, Transaction) {
+  const string small(100, 'a');
+  const string large(kMaxObjectSize + 1, 'b');
+  shash::Any hash_small = MakeTestHash(1);
+  shash::Any hash_large = MakeTestHash(2);
+
+  // Size known in advance
+  void *txn = alloca(cache_mgr_->SizeOfTxn());
+  ASSERT_GE(cache_mgr_->StartTxn(hash_small, small.length(), txn), 0);
+  cache_mgr_->CtrlTxn("small", CacheManager::kTypeRegular, 0, txn);
+  EXPECT_EQ(50, cache_mgr_->Write(small.data(), 50, txn));
+  EXPECT_EQ(50, cache_mgr_->Write(small.data() + 50, 50, txn));
+  int fd = cache_mgr_->OpenFromTxn(txn);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(small, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  EXPECT_EQ(0, cache_mgr_->CommitTxn(txn));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_insert"));
+
+  // Unknown size, grows beyond the object size limit
+  ASSERT_GE(cache_mgr_->StartTxn(hash_large, CacheManager::kSizeUnknown, txn),
+            0);
+  EXPECT_EQ(10, cache_mgr_->Write(large.data(), 10, txn));
+  EXPECT_EQ(0, cache_mgr_->Reset(txn));
+  EXPECT_EQ(static_cast<int64_t>(large.length()),
+            cache_mgr_->Write(large.data(), large.length(), txn));
+  EXPECT_EQ(0, cache_mgr_->CommitTxn(txn));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_insert"));
+  EXPECT_EQ(static_cast<int64_t>(small.length()),
+            GetCounterValue(&statistics_, "ram_cache.sz_used"));
+
+  fd = cache_mgr_->Open(hash_small);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(small, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_EQ(-ENOTSUP, cache_mgr_->GetRawFd(fd));
+  char c;
+  EXPECT_EQ(0, cache_mgr_->Pread(fd, &c, 1, small.length()));
+  EXPECT_EQ(0, cache_mgr_->Readahead(fd));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_hit_ram"));
+
+  fd = cache_mgr_->Open(hash_large);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(large, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_GE(cache_mgr_->GetRawFd(fd), 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_hit_backing"));
+
+  EXPECT_EQ(-ENOENT, cache_mgr_->Open(MakeTestHash(3)));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_miss"));
+  EXPECT_EQ(-EBADF, cache_mgr_->Close(fd));
+
+  // Aborted transactions leave no trace
+  ASSERT_GE(cache_mgr_->StartTxn(MakeTestHash(3), 1, txn), 0);
+  EXPECT_EQ(1, cache_mgr_->Write("x", 1, txn));
+  EXPECT_EQ(0, cache_mgr_->AbortTxn(txn));
+  EXPECT_EQ(-ENOENT, cache_mgr_->Open(MakeTestHash(3)));
+}
+
+
+TEST_F(T_RamCacheManager, OpenFromBacking) {
+  const string data(1000, 'x');
+  shash::Any hash = MakeTestHash(1);
+  // Committed to the backing cache only, e.g. before a restart
+  ASSERT_TRUE(cache_mgr_->backing()->CommitFromMem(
+    hash, reinterpret_cast<const unsigned char *>(data.data()), data.length(),
+    "data"));
+
+  int fd = cache_mgr_->Open(hash);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_hit_backing"));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_insert"));
+  int fd_dup = cache_mgr_->Dup(fd);
+  ASSERT_GE(fd_dup, 0);
+  EXPECT_NE(fd, fd_dup);
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  EXPECT_EQ(data, ReadCacheObject(cache_mgr_, fd_dup));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_dup));
+
+  fd = cache_mgr_->Open(hash);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_hit_ram"));
+  EXPECT_EQ(data, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+}
+
+
+/**
+ * Records the touched objects, in order to check that RAM hits still reach
+ * the quota manager of the backing cache.
+ */
+class TouchRecorder : public NoopQuotaManager {
+ public:
+  virtual void Touch(const shash::Any &hash) { touched.push_back(hash); }
+  vector<shash::Any> touched;
+};
+
+
+TEST_F(T_RamCacheManager, Touch) {
+  TouchRecorder *quota_mgr = new TouchRecorder();
+  ASSERT_TRUE(cache_mgr_->AcquireQuotaManager(quota_mgr));
+  const string data(100, 'x');
+  ASSERT_TRUE(cache_mgr_->CommitFromMem(MakeTestHash(1),
+    reinterpret_cast<const unsigned char *>(data.data()), data.length(),
+    "data"));
+
+  int fd = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "ram_cache.n_hit_ram"));
+  ASSERT_EQ(1U, quota_mgr->touched.size());
+  EXPECT_EQ(MakeTestHash(1), quota_mgr->touched[0]);
+}
+
+
+TEST_F(T_RamCacheManager, Eviction) {
+  const unsigned kNumObjects = 2 * kMaxSize / kMaxObjectSize;
+  const unsigned kNumInMemory = kMaxSize / kMaxObjectSize;
+  vector<string> objects;
+  for (unsigned i = 0; i < kNumObjects; ++i)
+    objects.push_back(string(kMaxObjectSize, 'a' + i));
+
+  // The first object stays open across its eviction
+  int fd_first = -1;
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    ASSERT_TRUE(cache_mgr_->CommitFromMem(MakeTestHash(i),
+      reinterpret_cast<const unsigned char *>(objects[i].data()),
+      kMaxObjectSize, "object"));
+    if (i == 0)
+      fd_first = cache_mgr_->Open(MakeTestHash(0));
+  }
+  ASSERT_GE(fd_first, 0);
+  EXPECT_EQ(static_cast<int64_t>(kMaxSize),
+            GetCounterValue(&statistics_, "ram_cache.sz_used"));
+  EXPECT_EQ(static_cast<int64_t>(kNumObjects - kNumInMemory),
+            GetCounterValue(&statistics_, "ram_cache.n_evict"));
+  EXPECT_EQ(objects[0], ReadCacheObject(cache_mgr_, fd_first));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_first));
+
+  // The most recently committed objects are in memory, the others are loaded
+  // from disk
+  for (int i = kNumObjects - 1; i >= 0; --i) {
+    int fd = cache_mgr_->Open(MakeTestHash(i));
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(objects[i], ReadCacheObject(cache_mgr_, fd));
+    EXPECT_EQ(0, cache_mgr_->Close(fd));
+  }
+  EXPECT_EQ(static_cast<int64_t>(kNumInMemory + 1),
+            GetCounterValue(&statistics_, "ram_cache.n_hit_ram"));
+  EXPECT_EQ(static_cast<int64_t>(kNumObjects - kNumInMemory),
+            GetCounterValue(&statistics_, "ram_cache.n_hit_backing"));
+  EXPECT_EQ(static_cast<int64_t>(kMaxSize),
+            GetCounterValue(&statistics_, "ram_cache.sz_used"));
+}
+
+
+/**
+ * A reload of the Fuse module replaces the cache manager while files are open.
+ */
+TEST_F(T_RamCacheManager, SaveRestoreFdTable) {
+  const string small(100, 's');
+  const string large(kMaxObjectSize + 1, 'l');
+  ASSERT_TRUE(cache_mgr_->CommitFromMem(MakeTestHash(1),
+    reinterpret_cast<const unsigned char *>(small.data()), small.length(),
+    "small"));
+  ASSERT_TRUE(cache_mgr_->CommitFromMem(MakeTestHash(2),
+    reinterpret_cast<const unsigned char *>(large.data()), large.length(),
+    "large"));
+  const int fd_small = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd_small, 0);
+  const int fd_closed = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd_closed, 0);
+  const int fd_dup = cache_mgr_->Dup(fd_small);
+  ASSERT_GE(fd_dup, 0);
+  const int fd_large = cache_mgr_->Open(MakeTestHash(2));
+  ASSERT_GE(fd_large, 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd_closed));
+
+  SavedFdTable *saved = cache_mgr_->SaveFdTable();
+  ASSERT_TRUE(saved != NULL);
+  EXPECT_EQ(kRamCacheManager, saved->id);
+  ASSERT_EQ(1U, saved->backing.size());
+  EXPECT_EQ(NULL, saved->backing[0]);
+  EXPECT_EQ(1U, saved->objects.size());
+  delete cache_mgr_;
+
+  perf::Statistics statistics;
+  PosixCacheManager *backing = PosixCacheManager::Create(tmp_path_, false);
+  ASSERT_TRUE(backing != NULL);
+  EXPECT_FALSE(backing->RestoreFdTable(saved));
+  cache_mgr_ = RamCacheManager::Create(backing, kMaxSize, kMaxObjectSize,
+                                       &statistics);
+  EXPECT_FALSE(cache_mgr_->RestoreFdTable(NULL));
+  EXPECT_TRUE(cache_mgr_->RestoreFdTable(saved));
+  delete saved;
+
+  EXPECT_EQ(small, ReadCacheObject(cache_mgr_, fd_small));
+  EXPECT_EQ(small, ReadCacheObject(cache_mgr_, fd_dup));
+  EXPECT_EQ(large, ReadCacheObject(cache_mgr_, fd_large));
+  EXPECT_EQ(-EBADF, cache_mgr_->Close(fd_closed));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_small));
+  EXPECT_EQ(small, ReadCacheObject(cache_mgr_, fd_dup));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_dup));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_large));
+  // The restored objects are not in the memory index
+  const int fd = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(1, GetCounterValue(&statistics, "ram_cache.n_hit_backing"));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  delete cache_mgr_;
+  cache_mgr_ = NULL;
+}
+
+
+/**
+ * Returns the number of open/read/close cycles per second for a set of small
+ * objects.
+ */
+static double MeasureOpenRead(
+  CacheManager *cache_mgr,
+  const vector<shash::Any> &hashes,
+  const unsigned rounds)
+{
+  char buf[4096];
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  for (unsigned r = 0; r < rounds; ++r) {
+    for (unsigned i = 0; i < hashes.size(); ++i) {
+      int fd = cache_mgr->Open(hashes[i]);
+      assert(fd >= 0);
+      const int64_t nbytes = cache_mgr->Pread(fd, buf, sizeof(buf), 0);
+      assert(nbytes == sizeof(buf));
+      cache_mgr->Close(fd);
+    }
+  }
+  gettimeofday(&end, NULL);
+  const double seconds =
+    (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  return (static_cast<double>(rounds) * hashes.size()) / seconds;
+}
+
+
+TEST_F(T_RamCacheManager, Throughput) {
+  const unsigned kNumObjects = kMaxSize / 4096;
+  const unsigned kRounds = 2000;
+  const string data(4096, 'x');
+  vector<shash::Any> hashes;
+  for (unsigned i = 0; i < kNumObjects; ++i) {
+    hashes.push_back(MakeTestHash(i));
+    ASSERT_TRUE(cache_mgr_->CommitFromMem(hashes[i],
+      reinterpret_cast<const unsigned char *>(data.data()), data.length(),
+      "object"));
+  }
+
+  const double rate_backing =
+    MeasureOpenRead(cache_mgr_->backing(), hashes, kRounds);
+  const double rate_ram = MeasureOpenRead(cache_mgr_, hashes, kRounds);
+  EXPECT_EQ(static_cast<int64_t>(kNumObjects * kRounds),
+            GetCounterValue(&statistics_, "ram_cache.n_hit_ram"));
+  printf("open/read/close of 4k objects: posix cache %.0f/s, "
+         "RAM tier %.0f/s\n", rate_backing, rate_ram);
+}
+
+}  // namespace cache
@@ -0,0 +1,340 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <alloca.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../../cvmfs/cache.h"
+#include "../../cvmfs/cache_tiered.h"
+#include "../../cvmfs/hash.h"
+#include "../../cvmfs/quota.h"
+#include "../../cvmfs/statistics.h"
+#include "../../cvmfs/util.h"
+#include "testutil.h"
+
+using namespace std;  // NOLINT
+
+namespace cache {
+
+/**
+ * Accounts for the inserted objects and refuses objects larger than a limit.
+ */
+class SharedQuotaManager : public NoopQuotaManager {
+ public:
+  explicit SharedQuotaManager(const uint64_t max_file_size)
+    : max_file_size_(max_file_size), size_(0) { }
+  virtual bool IsEnforcing() { return true; }
+  virtual void Insert(const shash::Any &hash, const uint64_t size,
+                      const std::string &description)
+  {
+    size_ += size;
+  }
+  virtual uint64_t GetMaxFileSize() { return max_file_size_; }
+  virtual uint64_t GetCapacity() { return 2 * max_file_size_; }
+  virtual uint64_t GetSize() { return size_; }
+
+ private:
+  uint64_t max_file_size_;
+  uint64_t size_;
+};
+
+
+/**
+ * Records the objects pinned in the local tier.
+ */
+class LocalQuotaManager : public NoopQuotaManager {
+ public:
+  virtual bool Pin(const shash::Any &hash, const uint64_t size,
+                   const std::string &description, const bool is_catalog)
+  {
+    pinned.push_back(hash);
+    return true;
+  }
+
+  vector<shash::Any> pinned;
+};
+
+
+class T_TieredCacheManager : public ::testing::Test {
+ protected:
+  static const uint64_t kMaxSharedObject = 16 * 1024;
+
+  virtual void SetUp() {
+    used_fds_ = GetNoUsedFds();
+    shared_path_ = CreateTempDir("./cvmfs_ut_cache_shared");
+    local_path_ = CreateTempDir("./cvmfs_ut_cache_local");
+    cache_mgr_ = Create(local_path_, &statistics_);
+    ASSERT_TRUE(cache_mgr_ != NULL);
+    shared_quota_ = new SharedQuotaManager(kMaxSharedObject);
+    ASSERT_TRUE(cache_mgr_->shared_tier()->AcquireQuotaManager(shared_quota_));
+  }
+
+  virtual void TearDown() {
+    delete cache_mgr_;
+    if (shared_path_ != "")
+      RemoveTree(shared_path_);
+    if (local_path_ != "")
+      RemoveTree(local_path_);
+    EXPECT_EQ(used_fds_, GetNoUsedFds());
+  }
+
+  TieredCacheManager *Create(const string &local_path,
+                             perf::Statistics *statistics)
+  {
+    PosixCacheManager *shared = PosixCacheManager::Create(shared_path_, false);
+    PosixCacheManager *local = PosixCacheManager::Create(local_path, false);
+    if ((shared == NULL) || (local == NULL))
+      return NULL;
+    return TieredCacheManager::Create(shared, local, statistics);
+  }
+
+  bool Commit(CacheManager *cache_mgr, const shash::Any &id,
+              const string &data, const CacheManager::ObjectType type)
+  {
+    void *txn = alloca(cache_mgr->SizeOfTxn());
+    if (cache_mgr->StartTxn(id, data.length(), txn) < 0)
+      return false;
+    cache_mgr->CtrlTxn("object", type, 0, txn);
+    if (cache_mgr->Write(data.data(), data.length(), txn) !=
+        static_cast<int64_t>(data.length()))
+    {
+      cache_mgr->AbortTxn(txn);
+      return false;
+    }
+    return cache_mgr->CommitTxn(txn) == 0;
+  }
+
+  bool IsInTier(CacheManager *tier, const shash::Any &id) {
+    const int fd = tier->Open(id);
+    if (fd < 0)
+      return false;
+    tier->Close(fd);
+    return true;
+  }
+
+  perf::Statistics statistics_;
+  TieredCacheManager *cache_mgr_;
+  SharedQuotaManager *shared_quota_;
+  string shared_path_;
+  string local_path_;
+  unsigned used_fds_;
+};
+
+
+TEST_F(T_TieredCacheManager, Placement) {
+  const string data(1000, 'x');
+  const string large(kMaxSharedObject + 1, 'y');
+
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(1), data,
+                     CacheManager::kTypeRegular));
+  EXPECT_TRUE(IsInTier(cache_mgr_->shared_tier(), MakeTestHash(1)));
+  EXPECT_FALSE(IsInTier(cache_mgr_->local_tier(), MakeTestHash(1)));
+  EXPECT_EQ(data.length(), shared_quota_->GetSize());
+
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(2), data,
+                     CacheManager::kTypeCatalog));
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(3), data,
+                     CacheManager::kTypeVolatile));
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(4), data,
+                     CacheManager::kTypePinned));
+  for (unsigned i = 2; i <= 4; ++i) {
+    EXPECT_FALSE(IsInTier(cache_mgr_->shared_tier(), MakeTestHash(i)));
+    EXPECT_TRUE(IsInTier(cache_mgr_->local_tier(), MakeTestHash(i)));
+  }
+
+  // Too large for the shared tier
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(5), large,
+                     CacheManager::kTypeRegular));
+  EXPECT_FALSE(IsInTier(cache_mgr_->shared_tier(), MakeTestHash(5)));
+  EXPECT_TRUE(IsInTier(cache_mgr_->local_tier(), MakeTestHash(5)));
+  EXPECT_EQ(data.length(), shared_quota_->GetSize());
+
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "tiered_cache.n_commit_shared"));
+  EXPECT_EQ(4, GetCounterValue(&statistics_, "tiered_cache.n_commit_local"));
+}
+
+
+TEST_F(T_TieredCacheManager, Open) {
+  const string data_shared(100, 's');
+  const string data_local(200, 'l');
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(1), data_shared,
+                     CacheManager::kTypeRegular));
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(2), data_local,
+                     CacheManager::kTypeCatalog));
+
+  int fd_shared = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd_shared, 0);
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "tiered_cache.n_hit_shared"));
+  int fd_local = cache_mgr_->Open(MakeTestHash(2));
+  ASSERT_GE(fd_local, 0);
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "tiered_cache.n_hit_local"));
+  EXPECT_NE(fd_shared, fd_local);
+  EXPECT_EQ(data_shared, ReadCacheObject(cache_mgr_, fd_shared));
+  EXPECT_EQ(data_local, ReadCacheObject(cache_mgr_, fd_local));
+  EXPECT_GE(cache_mgr_->GetRawFd(fd_local), 0);
+  EXPECT_EQ(0, cache_mgr_->Readahead(fd_local));
+
+  int fd_dup = cache_mgr_->Dup(fd_shared);
+  ASSERT_GE(fd_dup, 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd_shared));
+  EXPECT_EQ(data_shared, ReadCacheObject(cache_mgr_, fd_dup));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_dup));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_local));
+
+  EXPECT_EQ(-EBADF, cache_mgr_->Close(fd_local));
+  EXPECT_EQ(-EBADF, cache_mgr_->GetSize(-1));
+  EXPECT_EQ(-ENOENT, cache_mgr_->Open(MakeTestHash(3)));
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "tiered_cache.n_miss"));
+}
+
+
+TEST_F(T_TieredCacheManager, Transaction) {
+  const string data(1000, 'x');
+  void *txn = alloca(cache_mgr_->SizeOfTxn());
+
+  // Unknown size, reset, open before commit
+  ASSERT_GE(
+    cache_mgr_->StartTxn(MakeTestHash(1), CacheManager::kSizeUnknown, txn), 0);
+  cache_mgr_->CtrlTxn("object", CacheManager::kTypeCatalog, 0, txn);
+  EXPECT_EQ(10, cache_mgr_->Write(data.data(), 10, txn));
+  EXPECT_EQ(0, cache_mgr_->Reset(txn));
+  EXPECT_EQ(static_cast<int64_t>(data.length()),
+            cache_mgr_->Write(data.data(), data.length(), txn));
+  int fd = cache_mgr_->OpenFromTxn(txn);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(data, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  EXPECT_EQ(0, cache_mgr_->CommitTxn(txn));
+  EXPECT_TRUE(IsInTier(cache_mgr_->local_tier(), MakeTestHash(1)));
+
+  // Aborted transactions leave no trace in either tier
+  ASSERT_GE(cache_mgr_->StartTxn(MakeTestHash(2), 1, txn), 0);
+  cache_mgr_->CtrlTxn("object", CacheManager::kTypeRegular, 0, txn);
+  EXPECT_EQ(1, cache_mgr_->Write("x", 1, txn));
+  EXPECT_EQ(0, cache_mgr_->AbortTxn(txn));
+  EXPECT_EQ(-ENOENT, cache_mgr_->Open(MakeTestHash(2)));
+}
+
+
+TEST_F(T_TieredCacheManager, Deduplication) {
+  const string data(1000, 'x');
+  const string other_local_path = CreateTempDir("./cvmfs_ut_cache_local");
+  perf::Statistics other_statistics;
+  TieredCacheManager *other_cache_mgr =
+    Create(other_local_path, &other_statistics);
+  ASSERT_TRUE(other_cache_mgr != NULL);
+
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(1), data,
+                     CacheManager::kTypeRegular));
+  int fd = other_cache_mgr->Open(MakeTestHash(1));
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(static_cast<int64_t>(data.length()),
+            other_cache_mgr->GetSize(fd));
+  EXPECT_EQ(0, other_cache_mgr->Close(fd));
+  EXPECT_EQ(1,
+            GetCounterValue(&other_statistics, "tiered_cache.n_hit_shared"));
+  EXPECT_FALSE(IsInTier(other_cache_mgr->local_tier(), MakeTestHash(1)));
+
+  delete other_cache_mgr;
+  RemoveTree(other_local_path);
+}
+
+
+TEST_F(T_TieredCacheManager, TearDown2ReadOnly) {
+  const string data(1000, 'x');
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(1), data,
+                     CacheManager::kTypeRegular));
+  EXPECT_EQ(kCacheReadWrite, cache_mgr_->GetCacheMode());
+
+  EXPECT_TRUE(cache_mgr_->TearDown2ReadOnly());
+  EXPECT_EQ(kCacheReadOnly, cache_mgr_->GetCacheMode());
+  EXPECT_EQ(cache_mgr_->local_tier()->quota_mgr(), cache_mgr_->quota_mgr());
+  void *txn = alloca(cache_mgr_->SizeOfTxn());
+  EXPECT_EQ(-EROFS, cache_mgr_->StartTxn(MakeTestHash(2), data.length(), txn));
+
+  int fd = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(data, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+}
+
+
+/**
+ * A reload of the Fuse module replaces the cache manager while files are open.
+ */
+TEST_F(T_TieredCacheManager, SaveRestoreFdTable) {
+  const string data_shared(100, 's');
+  const string data_local(200, 'l');
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(1), data_shared,
+                     CacheManager::kTypeRegular));
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(2), data_local,
+                     CacheManager::kTypeCatalog));
+  const int fd_closed = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd_closed, 0);
+  const int fd_shared = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd_shared, 0);
+  const int fd_local = cache_mgr_->Open(MakeTestHash(2));
+  ASSERT_GE(fd_local, 0);
+  EXPECT_EQ(0, cache_mgr_->Close(fd_closed));
+
+  SavedFdTable *saved = cache_mgr_->SaveFdTable();
+  ASSERT_TRUE(saved != NULL);
+  EXPECT_EQ(kTieredCacheManager, saved->id);
+  ASSERT_EQ(2U, saved->backing.size());
+  delete cache_mgr_;
+
+  perf::Statistics statistics;
+  cache_mgr_ = Create(local_path_, &statistics);
+  ASSERT_TRUE(cache_mgr_ != NULL);
+  EXPECT_FALSE(cache_mgr_->RestoreFdTable(NULL));
+  EXPECT_FALSE(cache_mgr_->local_tier()->RestoreFdTable(saved));
+  EXPECT_TRUE(cache_mgr_->RestoreFdTable(saved));
+  delete saved;
+
+  EXPECT_EQ(data_shared, ReadCacheObject(cache_mgr_, fd_shared));
+  EXPECT_EQ(data_local, ReadCacheObject(cache_mgr_, fd_local));
+  EXPECT_EQ(-EBADF, cache_mgr_->Close(fd_closed));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_shared));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_local));
+  delete cache_mgr_;
+  cache_mgr_ = NULL;
+}
+
+
+TEST_F(T_TieredCacheManager, PinShared) {
+  const string data(1000, 'x');
+  LocalQuotaManager *local_quota = new LocalQuotaManager();
+  ASSERT_TRUE(cache_mgr_->AcquireQuotaManager(local_quota));
+  EXPECT_TRUE(Commit(cache_mgr_, MakeTestHash(1), data,
+                     CacheManager::kTypeRegular));
+  EXPECT_FALSE(IsInTier(cache_mgr_->local_tier(), MakeTestHash(1)));
+
+  const int fd = cache_mgr_->OpenPinned(MakeTestHash(1), "pinned", false);
+  ASSERT_GE(fd, 0);
+  EXPECT_TRUE(IsInTier(cache_mgr_->local_tier(), MakeTestHash(1)));
+  ASSERT_FALSE(local_quota->pinned.empty());
+  EXPECT_EQ(MakeTestHash(1), local_quota->pinned.back());
+  EXPECT_EQ(1, GetCounterValue(&statistics_, "tiered_cache.n_commit_local"));
+
+  // The quota manager of the shared tier evicts the object
+  EXPECT_EQ(0, unlink((shared_path_ + "/" +
+                       MakeTestHash(1).MakePathWithoutSuffix()).c_str()));
+  EXPECT_EQ(data, ReadCacheObject(cache_mgr_, fd));
+  EXPECT_EQ(0, cache_mgr_->Close(fd));
+  const int fd_reopen = cache_mgr_->Open(MakeTestHash(1));
+  ASSERT_GE(fd_reopen, 0);
+  EXPECT_EQ(data, ReadCacheObject(cache_mgr_, fd_reopen));
+  EXPECT_EQ(0, cache_mgr_->Close(fd_reopen));
+
+  EXPECT_EQ(-ENOENT,
+            cache_mgr_->OpenPinned(MakeTestHash(2), "missing", false));
+}
+
+}  // namespace cache
@@ -4,10 +4,128 @@
 
 #include <gtest/gtest.h>
 
+#include <alloca.h>
 #include <fcntl.h>
+#include <sys/time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
 
 #include "../../cvmfs/compression.h"
 #include "../../cvmfs/hash.h"
+#include "../../cvmfs/prng.h"
+#include "../../cvmfs/sink.h"
+
+using namespace std;  // NOLINT
+
+namespace {
+
+/**
+ * Hashes the decompressed data so that both decompression paths can be
+ * compared.
+ */
+class HashSink : public cvmfs::Sink {
+ public:
+  HashSink() : context_(shash::kSha1) {
+    context_.buffer = smalloc(context_.size);
+    shash::Init(context_);
+  }
+  virtual ~HashSink() { free(context_.buffer); }
+  virtual int64_t Write(const void *buf, uint64_t sz) {
+    shash::Update(static_cast<const unsigned char *>(buf), sz, context_);
+    return sz;
+  }
+  virtual int Reset() { return 0; }
+  string Digest() {
+    shash::Any digest(shash::kSha1);
+    shash::Final(context_, &digest);
+    return digest.ToString();
+  }
+
+ private:
+  shash::ContextPtr context_;
+};
+
+
+/**
+ * The streaming decompression as it was with kZChunk buffers, as a baseline.
+ */
+zlib::StreamStates DecompressZStream2SinkBaseline(
+  const void *buf,
+  const int64_t size,
+  z_stream *strm,
+  cvmfs::Sink *sink)
+{
+  unsigned char out[zlib::kZChunk];
+  int z_ret;
+  int64_t pos = 0;
+
+  do {
+    strm->avail_in = (zlib::kZChunk > (size-pos)) ? size-pos : zlib::kZChunk;
+    strm->next_in = ((unsigned char *)buf)+pos;
+    do {
+      strm->avail_out = zlib::kZChunk;
+      strm->next_out = out;
+      z_ret = inflate(strm, Z_NO_FLUSH);
+      if ((z_ret != Z_OK) && (z_ret != Z_STREAM_END) && (z_ret != Z_BUF_ERROR))
+        return zlib::kStreamDataError;
+      size_t have = zlib::kZChunk - strm->avail_out;
+      sink->Write(out, have);
+    } while (strm->avail_out == 0);
+    pos += zlib::kZChunk;
+  } while (pos < size);
+
+  return (z_ret == Z_STREAM_END ? zlib::kStreamEnd : zlib::kStreamContinue);
+}
+
+
+/**
+ * Feeds the compressed stream in chunks of chunk_size like the curl data
+ * callback: hash verification of the compressed data plus decompression.
+ * Returns the throughput in MB/s of uncompressed data.
+ */
+double VerifyAndInflate(
+  const unsigned char *buf,
+  const uint64_t size,
+  const uint64_t size_uncompressed,
+  const unsigned chunk_size,
+  const bool baseline,
+  string *digest)
+{
+  HashSink sink;
+  shash::ContextPtr context(shash::kSha1);
+  context.buffer = alloca(context.size);
+  shash::Init(context);
+  z_stream strm;
+  zlib::DecompressInit(&strm);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  zlib::StreamStates retval = zlib::kStreamContinue;
+  for (uint64_t pos = 0; pos < size; pos += chunk_size) {
+    const unsigned nbytes = std::min(uint64_t(chunk_size), size - pos);
+    shash::Update(buf + pos, nbytes, context);
+    if (baseline)
+      retval = DecompressZStream2SinkBaseline(buf + pos, nbytes, &strm, &sink);
+    else
+      retval = zlib::DecompressZStream2Sink(buf + pos, nbytes, &strm, &sink);
+    EXPECT_NE(zlib::kStreamDataError, retval);
+  }
+  shash::Any hash(shash::kSha1);
+  shash::Final(context, &hash);
+  gettimeofday(&end, NULL);
+  zlib::DecompressFini(&strm);
+  EXPECT_EQ(zlib::kStreamEnd, retval);
+
+  *digest = sink.Digest();
+  const double seconds = (end.tv_sec - start.tv_sec) +
+                         (end.tv_usec - start.tv_usec) / 1000000.0;
+  return size_uncompressed / seconds / (1024 * 1024);
+}
+
+}  // anonymous namespace
+
 
 TEST(T_Compression, CompressFd2Null) {
   shash::Any hash(shash::kSha1);
@@ -21,3 +139,45 @@ TEST(T_Compression, CompressFd2Null) {
 
   EXPECT_FALSE(zlib::CompressFd2Null(-1, &hash));
 }
+
+
+/**
+ * Not a strict test but a benchmark of the download stream processing.  Prints
+ * the throughput of the kZChunk baseline with 16k curl chunks and of
+ * DecompressZStream2Sink with kZChunkStream and 128k curl chunks.
+ */
+TEST(T_Compression, DecompressZStreamThroughput) {
+  const char *words[] = { "cvmfs", "catalog", "chunk", "/cvmfs/atlas.cern.ch",
+    "lib", ".so", "\n", "0x1f", "include", "ROOT", "sw", "x86_64-slc6-gcc49",
+    "libCore", "event", "{", "}", "return", "const", " ", " ", "\t" };
+  const unsigned num_words = sizeof(words) / sizeof(words[0]);
+  const uint64_t size = 16 * 1024 * 1024;
+  string data;
+  data.reserve(size + 64);
+  Prng prng;
+  prng.InitSeed(42);
+  while (data.size() < size) {
+    data += words[prng.Next(num_words)];
+    if (prng.Next(8) == 0)
+      data.push_back(static_cast<char>(prng.Next(256)));
+  }
+
+  void *compressed;
+  uint64_t compressed_size;
+  ASSERT_TRUE(zlib::CompressMem2Mem(data.data(), data.size(),
+                                    &compressed, &compressed_size));
+  const unsigned char *buf = static_cast<const unsigned char *>(compressed);
+
+  string digest_baseline;
+  string digest_stream;
+  double mbs_baseline = VerifyAndInflate(buf, compressed_size, data.size(),
+                                         16 * 1024, true, &digest_baseline);
+  double mbs_stream = VerifyAndInflate(buf, compressed_size, data.size(),
+                                       128 * 1024, false, &digest_stream);
+  EXPECT_EQ(digest_baseline, digest_stream);
+  printf("verify+inflate of %.1f MB (%.1f MB compressed): "
+         "baseline %.1f MB/s, stream buffers %.1f MB/s\n",
+         data.size() / (1024.0 * 1024.0),
+         compressed_size / (1024.0 * 1024.0), mbs_baseline, mbs_stream);
+  free(compressed);
+}
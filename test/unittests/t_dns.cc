@@ -13,6 +13,7 @@
 #include <string>
 
 #include "../../cvmfs/dns.h"
+#include "../../cvmfs/statistics.h"
 #include "../../cvmfs/util.h"
 
 using namespace std;  // NOLINT
@@ -980,4 +981,84 @@ TEST_F(T_Dns, NormalResolverCombined) {
   EXPECT_EQ(hosts[5].status(), kFailUnknownHost);
 }
 
+
+
+TEST_F(T_Dns, HostCacheLookup) {
+  perf::Statistics statistics;
+  UniquePtr<HostCache> host_cache(
+    HostCache::Create(new DummyResolver(), &statistics));
+
+  // Unknown names are not resolved in the calling thread
+  Host host = host_cache->Lookup("normal");
+  EXPECT_EQ(kFailNotYetResolved, host.status());
+  EXPECT_EQ(1, statistics.Lookup("dns.n_miss")->Get());
+  host_cache->Refresh();
+  EXPECT_EQ(1, statistics.Lookup("dns.n_refresh")->Get());
+  host = host_cache->Lookup("normal");
+  EXPECT_EQ(kFailOk, host.status());
+  EXPECT_EQ(2U, host.ipv4_addresses().size());
+  EXPECT_EQ(1, statistics.Lookup("dns.n_hit")->Get());
+
+  // Nothing is due
+  host_cache->Refresh();
+  EXPECT_EQ(1, statistics.Lookup("dns.n_refresh")->Get());
+
+  vector<string> names;
+  names.push_back("normal");
+  names.push_back("ipv4");
+  names.push_back("timeout");
+  names.push_back("");
+  vector<Host> hosts;
+  host_cache->ResolveMany(names, &hosts);
+  ASSERT_EQ(names.size(), hosts.size());
+  EXPECT_TRUE(hosts[0].IsEquivalent(host));
+  EXPECT_EQ(kFailOk, hosts[1].status());
+  EXPECT_EQ(kFailTimeout, hosts[2].status());
+  EXPECT_EQ(kFailInvalidHost, hosts[3].status());
+  EXPECT_EQ(2, statistics.Lookup("dns.n_hit")->Get());
+  EXPECT_EQ(3, statistics.Lookup("dns.n_miss")->Get());
+  EXPECT_EQ(2U, host_cache->size());
+  EXPECT_TRUE(host_cache->Resolve("ipv4").IsEquivalent(hosts[1]));
+  EXPECT_EQ(3, statistics.Lookup("dns.n_hit")->Get());
+}
+
+
+TEST_F(T_Dns, HostCacheRefresh) {
+  perf::Statistics statistics;
+  UniquePtr<HostCache> host_cache(
+    HostCache::Create(new DummyResolver(), &statistics));
+
+  Host host = host_cache->Resolve("normal");
+  ASSERT_EQ(kFailOk, host.status());
+  time_t deadline = host.deadline();
+  time_t refresh_at = host_cache->entries_["normal"].refresh_at;
+  EXPECT_LT(refresh_at, deadline);
+  EXPECT_GT(refresh_at, time(NULL));
+
+  // Unused entries are not refreshed
+  host_cache->entries_["normal"].refresh_at = 0;
+  host_cache->Refresh();
+  EXPECT_EQ(0, statistics.Lookup("dns.n_refresh")->Get());
+  host_cache->Lookup("normal");
+  host_cache->Refresh();
+  EXPECT_EQ(1, statistics.Lookup("dns.n_refresh")->Get());
+  EXPECT_NE(host.id(), host_cache->Lookup("normal").id());
+
+  // A failed refresh keeps serving the expired addresses
+  host.name_ = "timeout";
+  host.deadline_ = time(NULL) - 1;
+  host_cache->entries_["timeout"].host = host;
+  host_cache->Refresh();
+  EXPECT_EQ(2, statistics.Lookup("dns.n_refresh")->Get());
+  Host stale = host_cache->Lookup("timeout");
+  EXPECT_EQ(1, statistics.Lookup("dns.n_stale")->Get());
+  EXPECT_EQ(kFailOk, stale.status());
+  EXPECT_TRUE(stale.IsEquivalent(host));
+  EXPECT_FALSE(stale.IsExpired());
+  EXPECT_GE(host_cache->entries_["timeout"].refresh_at,
+            time(NULL) + HostCache::kRetryDelay - 1);
+
+  host_cache->Spawn();
+}
+
 }  // namespace dns
@@ -4,9 +4,19 @@
 
 #include "gtest/gtest.h"
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
 
 #include "../../cvmfs/compression.h"
 #include "../../cvmfs/download.h"
@@ -15,6 +25,7 @@
 #include "../../cvmfs/sink.h"
 #include "../../cvmfs/statistics.h"
 #include "../../cvmfs/util.h"
+#include "../../cvmfs/util_concurrency.h"
 
 using namespace std;  // NOLINT
 
@@ -66,7 +77,7 @@ class TestSink : public cvmfs::Sink {
   virtual int Reset() {
     int retval = ftruncate(fd, 0);
     assert(retval == 0);
-    return 0;
+    return (lseek(fd, 0, SEEK_SET) == 0) ? 0 : -1;
   }
 
   ~TestSink() {
@@ -79,6 +90,218 @@ class TestSink : public cvmfs::Sink {
 };
 
 
+class AsyncJobs {
+ public:
+  AsyncJobs() { atomic_init32(&num_ok); }
+
+  void OnFinished(JobInfo * const &info) {
+    if (info->error_code == kFailOk)
+      atomic_inc32(&num_ok);
+    --pending;
+  }
+
+  SynchronizingCounter<int> pending;
+  atomic_int32 num_ok;
+};
+
+
+/**
+ * Minimal HTTP proxy on localhost that answers every request with a fixed body
+ * after a delay.  Range requests are answered with the requested part of the
+ * body.  Connections are closed after a single request unless keep-alive is
+ * set.
+ */
+class FakeProxy {
+ public:
+  enum RangeFault {
+    kRangeOk = 0,
+    kRangeShort,  ///< Sends fewer bytes than requested
+    kRangeError,  ///< Answers with a 404 error
+  };
+
+  explicit FakeProxy(const unsigned delay_ms)
+    : delay_ms_(delay_ms)
+    , body_(1000, 'x')
+    , range_fault_(kRangeOk)
+    , range_fault_offset_(0)
+    , keep_alive_(false)
+  {
+    atomic_init32(&num_requests_);
+    atomic_init32(&num_connections_);
+    fd_listen_ = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd_listen_ >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    int retval = bind(fd_listen_, reinterpret_cast<struct sockaddr *>(&addr),
+                      sizeof(addr));
+    assert(retval == 0);
+    retval = listen(fd_listen_, 128);
+    assert(retval == 0);
+    socklen_t addr_len = sizeof(addr);
+    retval = getsockname(fd_listen_,
+                         reinterpret_cast<struct sockaddr *>(&addr), &addr_len);
+    assert(retval == 0);
+    port_ = ntohs(addr.sin_port);
+    MakePipe(pipe_terminate_);
+    retval = pthread_create(&thread_, NULL, MainProxy, this);
+    assert(retval == 0);
+  }
+
+  ~FakeProxy() {
+    char c = 'T';
+    WritePipe(pipe_terminate_[1], &c, 1);
+    pthread_join(thread_, NULL);
+    ClosePipe(pipe_terminate_);
+    close(fd_listen_);
+  }
+
+  string url() const { return "http://127.0.0.1:" + StringifyInt(port_); }
+  int num_requests() { return atomic_read32(&num_requests_); }
+  int num_connections() { return atomic_read32(&num_connections_); }
+  // Not thread-safe, to be set before the first request
+  void set_body(const string &body) { body_ = body; }
+  void set_keep_alive(const bool keep_alive) { keep_alive_ = keep_alive; }
+  // Not thread-safe, to be set while there are no requests
+  void set_range_fault(const RangeFault fault, const unsigned offset) {
+    range_fault_ = fault;
+    range_fault_offset_ = offset;
+  }
+
+ private:
+  static void *MainProxy(void *data) {
+    FakeProxy *proxy = reinterpret_cast<FakeProxy *>(data);
+    // Terminate pipe, listening socket, open connections
+    vector<struct pollfd> watch(2);
+    watch[0].fd = proxy->pipe_terminate_[0];
+    watch[0].events = POLLIN;
+    watch[1].fd = proxy->fd_listen_;
+    watch[1].events = POLLIN;
+    while (true) {
+      for (unsigned i = 0; i < watch.size(); ++i)
+        watch[i].revents = 0;
+      if (poll(&watch[0], watch.size(), -1) < 0)
+        continue;
+      if (watch[0].revents)
+        break;
+      for (unsigned i = 2; i < watch.size(); ) {
+        if (watch[i].revents && !proxy->Serve(watch[i].fd)) {
+          close(watch[i].fd);
+          watch.erase(watch.begin() + i);
+          continue;
+        }
+        ++i;
+      }
+      if (!watch[1].revents)
+        continue;
+      struct pollfd watch_connection;
+      watch_connection.fd = accept(proxy->fd_listen_, NULL, NULL);
+      if (watch_connection.fd < 0)
+        continue;
+      atomic_inc32(&proxy->num_connections_);
+      watch_connection.events = POLLIN;
+      watch.push_back(watch_connection);
+    }
+    for (unsigned i = 2; i < watch.size(); ++i)
+      close(watch[i].fd);
+    return NULL;
+  }
+
+  /**
+   * Answers a single request, returns false if the connection is to be closed.
+   */
+  bool Serve(const int fd_connection) {
+    string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == string::npos) {
+      const int nbytes = read(fd_connection, buf, sizeof(buf));
+      if (nbytes <= 0)
+        return false;
+      request.append(buf, nbytes);
+    }
+    atomic_inc32(&num_requests_);
+    SafeSleepMs(delay_ms_);
+
+    string status = "200 OK";
+    string headers;
+    string body = body_;
+    unsigned first, last;
+    const size_t pos_range = ToUpper(request).find("\r\nRANGE: BYTES=");
+    if ((pos_range != string::npos) &&
+        (sscanf(request.c_str() + pos_range + 15, "%u-%u", &first, &last) == 2)
+        && (first <= last) && (first < body_.length()))
+    {
+      last = std::min(last, static_cast<unsigned>(body_.length() - 1));
+      if ((range_fault_ == kRangeShort) && (first == range_fault_offset_))
+        last = first + (last - first) / 2;
+      status = "206 Partial Content";
+      headers = "Content-Range: bytes " + StringifyInt(first) + "-" +
+                StringifyInt(last) + "/" + StringifyInt(body_.length()) +
+                "\r\n";
+      body = body_.substr(first, last - first + 1);
+      if ((range_fault_ == kRangeError) && (first == range_fault_offset_)) {
+        status = "404 Not Found";
+        headers.clear();
+        body.clear();
+      }
+    }
+    headers += "Content-Length: " + StringifyInt(body.length()) + "\r\n";
+    headers += keep_alive_ ? "Connection: keep-alive\r\n" :
+                             "Connection: close\r\n";
+    string response = "HTTP/1.1 " + status + "\r\n" + headers + "\r\n";
+    if (!HasPrefix(request, "HEAD ", false))
+      response += body;
+    // The client might have given up in the meantime
+    return (send(fd_connection, response.data(), response.length(),
+                 MSG_NOSIGNAL) == static_cast<ssize_t>(response.length())) &&
+           keep_alive_;
+  }
+
+  unsigned delay_ms_;
+  string body_;
+  RangeFault range_fault_;
+  unsigned range_fault_offset_;
+  bool keep_alive_;
+  int fd_listen_;
+  int port_;
+  int pipe_terminate_[2];
+  pthread_t thread_;
+  atomic_int32 num_requests_;
+  atomic_int32 num_connections_;
+};
+
+
+/**
+ * Fetches url n times and returns the latencies in milliseconds, sorted.  If
+ * rebalance is set, a random proxy is selected before every request.
+ */
+static vector<double> MeasureLatencies(
+  DownloadManager *download_mgr,
+  const string &url,
+  const unsigned n,
+  const bool rebalance)
+{
+  vector<double> latencies;
+  for (unsigned i = 0; i < n; ++i) {
+    if (rebalance)
+      download_mgr->RebalanceProxies();
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 NULL /* expected hash */);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    EXPECT_EQ(kFailOk, download_mgr->Fetch(&info));
+    gettimeofday(&end, NULL);
+    free(info.destination_mem.data);
+    latencies.push_back(1000.0 * (end.tv_sec - start.tv_sec) +
+                        (end.tv_usec - start.tv_usec) / 1000.0);
+  }
+  sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+
 //------------------------------------------------------------------------------
 
 
@@ -182,6 +405,465 @@ TEST_F(T_Download, LocalFile2Sink) {
 }
 
 
+TEST_F(T_Download, FetchAsync) {
+  fwrite("cvmfs", 1, 5, ffoo);
+  fflush(ffoo);
+  AsyncJobs jobs;
+
+  // Not spawned yet: the callback is called before FetchAsync returns
+  JobInfo info(&foo_url, false /* compressed */, false /* probe hosts */,
+               NULL /* expected hash */);
+  ++jobs.pending;
+  download_mgr.FetchAsync(&info,
+    Callbackable<JobInfo *>::MakeCallback(&AsyncJobs::OnFinished, &jobs));
+  EXPECT_EQ(0, jobs.pending);
+  EXPECT_EQ(kFailOk, info.error_code);
+  EXPECT_TRUE(info.callback == NULL);
+  free(info.destination_mem.data);
+
+  download_mgr.Spawn();
+  const unsigned N = 128;
+  string missing_url = foo_url + ".missing";
+  vector<JobInfo *> infos;
+  for (unsigned i = 0; i < N; ++i) {
+    infos.push_back(new JobInfo((i % 2 == 0) ? &foo_url : &missing_url,
+                                false /* compressed */,
+                                false /* probe hosts */,
+                                NULL /* expected hash */));
+    ++jobs.pending;
+    download_mgr.FetchAsync(infos[i],
+      Callbackable<JobInfo *>::MakeCallback(&AsyncJobs::OnFinished, &jobs));
+  }
+  jobs.pending.WaitForZero();
+  EXPECT_EQ(static_cast<int>(N / 2 + 1), atomic_read32(&jobs.num_ok));
+  EXPECT_EQ(0, statistics.Lookup("download.sz_job_queue")->Get());
+  EXPECT_GT(statistics.Lookup("download.n_loop_iterations")->Get(), 0);
+  EXPECT_GT(statistics.Lookup("download.n_loop_syscalls")->Get(), 0);
+
+  for (unsigned i = 0; i < N; ++i) {
+    if (i % 2 == 0) {
+      EXPECT_EQ(kFailOk, infos[i]->error_code);
+      ASSERT_EQ(5U, infos[i]->destination_mem.size);
+      EXPECT_EQ(0, memcmp(infos[i]->destination_mem.data, "cvmfs", 5));
+      free(infos[i]->destination_mem.data);
+    } else {
+      EXPECT_NE(kFailOk, infos[i]->error_code);
+      EXPECT_TRUE(infos[i]->destination_mem.data == NULL);
+    }
+    delete infos[i];
+  }
+
+  // The blocking Fetch is built on top of FetchAsync
+  JobInfo info_sync(&foo_url, false /* compressed */, false /* probe hosts */,
+                    NULL /* expected hash */);
+  EXPECT_EQ(kFailOk, download_mgr.Fetch(&info_sync));
+  EXPECT_EQ(5U, info_sync.destination_mem.size);
+  free(info_sync.destination_mem.data);
+}
+
+
+TEST_F(T_Download, EnableHttp2) {
+  bool has_http2 = false;
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  has_http2 = curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2;
+#endif
+  EXPECT_EQ(has_http2,
+            download_mgr.EnableHttp2(DownloadManager::kHttp2DefaultMaxStreams));
+
+  // Non-HTTP transfers are unaffected
+  string dest_path;
+  FILE *fdest = CreateTemporaryFile(&dest_path);
+  ASSERT_TRUE(fdest != NULL);
+  UnlinkGuard unlink_guard(dest_path);
+  JobInfo info(&foo_url, false /* compressed */, false /* probe hosts */,
+               fdest,  NULL);
+  download_mgr.Fetch(&info);
+  EXPECT_EQ(kFailOk, info.error_code);
+  EXPECT_EQ(0, statistics.Lookup("download.n_http2_requests")->Get());
+  fclose(fdest);
+}
+
+
+/**
+ * Status lines of HTTP/1.x and HTTP/2 responses.  HTTP/2 status lines carry
+ * no reason phrase.
+ */
+TEST_F(T_Download, HeaderStatusLine) {
+  const string url = "http://cvmfs-ut.invalid/data";
+  string line;
+
+  JobInfo info(&url, false /* probe hosts */);
+  info.proxy = "DIRECT";
+  line = "HTTP/2 200\r\n";
+  EXPECT_EQ(line.length(), DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info));
+  EXPECT_EQ(200, info.http_code);
+  line = "HTTP/1.1 200 OK\r\n";
+  EXPECT_EQ(line.length(), DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info));
+  EXPECT_EQ(200, info.http_code);
+  line = "HTTP/2 404\r\n";
+  EXPECT_EQ(0U, DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info));
+  EXPECT_EQ(404, info.http_code);
+  EXPECT_EQ(kFailHostHttp, info.error_code);
+
+  JobInfo info_proxy(&url, false /* probe hosts */);
+  info_proxy.proxy = "http://127.0.0.1:3128";
+  line = "HTTP/2 403\r\n";
+  EXPECT_EQ(0U, DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info_proxy));
+  EXPECT_EQ(403, info_proxy.http_code);
+  EXPECT_EQ(kFailProxyHttp, info_proxy.error_code);
+  line = "HTTP/2 503\r\n";
+  EXPECT_EQ(0U, DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info_proxy));
+  EXPECT_EQ(503, info_proxy.http_code);
+  EXPECT_EQ(kFailHostHttp, info_proxy.error_code);
+
+  JobInfo info_redirect(&url, false /* probe hosts */);
+  line = "HTTP/2 302\r\n";
+  EXPECT_EQ(0U, DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info_redirect));
+  EXPECT_EQ(kFailHostHttp, info_redirect.error_code);
+  info_redirect.follow_redirects = true;
+  EXPECT_EQ(line.length(), DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info_redirect));
+  EXPECT_EQ(302, info_redirect.http_code);
+
+  // Truncated status line
+  line = "HTTP/2 \r\n";
+  EXPECT_EQ(0U, DownloadManager::CallbackCurlHeader(
+    &line[0], 1, line.length(), &info_redirect));
+}
+
+
+TEST_F(T_Download, ParallelRanges) {
+  const unsigned range_size = 64 * 1024;
+  const unsigned large_size = 3 * range_size + 17;
+  vector<char> content(large_size);
+  for (unsigned i = 0; i < large_size; ++i)
+    content[i] = static_cast<char>(i % 251);
+  download_mgr.SetParallelRanges(4, range_size);
+  download_mgr.Spawn();
+  perf::Counter *n_requests = statistics.Lookup("download.n_requests");
+
+  // The object fits into the first range
+  ASSERT_EQ(1000U, fwrite(&content[0], 1, 1000, ffoo));
+  fflush(ffoo);
+  shash::Any hash(shash::kSha1);
+  EXPECT_TRUE(shash::HashFile(foo_path, &hash));
+  {
+    TestSink sink;
+    JobInfo info(&foo_url, false /* compressed */, false /* probe hosts */,
+                 &sink, &hash);
+    info.range_size = large_size;
+    EXPECT_EQ(kFailOk, download_mgr.Fetch(&info));
+    EXPECT_EQ(1, n_requests->Get());
+    EXPECT_EQ(1000, GetFileSize(sink.path));
+  }
+
+  // file:// transfers do not tell the object size in a Content-Range header,
+  // so the download is repeated as a single transfer
+  ASSERT_EQ(large_size - 1000,
+            fwrite(&content[1000], 1, large_size - 1000, ffoo));
+  fflush(ffoo);
+  EXPECT_TRUE(shash::HashFile(foo_path, &hash));
+  {
+    TestSink sink;
+    JobInfo info(&foo_url, false /* compressed */, false /* probe hosts */,
+                 &sink, &hash);
+    info.range_size = large_size;
+    EXPECT_EQ(kFailOk, download_mgr.Fetch(&info));
+    EXPECT_EQ(3, n_requests->Get());
+    EXPECT_EQ(static_cast<int64_t>(large_size), GetFileSize(sink.path));
+  }
+  perf::Counter *n_range_fetches =
+    statistics.Lookup("download.n_range_fetches");
+  EXPECT_EQ(0, n_range_fetches->Get());
+
+  // Through a proxy that serves ranges: four ranges, reassembled in order
+  FakeProxy proxy(0);
+  proxy.set_body(string(&content[0], large_size));
+  download_mgr.SetProxyChain(proxy.url(), "",
+                             DownloadManager::kSetProxyRegular);
+  const string url = "http://cvmfs-ut.invalid/data";
+  shash::HashMem(reinterpret_cast<unsigned char *>(&content[0]), large_size,
+                 &hash);
+  string received(large_size, '\0');
+  {
+    TestSink sink;
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 &sink, &hash);
+    info.range_size = large_size;
+    EXPECT_EQ(kFailOk, download_mgr.Fetch(&info));
+    EXPECT_EQ(1, n_range_fetches->Get());
+    EXPECT_EQ(4, proxy.num_requests());
+    ASSERT_EQ(static_cast<int64_t>(large_size), GetFileSize(sink.path));
+    EXPECT_EQ(static_cast<ssize_t>(large_size),
+              pread(sink.fd, &received[0], large_size, 0));
+    EXPECT_EQ(0, memcmp(&content[0], received.data(), large_size));
+  }
+
+  // A short and a failed range: retried as a single transfer
+  proxy.set_range_fault(FakeProxy::kRangeShort, 2 * range_size);
+  {
+    TestSink sink;
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 &sink, &hash);
+    info.range_size = large_size;
+    EXPECT_EQ(kFailOk, download_mgr.Fetch(&info));
+    EXPECT_EQ(2, n_range_fetches->Get());
+    EXPECT_EQ(4 + 4 + 1, proxy.num_requests());
+    ASSERT_EQ(static_cast<int64_t>(large_size), GetFileSize(sink.path));
+    EXPECT_EQ(static_cast<ssize_t>(large_size),
+              pread(sink.fd, &received[0], large_size, 0));
+    EXPECT_EQ(0, memcmp(&content[0], received.data(), large_size));
+  }
+  proxy.set_range_fault(FakeProxy::kRangeError, range_size);
+  {
+    TestSink sink;
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 &sink, &hash);
+    info.range_size = large_size;
+    EXPECT_EQ(kFailOk, download_mgr.Fetch(&info));
+    EXPECT_EQ(3, n_range_fetches->Get());
+    EXPECT_EQ(static_cast<int64_t>(large_size), GetFileSize(sink.path));
+  }
+
+  // The reassembled object is verified
+  proxy.set_range_fault(FakeProxy::kRangeOk, 0);
+  shash::Any wrong_hash(shash::kSha1);
+  {
+    TestSink sink;
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 &sink, &wrong_hash);
+    info.range_size = large_size;
+    EXPECT_EQ(kFailBadData, download_mgr.Fetch(&info));
+    EXPECT_EQ(4, n_range_fetches->Get());
+  }
+}
+
+
+/**
+ * Simulates a load-balance group with a slow proxy.  Choosing proxies
+ * randomly, every third request goes to the slow proxy.  With adaptive proxy
+ * selection, the slow proxy is avoided once it is measured.
+ */
+TEST_F(T_Download, AdaptiveProxies) {
+  const unsigned slow_ms = 50;
+  const unsigned n = 60;
+  FakeProxy fast1(0);
+  FakeProxy fast2(2);
+  FakeProxy slow(slow_ms);
+  download_mgr.SetProxyChain(fast1.url() + "|" + fast2.url() + "|" +
+                             slow.url(), "", DownloadManager::kSetProxyRegular);
+  const string url = "http://cvmfs-ut.invalid/data";
+
+  vector<double> random_latencies =
+    MeasureLatencies(&download_mgr, url, n, true);
+  const int num_slow_random = slow.num_requests();
+  EXPECT_GT(num_slow_random, 0);
+
+  download_mgr.EnableAdaptiveProxies();
+  vector<double> adaptive_latencies =
+    MeasureLatencies(&download_mgr, url, n, false);
+  const int num_slow_adaptive = slow.num_requests() - num_slow_random;
+  EXPECT_LT(num_slow_adaptive, num_slow_random);
+
+  // 90th percentile
+  const unsigned p90 = n * 9 / 10;
+  EXPECT_GE(random_latencies[p90], static_cast<double>(slow_ms));
+  EXPECT_LT(adaptive_latencies[p90], static_cast<double>(slow_ms));
+  EXPECT_LT(adaptive_latencies[p90], random_latencies[p90]);
+
+  vector< vector<DownloadManager::ProxyInfo> > proxy_chain;
+  download_mgr.GetProxyInfo(&proxy_chain, NULL, NULL);
+  ASSERT_EQ(1U, proxy_chain.size());
+  ASSERT_EQ(3U, proxy_chain[0].size());
+  for (unsigned i = 0; i < proxy_chain[0].size(); ++i) {
+    const DownloadManager::ProxyStats &stats = proxy_chain[0][i].stats;
+    EXPECT_GT(stats.num_samples, 0U);
+    EXPECT_EQ(0.0, stats.error_rate);
+    if (proxy_chain[0][i].url == slow.url())
+      EXPECT_GE(stats.latency_ms, static_cast<double>(slow_ms));
+    else
+      EXPECT_LT(stats.latency_ms, static_cast<double>(slow_ms));
+  }
+}
+
+
+/**
+ * Requests that go to the slow proxy of a load-balance group first are
+ * duplicated to the fast proxy once the hedge delay, learned from the fast
+ * proxy, is exceeded.
+ */
+TEST_F(T_Download, Hedging) {
+  const unsigned slow_ms = 500;
+  const unsigned n = 20;
+  FakeProxy fast(0);
+  FakeProxy slow(slow_ms);
+  download_mgr.EnableHedging(90);
+  download_mgr.Spawn();
+  const string url = "http://cvmfs-ut.invalid/data";
+
+  download_mgr.SetProxyChain(fast.url(), "", DownloadManager::kSetProxyRegular);
+  MeasureLatencies(&download_mgr, url, DownloadManager::kHedgeMinSamples,
+                   false);
+  EXPECT_EQ(0, statistics.Lookup("download.n_hedged_requests")->Get());
+
+  download_mgr.SetProxyChain(fast.url() + "|" + slow.url(), "",
+                             DownloadManager::kSetProxyRegular);
+  vector<double> latencies = MeasureLatencies(&download_mgr, url, n, true);
+  EXPECT_GT(slow.num_requests(), 0);
+  EXPECT_LT(latencies[n - 1], static_cast<double>(slow_ms));
+  EXPECT_GT(statistics.Lookup("download.n_hedged_requests")->Get(), 0);
+  EXPECT_GT(statistics.Lookup("download.n_hedged_wins")->Get(), 0);
+}
+
+
+/**
+ * Compressed downloads into sinks are decompressed and verified by the
+ * processing threads, the results are the same as without them.
+ */
+TEST_F(T_Download, ProcessingThreads) {
+  Prng prng;
+  prng.InitLocaltime();
+  string data;
+  // Hardly compressible, so that transfers get paused
+  for (unsigned i = 0; i < 4 * DownloadManager::kProcessingMaxQueued; ++i)
+    data.push_back(static_cast<char>(prng.Next(256)));
+  void *compressed;
+  uint64_t compressed_size;
+  ASSERT_TRUE(zlib::CompressMem2Mem(data.data(), data.length(),
+                                    &compressed, &compressed_size));
+  shash::Any checksum(shash::kSha1);
+  shash::HashMem(static_cast<unsigned char *>(compressed), compressed_size,
+                 &checksum);
+  shash::Any wrong_checksum(shash::kSha1);
+
+  FakeProxy proxy(0);
+  proxy.set_body(string(static_cast<char *>(compressed), compressed_size));
+  free(compressed);
+  download_mgr.SetProcessingThreads(4);
+  download_mgr.Spawn();
+  download_mgr.SetProxyChain(proxy.url(), "",
+                             DownloadManager::kSetProxyRegular);
+  const string url = "http://cvmfs-ut.invalid/data";
+
+  const unsigned N = 16;
+  AsyncJobs jobs;
+  vector<TestSink *> sinks;
+  vector<JobInfo *> infos;
+  for (unsigned i = 0; i < N; ++i) {
+    sinks.push_back(new TestSink());
+    infos.push_back(new JobInfo(&url, true /* compressed */,
+                                false /* probe hosts */, sinks[i],
+                                (i % 4 == 3) ? &wrong_checksum : &checksum));
+    ++jobs.pending;
+    download_mgr.FetchAsync(infos[i],
+      Callbackable<JobInfo *>::MakeCallback(&AsyncJobs::OnFinished, &jobs));
+  }
+  jobs.pending.WaitForZero();
+  EXPECT_EQ(static_cast<int>(N - N / 4), atomic_read32(&jobs.num_ok));
+  EXPECT_EQ(0, statistics.Lookup("download.sz_processing_queue")->Get());
+
+  string received(data.length(), '\0');
+  for (unsigned i = 0; i < N; ++i) {
+    if (i % 4 == 3) {
+      EXPECT_EQ(kFailBadData, infos[i]->error_code);
+    } else {
+      EXPECT_EQ(kFailOk, infos[i]->error_code);
+      ASSERT_EQ(static_cast<int64_t>(data.length()),
+                GetFileSize(sinks[i]->path));
+      EXPECT_EQ(static_cast<int>(data.length()),
+                pread(sinks[i]->fd, &received[0], data.length(), 0));
+      EXPECT_EQ(data, received);
+    }
+    delete infos[i];
+    delete sinks[i];
+  }
+}
+
+
+/**
+ * A paused transfer can fail after a processing thread asked the I/O thread to
+ * resume it.  The finalized job must not stay in the notification list.
+ */
+TEST_F(T_Download, CollectNotifiedJob) {
+  const string url = "http://cvmfs-ut.invalid/data";
+  JobInfo info(&url, false /* probe hosts */);
+  info.processing.paused = true;
+  info.processing.resume = true;
+  info.processing.notified = true;
+  download_mgr.processing_notify_.push_back(&info);
+
+  int curl_error = CURLE_OPERATION_TIMEDOUT;
+  EXPECT_TRUE(download_mgr.CollectProcessing(&info, &curl_error));
+  EXPECT_EQ(CURLE_OPERATION_TIMEDOUT, curl_error);
+  EXPECT_TRUE(download_mgr.processing_notify_.empty());
+  EXPECT_FALSE(info.processing.notified);
+  EXPECT_FALSE(info.processing.resume);
+}
+
+
+/**
+ * After Spawn(), every usable proxy of the active group receives a request
+ * that opens a connection in advance.  The following requests reuse these
+ * connections.
+ */
+TEST_F(T_Download, Prewarm) {
+  FakeProxy proxy1(0);
+  FakeProxy proxy2(0);
+  proxy1.set_keep_alive(true);
+  proxy2.set_keep_alive(true);
+  download_mgr.SetHostChain("http://cvmfs-ut.invalid/cvmfs/ut");
+  download_mgr.SetProxyChain(proxy1.url() + "|" + proxy2.url(), "",
+                             DownloadManager::kSetProxyRegular);
+  download_mgr.EnablePrewarming();
+  download_mgr.Spawn();
+  EXPECT_EQ(2, statistics.Lookup("download.n_prewarm_requests")->Get());
+  perf::Counter *n_requests = statistics.Lookup("download.n_requests");
+  for (unsigned i = 0; (i < 1000) && (n_requests->Get() < 2); ++i)
+    SafeSleepMs(5);
+  EXPECT_EQ(1, proxy1.num_requests());
+  EXPECT_EQ(1, proxy2.num_requests());
+  EXPECT_EQ(1, proxy1.num_connections());
+  EXPECT_EQ(1, proxy2.num_connections());
+
+  const string url = "http://cvmfs-ut.invalid/data";
+  for (unsigned i = 0; i < 4; ++i) {
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 NULL /* expected hash */);
+    EXPECT_EQ(kFailOk, download_mgr.Fetch(&info));
+    EXPECT_EQ(1000U, info.destination_mem.size);
+    free(info.destination_mem.data);
+  }
+  EXPECT_EQ(6, proxy1.num_requests() + proxy2.num_requests());
+  EXPECT_EQ(1, proxy1.num_connections());
+  EXPECT_EQ(1, proxy2.num_connections());
+
+  // Another download manager using the same DNS and TLS session caches opens
+  // its own connection
+  DownloadManager download_mgr2;
+  download_mgr2.Init(8, false, &statistics, "download2");
+  download_mgr2.ShareCurlCaches(&download_mgr);
+  download_mgr2.SetProxyChain(proxy1.url(), "",
+                              DownloadManager::kSetProxyRegular);
+  const int num_requests_proxy1 = proxy1.num_requests();
+  for (unsigned i = 0; i < 2; ++i) {
+    JobInfo info(&url, false /* compressed */, false /* probe hosts */,
+                 NULL /* expected hash */);
+    EXPECT_EQ(kFailOk, download_mgr2.Fetch(&info));
+    EXPECT_EQ(1000U, info.destination_mem.size);
+    free(info.destination_mem.data);
+  }
+  download_mgr2.Fini();
+  EXPECT_EQ(num_requests_proxy1 + 2, proxy1.num_requests());
+  EXPECT_EQ(2, proxy1.num_connections());
+}
+
+
 TEST_F(T_Download, StripDirect) {
   string cleaned = "FALSE";
   EXPECT_FALSE(download_mgr.StripDirect("", &cleaned));
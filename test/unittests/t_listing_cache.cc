@@ -0,0 +1,132 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "../../cvmfs/bigvector.h"
+#include "../../cvmfs/hash.h"
+#include "../../cvmfs/listing_cache.h"
+#include "../../cvmfs/statistics.h"
+#include "../../cvmfs/util.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs {
+
+class T_ListingCache : public ::testing::Test {
+ protected:
+  static const unsigned kArenaSize = 1000;
+
+  virtual void SetUp() {
+    cache_ = new ListingCache(kArenaSize, &statistics_);
+  }
+
+  virtual void TearDown() {
+    delete cache_;
+  }
+
+  shash::Md5 Key(const unsigned i) {
+    const string path = "/dir/" + StringifyInt(i);
+    return shash::Md5(path.data(), path.length());
+  }
+
+  bool Insert(const unsigned i, const unsigned size) {
+    const string listing(size, 'a' + (i % 26));
+    return cache_->Insert(Key(i), listing.data(), size);
+  }
+
+  // Returns the size of the listing or 0 on a miss, checks the content
+  unsigned Lookup(const unsigned i) {
+    BigVector<char> listing;
+    if (!cache_->Lookup(Key(i), &listing))
+      return 0;
+    char *buffer;
+    bool large_alloc;
+    listing.ShareBuffer(&buffer, &large_alloc);
+    const string content(buffer, listing.size());
+    EXPECT_EQ(string(listing.size(), 'a' + (i % 26)), content);
+    listing.Clear();  // Buffer is shared, empty manually
+    return content.length();
+  }
+
+  perf::Statistics statistics_;
+  ListingCache *cache_;
+};
+
+
+TEST_F(T_ListingCache, InsertLookup) {
+  EXPECT_EQ(0U, Lookup(0));
+  EXPECT_TRUE(Insert(0, 100));
+  EXPECT_TRUE(Insert(1, 300));
+  // Too large or empty
+  EXPECT_FALSE(Insert(2, kArenaSize / 2 + 1));
+  EXPECT_FALSE(Insert(3, 0));
+  EXPECT_EQ(2U, cache_->num_entries());
+
+  EXPECT_EQ(100U, Lookup(0));
+  EXPECT_EQ(300U, Lookup(1));
+  EXPECT_EQ(0U, Lookup(2));
+  EXPECT_EQ(2, statistics_.Lookup("listing_cache.n_hit")->Get());
+  EXPECT_EQ(2, statistics_.Lookup("listing_cache.n_miss")->Get());
+  EXPECT_EQ(400, statistics_.Lookup("listing_cache.sz_used")->Get());
+
+  // Already present
+  EXPECT_TRUE(Insert(0, 200));
+  EXPECT_EQ(100U, Lookup(0));
+
+  cache_->Drop();
+  EXPECT_EQ(0U, Lookup(0));
+  EXPECT_EQ(0U, cache_->num_entries());
+  EXPECT_EQ(0, statistics_.Lookup("listing_cache.sz_used")->Get());
+}
+
+
+TEST_F(T_ListingCache, Eviction) {
+  // 0..3 fill 800 bytes
+  for (unsigned i = 0; i < 4; ++i)
+    EXPECT_TRUE(Insert(i, 200));
+  // Doesn't fit at the end, starts over and overwrites 0 and 1
+  EXPECT_TRUE(Insert(4, 300));
+  EXPECT_EQ(0U, Lookup(0));
+  EXPECT_EQ(0U, Lookup(1));
+  EXPECT_EQ(200U, Lookup(2));
+  EXPECT_EQ(200U, Lookup(3));
+  EXPECT_EQ(300U, Lookup(4));
+
+  // Overwrites 2
+  EXPECT_TRUE(Insert(5, 300));
+  EXPECT_EQ(0U, Lookup(2));
+  EXPECT_EQ(200U, Lookup(3));
+  EXPECT_EQ(3U, cache_->num_entries());
+
+  // Wraps again, 3 at the end of the arena is evicted on the way
+  EXPECT_TRUE(Insert(6, 450));
+  EXPECT_EQ(0U, Lookup(3));
+  EXPECT_EQ(0U, Lookup(4));
+  EXPECT_EQ(0U, Lookup(5));
+  EXPECT_EQ(450U, Lookup(6));
+  EXPECT_EQ(1U, cache_->num_entries());
+  EXPECT_EQ(450, statistics_.Lookup("listing_cache.sz_used")->Get());
+  EXPECT_EQ(6, statistics_.Lookup("listing_cache.n_evict")->Get());
+
+  // Fits behind 6
+  EXPECT_TRUE(Insert(7, 100));
+  EXPECT_EQ(450U, Lookup(6));
+  EXPECT_EQ(100U, Lookup(7));
+}
+
+
+TEST_F(T_ListingCache, ManyListings) {
+  for (unsigned i = 0; i < 10000; ++i) {
+    EXPECT_TRUE(Insert(i, 1 + (i * 7) % 400));
+    EXPECT_EQ(1 + (i * 7) % 400, Lookup(i));
+  }
+  EXPECT_LE(static_cast<uint64_t>(
+              statistics_.Lookup("listing_cache.sz_used")->Get()),
+            cache_->arena_size());
+}
+
+}  // namespace cvmfs
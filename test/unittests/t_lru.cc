@@ -3,16 +3,27 @@
  */
 
 #include <gtest/gtest.h>
+#include <pthread.h>
+
+#include <cstdio>
+#include <string>
 
 #include "../../cvmfs/lru.h"
+#include "../../cvmfs/murmur.h"
 #include "../../cvmfs/statistics.h"
+#include "../../cvmfs/util.h"
 
 using lru::LruCache;
+using lru::ShardedLruCache;
 
 static inline uint32_t hasher_int(const int &value) {
   return value;
 }
 
+static inline uint32_t hasher_int_murmur(const int &value) {
+  return MurmurHash2(&value, sizeof(value), 0x07387a4f);
+}
+
 static const unsigned cache_size = 1024;
 const std::string name = "lru_cache";
 
@@ -506,3 +517,168 @@ TEST(T_LruCache, PauseAndResume) {
   EXPECT_TRUE(cache.IsEmpty());
   EXPECT_FALSE(cache.IsFull());
 }
+
+
+TEST(T_LruCache, ShardedBasics) {
+  perf::Statistics statistics;
+  ShardedLruCache<int, int> cache(8 * cache_size, -1, hasher_int_murmur,
+      &statistics, name, 6);
+  EXPECT_EQ(4U, cache.num_shards());
+  EXPECT_TRUE(cache.IsEmpty());
+  EXPECT_FALSE(cache.IsFull());
+
+  for (int i = 0; i < 1000; ++i)
+    EXPECT_TRUE(cache.Insert(i, 2 * i));
+  EXPECT_FALSE(cache.IsEmpty());
+  EXPECT_FALSE(cache.IsFull());
+  EXPECT_EQ(1000, statistics.Lookup(name + ".n_insert")->Get());
+  EXPECT_EQ(8 * static_cast<int>(cache_size),
+            statistics.Lookup(name + ".sz_size")->Get());
+
+  int value;
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(cache.Lookup(i, &value));
+    EXPECT_EQ(2 * i, value);
+  }
+  EXPECT_FALSE(cache.Lookup(1000, &value));
+  EXPECT_EQ(1000, statistics.Lookup(name + ".n_hit")->Get());
+  EXPECT_EQ(1, statistics.Lookup(name + ".n_miss")->Get());
+
+  EXPECT_TRUE(cache.Forget(42));
+  EXPECT_FALSE(cache.Forget(42));
+  EXPECT_FALSE(cache.Lookup(42, &value));
+  EXPECT_EQ(1, statistics.Lookup(name + ".n_forget")->Get());
+
+  cache.Pause();
+  EXPECT_FALSE(cache.Insert(2000, 0));
+  EXPECT_FALSE(cache.Lookup(1, &value));
+  cache.Resume();
+  EXPECT_TRUE(cache.Lookup(1, &value));
+
+  cache.Drop();
+  EXPECT_TRUE(cache.IsEmpty());
+  EXPECT_FALSE(cache.Lookup(1, &value));
+  EXPECT_EQ(1, statistics.Lookup(name + ".n_drop")->Get());
+}
+
+
+TEST(T_LruCache, ShardedNumShards) {
+  perf::Statistics statistics;
+  // Shards are not smaller than kMinShardSize
+  ShardedLruCache<int, int> small(cache_size, -1, hasher_int_murmur,
+      &statistics, "small", 16);
+  EXPECT_EQ(1U, small.num_shards());
+  ShardedLruCache<int, int> medium(4 * cache_size + 64, -1, hasher_int_murmur,
+      &statistics, "medium", 16);
+  EXPECT_EQ(4U, medium.num_shards());
+  EXPECT_EQ(4 * static_cast<int>(cache_size),
+            statistics.Lookup("medium.sz_size")->Get());
+  ShardedLruCache<int, int> large(1024 * cache_size, -1, hasher_int_murmur,
+      &statistics, "large", 1000);
+  EXPECT_EQ(64U, large.num_shards());
+}
+
+
+TEST(T_LruCache, ShardedFillCompletely) {
+  perf::Statistics statistics;
+  ShardedLruCache<int, int> cache(4 * cache_size, -1, hasher_int_murmur,
+      &statistics, name, 4);
+  ASSERT_EQ(4U, cache.num_shards());
+
+  // Every shard evicts its own least recently used entries
+  for (int i = 0; i < 64 * static_cast<int>(cache_size); ++i)
+    cache.Insert(i, i);
+  EXPECT_TRUE(cache.IsFull());
+  int value;
+  const int last = 64 * cache_size - 1;
+  EXPECT_TRUE(cache.Lookup(last, &value));
+  EXPECT_EQ(last, value);
+  EXPECT_FALSE(cache.Lookup(0, &value));
+}
+
+
+namespace {
+
+struct LookupThreadInfo {
+  ShardedLruCache<int, int> *cache;
+  int num_keys;
+  int offset;
+  unsigned num_lookups;
+};
+
+void *MainLookup(void *data) {
+  LookupThreadInfo *info = reinterpret_cast<LookupThreadInfo *>(data);
+  int value;
+  for (unsigned i = 0; i < info->num_lookups; ++i) {
+    const int key = (info->offset + i) % info->num_keys;
+    info->cache->Lookup(key, &value);
+  }
+  return NULL;
+}
+
+}  // anonymous namespace
+
+
+/**
+ * Compares lookup throughput of a single-lock cache and a sharded cache for an
+ * increasing number of threads.
+ */
+TEST(T_LruCache, ShardedScalingSlow) {
+  const int kNumKeys = 64 * 1024;
+  const unsigned kNumLookups = 1000000;
+  const unsigned kMaxThreads = 16;
+  const unsigned shard_configs[] = {1, kMaxThreads};
+
+  for (unsigned c = 0; c < 2; ++c) {
+    perf::Statistics statistics;
+    ShardedLruCache<int, int> cache(2 * kNumKeys, -1, hasher_int_murmur,
+        &statistics, name, shard_configs[c]);
+    for (int i = 0; i < kNumKeys; ++i)
+      cache.Insert(i, i);
+
+    for (unsigned num_threads = 1; num_threads <= kMaxThreads;
+         num_threads *= 2)
+    {
+      pthread_t threads[kMaxThreads];
+      LookupThreadInfo infos[kMaxThreads];
+      StopWatch stopwatch;
+      stopwatch.Start();
+      for (unsigned t = 0; t < num_threads; ++t) {
+        infos[t].cache = &cache;
+        infos[t].num_keys = kNumKeys;
+        infos[t].offset = t * (kNumKeys / kMaxThreads);
+        infos[t].num_lookups = kNumLookups;
+        int retval = pthread_create(&threads[t], NULL, MainLookup, &infos[t]);
+        ASSERT_EQ(0, retval);
+      }
+      for (unsigned t = 0; t < num_threads; ++t)
+        pthread_join(threads[t], NULL);
+      stopwatch.Stop();
+
+      printf("%2u shard(s), %2u thread(s): %.0f lookups/s\n",
+             cache.num_shards(), num_threads,
+             (num_threads * kNumLookups) / stopwatch.GetTime());
+    }
+    EXPECT_EQ(static_cast<int64_t>(kNumLookups) * (2 * kMaxThreads - 1),
+              statistics.Lookup(name + ".n_hit")->Get());
+  }
+}
+
+
+TEST(T_LruCache, NegativeCache) {
+  perf::Statistics statistics;
+  lru::NegativeCache cache(cache_size, &statistics);
+  EXPECT_FALSE(cache.Lookup(2, "foo"));
+  EXPECT_TRUE(cache.Insert(2, "foo"));
+  EXPECT_TRUE(cache.Insert(3, "bar"));
+  EXPECT_TRUE(cache.Lookup(2, "foo"));
+  EXPECT_TRUE(cache.Lookup(3, "bar"));
+  EXPECT_FALSE(cache.Lookup(3, "foo"));
+  EXPECT_FALSE(cache.Lookup(2, "bar"));
+  EXPECT_EQ(2, statistics.Lookup("negative_cache.n_hit")->Get());
+  EXPECT_EQ(3, statistics.Lookup("negative_cache.n_miss")->Get());
+
+  cache.Drop();
+  EXPECT_FALSE(cache.Lookup(2, "foo"));
+  EXPECT_TRUE(cache.IsEmpty());
+}
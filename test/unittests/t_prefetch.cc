@@ -0,0 +1,181 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "../../cvmfs/file_chunk.h"
+#include "../../cvmfs/hash.h"
+#include "../../cvmfs/prefetch.h"
+#include "../../cvmfs/statistics.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs {
+
+class T_ChunkPrefetcher : public ::testing::Test {
+ protected:
+  static const unsigned kNumChunks = 8;
+  static const unsigned kWindow = 3;
+
+  virtual void SetUp() {
+    chunk_list_ = new FileChunkList();
+    for (unsigned i = 0; i < kNumChunks; ++i) {
+      shash::Any hash(shash::kSha1);
+      hash.Randomize();
+      chunk_list_->PushBack(FileChunk(hash, i * 1024, 1024));
+    }
+    chunks_ = FileChunkReflist(chunk_list_, PathString("/chunked", 8),
+                               zlib::kZlibDefault, false);
+    // Not spawned, jobs stay in the queue
+    prefetcher_ = new ChunkPrefetcher(NULL, NULL, kWindow, 0, &statistics_);
+  }
+
+  virtual void TearDown() {
+    delete prefetcher_;
+    delete chunk_list_;
+  }
+
+  int64_t Counter(const string &name) {
+    return statistics_.Lookup("prefetch." + name)->Get();
+  }
+
+  void Access(const uint64_t handle, const unsigned chunk_idx) {
+    prefetcher_->OnChunkAccess(handle, chunks_, chunk_idx,
+                               cache::CacheManager::kTypeRegular);
+  }
+
+  perf::Statistics statistics_;
+  FileChunkList *chunk_list_;
+  FileChunkReflist chunks_;
+  ChunkPrefetcher *prefetcher_;
+};
+
+const unsigned T_ChunkPrefetcher::kNumChunks;
+const unsigned T_ChunkPrefetcher::kWindow;
+
+
+TEST_F(T_ChunkPrefetcher, SequentialDetection) {
+  Access(1, 0);
+  EXPECT_TRUE(prefetcher_->jobs_.empty());
+  Access(1, 1);
+  ASSERT_EQ(kWindow, prefetcher_->jobs_.size());
+  for (unsigned i = 0; i < kWindow; ++i) {
+    EXPECT_EQ(chunk_list_->AtPtr(2 + i)->content_hash(),
+              prefetcher_->jobs_[i].id);
+    EXPECT_EQ(chunk_list_->AtPtr(2 + i)->size(), prefetcher_->jobs_[i].size);
+    EXPECT_FALSE(prefetcher_->jobs_[i].external_data);
+  }
+
+  // Only the chunk that moved into the window is added
+  Access(1, 2);
+  ASSERT_EQ(kWindow + 1, prefetcher_->jobs_.size());
+  EXPECT_EQ(chunk_list_->AtPtr(5)->content_hash(),
+            prefetcher_->jobs_.back().id);
+
+  // Repeated access to the same chunk changes nothing
+  Access(1, 2);
+  EXPECT_EQ(kWindow + 1, prefetcher_->jobs_.size());
+
+  // Nothing beyond the end of the file
+  Access(1, 3);
+  Access(1, 4);
+  Access(1, 5);
+  Access(1, 6);
+  Access(1, 7);
+  EXPECT_EQ(kNumChunks - 2, prefetcher_->jobs_.size());
+  EXPECT_EQ(static_cast<int64_t>(kNumChunks - 2), Counter("n_scheduled"));
+}
+
+
+TEST_F(T_ChunkPrefetcher, Counters) {
+  EXPECT_EQ(static_cast<int64_t>(kWindow), Counter("sz_window"));
+  Access(1, 0);
+  Access(1, 1);
+  EXPECT_EQ(static_cast<int64_t>(kWindow), Counter("n_scheduled"));
+  EXPECT_EQ(0, Counter("n_hit"));
+  Access(1, 2);
+  Access(1, 3);
+  EXPECT_EQ(2, Counter("n_hit"));
+  EXPECT_EQ(0, Counter("n_miss"));
+
+  // Jumping backwards breaks the streak
+  Access(1, 0);
+  EXPECT_EQ(1, Counter("n_miss"));
+  Access(1, 6);
+  EXPECT_EQ(1, Counter("n_miss"));
+  EXPECT_EQ(0, Counter("n_dropped"));
+  EXPECT_EQ(0, Counter("n_failed"));
+}
+
+
+TEST_F(T_ChunkPrefetcher, RandomAccess) {
+  Access(1, 3);
+  Access(1, 4);
+  EXPECT_EQ(0, Counter("n_scheduled"));
+  Access(1, 5);
+  EXPECT_EQ(static_cast<int64_t>(kWindow - 1), Counter("n_scheduled"));
+
+  Access(2, 6);
+  Access(2, 1);
+  Access(2, 4);
+  Access(2, 0);
+  EXPECT_EQ(static_cast<int64_t>(kWindow - 1), Counter("n_scheduled"));
+}
+
+
+TEST_F(T_ChunkPrefetcher, Forget) {
+  Access(1, 0);
+  prefetcher_->Forget(1);
+  // Starts from scratch in the middle of the file
+  Access(1, 1);
+  Access(1, 2);
+  EXPECT_EQ(0, Counter("n_scheduled"));
+  Access(1, 3);
+  EXPECT_EQ(static_cast<int64_t>(kWindow), Counter("n_scheduled"));
+  prefetcher_->Forget(1);
+  prefetcher_->Forget(42);
+}
+
+
+TEST_F(T_ChunkPrefetcher, ExternalData) {
+  FileChunkReflist external(chunk_list_, PathString("/external", 9),
+                            zlib::kNoCompression, true);
+  prefetcher_->OnChunkAccess(1, external, 0, cache::CacheManager::kTypeRegular);
+  prefetcher_->OnChunkAccess(1, external, 1, cache::CacheManager::kTypeRegular);
+  EXPECT_EQ(static_cast<int64_t>(kWindow), Counter("n_scheduled"));
+}
+
+TEST_F(T_ChunkPrefetcher, OnOpen) {
+  // Disabled
+  prefetcher_->OnOpen(chunks_, cache::CacheManager::kTypeRegular);
+  EXPECT_EQ(0, Counter("n_scheduled"));
+  EXPECT_EQ(0, Counter("n_eager"));
+
+  delete prefetcher_;
+  perf::Statistics statistics;
+  prefetcher_ = new ChunkPrefetcher(NULL, NULL, 0, 5, &statistics);
+  EXPECT_EQ(5U, prefetcher_->num_threads());
+  prefetcher_->OnOpen(chunks_, cache::CacheManager::kTypeRegular);
+  EXPECT_EQ(5, statistics.Lookup("prefetch.n_scheduled")->Get());
+  EXPECT_EQ(5, statistics.Lookup("prefetch.n_eager")->Get());
+  // Sequential read-ahead is disabled
+  prefetcher_->OnChunkAccess(1, chunks_, 0, cache::CacheManager::kTypeRegular);
+  prefetcher_->OnChunkAccess(1, chunks_, 1, cache::CacheManager::kTypeRegular);
+  EXPECT_EQ(5, statistics.Lookup("prefetch.n_scheduled")->Get());
+  delete prefetcher_;
+
+  // More eager chunks than chunks in the file
+  perf::Statistics statistics2;
+  prefetcher_ = new ChunkPrefetcher(NULL, NULL, 2, 100, &statistics2);
+  EXPECT_EQ(ChunkPrefetcher::kMaxNumThreads, prefetcher_->num_threads());
+  prefetcher_->OnOpen(chunks_, cache::CacheManager::kTypeRegular);
+  EXPECT_EQ(static_cast<int64_t>(kNumChunks),
+            statistics2.Lookup("prefetch.n_eager")->Get());
+  delete prefetcher_;
+  prefetcher_ = NULL;
+}
+
+}  // namespace cvmfs
@@ -8,6 +8,7 @@
 #include <signal.h>
 
 #include <algorithm>
+#include <cstdio>
 #include <string>
 #include <vector>
 
@@ -16,6 +17,7 @@
 #include "../../cvmfs/fs_traversal.h"
 #include "../../cvmfs/hash.h"
 #include "../../cvmfs/quota.h"
+#include "../../cvmfs/shm_ring.h"
 #include "../../cvmfs/util.h"
 #include "testutil.h"
 
@@ -158,6 +160,56 @@ TEST_F(T_QuotaManager, BindReturnPipe) {
 }
 
 
+TEST_F(T_QuotaManager, Checkpoint) {
+  PosixQuotaManager *mgr = quota_mgr_not_spawned_;
+  EXPECT_TRUE(mgr->Pin(hashes_[0], 1, "/a", false));
+  EXPECT_TRUE(mgr->Contains(hashes_[0].ToString()));
+  EXPECT_EQ(1U, mgr->index_.num_pending());
+
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(mgr->database_,
+                     "SELECT count(*), coalesce(max(acseq), -1), "
+                     "coalesce(max(pinned), -1) FROM cache_catalog;",
+                     -1, &stmt, NULL);
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(0, sqlite3_column_int64(stmt, 0));
+  sqlite3_reset(stmt);
+
+  mgr->Checkpoint();
+  EXPECT_EQ(0U, mgr->index_.num_pending());
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(1, sqlite3_column_int64(stmt, 0));
+  EXPECT_EQ(1, sqlite3_column_int64(stmt, 2));
+  sqlite3_reset(stmt);
+
+  QuotaIndex::Entry *entry = mgr->index_.Lookup(hashes_[0]);
+  ASSERT_TRUE(entry != NULL);
+  mgr->index_.Touch(entry, 42);
+  mgr->index_.SetPinned(entry, 0);
+  mgr->Checkpoint();
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(1, sqlite3_column_int64(stmt, 0));
+  EXPECT_EQ(42, sqlite3_column_int64(stmt, 1));
+  EXPECT_EQ(0, sqlite3_column_int64(stmt, 2));
+  sqlite3_reset(stmt);
+
+  // Reloading restores the index from the database
+  mgr->index_.Insert(hashes_[1], 1, 43, "/b", 0, 0);
+  mgr->index_.Remove(entry);
+  EXPECT_EQ(2U, mgr->index_.num_pending());
+  mgr->Checkpoint();
+  sqlite3_finalize(stmt);
+  EXPECT_TRUE(mgr->LoadIndex());
+  EXPECT_EQ(1U, mgr->index_.size());
+  EXPECT_EQ(0U, mgr->index_.num_pending());
+  EXPECT_FALSE(mgr->Contains(hashes_[0].ToString()));
+  entry = mgr->index_.Lookup(hashes_[1]);
+  ASSERT_TRUE(entry != NULL);
+  EXPECT_EQ(43U, entry->seq);
+  EXPECT_EQ(QuotaIndex::kStateClean, entry->state);
+}
+
+
 TEST_F(T_QuotaManager, CheckHighPinWatermark) {
   int channel[2];
   quota_mgr_->RegisterBackChannel(channel, "A");
@@ -279,6 +331,74 @@ TEST_F(T_QuotaManager, CloseDatabase) {
 }
 
 
+TEST_F(T_QuotaManager, CommandRing) {
+  EXPECT_TRUE(quota_mgr_->command_ring_ != NULL);
+
+  // More inserts than fit into the ring, listing must see all of them
+  const unsigned num_inserts = 3 * ShmRing::kNumSlots;
+  for (unsigned i = 0; i < num_inserts; ++i) {
+    shash::Any hash(shash::kSha1);
+    hash.Randomize(&prng_);
+    quota_mgr_->Insert(hash, 1, "/" + StringifyInt(i));
+  }
+  quota_mgr_->Touch(hashes_[0]);
+  EXPECT_EQ(num_inserts, quota_mgr_->List().size());
+  EXPECT_EQ(num_inserts, quota_mgr_->GetSize());
+
+  // Without the ring, asynchronous commands fall back to the pipe
+  ASSERT_TRUE(quota_mgr_not_spawned_->command_ring_ != NULL);
+  delete quota_mgr_not_spawned_->command_ring_;
+  quota_mgr_not_spawned_->command_ring_ = NULL;
+  quota_mgr_not_spawned_->Spawn();
+  quota_mgr_not_spawned_->Insert(hashes_[0], 1, "/pipe");
+  quota_mgr_not_spawned_->Touch(hashes_[0]);
+  EXPECT_EQ(1U, quota_mgr_not_spawned_->List().size());
+}
+
+
+TEST_F(T_QuotaManager, CommandThroughputSlow) {
+  const unsigned num_files = 2000;
+  const unsigned num_rounds = 50;
+  vector<shash::Any> hashes;
+  for (unsigned i = 0; i < num_files; ++i) {
+    hashes.push_back(shash::Any(shash::kSha1));
+    hashes[i].Randomize(&prng_);
+  }
+
+  // Every open() of a cached file results in a Touch()
+  delete quota_mgr_not_spawned_->command_ring_;
+  quota_mgr_not_spawned_->command_ring_ = NULL;
+  quota_mgr_not_spawned_->Spawn();
+  PosixQuotaManager *quota_mgrs[2] = { quota_mgr_, quota_mgr_not_spawned_ };
+  double submit_rates[2];
+  double rates[2];
+  for (unsigned m = 0; m < 2; ++m) {
+    for (unsigned i = 0; i < num_files; ++i)
+      quota_mgrs[m]->Insert(hashes[i], 1, "/" + StringifyInt(i));
+    EXPECT_EQ(num_files, quota_mgrs[m]->GetSize());
+
+    StopWatch submit_watch;
+    StopWatch stop_watch;
+    submit_watch.Start();
+    stop_watch.Start();
+    for (unsigned r = 0; r < num_rounds; ++r) {
+      for (unsigned i = 0; i < num_files; ++i)
+        quota_mgrs[m]->Touch(hashes[i]);
+    }
+    submit_watch.Stop();
+    submit_rates[m] = (num_rounds * num_files) / submit_watch.GetTime();
+    // Synchronous command, waits for all the touches to be processed
+    EXPECT_EQ(num_files, quota_mgrs[m]->GetSize());
+    stop_watch.Stop();
+    rates[m] = (num_rounds * num_files) / stop_watch.GetTime();
+  }
+  printf("touches/second submitted: ring %.0f, pipe %.0f\n",
+         submit_rates[0], submit_rates[1]);
+  printf("touches/second processed: ring %.0f, pipe %.0f\n",
+         rates[0], rates[1]);
+}
+
+
 TEST_F(T_QuotaManager, Contains) {
   shash::Any hash_null(shash::kSha1);
   shash::Any hash_rnd(shash::kSha1);
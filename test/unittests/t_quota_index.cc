@@ -0,0 +1,126 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "../../cvmfs/hash.h"
+#include "../../cvmfs/quota_index.h"
+#include "../../cvmfs/util.h"
+
+using namespace std;  // NOLINT
+
+class T_QuotaIndex : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    for (unsigned i = 0; i < 8; ++i) {
+      hashes_.push_back(shash::Any(shash::kSha1));
+      hashes_[i].digest[0] = i;
+    }
+  }
+
+  // Sequence numbers of the entries in eviction order
+  string PrintOrder() {
+    string result;
+    for (QuotaIndex::Entry *entry = index_.First(); entry != NULL;
+         entry = index_.Next(entry))
+    {
+      result += StringifyInt(entry->hash.digest[0]) + " ";
+    }
+    return result;
+  }
+
+  QuotaIndex index_;
+  vector<shash::Any> hashes_;
+};
+
+
+TEST_F(T_QuotaIndex, LruOrder) {
+  EXPECT_TRUE(index_.First() == NULL);
+  EXPECT_TRUE(index_.Lookup(hashes_[0]) == NULL);
+
+  for (unsigned i = 0; i < 4; ++i)
+    index_.Insert(hashes_[i], i, i, "/" + StringifyInt(i), 0, 0);
+  EXPECT_EQ(4U, index_.size());
+  EXPECT_EQ("0 1 2 3 ", PrintOrder());
+
+  index_.Touch(index_.Lookup(hashes_[1]), 10);
+  EXPECT_EQ("0 2 3 1 ", PrintOrder());
+  index_.Touch(index_.Lookup(hashes_[0]), 11);
+  EXPECT_EQ("2 3 1 0 ", PrintOrder());
+
+  // Replacing an entry makes it most recently used
+  QuotaIndex::Entry *entry =
+    index_.Insert(hashes_[3], 100, 12, "/replaced", 1, 1);
+  EXPECT_EQ("2 1 0 3 ", PrintOrder());
+  EXPECT_EQ(4U, index_.size());
+  EXPECT_EQ(100U, entry->size);
+  EXPECT_EQ("/replaced", entry->description);
+
+  index_.Remove(index_.Lookup(hashes_[1]));
+  EXPECT_EQ("2 0 3 ", PrintOrder());
+  index_.Remove(index_.Lookup(hashes_[3]));
+  index_.Remove(index_.Lookup(hashes_[2]));
+  EXPECT_EQ("0 ", PrintOrder());
+  EXPECT_TRUE(index_.Lookup(hashes_[2]) == NULL);
+
+  index_.Clear();
+  EXPECT_EQ("", PrintOrder());
+  EXPECT_EQ(0U, index_.size());
+  EXPECT_EQ(0U, index_.num_pending());
+}
+
+
+TEST_F(T_QuotaIndex, Volatile) {
+  const uint64_t volatile_flag = 1ULL << 63;
+  index_.Insert(hashes_[0], 1, 0, "", 0, 0);
+  index_.Insert(hashes_[1], 1, 1 | volatile_flag, "", 0, 0);
+  index_.Insert(hashes_[2], 1, 2, "", 0, 0);
+  index_.Insert(hashes_[3], 1, 3 | volatile_flag, "", 0, 0);
+  EXPECT_EQ("1 3 0 2 ", PrintOrder());
+
+  index_.Touch(index_.Lookup(hashes_[1]), 4);
+  EXPECT_EQ(4U | volatile_flag, index_.Lookup(hashes_[1])->seq);
+  EXPECT_EQ("3 1 0 2 ", PrintOrder());
+
+  // A volatile entry can be replaced by a regular one
+  index_.Insert(hashes_[3], 1, 5, "", 0, 0);
+  EXPECT_EQ("1 0 2 3 ", PrintOrder());
+  index_.Remove(index_.Lookup(hashes_[1]));
+  EXPECT_EQ("0 2 3 ", PrintOrder());
+}
+
+
+TEST_F(T_QuotaIndex, Pending) {
+  vector<shash::Any> pending;
+  EXPECT_TRUE(index_.Restore(hashes_[0], 1, 0, 0, 0));
+  EXPECT_FALSE(index_.Restore(hashes_[0], 1, 0, 0, 0));
+  EXPECT_TRUE(index_.Restore(hashes_[1], 1, 1, 0, 0));
+  EXPECT_EQ(0U, index_.num_pending());
+  EXPECT_EQ("0 1 ", PrintOrder());
+
+  QuotaIndex::Entry *entry = index_.Lookup(hashes_[0]);
+  index_.SetPinned(entry, 0);
+  EXPECT_EQ(0U, index_.num_pending());
+  index_.Touch(entry, 2);
+  index_.Touch(entry, 3);
+  index_.SetPinned(entry, 1);
+  EXPECT_EQ(1U, index_.num_pending());
+  EXPECT_EQ(QuotaIndex::kStateModified, entry->state);
+
+  index_.Insert(hashes_[2], 1, 4, "/new", 0, 0);
+  index_.Touch(index_.Lookup(hashes_[2]), 5);
+  EXPECT_EQ(QuotaIndex::kStateNew, index_.Lookup(hashes_[2])->state);
+  index_.Remove(index_.Lookup(hashes_[1]));
+  EXPECT_EQ(3U, index_.num_pending());
+
+  index_.TakePending(&pending);
+  ASSERT_EQ(3U, pending.size());
+  EXPECT_EQ(hashes_[0], pending[0]);
+  EXPECT_EQ(hashes_[2], pending[1]);
+  EXPECT_EQ(hashes_[1], pending[2]);
+  EXPECT_EQ(0U, index_.num_pending());
+}
@@ -0,0 +1,324 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../../cvmfs/shm_ring.h"
+#include "../../cvmfs/util.h"
+#include "testutil.h"
+
+using namespace std;  // NOLINT
+
+class T_ShmRing : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    tmp_path_ = CreateTempDir("./cvmfs_ut_shm_ring");
+    ring_ = ShmRing::Create("");
+    ASSERT_TRUE(ring_ != NULL);
+  }
+
+  virtual void TearDown() {
+    delete ring_;
+    if (tmp_path_ != "")
+      RemoveTree(tmp_path_);
+  }
+
+  struct ProducerInfo {
+    ShmRing *ring;
+    unsigned id;
+    unsigned num_messages;
+  };
+
+  struct Message {
+    unsigned producer;
+    unsigned number;
+  };
+
+  static void *MainProducer(void *data) {
+    ProducerInfo *info = reinterpret_cast<ProducerInfo *>(data);
+    for (unsigned i = 0; i < info->num_messages; ++i) {
+      Message msg;
+      msg.producer = info->id;
+      msg.number = i;
+      while (info->ring->Enqueue(&msg, sizeof(msg)) == ShmRing::kEnqueueFull)
+        SafeSleepMs(1);
+    }
+    return NULL;
+  }
+
+  string tmp_path_;
+  ShmRing *ring_;
+};
+
+
+TEST_F(T_ShmRing, Basics) {
+  unsigned char buffer[ShmRing::kSlotSize];
+  EXPECT_TRUE(ring_->IsEmpty());
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue("abc", 3));
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue("defgh", 5));
+  EXPECT_FALSE(ring_->IsEmpty());
+  EXPECT_EQ(2U, ring_->head());
+  EXPECT_EQ(0U, ring_->tail());
+
+  EXPECT_EQ(3U, ring_->Dequeue(buffer));
+  EXPECT_EQ("abc", string(reinterpret_cast<char *>(buffer), 3));
+  EXPECT_EQ(5U, ring_->Dequeue(buffer));
+  EXPECT_EQ("defgh", string(reinterpret_cast<char *>(buffer), 5));
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  EXPECT_TRUE(ring_->IsEmpty());
+
+  unsigned char big[ShmRing::kSlotSize];
+  memset(big, 'x', sizeof(big));
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue(big, sizeof(big)));
+  EXPECT_EQ(ShmRing::kSlotSize, ring_->Dequeue(buffer));
+  EXPECT_EQ(0, memcmp(big, buffer, sizeof(big)));
+  EXPECT_DEATH(ring_->Enqueue(big, sizeof(big) + 1), ".*");
+}
+
+
+TEST_F(T_ShmRing, Full) {
+  unsigned char buffer[ShmRing::kSlotSize];
+  for (unsigned round = 0; round < 3; ++round) {
+    for (unsigned i = 0; i < ShmRing::kNumSlots; ++i)
+      EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue(&i, sizeof(i)));
+    unsigned value = 42;
+    EXPECT_EQ(ShmRing::kEnqueueFull, ring_->Enqueue(&value, sizeof(value)));
+
+    EXPECT_EQ(sizeof(unsigned), ring_->Dequeue(buffer));
+    EXPECT_EQ(0U, *reinterpret_cast<unsigned *>(buffer));
+    EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue(&value, sizeof(value)));
+    EXPECT_EQ(ShmRing::kEnqueueFull, ring_->Enqueue(&value, sizeof(value)));
+
+    for (unsigned i = 1; i < ShmRing::kNumSlots; ++i) {
+      EXPECT_EQ(sizeof(unsigned), ring_->Dequeue(buffer));
+      EXPECT_EQ(i, *reinterpret_cast<unsigned *>(buffer));
+    }
+    EXPECT_EQ(sizeof(unsigned), ring_->Dequeue(buffer));
+    EXPECT_EQ(value, *reinterpret_cast<unsigned *>(buffer));
+    EXPECT_TRUE(ring_->IsEmpty());
+  }
+}
+
+
+TEST_F(T_ShmRing, Sleep) {
+  unsigned char buffer[ShmRing::kSlotSize];
+  EXPECT_TRUE(ring_->PrepareSleep());
+  // Only the first producer wakes up the consumer
+  EXPECT_EQ(ShmRing::kEnqueueWakeup, ring_->Enqueue("a", 1));
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue("b", 1));
+
+  // Not empty, no sleep
+  EXPECT_FALSE(ring_->PrepareSleep());
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue("c", 1));
+  EXPECT_EQ(1U, ring_->Dequeue(buffer));
+  EXPECT_EQ(1U, ring_->Dequeue(buffer));
+  EXPECT_EQ(1U, ring_->Dequeue(buffer));
+
+  EXPECT_TRUE(ring_->PrepareSleep());
+  ring_->CancelSleep();
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue("d", 1));
+}
+
+
+TEST_F(T_ShmRing, Attach) {
+  const string path = tmp_path_ + "/ring";
+  EXPECT_EQ(NULL, ShmRing::Attach(path));
+  EXPECT_EQ(NULL, ShmRing::Create(tmp_path_ + "/noent/ring"));
+
+  ShmRing *consumer = ShmRing::Create(path);
+  ASSERT_TRUE(consumer != NULL);
+  ShmRing *producer = ShmRing::Attach(path);
+  ASSERT_TRUE(producer != NULL);
+
+  EXPECT_EQ(ShmRing::kEnqueueOk, producer->Enqueue("abc", 3));
+  unsigned char buffer[ShmRing::kSlotSize];
+  EXPECT_EQ(3U, consumer->Dequeue(buffer));
+  EXPECT_EQ("abc", string(reinterpret_cast<char *>(buffer), 3));
+  delete producer;
+
+  // Re-creation resets the ring
+  EXPECT_EQ(ShmRing::kEnqueueOk, consumer->Enqueue("abc", 3));
+  delete consumer;
+  consumer = ShmRing::Create(path);
+  ASSERT_TRUE(consumer != NULL);
+  EXPECT_TRUE(consumer->IsEmpty());
+  delete consumer;
+
+  // Wrong size
+  EXPECT_EQ(0, truncate(path.c_str(), 1024));
+  EXPECT_EQ(NULL, ShmRing::Attach(path));
+}
+
+
+TEST_F(T_ShmRing, ForkedProducer) {
+  const unsigned kNumMessages = 4 * ShmRing::kNumSlots;
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    ProducerInfo info;
+    info.ring = ring_;
+    info.id = 1;
+    info.num_messages = kNumMessages;
+    MainProducer(&info);
+    _exit(0);
+  }
+
+  unsigned char buffer[ShmRing::kSlotSize];
+  unsigned expected = 0;
+  while (expected < kNumMessages) {
+    const unsigned size = ring_->Dequeue(buffer);
+    if (size == 0)
+      continue;
+    ASSERT_EQ(sizeof(Message), size);
+    Message *msg = reinterpret_cast<Message *>(buffer);
+    EXPECT_EQ(1U, msg->producer);
+    EXPECT_EQ(expected, msg->number);
+    expected++;
+  }
+  int statloc;
+  EXPECT_EQ(pid, waitpid(pid, &statloc, 0));
+  EXPECT_TRUE(ring_->IsEmpty());
+}
+
+
+/**
+ * The pid of the process that attached to the ring must not be used to tell
+ * whether the producer is still alive.
+ */
+TEST_F(T_ShmRing, ProducerForkedAfterAttach) {
+  const string path = tmp_path_ + "/ring";
+  ShmRing *consumer = ShmRing::Create(path);
+  ASSERT_TRUE(consumer != NULL);
+  ShmRing *producer = ShmRing::Attach(path);
+  ASSERT_TRUE(producer != NULL);
+
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    _exit((producer->Enqueue("c", 1) == ShmRing::kEnqueueOk) ? 0 : 1);
+  }
+  int statloc;
+  EXPECT_EQ(pid, waitpid(pid, &statloc, 0));
+  EXPECT_TRUE(WIFEXITED(statloc));
+  EXPECT_EQ(0, WEXITSTATUS(statloc));
+  EXPECT_EQ(pid, ShmRing::GetOwnerPid(consumer->GetSlot(0)->owner));
+
+  unsigned char buffer[ShmRing::kSlotSize];
+  EXPECT_EQ(1U, consumer->Dequeue(buffer));
+  EXPECT_EQ('c', buffer[0]);
+  EXPECT_EQ(ShmRing::kEnqueueOk, producer->Enqueue("p", 1));
+  EXPECT_EQ(getpid(), ShmRing::GetOwnerPid(consumer->GetSlot(1)->owner));
+  delete producer;
+  delete consumer;
+}
+
+
+TEST_F(T_ShmRing, ConcurrentProducers) {
+  const unsigned kNumProducers = 8;
+  const unsigned kNumMessages = 20000;
+  pthread_t threads[kNumProducers];
+  ProducerInfo infos[kNumProducers];
+  for (unsigned i = 0; i < kNumProducers; ++i) {
+    infos[i].ring = ring_;
+    infos[i].id = i;
+    infos[i].num_messages = kNumMessages;
+    int retval = pthread_create(&threads[i], NULL, MainProducer, &infos[i]);
+    ASSERT_EQ(0, retval);
+  }
+
+  // Messages of every single producer arrive in order
+  vector<unsigned> next(kNumProducers, 0);
+  unsigned char buffer[ShmRing::kSlotSize];
+  unsigned num_received = 0;
+  while (num_received < kNumProducers * kNumMessages) {
+    const unsigned size = ring_->Dequeue(buffer);
+    if (size == 0)
+      continue;
+    ASSERT_EQ(sizeof(Message), size);
+    Message *msg = reinterpret_cast<Message *>(buffer);
+    ASSERT_LT(msg->producer, kNumProducers);
+    EXPECT_EQ(next[msg->producer], msg->number);
+    next[msg->producer] = msg->number + 1;
+    num_received++;
+  }
+
+  for (unsigned i = 0; i < kNumProducers; ++i)
+    pthread_join(threads[i], NULL);
+  EXPECT_TRUE(ring_->IsEmpty());
+  EXPECT_EQ(0U, ring_->num_lost());
+}
+
+
+TEST_F(T_ShmRing, UnpublishedSlots) {
+  unsigned char buffer[ShmRing::kSlotSize];
+
+  // Alive but stalled producer: claimed and registered, never taken back
+  ASSERT_TRUE(atomic_cas64(&ring_->header_->head, 0, 1));
+  ShmRing::Slot *slot = ring_->GetSlot(0);
+  ASSERT_TRUE(atomic_cas64(&slot->owner, slot->owner,
+                           ShmRing::MakeOwner(getpid(), 0)));
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  ring_->pending_since_ = 0;
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  EXPECT_FALSE(ring_->IsEmpty());
+  EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue("b", 1));
+  // The producer resumes
+  slot->data[0] = 'a';
+  slot->size = 1;
+  atomic_write64(&slot->seq, 1);
+  EXPECT_EQ(1U, ring_->Dequeue(buffer));
+  EXPECT_EQ('a', buffer[0]);
+  EXPECT_EQ(1U, ring_->Dequeue(buffer));
+  EXPECT_EQ('b', buffer[0]);
+  EXPECT_EQ(0U, ring_->num_lost());
+
+  // Claimed but not registered: the claim is revoked and the producer cannot
+  // register anymore
+  ASSERT_TRUE(atomic_cas64(&ring_->header_->head, 2, 3));
+  slot = ring_->GetSlot(2);
+  const int64_t previous_owner = slot->owner;
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  ring_->pending_since_ = 0;
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  EXPECT_EQ(1U, ring_->num_lost());
+  EXPECT_TRUE(ring_->IsEmpty());
+  EXPECT_FALSE(atomic_cas64(&slot->owner, previous_owner,
+                            ShmRing::MakeOwner(getpid(), 2)));
+
+  // Registered by a process that died
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    atomic_cas64(&ring_->header_->head, 3, 4);
+    slot = ring_->GetSlot(3);
+    atomic_cas64(&slot->owner, slot->owner, ShmRing::MakeOwner(getpid(), 3));
+    _exit(0);
+  }
+  int statloc;
+  EXPECT_EQ(pid, waitpid(pid, &statloc, 0));
+  EXPECT_FALSE(ring_->IsEmpty());
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  ring_->pending_since_ = 0;
+  EXPECT_EQ(0U, ring_->Dequeue(buffer));
+  EXPECT_EQ(2U, ring_->num_lost());
+  EXPECT_TRUE(ring_->IsEmpty());
+
+  // The skipped slots are usable in the next round
+  for (unsigned i = 0; i < ShmRing::kNumSlots; ++i)
+    EXPECT_EQ(ShmRing::kEnqueueOk, ring_->Enqueue(&i, sizeof(i)));
+  for (unsigned i = 0; i < ShmRing::kNumSlots; ++i) {
+    EXPECT_EQ(sizeof(unsigned), ring_->Dequeue(buffer));
+    EXPECT_EQ(i, *reinterpret_cast<unsigned *>(buffer));
+  }
+}
@@ -0,0 +1,133 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "../../cvmfs/cache.h"
+#include "../../cvmfs/cache_ram.h"
+#include "../../cvmfs/compression.h"
+#include "../../cvmfs/duplex_sqlite3.h"
+#include "../../cvmfs/hash.h"
+#include "../../cvmfs/sqlitevfs.h"
+#include "../../cvmfs/statistics.h"
+#include "../../cvmfs/util.h"
+
+using namespace std;  // NOLINT
+
+class T_SqliteVfs : public ::testing::Test {
+ protected:
+  static const unsigned kNumRows = 2000;
+  static const unsigned kRowSize = 200;
+
+  virtual void SetUp() {
+    tmp_path_ = CreateTempDir("./cvmfs_ut_sqlitevfs");
+    cache_mgr_ = cache::PosixCacheManager::Create(tmp_path_, false);
+    ASSERT_TRUE(cache_mgr_ != NULL);
+    hash_ = shash::Any(shash::kSha1);
+    hash_.digest[0] = 1;
+    CreateCatalog();
+  }
+
+  virtual void TearDown() {
+    sqlite::UnregisterVfsRdOnly();
+    delete cache_mgr_;
+    if (tmp_path_ != "")
+      RemoveTree(tmp_path_);
+  }
+
+  /**
+   * Fills a database with kNumRows blobs and stores it in the cache.
+   */
+  void CreateCatalog() {
+    const string db_path = tmp_path_ + "/catalog.db";
+    sqlite3 *db;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(db_path.c_str(), &db,
+      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "unix"));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+      "CREATE TABLE blobs (data BLOB);"
+      "BEGIN;", NULL, NULL, NULL));
+    sqlite3_stmt *stmt;
+    ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db,
+      "INSERT INTO blobs VALUES (randomblob(:size));", -1, &stmt, NULL));
+    for (unsigned i = 0; i < kNumRows; ++i) {
+      sqlite3_bind_int(stmt, 1, kRowSize);
+      ASSERT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
+    ASSERT_EQ(SQLITE_OK, sqlite3_close(db));
+
+    unsigned char *buffer;
+    unsigned buffer_size;
+    ASSERT_TRUE(CopyPath2Mem(db_path, &buffer, &buffer_size));
+    catalog_size_ = buffer_size;
+    EXPECT_TRUE(cache_mgr_->CommitFromMem(hash_, buffer, buffer_size, "db"));
+    free(buffer);
+  }
+
+  /**
+   * Opens the catalog from the cache through the read-only VFS and returns the
+   * sum of the blob sizes.
+   */
+  int64_t ScanCatalog(cache::CacheManager *cache_mgr) {
+    const int fd = cache_mgr->Open(hash_);
+    EXPECT_GE(fd, 0);
+    sqlite3 *db;
+    const string name = "@" + StringifyInt(fd);
+    EXPECT_EQ(SQLITE_OK, sqlite3_open_v2(name.c_str(), &db,
+      SQLITE_OPEN_READONLY, "cvmfs-readonly"));
+    EXPECT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA mmap_size=1073741824;",
+                                      NULL, NULL, NULL));
+    sqlite3_stmt *stmt;
+    EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db,
+      "SELECT sum(length(data)) FROM blobs;", -1, &stmt, NULL));
+    EXPECT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    const int64_t result = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    EXPECT_EQ(SQLITE_OK, sqlite3_close(db));
+    return result;
+  }
+
+  int64_t Counter(const string &name) {
+    return statistics_.Lookup("sqlite." + name)->Get();
+  }
+
+  perf::Statistics statistics_;
+  cache::PosixCacheManager *cache_mgr_;
+  shash::Any hash_;
+  uint64_t catalog_size_;
+  string tmp_path_;
+};
+
+
+TEST_F(T_SqliteVfs, Mapped) {
+  ASSERT_TRUE(sqlite::RegisterVfsRdOnly(cache_mgr_, &statistics_,
+                                        sqlite::kVfsOptNone));
+  EXPECT_EQ(static_cast<int64_t>(kNumRows * kRowSize), ScanCatalog(cache_mgr_));
+  EXPECT_GT(Counter("n_fetch"), 0);
+  EXPECT_EQ(0, Counter("n_pread"));
+  EXPECT_EQ(0, Counter("no_open"));
+}
+
+
+TEST_F(T_SqliteVfs, Buffered) {
+  // Objects in the RAM tier have no file descriptor
+  cache::RamCacheManager *ram_cache_mgr = cache::RamCacheManager::Create(
+    cache_mgr_, 2 * catalog_size_, catalog_size_, &statistics_);
+  cache_mgr_ = NULL;
+  ASSERT_TRUE(sqlite::RegisterVfsRdOnly(ram_cache_mgr, &statistics_,
+                                        sqlite::kVfsOptNone));
+  EXPECT_EQ(static_cast<int64_t>(kNumRows * kRowSize),
+            ScanCatalog(ram_cache_mgr));
+  EXPECT_EQ(1, statistics_.Lookup("ram_cache.n_hit_backing")->Get());
+  EXPECT_EQ(0, Counter("n_fetch"));
+  EXPECT_GT(Counter("n_read"), 0);
+  EXPECT_LT(Counter("n_pread"), Counter("n_read"));
+  EXPECT_GE(Counter("sz_read"), static_cast<int64_t>(catalog_size_));
+  delete ram_cache_mgr;
+}
@@ -14,8 +14,10 @@
 #include <map>
 #include <sstream>  // TODO(jblomer): remove me
 
+#include "../../cvmfs/cache.h"
 #include "../../cvmfs/hash.h"
 #include "../../cvmfs/manifest.h"
+#include "../../cvmfs/statistics.h"
 #include "testutil.h"
 
 
@@ -166,6 +168,27 @@ shash::Any h(const std::string &hash, const shash::Suffix suffix) {
   return shash::Any(shash::kSha1, shash::HexPtr(hash), suffix);
 }
 
+shash::Any MakeTestHash(const unsigned i) {
+  shash::Any hash(shash::kSha1);
+  hash.digest[0] = i & 0xff;
+  hash.digest[1] = (i >> 8) & 0xff;
+  return hash;
+}
+
+std::string ReadCacheObject(cache::CacheManager *cache_mgr, const int fd) {
+  const int64_t size = cache_mgr->GetSize(fd);
+  EXPECT_GE(size, 0);
+  std::string result(size, '\0');
+  if (size > 0) {
+    EXPECT_EQ(size, cache_mgr->Pread(fd, &result[0], size, 0));
+  }
+  return result;
+}
+
+int64_t GetCounterValue(perf::Statistics *statistics, const std::string &name) {
+  return statistics->Lookup(name)->Get();
+}
+
 namespace catalog {
 
 DirectoryEntry DirectoryEntryTestFactory::RegularFile(const string &name,
@@ -33,6 +33,21 @@ time_t t(const int day, const int month, const int year);
 shash::Any h(const std::string &hash,
              const shash::Suffix suffix = shash::kSuffixNone);
 
+namespace cache {
+class CacheManager;
+}
+namespace perf {
+class Statistics;
+}
+
+/**
+ * Helpers for the tests of cache managers: distinct SHA-1 hashes for the
+ * objects, the full content of an open object, and statistics counters.
+ */
+shash::Any MakeTestHash(const unsigned i);
+std::string ReadCacheObject(cache::CacheManager *cache_mgr, const int fd);
+int64_t GetCounterValue(perf::Statistics *statistics, const std::string &name);
+
 namespace catalog {
 
 class DirectoryEntryTestFactory {